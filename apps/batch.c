@@ -0,0 +1,359 @@
+// Aligns the pairs of local audio files listed in a manifest, so that a
+// corpus of recordings can be validated again after every change. Each line
+// of the manifest has the path of a source and the path of a sample,
+// separated by tabs or spaces. The empty lines and the ones starting with
+// '#' are skipped.
+//
+// The pairs are shared by a few worker threads, each one with its own
+// workspace and buffers, which are reused for all of its pairs, along with
+// the FFTW plans for every length. They take the next pair as soon as they
+// finish the previous one, so that the slow pairs don't hold the rest back.
+// The results are written as JSON lines in the order they finish, with the
+// pair's index in the manifest.
+//
+// A large manifest can be split into `n` shards with `--shard i/n`, each one
+// with the pairs whose index modulo `n` is `i`, starting at zero.
+
+#define _POSIX_C_SOURCE 200809L  // clock_gettime() and getline()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/thread_pool.h>
+#include "decode.h"
+
+// The default length of the samples, in seconds. The sources are decoded up
+// to twice that.
+#define DEFAULT_SECONDS 20
+
+
+struct pair {
+    size_t index;
+    char *source;
+    char *sample;
+};
+
+struct worker {
+    pthread_t thread;
+    struct xcorr_workspace *ws;
+    sample_t *source;
+    sample_t *sample;
+};
+
+// The configuration, which is only written before starting the workers.
+static struct pair *pairs = NULL;
+static size_t n_pairs = 0;
+static unsigned int seconds = DEFAULT_SECONDS;
+static int normalized = 0;
+static weighting_t weighting = NO_WEIGHTING;
+
+// The index of the next pair to be aligned by any worker.
+static size_t next_pair = 0;
+// The lines are written with this lock taken, so that they aren't mixed.
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3
+           + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Writes a JSON string with its quotes, escaping the characters that need
+// it.
+static void print_string(const char *str) {
+    putchar('"');
+    for (; *str != '\0'; str++) {
+        const unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+// Writes a finished pair, with its results if `error` is NULL.
+static void print_result(const struct pair *pair, const char *error,
+                         long lag, double coef, double decode_ms,
+                         double align_ms) {
+    pthread_mutex_lock(&output_mutex);
+    printf("{\"index\": %zu, \"source\": ", pair->index);
+    print_string(pair->source);
+    printf(", \"sample\": ");
+    print_string(pair->sample);
+    if (error != NULL) {
+        printf(", \"error\": ");
+        print_string(error);
+    } else {
+        printf(", \"lag\": %ld, \"lag_ms\": %.1f", lag, lag * FRAMES_TO_MS);
+        // The coefficient is NaN when either signal is constant, which JSON
+        // can't represent.
+        if (isnan(coef)) {
+            printf(", \"coefficient\": null, \"ok\": false");
+        } else {
+            printf(", \"coefficient\": %.4f, \"ok\": %s", coef,
+                   coef >= MIN_CONFIDENCE ? "true" : "false");
+        }
+        printf(", \"decode_ms\": %.1f, \"align_ms\": %.1f", decode_ms,
+               align_ms);
+    }
+    printf("}\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+// Aligns a single pair with the worker's buffers.
+static void align_pair(struct worker *worker, const struct pair *pair) {
+    const size_t max_len = seconds * SAMPLE_RATE;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t source_len, sample_len;
+    sample_t *source = decode(pair->source, 2 * seconds, &source_len);
+    sample_t *sample = decode(pair->sample, seconds, &sample_len);
+    if (source == NULL || sample == NULL) {
+        print_result(pair, "couldn't decode the files", 0, 0, 0, 0);
+        goto finish;
+    }
+    const double decode_ms = elapsed_ms(&start);
+
+    // The sample is cut to whole seconds, so that the pairs share the plans
+    // of a few lengths, which also have small factors.
+    if (sample_len > max_len) sample_len = max_len;
+    sample_len -= sample_len % SAMPLE_RATE;
+    if (sample_len == 0) {
+        print_result(pair, "the sample is shorter than a second", 0, 0, 0, 0);
+        goto finish;
+    }
+
+    // The source is zero-padded or cut to twice the sample's length.
+    if (source_len > 2 * sample_len) source_len = 2 * sample_len;
+    memcpy(worker->source, source, source_len * sizeof(*source));
+    memset(worker->source + source_len, 0,
+           (2 * sample_len - source_len) * sizeof(*source));
+    memcpy(worker->sample, sample, sample_len * sizeof(*sample));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long lag;
+    double coef;
+    int ret;
+    if (normalized) {
+        ret = xcorr_workspace_ncc(worker->ws, worker->source, worker->sample,
+                                  sample_len, 0, &lag, &coef);
+    } else {
+        ret = xcorr_workspace_run(worker->ws, worker->source, worker->sample,
+                                  sample_len, 0, &lag, &coef);
+    }
+    if (ret < 0) {
+        print_result(pair, "the cross-correlation failed", 0, 0, 0, 0);
+        goto finish;
+    }
+    print_result(pair, NULL, lag, coef, decode_ms, elapsed_ms(&start));
+
+finish:
+    free(source);
+    free(sample);
+}
+
+static void *worker_loop(void *arg) {
+    struct worker *worker = arg;
+    for (;;) {
+        const size_t i = __atomic_fetch_add(&next_pair, 1, __ATOMIC_RELAXED);
+        if (i >= n_pairs) break;
+        align_pair(worker, &pairs[i]);
+    }
+
+    return NULL;
+}
+
+static int init_worker(struct worker *worker) {
+    const size_t max_len = seconds * SAMPLE_RATE;
+    worker->ws = xcorr_workspace_new(max_len);
+    worker->source = FFTW(alloc_real)(2 * max_len);
+    worker->sample = FFTW(alloc_real)(max_len);
+    if (worker->ws == NULL || worker->source == NULL
+            || worker->sample == NULL) {
+        fprintf(stderr, "Couldn't allocate the worker buffers\n");
+        return -1;
+    }
+    if (!normalized
+            && xcorr_workspace_set_weighting(worker->ws, weighting,
+                                             SAMPLE_RATE) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void free_worker(struct worker *worker) {
+    xcorr_workspace_free(worker->ws);
+    if (worker->source) FFTW(free)(worker->source);
+    if (worker->sample) FFTW(free)(worker->sample);
+}
+
+// Reads the pairs of the shard `shard` out of `n_shards` from the manifest.
+//
+// Returns -1 in case of error, or zero otherwise.
+static int read_manifest(const char *path, size_t shard, size_t n_shards) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Couldn't open the manifest");
+        return -1;
+    }
+
+    int ret = -1;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t capacity = 0;
+    size_t index = 0;
+    size_t line_num = 0;
+    while (getline(&line, &line_size, file) >= 0) {
+        line_num++;
+        const char *delims = " \t\r\n";
+        char *save;
+        char *source = strtok_r(line, delims, &save);
+        if (source == NULL || source[0] == '#') continue;
+        char *sample = strtok_r(NULL, delims, &save);
+        if (sample == NULL || strtok_r(NULL, delims, &save) != NULL) {
+            fprintf(stderr, "Invalid pair in line %zu of the manifest\n",
+                    line_num);
+            goto finish;
+        }
+
+        // The index counts every pair, so that it's the same in all shards.
+        if (index++ % n_shards != shard) continue;
+        if (n_pairs == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            struct pair *tmp = realloc(pairs, capacity * sizeof(*pairs));
+            if (tmp == NULL) {
+                perror("Couldn't allocate the pairs");
+                goto finish;
+            }
+            pairs = tmp;
+        }
+        pairs[n_pairs].index = index - 1;
+        pairs[n_pairs].source = strdup(source);
+        pairs[n_pairs].sample = strdup(sample);
+        n_pairs++;
+        if (pairs[n_pairs - 1].source == NULL
+                || pairs[n_pairs - 1].sample == NULL) {
+            perror("Couldn't allocate the pairs");
+            goto finish;
+        }
+    }
+    ret = 0;
+
+finish:
+    free(line);
+    fclose(file);
+
+    return ret;
+}
+
+static int parse_weighting(const char *name) {
+    const weighting_t all[] = {NO_WEIGHTING, PHAT_WEIGHTING,
+                               COHERENCE_WEIGHTING, BAND_WEIGHTING};
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(name, weighting_to_string(all[i])) == 0) {
+            weighting = all[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        goto usage;
+    }
+
+    size_t shard = 0, n_shards = 1;
+    size_t jobs = thread_pool_size();
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--normalized") == 0) {
+            normalized = 1;
+        } else if (i + 1 == argc) {
+            goto usage;
+        } else if (strcmp(argv[i], "--shard") == 0) {
+            if (sscanf(argv[++i], "%zu/%zu", &shard, &n_shards) != 2
+                    || n_shards == 0 || shard >= n_shards) {
+                goto usage;
+            }
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = strtoul(argv[++i], NULL, 10);
+            if (jobs == 0) goto usage;
+        } else if (strcmp(argv[i], "--seconds") == 0) {
+            seconds = strtoul(argv[++i], NULL, 10);
+            if (seconds == 0) goto usage;
+        } else if (strcmp(argv[i], "--weighting") == 0) {
+            if (parse_weighting(argv[++i]) < 0) goto usage;
+        } else {
+            goto usage;
+        }
+    }
+
+    int ret = 1;
+    struct worker *workers = NULL;
+    size_t n_workers = 0;
+    if (read_manifest(argv[1], shard, n_shards) < 0) {
+        goto finish;
+    }
+    if (jobs > n_pairs) jobs = n_pairs;
+
+    workers = calloc(jobs, sizeof(*workers));
+    if (workers == NULL && jobs > 0) {
+        perror("Couldn't allocate the workers");
+        goto finish;
+    }
+    for (; n_workers < jobs; n_workers++) {
+        if (init_worker(&workers[n_workers]) < 0) {
+            free_worker(&workers[n_workers]);
+            goto finish;
+        }
+    }
+    for (size_t i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, &worker_loop,
+                           &workers[i]) != 0) {
+            perror("Couldn't start the workers");
+            // The remaining pairs are aligned by the ones already started.
+            for (size_t j = i; j < n_workers; j++) {
+                free_worker(&workers[j]);
+            }
+            n_workers = i;
+            break;
+        }
+    }
+    if (n_workers > 0 || n_pairs == 0) ret = 0;
+    for (size_t i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+finish:
+    for (size_t i = 0; i < n_workers; i++) {
+        free_worker(&workers[i]);
+    }
+    free(workers);
+    for (size_t i = 0; i < n_pairs; i++) {
+        free(pairs[i].source);
+        free(pairs[i].sample);
+    }
+    free(pairs);
+
+    return ret;
+
+usage:
+    printf("Usage: %s MANIFEST [--shard I/N] [--jobs N] [--seconds S]"
+           " [--normalized]\n"
+           "       [--weighting none|phat|coherence|band]\n", argv[0]);
+    return 1;
+}
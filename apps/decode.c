@@ -0,0 +1,93 @@
+// Decoding the local audio files used by the apps with ffmpeg.
+
+#define _POSIX_C_SOURCE 200809L  // fork()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "decode.h"
+
+
+// The pipes are created and forked with this lock taken, so that the child
+// of a thread doesn't inherit the write end of another one's pipe, which
+// wouldn't reach its end until both children finished.
+static pthread_mutex_t fork_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+sample_t *decode(const char *path, unsigned int max_seconds, size_t *len) {
+    // The limit is passed to ffmpeg with -t, which is skipped entirely when
+    // it's zero.
+    char limit[16];
+    snprintf(limit, sizeof(limit), "%u", max_seconds);
+
+    int fds[2];
+    pthread_mutex_lock(&fork_mutex);
+    if (pipe(fds) < 0) {
+        perror("pipe failed");
+        pthread_mutex_unlock(&fork_mutex);
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        close(fds[0]); close(fds[1]);
+        pthread_mutex_unlock(&fork_mutex);
+        return NULL;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], 1);
+        close(fds[1]);
+        if (max_seconds == 0) {
+            execlp("ffmpeg", "ffmpeg", "-loglevel", "fatal", "-i", path,
+                   "-ac", NUM_CHANNELS_STR, "-ar", SAMPLE_RATE_STR, "-f",
+                   SAMPLE_FORMAT_STR, "pipe:1", (char *) NULL);
+        } else {
+            execlp("ffmpeg", "ffmpeg", "-loglevel", "fatal", "-i", path,
+                   "-t", limit, "-ac", NUM_CHANNELS_STR, "-ar",
+                   SAMPLE_RATE_STR, "-f", SAMPLE_FORMAT_STR, "pipe:1",
+                   (char *) NULL);
+        }
+        perror("execlp failed");
+        exit(1);
+    }
+
+    close(fds[1]);
+    pthread_mutex_unlock(&fork_mutex);
+    size_t capacity = 60 * SAMPLE_RATE;
+    sample_t *buf = malloc(capacity * sizeof(*buf));
+    size_t read_bytes = 0;
+    ssize_t n = 0;
+    while (buf != NULL) {
+        if (read_bytes == capacity * sizeof(*buf)) {
+            capacity *= 2;
+            sample_t *tmp = realloc(buf, capacity * sizeof(*buf));
+            if (tmp == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = tmp;
+        }
+        n = read(fds[0], (char *) buf + read_bytes,
+                 capacity * sizeof(*buf) - read_bytes);
+        if (n <= 0) break;
+        read_bytes += n;
+    }
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (buf == NULL || n < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Couldn't decode %s\n", path);
+        free(buf);
+        return NULL;
+    }
+
+    *len = read_bytes / sizeof(*buf);
+    return buf;
+}
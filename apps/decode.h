@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <audiosync/audiosync.h>
+
+// Decodes an audio file with ffmpeg into a new buffer, in the format used by
+// audiosync. Only its first `max_seconds` are decoded, unless it's zero.
+// Returns NULL in case of error.
+sample_t *decode(const char *path, unsigned int max_seconds, size_t *len);
@@ -0,0 +1,116 @@
+// Creates or extends the index used by the fingerprint engine with local
+// audio files (decoded with ffmpeg) and the tracks in audiosync's cache, or
+// matches the start of a file against it.
+
+#define _POSIX_C_SOURCE 200809L  // clock_gettime()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fingerprint.h>
+#include <audiosync/track_cache.h>
+#include "decode.h"
+
+// How much of the file is matched with --match.
+#define MATCH_SECONDS 5
+
+
+static int add_cached(const char *title, const sample_t *buf, size_t len,
+                      void *data) {
+    printf("Adding cached track '%s'\n", title);
+    return fp_index_add(data, title, buf, len);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3
+           + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s INDEX [--cache DIR] [FILE...]\n"
+               "       %s INDEX --match FILE\n", argv[0], argv[0]);
+        exit(1);
+    }
+
+    const char *index_path = argv[1];
+    int ret = 1;
+    sample_t *buf = NULL;
+    size_t len;
+
+    // Matching the start of a file.
+    if (strcmp(argv[2], "--match") == 0) {
+        struct fp_index *index = fp_index_load(index_path);
+        if (index == NULL || argc < 4
+                || (buf = decode(argv[3], 0, &len)) == NULL) {
+            fp_index_free(index);
+            return 1;
+        }
+
+        struct timespec start;
+        struct fp_match match;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (len > MATCH_SECONDS * SAMPLE_RATE) {
+            len = MATCH_SECONDS * SAMPLE_RATE;
+        }
+        if (fp_index_match(index, NULL, buf, len, &match) == 0) {
+            printf("Matched '%s' at %.0f ms (%ld votes, confidence %.3f)"
+                   " in %.1f ms\n", fp_index_title(index, match.track),
+                   match.offset * FRAMES_TO_MS, match.votes, match.confidence,
+                   elapsed_ms(&start));
+            ret = 0;
+        } else {
+            printf("No match found\n");
+        }
+        fp_index_free(index);
+        free(buf);
+        return ret;
+    }
+
+    // Creating the index, or extending it if it already exists.
+    struct fp_index *index = NULL;
+    if (access(index_path, F_OK) == 0) {
+        index = fp_index_load(index_path);
+    } else {
+        index = fp_index_new();
+    }
+    if (index == NULL) {
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            if (audiosync_set_cache(argv[++i], 0) < 0
+                    || track_cache_foreach(&add_cached, index) < 0) {
+                goto finish;
+            }
+            continue;
+        }
+
+        // The title is the file name, without its directories.
+        const char *title = strrchr(argv[i], '/');
+        title = title ? title + 1 : argv[i];
+        printf("Adding '%s'\n", title);
+        buf = decode(argv[i], 0, &len);
+        if (buf == NULL || fp_index_add(index, title, buf, len) < 0) {
+            goto finish;
+        }
+        free(buf);
+        buf = NULL;
+    }
+
+    if (fp_index_save(index, index_path) == 0) {
+        printf("Saved %ld tracks into %s\n", fp_index_len(index), index_path);
+        ret = 0;
+    }
+
+finish:
+    free(buf);
+    fp_index_free(index);
+
+    return ret;
+}
@@ -0,0 +1,287 @@
+// Times the hot path of the algorithm on synthetic signals, for every
+// interval length: the cross-correlation, the full engine's run with one or
+// several peaks checked, the Pearson Correlation Coefficient, the search of
+// the cross-correlation's peak, and the loop that ingests the audio read
+// from ffmpeg. Unlike dev/benchmark.py, it
+// doesn't need the network or a music player, so its results can be
+// compared between releases.
+//
+// The results are written to stdout as JSON, with the minimum, median and
+// 99th percentile of the repetitions of each case, and its throughput in
+// frames per second calculated from the median.
+
+#define _POSIX_C_SOURCE 200809L  // clock_gettime()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/kernels.h>
+#include <audiosync/thread_pool.h>
+
+#define DEFAULT_REPS 20
+// The lag of the synthetic sample over the source, in frames.
+#define LAG 12345
+// The size of the reads from the pipe, the same as in ffmpeg_pipe.c.
+#define BUFSIZE 4096
+
+
+// The signals shared by every case, long enough for the biggest interval.
+static sample_t *source = NULL;
+static sample_t *sample = NULL;
+static size_t reps = DEFAULT_REPS;
+static int first_result = 1;
+
+// Simple pseudo-random noise between -0.5 and 0.5.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Writes the results of a case from the times of its repetitions, which are
+// sorted first, in place. `frames` is the number of frames processed in each
+// one.
+static void print_result(const char *name, size_t len, size_t frames,
+                         double *times) {
+    qsort(times, reps, sizeof(*times), &compare_doubles);
+    // The percentile uses the nearest rank.
+    size_t p99 = (99 * reps + 99) / 100;
+    if (p99 > 0) p99--;
+    const double median = reps % 2 ? times[reps / 2]
+                          : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+
+    printf("%s\n    {\"name\": \"%s\", \"len\": %zu, \"reps\": %zu,"
+           " \"min_ms\": %.3f, \"median_ms\": %.3f, \"p99_ms\": %.3f,"
+           " \"frames_per_s\": %.0f}", first_result ? "" : ",", name, len,
+           reps, times[0], median, times[p99], frames / (median / 1e3));
+    first_result = 0;
+}
+
+// The cross-correlation of a sample of `len` frames with its source of
+// twice that, including the allocation of its workspace.
+static int bench_cross_correlation(size_t len, double *times) {
+    long lag;
+    double coef;
+    // The first run creates the plans, which isn't measured. A failed run
+    // would be timed without doing all the work, so it stops the benchmark.
+    if (cross_correlation(source, sample, len, &lag, &coef) < 0) {
+        fprintf(stderr, "cross_correlation failed with %zu frames\n", len);
+        return -1;
+    }
+    for (size_t i = 0; i < reps; i++) {
+        const double start = now_ms();
+        const int ret = cross_correlation(source, sample, len, &lag, &coef);
+        times[i] = now_ms() - start;
+        if (ret < 0) {
+            fprintf(stderr, "cross_correlation failed with %zu frames\n",
+                    len);
+            return -1;
+        }
+    }
+    print_result("cross_correlation", len, len, times);
+
+    return 0;
+}
+
+// The full engine's run in a reused workspace, checking only the highest
+// peak of the cross-correlation or the highest ones, see
+// xcorr_workspace_set_multi_peak.
+static int bench_workspace(struct xcorr_workspace *ws, size_t len,
+                           int multi_peak, double *times) {
+    const char *name = multi_peak ? "xcorr_multi_peak" : "xcorr_single_peak";
+    long lag;
+    double coef;
+    xcorr_workspace_set_multi_peak(ws, multi_peak);
+    // Like in bench_cross_correlation, the first run isn't measured.
+    for (size_t i = 0; i <= reps; i++) {
+        const double start = now_ms();
+        const int ret = xcorr_workspace_run(ws, source, sample, len, 0, &lag,
+                                            &coef);
+        if (i > 0) times[i - 1] = now_ms() - start;
+        if (ret < 0) {
+            fprintf(stderr, "%s failed with %zu frames\n", name, len);
+            return -1;
+        }
+    }
+    print_result(name, len, len, times);
+
+    return 0;
+}
+
+static void bench_pearson(size_t len, double *times) {
+    volatile double coef;
+    for (size_t i = 0; i < reps; i++) {
+        const double start = now_ms();
+        coef = pearson_coefficient(source, source + len, sample,
+                                   sample + len);
+        times[i] = now_ms() - start;
+    }
+    UNUSED(coef);
+    print_result("pearson_coefficient", len, len, times);
+}
+
+// The peak is searched in the whole cross-correlation, which is twice as
+// long as the sample.
+static void bench_max_abs_index(size_t len, double *times) {
+    volatile size_t index;
+    for (size_t i = 0; i < reps; i++) {
+        const double start = now_ms();
+        index = kernel_max_abs_index(source, 2 * len);
+        times[i] = now_ms() - start;
+    }
+    UNUSED(index);
+    print_result("max_abs_index", len, 2 * len, times);
+}
+
+struct writer_args {
+    int fd;
+    size_t len;
+};
+
+// Plays the role of ffmpeg, writing the source into the pipe.
+static void *writer(void *arg) {
+    struct writer_args *args = arg;
+    const char *buf = (const char *) source;
+    size_t left = args->len * sizeof(*source);
+    while (left > 0) {
+        const ssize_t n = write(args->fd, buf, left);
+        if (n <= 0) break;
+        buf += n;
+        left -= n;
+    }
+    close(args->fd);
+
+    return NULL;
+}
+
+// Ingesting a source of `2 * len` frames from a pipe, with the same loop as
+// ffmpeg_pipe and the same intervals as a run, but written by a thread
+// instead of ffmpeg, so that only the reading side is measured.
+static int bench_ingest(size_t len, double *times, sample_t *buf) {
+    size_t intervals[N_INTERVALS];
+    size_t n_intervals = 0;
+    while (n_intervals < N_INTERVALS && INTERV_SAMPLE[n_intervals] <= len) {
+        intervals[n_intervals] = 2 * INTERV_SAMPLE[n_intervals];
+        n_intervals++;
+    }
+
+    for (size_t i = 0; i < reps; i++) {
+        struct ffmpeg_data data = {
+            .title = "benchmark",
+            .buf = buf,
+            .total_len = 2 * len,
+            .intervals = intervals,
+            .n_intervals = n_intervals,
+        };
+        int fds[2];
+        if (pipe(fds) < 0) {
+            perror("pipe failed");
+            return -1;
+        }
+        struct writer_args args = { .fd = fds[1], .len = 2 * len };
+        pthread_t thread;
+        const double start = now_ms();
+        if (pthread_create(&thread, NULL, &writer, &args) != 0) {
+            perror("pthread_create failed");
+            close(fds[0]); close(fds[1]);
+            return -1;
+        }
+
+        size_t read_len = 0;
+        size_t interval_count = 0;
+        while (read_len < data.total_len) {
+            size_t room;
+            sample_t *dest = ffmpeg_data_dest(&data, read_len, BUFSIZE,
+                                              &room);
+            const ssize_t n = read(fds[0], dest, room * sizeof(*dest));
+            if (n <= 0) break;
+            read_len += n / sizeof(*dest);
+            ffmpeg_data_publish(&data, read_len, &interval_count);
+        }
+        ffmpeg_data_finish(&data, read_len);
+        times[i] = now_ms() - start;
+
+        close(fds[0]);
+        pthread_join(thread, NULL);
+    }
+    print_result("ingest", len, 2 * len, times);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        reps = strtoul(argv[1], NULL, 10);
+        if (reps == 0) {
+            printf("Usage: %s [REPETITIONS]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    int ret = 1;
+    const size_t max_len = INTERV_SAMPLE[N_INTERVALS - 1];
+    double *times = malloc(reps * sizeof(*times));
+    sample_t *buf = malloc(2 * max_len * sizeof(*buf));
+    source = FFTW(alloc_real)(2 * max_len);
+    sample = FFTW(alloc_real)(max_len);
+    struct xcorr_workspace *ws = xcorr_workspace_new(max_len);
+    if (times == NULL || buf == NULL || source == NULL || sample == NULL
+            || ws == NULL) {
+        perror("Couldn't allocate the signals");
+        goto finish;
+    }
+
+    // The sample is part of the source with some noise, so that the
+    // cross-correlation does the same work as with real audio.
+    unsigned seed = 1;
+    for (size_t i = 0; i < 2 * max_len; i++) {
+        source[i] = noise(&seed);
+    }
+    for (size_t i = 0; i < max_len; i++) {
+        sample[i] = source[i + LAG] + 0.1 * noise(&seed);
+    }
+
+    printf("{\n  \"precision\": \"%s\",\n  \"isa\": \"%s\",\n"
+           "  \"threads\": %zu,\n  \"results\": [",
+           sizeof(sample_t) == sizeof(double) ? "double" : "single",
+           isa_to_string(kernels_get_isa()), thread_pool_size());
+    for (size_t i = 0; i < N_INTERVALS; i++) {
+        const size_t len = INTERV_SAMPLE[i];
+        if (bench_cross_correlation(len, times) < 0
+                || bench_workspace(ws, len, 0, times) < 0
+                || bench_workspace(ws, len, 1, times) < 0
+                || bench_ingest(len, times, buf) < 0) {
+            goto finish;
+        }
+        bench_pearson(len, times);
+        bench_max_abs_index(len, times);
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+    ret = 0;
+
+finish:
+    free(times);
+    free(buf);
+    if (source) FFTW(free)(source);
+    if (sample) FFTW(free)(sample);
+    if (ws) xcorr_workspace_free(ws);
+
+    return ret;
+}
@@ -0,0 +1,79 @@
+// The program run by end_to_end.py for every run of the end-to-end
+// benchmark. It runs audiosync once with the stand-ins of ffmpeg and
+// youtube-dl in the PATH, and writes how long it took to stdout as JSON,
+// along with the CPU time used by the process and by its children (the
+// stand-ins), and the interval the run stopped at, from its statistics.
+//
+// "ready" is written right before starting the run, so that the harness
+// starts playing the recorded audio at the same time.
+
+#define _POSIX_C_SOURCE 200809L  // clock_gettime()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <audiosync/audiosync.h>
+
+
+static double cpu_ms(const struct rusage *usage) {
+    return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1e3
+           + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e3;
+}
+
+static int parse_engine(const char *name) {
+    const engine_t all[] = {FULL_ENGINE, PARTITIONED_ENGINE,
+                            DECIMATED_ENGINE};
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(name, engine_to_string(all[i])) == 0) {
+            audiosync_set_engine(all[i]);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && !(argc == 4 && strcmp(argv[2], "--engine") == 0
+                       && parse_engine(argv[3]) == 0)) {
+        printf("Usage: %s TITLE [--engine full|partitioned|decimated]\n",
+               argv[0]);
+        exit(1);
+    }
+
+    printf("ready\n");
+    fflush(stdout);
+
+    struct rusage self_start, self_end, children_start, children_end;
+    struct timespec start, end;
+    getrusage(RUSAGE_SELF, &self_start);
+    getrusage(RUSAGE_CHILDREN, &children_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long lag;
+    const int ret = audiosync_run(argv[1], &lag);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self_end);
+    getrusage(RUSAGE_CHILDREN, &children_end);
+
+    printf("{\"ret\": %d, \"lag_ms\": %ld, \"time_to_result_ms\": %.1f,"
+           " \"cpu_ms\": %.1f, \"children_cpu_ms\": %.1f,"
+           " \"intervals\": [", ret, ret == 0 ? lag : 0,
+           (end.tv_sec - start.tv_sec) * 1e3
+           + (end.tv_nsec - start.tv_nsec) / 1e6,
+           cpu_ms(&self_end) - cpu_ms(&self_start),
+           cpu_ms(&children_end) - cpu_ms(&children_start));
+    for (size_t i = 0; i < N_INTERVALS; i++) {
+        printf("%s%zu", i ? ", " : "", INTERV_SAMPLE[i] / SAMPLE_RATE);
+    }
+    // The last interval the algorithm was run with, if any.
+    struct audiosync_stats stats;
+    if (audiosync_get_stats(&stats) == 0 && stats.n_runs > 0) {
+        printf("], \"interval\": %zu}\n",
+               stats.runs[stats.n_runs - 1].interval);
+    } else {
+        printf("], \"interval\": null}\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+
+# End-to-end benchmark of audiosync_run, which measures how long it takes to
+# obtain a confident lag without the network, a music player or a human, so
+# that the changes to the scheduling or the engines can be compared offline.
+#
+# A synthetic source (or the WAV file passed with --source) is served by the
+# stand-ins of youtube-dl and ffmpeg in the stubs directory, which are put
+# first in the PATH. The recorded audio is the same source delayed by --lag
+# milliseconds, with some noise, and it's played into a PulseAudio pipe
+# source that's made the default one while the benchmark runs. Both can be
+# played faster than real time.
+#
+# Every run is done by the end_to_end program built with
+# -DBUILD_BENCHMARKS=ON, and it's written as a JSON line with the lag
+# obtained, the time to the result, the interval the run stopped at, and the
+# CPU time used. The lag error includes the time the capture takes to start,
+# which is usually a few milliseconds. A summary of all the runs is written
+# at the end.
+#
+# It needs a PulseAudio server running, and it should be run from the build
+# directory:
+#
+#     python3 ../benchmarks/end_to_end.py --runs 10 --noise 0.3
+
+import argparse
+import array
+import json
+import os
+import random
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import wave
+
+RATE = 48000
+SOURCE_NAME = 'audiosync_e2e'
+STUBS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'stubs')
+
+
+def write_wav(path, samples):
+    with wave.open(path, 'wb') as wav:
+        wav.setnchannels(1)
+        wav.setsampwidth(2)
+        wav.setframerate(RATE)
+        wav.writeframes(samples.tobytes())
+
+
+def read_wav(path):
+    with wave.open(path, 'rb') as wav:
+        if wav.getnchannels() != 1 or wav.getsampwidth() != 2 \
+                or wav.getframerate() != RATE:
+            sys.exit('The source must be a 16 bits mono WAV at 48 kHz')
+        samples = array.array('h')
+        samples.frombytes(wav.readframes(wav.getnframes()))
+    return samples
+
+
+def synthesize(seconds, seed):
+    rng = random.Random(seed)
+    return array.array('h', (int(rng.uniform(-0.5, 0.5) * 32767)
+                             for _ in range(seconds * RATE)))
+
+
+def record(source, lag_frames, noise, seed):
+    """The recorded audio is the source delayed by `lag_frames`, with
+    uniform noise of up to `noise` times the full scale."""
+
+    rng = random.Random(seed)
+    recorded = array.array('f', bytes(4 * len(source)))
+    for i in range(len(source)):
+        j = i + lag_frames
+        value = source[j] / 32768 if 0 <= j < len(source) else 0.0
+        recorded[i] = value + noise * rng.uniform(-1, 1)
+    return recorded
+
+
+def pactl(*args):
+    return subprocess.run(('pactl',) + args, check=True,
+                          stdout=subprocess.PIPE,
+                          universal_newlines=True).stdout.strip()
+
+
+def default_source():
+    for line in pactl('info').splitlines():
+        if line.startswith('Default Source:'):
+            return line.split(':', 1)[1].strip()
+    return None
+
+
+def play(fifo, recorded, speed, stop):
+    """Writes the recorded audio into the pipe source `speed` times faster
+    than real time, until it's finished or `stop` is set."""
+
+    chunk = RATE // 100
+    start = time.monotonic()
+    with open(fifo, 'wb') as out:
+        for written in range(0, len(recorded), chunk):
+            if stop.is_set():
+                break
+            out.write(recorded[written:written + chunk].tobytes())
+            out.flush()
+            delay = start + (written + chunk) / RATE / speed \
+                - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+
+
+def run_once(args, env, fifo, recorded, title):
+    driver_args = [args.driver, title]
+    if args.engine:
+        driver_args += ['--engine', args.engine]
+    proc = subprocess.Popen(driver_args, env=env, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    if proc.stdout.readline().strip() != 'ready':
+        proc.kill()
+        sys.exit('The driver failed: ' + proc.communicate()[1])
+
+    stop = threading.Event()
+    player = threading.Thread(target=play, args=(fifo, recorded,
+                                                 args.capture_speed, stop))
+    player.start()
+    out, _ = proc.communicate()
+    stop.set()
+    player.join()
+
+    result = json.loads(out)
+    intervals = result.pop('intervals')
+    interval = result['interval']
+    result['interval_s'] = None if interval is None else intervals[interval]
+    if result['ret'] == 0:
+        result['lag_error_ms'] = result['lag_ms'] - args.lag
+    return result
+
+
+def summarize(results):
+    times = [r['time_to_result_ms'] for r in results if r['ret'] == 0]
+    summary = {
+        'runs': len(results),
+        'failed': sum(r['ret'] != 0 for r in results),
+        'cpu_ms_mean': statistics.mean(r['cpu_ms'] for r in results),
+    }
+    if times:
+        summary.update({
+            'time_to_result_ms_min': min(times),
+            'time_to_result_ms_median': statistics.median(times),
+            'time_to_result_ms_max': max(times),
+        })
+    return summary
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='End-to-end benchmark of audiosync_run')
+    parser.add_argument('--driver', default='./benchmarks/end_to_end',
+                        help='path of the end_to_end program')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--lag', type=int, default=250,
+                        help='lag of the recorded audio, in milliseconds')
+    parser.add_argument('--noise', type=float, default=0.0,
+                        help='amplitude of the noise in the recorded audio')
+    parser.add_argument('--download-speed', type=float, default=20.0,
+                        help='times faster than real time the source is'
+                        ' downloaded, or 0 for no limit')
+    parser.add_argument('--capture-speed', type=float, default=1.0,
+                        help='times faster than real time the recorded'
+                        ' audio is played')
+    parser.add_argument('--resolve-delay', type=float, default=0.0,
+                        help='time taken by youtube-dl, in milliseconds')
+    parser.add_argument('--source', help='16 bits mono WAV at 48 kHz to use'
+                        ' instead of a synthetic one')
+    parser.add_argument('--engine', choices=('full', 'partitioned',
+                                             'decimated'))
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+    if args.capture_speed <= 0:
+        parser.error('the capture speed must be positive')
+
+    tmp = tempfile.mkdtemp(prefix='audiosync-e2e-')
+    source_path = os.path.join(tmp, 'source.wav')
+    fifo = os.path.join(tmp, 'capture.fifo')
+    if args.source:
+        source = read_wav(args.source)
+    else:
+        source = synthesize(70, args.seed)
+    write_wav(source_path, source)
+    recorded = record(source, args.lag * RATE // 1000, args.noise, args.seed)
+
+    env = dict(os.environ)
+    env['PATH'] = STUBS_DIR + os.pathsep + env.get('PATH', '')
+    env['E2E_SOURCE'] = source_path
+    env['E2E_DOWNLOAD_SPEED'] = str(args.download_speed)
+    env['E2E_RESOLVE_DELAY'] = str(args.resolve_delay)
+
+    # The pipe source is the default one only while the benchmark runs.
+    previous = default_source()
+    module = pactl('load-module', 'module-pipe-source',
+                   'source_name=' + SOURCE_NAME, 'file=' + fifo,
+                   'format=float32le', 'rate=%d' % RATE, 'channels=1')
+    results = []
+    try:
+        pactl('set-default-source', SOURCE_NAME)
+        for run in range(args.runs):
+            # Every run has its own title, in case the cache is enabled.
+            result = run_once(args, env, fifo, recorded, 'e2e-%d' % run)
+            result['run'] = run
+            results.append(result)
+            print(json.dumps(result), flush=True)
+    finally:
+        if previous:
+            pactl('set-default-source', previous)
+        pactl('unload-module', module)
+        os.remove(source_path)
+        if os.path.exists(fifo):
+            os.remove(fifo)
+        os.rmdir(tmp)
+
+    if results:
+        print(json.dumps({'summary': summarize(results)}))
+
+
+if __name__ == '__main__':
+    main()
@@ -11,7 +11,11 @@ endif ()
 
 find_path (FFTW_INCLUDES fftw3.h)
 
-find_library (FFTW_LIBRARIES NAMES fftw3)
+# FFTW_LIB may be set to look for a specific precision, like fftw3f.
+if (NOT FFTW_LIB)
+    set (FFTW_LIB fftw3)
+endif ()
+find_library (FFTW_LIBRARIES NAMES ${FFTW_LIB})
 
 # Handle the QUIETLY and REQUIRED arguments and set FFTW_FOUND to TRUE if
 # all listed variables are TRUE
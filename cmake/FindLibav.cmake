@@ -0,0 +1,34 @@
+# Find the FFmpeg libraries used to decode the audio in-process
+#
+# LIBAV_INCLUDES  - where to find libavformat/avformat.h
+# LIBAV_LIBRARIES - list of libraries when using libav.
+# LIBAV_FOUND     - true if all the libav libraries were found.
+
+if (LIBAV_INCLUDES AND LIBAV_LIBRARIES)
+    # Already in cache, be silent
+    set (Libav_FIND_QUIETLY TRUE)
+endif ()
+
+find_path (LIBAV_INCLUDES libavformat/avformat.h PATH_SUFFIXES ffmpeg)
+
+if (NOT LIBAV_LIBRARIES)
+    foreach (lib avformat avcodec swresample avutil)
+        find_library (LIBAV_${lib}_LIBRARY NAMES ${lib})
+        mark_as_advanced (LIBAV_${lib}_LIBRARY)
+        if (LIBAV_${lib}_LIBRARY)
+            list (APPEND LIBAV_LIBRARIES ${LIBAV_${lib}_LIBRARY})
+        else ()
+            set (LIBAV_MISSING TRUE)
+        endif ()
+    endforeach ()
+    if (LIBAV_MISSING)
+        unset (LIBAV_LIBRARIES)
+    endif ()
+endif ()
+
+# Handle the QUIETLY and REQUIRED arguments and set LIBAV_FOUND to TRUE if
+# all listed variables are TRUE
+include (FindPackageHandleStandardArgs)
+find_package_handle_standard_args (Libav DEFAULT_MSG LIBAV_LIBRARIES LIBAV_INCLUDES)
+
+mark_as_advanced (LIBAV_LIBRARIES LIBAV_INCLUDES)
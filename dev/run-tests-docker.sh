@@ -10,3 +10,14 @@ mkdir images
 cmake .. -DCMAKE_BUILD_TYPE=Debug -DBUILD_TESTING=YES
 make
 make test
+
+# The release configuration defines NDEBUG, which removes the assertions of
+# the library (but not the tests'), so it's built and tested as well, along
+# with the benchmarks.
+cd ..
+mkdir build-release
+cd build-release
+
+cmake .. -DCMAKE_BUILD_TYPE=Release -DBUILD_TESTING=YES -DBUILD_BENCHMARKS=ON
+make
+make test
@@ -15,6 +15,26 @@
 #define SAMPLE_RATE_STR "48000"
 // The value of the last interval in audiosync.c in seconds.
 #define MAX_SECONDS_STR "30"
+// The maximum length of the track in seconds while tracking the lag, see
+// audiosync_track.
+#define TRACK_SECONDS 360
+#define TRACK_SECONDS_STR "360"
+
+// The precision of the audio data and of the calculations. By default it's
+// double precision, but single precision can be enabled with the
+// SINGLE_PRECISION macro (or the CMake option with the same name), which
+// halves the memory used and the data read from ffmpeg. The source audio
+// is 16 bits anyway, so float is more than enough for the transforms. The
+// coefficients are still accumulated with double precision.
+//
+// SAMPLE_FORMAT_STR is the ffmpeg format with the same precision.
+#ifdef SINGLE_PRECISION
+typedef float sample_t;
+# define SAMPLE_FORMAT_STR "f32le"
+#else
+typedef double sample_t;
+# define SAMPLE_FORMAT_STR "f64le"
+#endif
 
 // Conversion factor from WAV samples with the defined sample rate to
 // milliseconds.
@@ -23,6 +43,11 @@
 // The minimum cross-correlation coefficient accepted.
 #define MIN_CONFIDENCE 0.95
 
+// The lengths of the intervals the algorithm may be run with, in frames,
+// defined in audiosync.c. The source intervals are twice as long.
+extern const size_t INTERV_SAMPLE[];
+extern const size_t N_INTERVALS;
+
 // Assertion that only takes place in debug mode. It helps prevent errors,
 // while not affecting performance in a release.
 #ifdef NDEBUG
@@ -36,45 +61,197 @@
 // of them have to be used mandatorily.
 #define UNUSED(x) (void)(x)
 
+// The status of a session, to communicate between its threads and control
+// audiosync externally.
+typedef enum {
+    IDLE_ST,     // Audiosync is doing nothing, it's not running
+    RUNNING_ST,  // Audiosync is running
+    PAUSED_ST,   // Audiosync is paused (recording and downloading too)
+    ABORT_ST     // Audiosync is stopping its algorithm completely
+} global_status_t;
+
+// The providers the source (the song the recorded audio is compared with)
+// can be obtained from.
+typedef enum {
+    SEARCH_PROVIDER,  // Searched on YouTube by its title with youtube-dl
+    URL_PROVIDER,     // Downloaded from the URL returned by a resolver
+    FILE_PROVIDER,    // Decoded from a local file, or from the standard input
+    BUFFER_PROVIDER   // Already decoded in memory
+} provider_t;
+
+// Where the source is obtained from. Only the fields used by its provider
+// have to be set.
+struct audiosync_source {
+    provider_t provider;
+    // The title of the song, used by the search and URL providers. It's also
+    // the key of the tracks in the cache, and the track matched by the
+    // fingerprint engine, which can be any track in the index if it's NULL.
+    const char *title;
+    // The resolver of the URL provider, which writes the URL of `title` into
+    // `url`, of up to `max_len` bytes. It returns -1 in case of error, or
+    // zero otherwise. `data` is passed to it as is.
+    int (*resolve)(const char *title, char *url, size_t max_len, void *data);
+    void *data;
+    // The path of the file provider, in any format ffmpeg supports, or "-"
+    // to read it from the standard input.
+    const char *path;
+    // The audio of the buffer provider, with `len` frames in the same format
+    // as the rest of the data (mono at SAMPLE_RATE).
+    const sample_t *buf;
+    size_t len;
+};
+
+// The state of a synchronization, see audiosync_session_new.
+struct audiosync_session;
+// The statistics of a stream read by a thread, see stats.h.
+struct stream_stats;
+
 // Structure used to pass the parameters to the threads.
 struct ffmpeg_data {
     const char *title;         // Only used to download the audio
-    double *buf;               // Buffer with the obtained data
-    size_t len;                // Current buffer's length
+    const struct audiosync_source *source;  // Only used to download it
+    // The session whose status the thread follows and whose main thread it
+    // signals, or NULL for the default one. It's loaded and stored
+    // atomically, since a prefetched download is moved into the session of
+    // the run that takes it while it's reading.
+    struct audiosync_session *session;
+    sample_t *buf;             // Buffer with the obtained data
+    // Current buffer's length. It's written by the reading thread only, and
+    // published atomically with release semantics after the frames it
+    // covers, so other threads may load it with acquire semantics and read
+    // them without any locks.
+    size_t len;
     const size_t total_len;    // Maximum length of the buffer
     const size_t *intervals;   // Intervals in which the data will be obtained
     const size_t n_intervals;  // Maximum number of intervals
+    // Limit of seconds read by ffmpeg, or MAX_SECONDS_STR if it's NULL.
+    char *max_seconds;
+    // If not NULL, the data keeps being read into this ring buffer of
+    // `ring_len` frames after `buf` is full, and `len` counts the frames read
+    // in total. The frame `i` after `total_len` is at `(i - total_len) %
+    // ring_len`.
+    sample_t *ring;
+    size_t ring_len;
+    // The statistics of the stream, updated as the data is published, or
+    // NULL if they aren't needed.
+    struct stream_stats *stats;
 };
 
-// The global status variable to communicate between threads and control
-// audiosync externally.
-typedef enum {
-    IDLE_ST,     // Audiosync is doing nothing, it's not running
-    RUNNING_ST,  // Audiosync is running
-    PAUSED_ST,   // Audiosync is paused (recording and downloading too)
-    ABORT_ST     // Audiosync is stopping its algorithm completely
-} global_status_t;
-extern volatile global_status_t global_status;
 // Converting a status enum value to a string.
 extern char *status_to_string(global_status_t status);
 
-// The global mutex and condition variables to synchronize between threads.
-extern pthread_mutex_t mutex;
-// Condition used to know when either thread has finished one of their
-// intervals.
-extern pthread_cond_t interval_done;
-// Condition used to continue the ffmpeg execution after it has been paused
-// with audiosync_pause().
-extern pthread_cond_t read_continue;
-
-// The module can be controlled externally with these basic functions. They
-// expose the global status variable, which will be received from the threads
-// accordingly. These functions atomically read or write the global status.
+// Every synchronization runs in a session, which owns its status, its
+// capture and its buffers, so that a process can run several of them at
+// once, each one from its own thread. The functions without a session use
+// the default one, which always exists and is never freed.
+//
+// Returns NULL in case of error.
+extern struct audiosync_session *audiosync_session_new();
+// Frees a session that isn't running.
+extern void audiosync_session_free(struct audiosync_session *session);
+extern struct audiosync_session *audiosync_default_session();
+
+// The sessions can be controlled externally with these basic functions. They
+// expose the status of the session, which will be received from its threads
+// accordingly. These functions atomically read or write the status, and
+// they're thread-safe.
+extern void audiosync_session_abort(struct audiosync_session *session);
+extern void audiosync_session_pause(struct audiosync_session *session);
+extern void audiosync_session_resume(struct audiosync_session *session);
+extern global_status_t audiosync_session_status(
+    const struct audiosync_session *session);
+
+// Same as above, for the default session.
 extern void audiosync_abort();
 extern void audiosync_pause();
 extern void audiosync_resume();
 extern global_status_t audiosync_status();
 
+// The engines available to calculate the cross-correlation in every interval.
+typedef enum {
+    FULL_ENGINE,         // A full-size cross-correlation in every interval
+    PARTITIONED_ENGINE,  // Incremental, partitioned cross-correlation
+    DECIMATED_ENGINE,    // Coarse-to-fine search on the decimated signals
+    FINGERPRINT_ENGINE   // Landmark hashes looked up in a local index
+} engine_t;
+// Converting an engine enum value to a string.
+extern char *engine_to_string(engine_t engine);
+
+// The engine used in the next runs can also be configured atomically.
+extern engine_t audiosync_get_engine();
+extern void audiosync_set_engine(engine_t engine);
+
+// The full engine can also choose the lag with the highest Pearson
+// Correlation Coefficient of all, rather than the highest peak of the
+// cross-correlation, which is then normalized. This is configured as a
+// boolean, atomically, and it's ignored by the other engines.
+extern int audiosync_get_normalized();
+extern void audiosync_set_normalized(int do_normalize);
+
+// The weightings that can be applied to the cross-spectrum before the
+// inverse transform, so that the peaks of the cross-correlation are sharper.
+// Otherwise, the loudest frequencies (usually the bass) dominate, and the
+// peaks are so broad that they need long intervals to be told apart.
+typedef enum {
+    NO_WEIGHTING,         // The plain cross-correlation
+    PHAT_WEIGHTING,       // Only the phase of every frequency is kept
+    COHERENCE_WEIGHTING,  // Divided by the smoothed spectra of both signals
+    BAND_WEIGHTING        // Like PHAT, but only between 200 Hz and 4 kHz
+} weighting_t;
+// Converting a weighting enum value to a string.
+extern char *weighting_to_string(weighting_t weighting);
+
+// The weighting used by the full and decimated engines in the next runs,
+// configured atomically. It's ignored by the normalized cross-correlation,
+// which needs the plain one.
+extern weighting_t audiosync_get_weighting();
+extern void audiosync_set_weighting(weighting_t weighting);
+
+// The full engine and the tracking can also check the coefficients of the
+// few highest peaks of the cross-correlation, rather than only the highest
+// one, which may be an alias of the actual lag in repetitive music. This is
+// configured as a boolean, atomically, and it's enabled by default: on a
+// single core, it adds from 18% of the time of the 3 seconds interval to 5%
+// of the 30 seconds one (see benchmarks/benchmark.c), which is a few
+// milliseconds, while a failed interval waits seconds for the next one.
+extern int audiosync_get_multi_peak();
+extern void audiosync_set_multi_peak(int enabled);
+
+// The fingerprint engine matches the recorded audio against a local index
+// of tracks instead of downloading it, created with the fingerprint app.
+// It's loaded from `path`, or unloaded if it's NULL. This can't be done
+// while audiosync is running. Returns -1 in case of error, or zero
+// otherwise.
+extern int audiosync_set_index(const char *path);
+
+// The downloaded tracks can be cached on disk, so that the same song isn't
+// searched and decoded again when it's played more than once. The least
+// recently used tracks are removed when the cache grows over `max_bytes`.
+// The directory is created if it doesn't exist, and a NULL `dir` disables
+// the cache, which is the default. Returns -1 in case of error, or zero
+// otherwise.
+extern int audiosync_set_cache(const char *dir, size_t max_bytes);
+
+// The recorded audio is read from PulseAudio in fragments of this many
+// milliseconds, configured atomically. Shorter fragments make the audio
+// available sooner, at the cost of waking up more often. It's
+// DEFAULT_FRAGMENT_MS by default, and it's used from the next run.
+#define DEFAULT_FRAGMENT_MS 20
+extern unsigned int audiosync_get_fragment();
+extern void audiosync_set_fragment(unsigned int ms);
+
+// The short concurrent tasks (the transforms, the coefficients and the
+// kernels) run in a pool of workers owned by the library by default. A host
+// application with its own pool may provide `submit` instead, which must
+// call `task(arg)` at some point and return zero, or return non-zero if it
+// couldn't take it, in which case it's run by audiosync itself. Since
+// audiosync waits for these tasks, the executor must be able to run them
+// while the submitting thread is blocked. The capture and download always
+// use the library's workers. Passing NULL restores the default.
+extern void audiosync_set_executor(int (*submit)(void (*task)(void *),
+                                                 void *arg, void *data),
+                                   void *data);
+
 // The debug mode can also be configured as a boolean, atomically.
 extern volatile int global_debug;
 extern int audiosync_get_debug();
@@ -95,18 +272,42 @@ extern void audiosync_set_debug(int do_debug);
 
 // The setup function is optional. It will initialize the PulseAudio sink to
 // later record the media player output directly, rather than the entire
-// desktop audio.
+// desktop audio. Each session has its own sink.
 // Thus, the `stream_name` variable indicates the name of the music player
 // being used. For example, "Spotify".
 //
 // It's possible that the setup fails, so it returns an integer which will
 // be zero on success, and negative on error.
+extern int audiosync_session_setup(struct audiosync_session *session,
+                                   const char *stream_name);
 extern int audiosync_setup(const char *stream_name);
 
+// The warm-up function is optional too. It creates the FFTW plans for every
+// interval ahead of time, so that they don't have to be created while the
+// algorithm is running. This may take a few seconds, or even minutes if
+// `patient` is true, so it's recommended to run it at startup, and to save
+// the results into a wisdom file at `wisdom_path`, which will be loaded
+// first in later calls. `wisdom_path` may be NULL to skip this.
+//
+// Returns zero on success, and -1 on error.
+extern int audiosync_warmup(const char *wisdom_path, int patient);
+
+// Starts searching and downloading the source of a song by its title in the
+// background, so that a later audiosync_run with the same title only has to
+// wait for the capture, like when the next song of a playlist is known
+// ahead of time. Up to `audiosync_set_prefetch` songs (2 by default) are
+// kept prepared, and the oldest one is dropped when a new one doesn't fit.
+//
+// Returns zero on success, and -1 on error.
+extern int audiosync_prepare(const char *yt_title);
+extern void audiosync_set_prefetch(size_t max_songs);
+
 // Main function to start the audio synchronization algorithm. It will return
-// 0 in case of success, or -1 otherwise. `yt_title` is the name of the song
-// currently playing on the computer. The obtained lag will be returned to
-// the variable `lag` points to.
+// 0 in case of success, or -1 otherwise. `source` indicates where the song
+// currently playing on the computer is obtained from. The obtained lag will
+// be returned to the variable `lag` points to. The local providers (a file
+// or a buffer) are read as fast as possible, so every interval of the source
+// is available almost immediately.
 //
 // It will start two threads: one to download the audio, and another one to
 // record it. These threads will signal this main function once they have
@@ -114,6 +315,90 @@ extern int audiosync_setup(const char *stream_name);
 // be ran with the current data. This will be done until an acceptable
 // result is obtained, or until all intervals are finished.
 //
-// This function starts the algorithm. Only one audiosync thread can be
-// running at once.
+// This function starts the algorithm in the default session. Only one
+// thread can be running each session at once, but different sessions can
+// run at the same time.
+extern int audiosync_run_source(const struct audiosync_source *source,
+                                long int *lag);
+// Same as audiosync_run_source, in the provided session.
+extern int audiosync_session_run(struct audiosync_session *session,
+                                 const struct audiosync_source *source,
+                                 long int *lag);
+
+// Same as audiosync_run_source, but the song is searched on YouTube by its
+// title, `yt_title`.
 extern int audiosync_run(const char *yt_title, long int *lag);
+
+// Same as audiosync_run, but instead of finishing after the lag is found, it
+// keeps recording the audio into a ring buffer, and checks the lag again
+// every second, only around the last one, which is very cheap. `update` is
+// called from the same thread with the initial lag in milliseconds and every
+// time it changes, so that a drift caused by the video player buffering can
+// be corrected. Only changes of up to half a second between checks are
+// detected, so a seek requires a new run. The download is limited to
+// TRACK_SECONDS, and it keeps tracking until audiosync_abort() is called or
+// its end is reached.
+//
+// Returns -1 if the initial lag couldn't be found or in case of error, or
+// zero otherwise.
+extern int audiosync_track(const char *yt_title,
+                           void (*update)(long int lag, void *data),
+                           void *data);
+// Same as audiosync_track, with any source and in the provided session,
+// which is aborted with audiosync_session_abort.
+extern int audiosync_session_track(struct audiosync_session *session,
+                                   const struct audiosync_source *source,
+                                   void (*update)(long int lag, void *data),
+                                   void *data);
+
+// The statistics of the last run of a session, so that it's possible to
+// tell if a slow synchronization was caused by the network, the capture or
+// the calculations. The times are in milliseconds since the start of the
+// run, or -1 if they weren't reached, like the download of a source
+// prepared with audiosync_prepare, which had started before the run.
+#define MAX_STATS_INTERVALS 16
+struct audiosync_interval_stats {
+    size_t interval;     // The interval run, see INTERV_SAMPLE
+    double start_ms;     // When the algorithm started running it
+    double compute_ms;   // The time taken by the whole algorithm
+    // The time taken by each of its phases. They're only measured by the
+    // full engine, and they're zero with the rest.
+    double fft_ms;       // The forward transforms
+    double multiply_ms;  // The cross-spectrum and its weighting
+    double ifft_ms;      // The inverse transform
+    double pearson_ms;   // The coefficients of the candidate lags
+    double confidence;   // NaN if it failed
+    // The confidence minus the one of the second best peak, which is only
+    // known when the full engine checks the highest peaks, or NaN.
+    double margin;
+};
+struct audiosync_stats {
+    double total_ms;
+    double resolve_ms;  // Obtaining the URL of the source
+    double download_first_byte_ms;
+    double capture_first_byte_ms;
+    // When each of the `n_intervals` intervals was read by the download and
+    // the capture.
+    size_t n_intervals;
+    double download_interval_ms[MAX_STATS_INTERVALS];
+    double capture_interval_ms[MAX_STATS_INTERVALS];
+    size_t download_bytes;
+    size_t capture_bytes;
+    // The index of the interval whose result was accepted, or -1.
+    long accepted_interval;
+    // The peak resident set size of the process, in kilobytes.
+    long peak_rss_kb;
+    // The intervals the algorithm was run with, in order.
+    size_t n_runs;
+    struct audiosync_interval_stats runs[MAX_STATS_INTERVALS];
+};
+
+// Copies the statistics of the last run of a session into `stats`. They can
+// be obtained at any time, even while the session is running again.
+//
+// Returns -1 if the session hasn't finished any runs yet, or zero
+// otherwise.
+extern int audiosync_session_get_stats(struct audiosync_session *session,
+                                       struct audiosync_stats *stats);
+// Same as audiosync_session_get_stats, for the default session.
+extern int audiosync_get_stats(struct audiosync_stats *stats);
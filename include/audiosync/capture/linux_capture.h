@@ -1,21 +1,25 @@
 #pragma once
 
-// Function used for the capture thread. It will start a new ffmpeg process
-// to record either the custom sink created with pulseaudio_setup, or the
-// entire desktop.
+// The name of the sink created by pulseaudio_setup for the default session.
+// The rest of the sessions add their id to it.
+#define SINK_NAME "audiosync"
+
+// Function used for the capture thread. It records either the custom sink
+// of its session, created with pulseaudio_setup, or the entire desktop, with
+// the asynchronous PulseAudio API.
 //
 // In case of errors, it will signal the main thread to abort.
 void *capture(void *);
 
-// Creates a new dedicated sink for recording within this module. It's
-// useful for complex PulseAudio setups, and avoids recording the entire
-// desktop audio. Only the indicated stream will be recorded, where
-// `stream_name` is the `application.name` attribute of its pulseaudio's
-// stream.
+// Creates a new dedicated sink for recording within this module, named
+// `sink`. It's useful for complex PulseAudio setups, and avoids recording
+// the entire desktop audio. Only the indicated stream will be recorded,
+// where `stream_name` is the `application.name` attribute of its
+// pulseaudio's stream.
 //
 // If this function isn't called, the capture function will use the desktop
 // audio instead, so it's completely optional, although recommended.
 //
 // This function will return 0 if it ran successfully, or -1 in case something
 // went wrong.
-int pulseaudio_setup(const char *stream_name);
+int pulseaudio_setup(const char *sink, const char *stream_name);
@@ -1,14 +1,37 @@
 #pragma once
 
 #include <stdlib.h>
+#include "audiosync.h"
 
 // Calculating the Pearson Correlation Coefficient between `source` and
 // `sample` between two pointers, applying the formula:
 // https://en.wikipedia.org/wiki/Pearson_correlation_coefficient#For_a_sample
 //
 // This function will only work correctly if end - start != 0.
-double pearson_coefficient(double *source_start, const double *source_end,
-                           double *sample_start, const double *sample_end);
+double pearson_coefficient(sample_t *source_start, const sample_t *source_end,
+                           sample_t *sample_start,
+                           const sample_t *sample_end);
+
+// Calculating the Pearson Correlation Coefficient of the overlapping segments
+// of `source` and `sample` after displacing the sample by `lag` frames. The
+// source must be twice the sample size, and
+// -sample_len < lag < 2 * sample_len.
+double lag_coefficient(sample_t *source, sample_t *sample, size_t sample_len,
+                       long lag);
+
+// The running sums of two overlapping segments, which are enough to
+// calculate their Pearson Correlation Coefficient in constant time given the
+// sum of their products. They can be updated as the segments slide.
+struct overlap_sums {
+    double n;       // Number of frames
+    double x, y;    // Sums of the source and the sample segments
+    double xx, yy;  // Sums of their squares
+};
+
+// Calculating the Pearson Correlation Coefficient of two segments from their
+// running sums and the sum of their products, `xy`. It's NaN if either of
+// them is constant.
+double overlap_coefficient(const struct overlap_sums *s, double xy);
 
 // Calculating the cross-correlation between two signals `a` and `b`:
 //     xcross = ifft(fft(a) * conj(fft(b)))
@@ -18,8 +41,111 @@ double pearson_coefficient(double *source_start, const double *source_end,
 // circular cross-correlation.
 //
 // Returns the lag in frames the sample has over the source, with a confidence
-// between -1 and 1.
+// between -1 and 1, from the highest peak of the cross-correlation.
 //
 // In case of error, the function returns -1. Otherwise, zero.
-int cross_correlation(double *data1, double *data2, const size_t length,
+int cross_correlation(sample_t *data1, sample_t *data2, const size_t length,
                       long *displacement, double *coefficient);
+
+// The buffers needed to calculate the cross-correlation, so that they can be
+// allocated once for the biggest interval, and then reused. A workspace can
+// only be used by one thread at a time.
+struct xcorr_workspace;
+
+// Allocates a new workspace for samples of up to `max_len` frames. Returns
+// NULL in case of error.
+struct xcorr_workspace *xcorr_workspace_new(size_t max_len);
+
+// Frees a workspace allocated with xcorr_workspace_new.
+void xcorr_workspace_free(struct xcorr_workspace *ws);
+
+// Returns the maximum sample length a workspace supports.
+size_t xcorr_workspace_max_len(const struct xcorr_workspace *ws);
+
+// The time taken by each phase of the last cross-correlation of a
+// workspace, in milliseconds. The phases that didn't run are zero.
+struct xcorr_timing {
+    double fft_ms;       // The forward transforms
+    double multiply_ms;  // The cross-spectrum and its weighting
+    double ifft_ms;      // The inverse transform
+    double pearson_ms;   // The coefficients of the candidate lags
+};
+
+// Obtains the timing of the last cross-correlation of a workspace.
+void xcorr_workspace_timing(const struct xcorr_workspace *ws,
+                            struct xcorr_timing *timing);
+
+// Configures the weighting applied to the cross-spectrum in the next
+// cross-correlations of the workspace, NO_WEIGHTING by default. The sample
+// rate of the signals, in Hz, is needed to find the limits of
+// BAND_WEIGHTING.
+//
+// Returns -1 in case of error, or zero otherwise.
+int xcorr_workspace_set_weighting(struct xcorr_workspace *ws,
+                                  weighting_t weighting, double rate);
+
+// Configures if xcorr_workspace_run checks the few highest peaks of the
+// cross-correlation like xcorr_workspace_peaks, instead of only the highest
+// one, which is the default.
+void xcorr_workspace_set_multi_peak(struct xcorr_workspace *ws,
+                                    int enabled);
+
+// Calculates the circular cross-correlation between the source and the
+// sample inside the workspace, and returns a pointer to it, of length
+// 2 * sample_len. The index i corresponds to a lag of i frames, or of
+// i - 2 * sample_len if i >= sample_len. It stays valid until the workspace
+// is used again. Returns NULL in case of error.
+//
+// The transforms are done in-place inside the workspace, except for the
+// source's. If `padded` is true, the sample buffer must already be
+// zero-padded up to twice its length, and it's transformed directly instead
+// of being copied into the workspace first.
+sample_t *xcorr_workspace_correlate(struct xcorr_workspace *ws,
+                                    sample_t *source, sample_t *sample,
+                                    const size_t sample_len, int padded);
+
+// The result of a cross-correlation: the lag in frames the sample has over
+// the source, its coefficient, and the difference between the coefficient
+// and the second best candidate's, which is the coefficient itself if there
+// was only one.
+struct xcorr_result {
+    long lag;
+    double coefficient;
+    double margin;
+};
+
+// Obtains the lag like xcorr_workspace_run, checking the coefficients of the
+// few highest peaks of the cross-correlation concurrently, rather than only
+// the highest one, which may be an alias of the actual lag in repetitive
+// music. The peaks are at least 50 ms apart, and both readings of the
+// circular cross-correlation are checked for the ones in its second half, so
+// the lag may be greater than sample_len. The cross-correlation in the
+// workspace is modified.
+//
+// Returns -1 in case of error, or zero otherwise.
+int xcorr_workspace_peaks(struct xcorr_workspace *ws, sample_t *source,
+                          sample_t *sample, const size_t sample_len,
+                          int padded, struct xcorr_result *result);
+
+// Same as cross_correlation, but using the buffers in the provided
+// workspace, so that no memory is allocated. See xcorr_workspace_correlate
+// for the `padded` parameter, and xcorr_workspace_set_multi_peak to check
+// more than the highest peak.
+int xcorr_workspace_run(struct xcorr_workspace *ws, sample_t *source,
+                        sample_t *sample, const size_t sample_len, int padded,
+                        long *lag, double *coefficient);
+
+// Same as xcorr_workspace_run, but the lag is the one with the highest
+// Pearson Correlation Coefficient of all, which is calculated for every lag
+// in linear time with the compensated running sums of its segments. The lags
+// whose overlap is shorter than half the sample are ignored. The signals
+// are zero-padded to xcorr_ncc_transform_len, so that the circular
+// cross-correlation is exact for all the other lags.
+int xcorr_workspace_ncc(struct xcorr_workspace *ws, sample_t *source,
+                        sample_t *sample, const size_t sample_len, int padded,
+                        long *lag, double *coefficient);
+
+// The length of the transforms used by xcorr_workspace_ncc for a sample of
+// `sample_len` frames, which is always even, so that they can be created
+// ahead of time with fft_plan_warmup for half of it.
+size_t xcorr_ncc_transform_len(size_t sample_len);
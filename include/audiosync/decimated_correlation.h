@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdlib.h>
+#include "audiosync.h"
+
+// Coarse-to-fine cross-correlation engine. The signals are first low-pass
+// filtered and decimated by `factor`, and their cross-correlation is
+// calculated at that lower rate to find a few candidate lags. Then, only the
+// lags around these candidates are checked at the full rate.
+//
+// Like in cross_correlation, the source must be twice as long as the sample.
+struct decimated_xcorr;
+
+// Allocates a new engine for samples up to `max_sample_len` frames, which
+// are decimated by `factor`. Returns NULL in case of error.
+struct decimated_xcorr *decimated_xcorr_new(size_t factor,
+                                            size_t max_sample_len);
+
+// Frees an engine allocated with decimated_xcorr_new.
+void decimated_xcorr_free(struct decimated_xcorr *d);
+
+// Configures the weighting of the coarse cross-correlation, see
+// xcorr_workspace_set_weighting.
+//
+// Returns -1 in case of error, or zero otherwise.
+int decimated_xcorr_set_weighting(struct decimated_xcorr *d,
+                                  weighting_t weighting);
+
+// Obtains the lag and the coefficient of the sample over the source, with the
+// same output as cross_correlation.
+//
+// Returns -1 in case of error, or zero otherwise.
+int decimated_xcorr_run(struct decimated_xcorr *d, sample_t *source,
+                        sample_t *sample, size_t sample_len, long *lag,
+                        double *coefficient);
@@ -7,8 +7,52 @@
 // provided array.
 //
 // It will send signals to the main thread as the intervals are being
-// finished, while also checking the current global status, or updating it in
+// finished, while also checking the status of its session, or updating it in
 // case of errors.
 //
 // Returns -1 in case of error, or zero otherwise.
 int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]);
+
+// The progress of the data is handled the same way by every backend that
+// reads it, with these functions.
+//
+// The session of the thread reading the data, which is the default one if it
+// wasn't set.
+struct audiosync_session *ffmpeg_data_session(const struct ffmpeg_data *data);
+
+// Signals the main thread of the session that more data is available.
+void ffmpeg_data_signal(const struct ffmpeg_data *data);
+
+// Obtains where the next frames of the data should be written, after the
+// `len` frames read so far, and how many of them fit there, up to `max`.
+sample_t *ffmpeg_data_dest(const struct ffmpeg_data *data, size_t len,
+                           size_t max, size_t *room);
+
+// Copies `len` frames of the data starting at the absolute frame `start`,
+// which may be in its buffer or in its ring buffer, into `out`, while it's
+// still being read. Returns -1 if the copy may be torn, when the reading
+// thread is within `margin` frames of wrapping around over the first frame
+// copied, or zero otherwise.
+int ffmpeg_data_copy(const struct ffmpeg_data *data, size_t start,
+                     size_t len, size_t margin, sample_t *out);
+
+// Publishes the new length of the data, and signals the main thread when one
+// or more intervals are finished. `interval_count` is the number of intervals
+// finished so far, which is updated.
+void ffmpeg_data_publish(struct ffmpeg_data *data, size_t len,
+                         size_t *interval_count);
+
+// Finishes the data after `len` frames were read, filling the rest of the
+// buffer with zeroes.
+void ffmpeg_data_finish(struct ffmpeg_data *data, size_t len);
+
+// The status followed by the thread reading the data, which is its
+// session's.
+global_status_t ffmpeg_data_status(const struct ffmpeg_data *data);
+
+// Aborts the session of the thread reading the data, in case of errors.
+void ffmpeg_data_abort(struct ffmpeg_data *data);
+
+// Blocks the calling thread while its session is paused. Returns the status
+// it was resumed with.
+global_status_t ffmpeg_data_wait_resume(const struct ffmpeg_data *data);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdlib.h>
+#include <complex.h>
+#include <fftw3.h>
+#include "audiosync.h"
+
+// FFTW has a different prefix for each precision, so its functions and types
+// are used through this macro, with the same precision as sample_t. For
+// example, FFTW(plan) is either fftw_plan or fftwf_plan.
+#ifdef SINGLE_PRECISION
+# define FFTW(name) fftwf_ ## name
+typedef float complex sample_cpx_t;
+#else
+# define FFTW(name) fftw_ ## name
+typedef double complex sample_cpx_t;
+#endif
+
+// The two kinds of transforms used in the cross-correlation.
+typedef enum {
+    R2C_PLAN,  // Forward, real to complex
+    C2R_PLAN   // Backward, complex to real
+} plan_kind_t;
+
+// A plan obtained with get_plan. `cached` indicates if it belongs to the
+// cache, or if it has to be destroyed with release_plan after its usage.
+struct plan_ref {
+    FFTW(plan) plan;
+    int cached;
+};
+
+// Obtains a plan for a transform of length `len` between `in` and `out`,
+// which may be used with FFTW(execute_dft_r2c) or FFTW(execute_dft_c2r).
+//
+// If it was already cached, no lock is taken at all. Otherwise, the plan is
+// created without measuring, so the arrays aren't overwritten. The returned
+// plan will be NULL in case of error.
+struct plan_ref get_plan(plan_kind_t kind, size_t len, void *in, void *out);
+
+// Destroys a plan obtained with get_plan in case it wasn't cached.
+void release_plan(struct plan_ref ref);
+
+// Creating the FFTW plans for the cross-correlation of the provided sample
+// lengths ahead of time, with the provided planner flags (FFTW_MEASURE or
+// FFTW_PATIENT, usually). They are saved in a process-wide cache, so that the
+// calls to cross_correlation don't have to run the planner anymore.
+//
+// Returns -1 in case of error, or zero otherwise.
+int fft_plan_warmup(const size_t *sample_lens, size_t n, unsigned flags);
+
+// Loading and saving the FFTW wisdom from or to a file, so that measuring
+// the plans only has to be done once.
+//
+// Both return -1 in case of error, or zero otherwise.
+int fft_wisdom_load(const char *path);
+int fft_wisdom_save(const char *path);
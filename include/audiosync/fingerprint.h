@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdlib.h>
+#include "audiosync.h"
+
+// Landmark fingerprint engine. The highest peaks of the spectrogram are
+// paired into hashes, which are saved in an inverted index with the track
+// and the time they were found at. A short sample can then be matched to
+// any offset of any track in the index by looking up its own hashes, with
+// no need to download the track.
+struct fp_index;
+
+// The result of matching a sample against an index.
+struct fp_match {
+    size_t track;       // Index of the matched track, see fp_index_title
+    long offset;        // Frames the sample starts at within the track
+    size_t votes;       // Hashes that agree with the offset
+    double confidence;  // Between zero and one, see fp_index_match
+};
+
+// Allocates a new empty index. Returns NULL in case of error.
+struct fp_index *fp_index_new();
+
+// Loads an index saved with fp_index_save. The file is mapped into memory,
+// so loading it is immediate. Returns NULL in case of error.
+struct fp_index *fp_index_load(const char *path);
+
+// Frees an index obtained with fp_index_new or fp_index_load.
+void fp_index_free(struct fp_index *index);
+
+// Saves the index into a file.
+//
+// Returns -1 in case of error, or zero otherwise.
+int fp_index_save(const struct fp_index *index, const char *path);
+
+// Adds the fingerprints of a track of `len` frames to the index.
+//
+// Returns -1 in case of error, or zero otherwise.
+int fp_index_add(struct fp_index *index, const char *title,
+                 const sample_t *track, size_t len);
+
+// Returns the number of tracks in the index.
+size_t fp_index_len(const struct fp_index *index);
+
+// Returns the title of a track in the index.
+const char *fp_index_title(const struct fp_index *index, size_t track);
+
+// Finds the track and the offset within it where the first `len` frames of
+// `sample` were most likely taken from. Only the tracks named `title` can
+// vote, unless it's NULL, so that a louder or longer track can't be matched
+// instead of the requested one. The confidence is zero with too few
+// matching hashes, and otherwise it's higher the more votes the best offset
+// has over the second best one (MIN_CONFIDENCE means about 4.5 times as
+// many).
+//
+// Returns -1 in case of error or if nothing matched, or zero otherwise.
+int fp_index_match(const struct fp_index *index, const char *title,
+                   const sample_t *sample, size_t len,
+                   struct fp_match *match);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdlib.h>
+#include "audiosync.h"
+#include "fft_plans.h"
+
+// The instruction sets the kernels may use. The best one supported by the
+// CPU is chosen at runtime.
+typedef enum {
+    GENERIC_ISA,  // Plain C, available everywhere
+    AVX2_ISA,     // AVX2 and FMA
+    AVX512_ISA    // AVX-512F
+} isa_t;
+// Converting an instruction set enum value to a string.
+char *isa_to_string(isa_t isa);
+
+// Returns the instruction set currently used by the kernels.
+isa_t kernels_get_isa();
+
+// Limits the kernels to an instruction set, mostly useful for testing and
+// benchmarking. Returns -1 if the CPU doesn't support it, or zero otherwise.
+int kernels_set_isa(isa_t isa);
+
+// Calculates the Pearson Correlation Coefficient between the first `len`
+// elements of `x` and `y` in a single pass. The sums are done in blocks with
+// double precision and merged with Chan's formulas, and big spans are split
+// between threads.
+//
+// The result is NaN if either signal is constant.
+double kernel_pearson(const sample_t *x, const sample_t *y, size_t len);
+
+// Multiplies each element of `a` by the conjugate of the one in `b`, saving
+// the result in `a`.
+void kernel_conj_multiply(sample_cpx_t *a, const sample_cpx_t *b,
+                          size_t len);
+
+// Adds the product of each element of `a` by the conjugate of the one in `b`
+// to `acc`.
+void kernel_conj_multiply_add(sample_cpx_t *acc, const sample_cpx_t *a,
+                              const sample_cpx_t *b, size_t len);
+
+// Returns the index of the absolute maximum value in the first `len`
+// elements of `arr`, or the first one in case of ties. Big arrays are split
+// between threads.
+//
+// Its length must be greater than zero to work correctly.
+size_t kernel_max_abs_index(const sample_t *arr, size_t len);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "audiosync.h"
+
+
+// Decodes the audio at `url` in-process with the FFmpeg libraries, instead of
+// running ffmpeg, downmixing and resampling it straight into the provided
+// data. `format` is the name of the input format, or NULL to detect it from
+// the URL.
+//
+// Like ffmpeg_pipe, it will send signals to the main thread as the intervals
+// are being finished, while also checking the status of its session, or
+// updating it in case of errors.
+//
+// Only available when built with the USE_LIBAV option.
+//
+// Returns -1 in case of error, or zero otherwise.
+int libav_decode(struct ffmpeg_data *data, const char *format,
+                 const char *url);
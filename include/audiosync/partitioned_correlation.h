@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdlib.h>
+#include "audiosync.h"
+
+// Incremental cross-correlation engine, based on uniformly partitioned
+// overlap-save correlation. The signals are split into blocks of
+// `block_len` frames, which are only transformed once, as soon as they are
+// available. The correlation of each interval is then built up from the
+// cached block spectra, so the work done in previous intervals is reused,
+// and only the ranges of lags that may still contain its peak are
+// transformed back.
+//
+// The sample lengths used must be a multiple of `block_len`, and like in
+// cross_correlation, the source must be twice as long as the sample.
+struct partitioned_xcorr;
+
+// Allocates a new engine for samples up to `max_sample_len` frames, which
+// must be a multiple of `block_len`. Returns NULL in case of error.
+struct partitioned_xcorr *partitioned_xcorr_new(size_t block_len,
+                                                size_t max_sample_len);
+
+// Frees an engine allocated with partitioned_xcorr_new.
+void partitioned_xcorr_free(struct partitioned_xcorr *p);
+
+// Resets the engine so that it can be used with new signals.
+void partitioned_xcorr_reset(struct partitioned_xcorr *p);
+
+// Transforms the blocks that have become available since the last call,
+// given the current lengths of the source and the sample, and accumulates
+// their products for a sample of up to `sample_len` frames. It may be called
+// as often as wanted, since each block is only processed once.
+//
+// Returns -1 in case of error, or zero otherwise.
+int partitioned_xcorr_update(struct partitioned_xcorr *p, sample_t *source,
+                             size_t source_len, sample_t *sample,
+                             size_t avail_sample_len, size_t sample_len);
+
+// Obtains the lag and the coefficient for the first `sample_len` frames of
+// the sample, with the same output as cross_correlation. All the blocks in
+// the interval must have been processed with partitioned_xcorr_update
+// first.
+//
+// Returns -1 in case of error, or zero otherwise.
+int partitioned_xcorr_result(struct partitioned_xcorr *p, sample_t *source,
+                             sample_t *sample, size_t sample_len, long *lag,
+                             double *coefficient);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdlib.h>
+#include "audiosync.h"
+
+// The queue of the sources prepared ahead of time, so that a run only has to
+// wait for the capture. Each one is searched and downloaded in the
+// background into its own buffer, like the download thread would do in the
+// run. The queue is bounded, and the oldest source is dropped when a new one
+// is added to a full queue.
+struct prefetch_entry;
+
+// The default number of sources in the queue.
+#define DEFAULT_PREFETCH 2
+
+// Starts preparing the source of `title` in the background, into a buffer
+// of `len` frames that signals the main thread at the `n_intervals`
+// `intervals`, which are copied. Nothing is done if it's already in the
+// queue.
+//
+// Returns -1 in case of error, or zero otherwise.
+int prefetch_add(const char *title, size_t len, const size_t *intervals,
+                 size_t n_intervals);
+
+// Takes the source of `title` out of the queue, if it's there and it didn't
+// fail, so that it's used by a run in `session`. It's still downloaded in the
+// background if it wasn't finished yet, in the run's session from now on.
+//
+// Returns NULL if it wasn't prepared.
+struct prefetch_entry *prefetch_take(const char *title,
+                                     struct audiosync_session *session);
+
+// The data of a taken source, which is read like the download thread's.
+struct ffmpeg_data *prefetch_data(struct prefetch_entry *entry);
+
+// Frees a taken source after the run, waiting for its download to stop. The
+// run's session must be aborted first.
+void prefetch_release(struct prefetch_entry *entry);
+
+// Configures the maximum number of sources in the queue, dropping the
+// oldest ones if there are more. Zero disables it.
+void prefetch_set_capacity(size_t capacity);
+
+// Waits until every download in the background has stopped, including the
+// ones dropped from the queue, which are freed by then.
+void prefetch_wait();
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <pthread.h>
+#include "audiosync.h"
+#include "cross_correlation.h"
+#include "decimated_correlation.h"
+
+// Maximum length of the name of a session's sink.
+#define MAX_SINK_NAME 64
+
+
+// The state of a synchronization. Several sessions can run at once, each one
+// with its own status, capture and buffers, which aren't shared with the
+// rest. Only the settings, the FFTW plans and the pool of workers are shared
+// by the whole process.
+struct audiosync_session {
+    // The status of the session, which is received by its threads. It's
+    // written with the mutex taken, since the threads wait for its changes
+    // with the condition variables, but it's also stored atomically, so that
+    // it can be loaded without the mutex.
+    volatile global_status_t status;
+    pthread_mutex_t mutex;
+    // Condition used to know when either thread has finished one of their
+    // intervals.
+    pthread_cond_t interval_done;
+    // Condition used to continue the threads after the session has been
+    // paused.
+    pthread_cond_t read_continue;
+    // If a thread is running the session, protected by the mutex. The status
+    // can't be used for this, since it may be aborted before running.
+    int running;
+    // The session's number, used to name its sink. It's zero for the default
+    // session.
+    unsigned int id;
+    // The sink recorded by the capture, created with audiosync_session_setup,
+    // or an empty string to record the entire desktop. It's protected by the
+    // mutex.
+    char sink[MAX_SINK_NAME];
+    // The buffers of the engines, which are allocated the first time they're
+    // needed and then reused between the runs of the session, so that the
+    // cross-correlation doesn't allocate memory at all. They're created with
+    // the mutex taken, since audiosync_warmup may do it at any time, and
+    // they're only used by the thread running the session.
+    struct xcorr_workspace *workspace;
+    struct xcorr_workspace *track_workspace;
+    struct decimated_xcorr *decimated;
+    // The statistics of the last run, and if there are any, protected by the
+    // mutex.
+    struct audiosync_stats stats;
+    int has_stats;
+};
+
+// Initializes a session that wasn't allocated with audiosync_session_new,
+// like the ones embedded into other structures.
+//
+// Returns -1 in case of error, or zero otherwise.
+int session_init(struct audiosync_session *session);
+
+// Frees everything allocated by a session initialized with session_init,
+// but not the session itself.
+void session_destroy(struct audiosync_session *session);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdlib.h>
+#include <time.h>
+#include "audiosync.h"
+
+// The statistics of each stream read in a run, filled by the thread reading
+// it while the data is published, see ffmpeg_data_publish. They're only
+// read by the main thread after the reading thread has finished.
+struct stream_stats {
+    struct timespec start;  // The start of the run
+    // The lengths at which the time is recorded, and the next one.
+    const size_t *boundaries;
+    size_t n_boundaries;
+    size_t next;
+    size_t len;  // The last length published
+    // The times since the start of the run, in milliseconds, or -1 if they
+    // weren't reached.
+    double resolve_ms;
+    double first_byte_ms;
+    double boundary_ms[MAX_STATS_INTERVALS];
+};
+
+// The time of a monotonic clock, in milliseconds, used to measure how long
+// something takes.
+double stats_now_ms();
+
+// Milliseconds since `start`, with the same clock.
+double stats_elapsed_ms(const struct timespec *start);
+
+// Initializes the statistics of a stream that records the time it reaches
+// each of the `n_boundaries` lengths in `boundaries`.
+void stream_stats_init(struct stream_stats *stats,
+                       const struct timespec *start, const size_t *boundaries,
+                       size_t n_boundaries);
+
+// Records the new length of a stream.
+void stream_stats_update(struct stream_stats *stats, size_t len);
+
+// The peak resident set size of the process, in kilobytes, or -1 if it
+// couldn't be obtained.
+long stats_peak_rss_kb();
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdlib.h>
+
+// The worker pool owned by the library, which runs the concurrent parts of
+// audiosync, so that no threads have to be created in every interval or run.
+// It's started the first time it's used, with a worker per core, and it
+// lives until the process ends.
+//
+// The tasks have the same signature as the functions passed to
+// pthread_create, and their return value is ignored.
+typedef void *(*task_fn)(void *arg);
+
+// A group of tasks that can be waited for with thread_pool_wait. It must be
+// initialized with TASK_GROUP_INIT.
+struct task_group {
+    size_t pending;
+};
+#define TASK_GROUP_INIT { 0 }
+
+// Returns the number of tasks that can run at once, which is the number of
+// cores.
+size_t thread_pool_size();
+
+// Runs a short task concurrently, in the pool or in the host application's
+// executor (see audiosync_set_executor). If it can't be queued, it's run
+// before returning.
+void thread_pool_submit(struct task_group *group, task_fn fn, void *arg);
+
+// Runs a task that may block for a long time, like reading from ffmpeg, in a
+// worker dedicated to it, so that it doesn't take the place of the short
+// ones. The worker is kept in the pool afterwards, so that it can be reused.
+//
+// Returns -1 if no worker could be started, with errno set, or zero
+// otherwise.
+int thread_pool_spawn(struct task_group *group, task_fn fn, void *arg);
+
+// Waits until all the tasks in the group have finished. In the meantime, the
+// current thread runs the queued short tasks, so that nested groups can't
+// run out of workers.
+void thread_pool_wait(struct task_group *group);
+
+// Sets the host application's executor, see audiosync_set_executor.
+void thread_pool_set_executor(int (*submit)(void (*task)(void *), void *arg,
+                                            void *data),
+                              void *data);
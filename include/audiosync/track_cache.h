@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdlib.h>
+#include "audiosync.h"
+
+// The on-disk cache of the downloaded tracks, so that the same song doesn't
+// have to be searched with youtube-dl and decoded by ffmpeg again when it's
+// played more than once. It's disabled until a directory is configured.
+
+// Configures the cache directory, which is created if it doesn't exist, and
+// the maximum size of the cache in bytes. The least recently used tracks are
+// removed when it's exceeded. A NULL `dir` disables the cache.
+//
+// Returns -1 in case of error, or zero otherwise.
+int track_cache_configure(const char *dir, size_t max_bytes);
+
+// Copies the cached track with the provided title into `buf`, which must
+// have room for `len` samples.
+//
+// Returns -1 if the cache is disabled or the track isn't cached with that
+// length, or zero otherwise.
+int track_cache_load(const char *title, sample_t *buf, size_t len);
+
+// Saves a fully downloaded track into the cache, removing the least recently
+// used ones if it grows too big.
+//
+// Returns -1 if the cache is disabled or in case of error, or zero
+// otherwise.
+int track_cache_store(const char *title, const sample_t *buf, size_t len);
+
+// Calls `fn` with every track in the cache, whose samples are only valid
+// during the call. It stops early if `fn` returns -1.
+//
+// Returns -1 if the cache is disabled, in case of error or if `fn` failed,
+// or zero otherwise.
+int track_cache_foreach(int (*fn)(const char *title, const sample_t *buf,
+                                  size_t len, void *data),
+                        void *data);
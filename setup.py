@@ -1,19 +1,41 @@
+import os
 from setuptools import setup, Extension
 
 
 args = ['-fno-finite-math-only']
 defines = [('NDEBUG', '1')]
+fftw = 'fftw3'
+
+# Single precision requires the float version of FFTW.
+if os.environ.get('AUDIOSYNC_SINGLE_PRECISION'):
+    defines.append(('SINGLE_PRECISION', '1'))
+    fftw = 'fftw3f'
+
+libraries = ['m', 'pthread', fftw + '_threads', fftw, 'pulse']
+sources = ['src/bind.c', 'src/audiosync.c', 'src/cross_correlation.c',
+           'src/decimated_correlation.c', 'src/fft_plans.c',
+           'src/fingerprint.c',
+           'src/ffmpeg_pipe.c', 'src/kernels.c',
+           'src/partitioned_correlation.c', 'src/prefetch.c',
+           'src/session.c', 'src/stats.c', 'src/thread_pool.c',
+           'src/track_cache.c',
+           'src/download/linux_download.c', 'src/capture/linux_capture.c']
+
+# The audio can be decoded in-process with the FFmpeg libraries instead of
+# running the ffmpeg command.
+if os.environ.get('AUDIOSYNC_LIBAV'):
+    defines.append(('USE_LIBAV', '1'))
+    libraries += ['avformat', 'avcodec', 'swresample', 'avutil']
+    sources.append('src/libav_decode.c')
 
 audiosync = Extension(
     'audiosync',
     define_macros = defines,
     extra_compile_args = args,
     include_dirs = ['include'],
-    libraries = ['m', 'pthread', 'fftw3', 'pulse'],
+    libraries = libraries,
     library_dirs = ['/usr/local/lib'],
-    sources = ['src/bind.c', 'src/audiosync.c', 'src/cross_correlation.c',
-               'src/ffmpeg_pipe.c', 'src/download/linux_download.c',
-               'src/capture/linux_capture.c']
+    sources = sources
 )
 
 setup(
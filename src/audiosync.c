@@ -20,39 +20,69 @@
 # error "Audiosync is not available on Windows yet."
 #endif
 
+#define _POSIX_C_SOURCE 200809L  // clock_gettime()
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <math.h>
 #include <fftw3.h>
 #include <string.h>
+#include <time.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/cross_correlation.h>
+#include <audiosync/decimated_correlation.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/fingerprint.h>
+#include <audiosync/partitioned_correlation.h>
+#include <audiosync/prefetch.h>
+#include <audiosync/session.h>
+#include <audiosync/stats.h>
+#include <audiosync/thread_pool.h>
+#include <audiosync/track_cache.h>
 #include <audiosync/capture/linux_capture.h>
 #include <audiosync/download/linux_download.h>
 
 
 // Defining the global variables from audiosync.h
-volatile global_status_t global_status = IDLE_ST;
 volatile int global_debug = 0;
-// If audiosync_abort or similar functions are called before audiosync_run,
-// nothing will happen, because the mutex and conditiona are initialized
-// already.
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t interval_done = PTHREAD_COND_INITIALIZER;
-pthread_cond_t read_continue = PTHREAD_COND_INITIALIZER;
-
-// The algorithm will be run in these intervals. When both threads signal
-// that their interval is finished, the cross correlation will be calculated.
-// If it's accepted, the threads will finish and the main function will return
-// the lag. The intervals for downloading and capturing audio differ, since
-// the source (download) doesn't require zero-padding inside cross_correlation.
+// The engine used for the cross-correlation.
+static volatile engine_t global_engine = FULL_ENGINE;
+// If the full engine uses the normalized cross-correlation.
+static volatile int global_normalized = 0;
+// The weighting of the cross-spectrum in the full and decimated engines.
+static volatile weighting_t global_weighting = NO_WEIGHTING;
+// If the full engine and the tracking check the few highest peaks of the
+// cross-correlation.
+static volatile int global_multi_peak = 1;
+// The size of the fragments read from PulseAudio in milliseconds.
+static volatile unsigned int global_fragment = DEFAULT_FRAGMENT_MS;
+// The number of sessions running, so that the index isn't changed while
+// it's used.
+static size_t running_sessions = 0;
+// The settings above are shared by every session, and protected by this
+// mutex.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The lengths of the intervals the algorithm may be run with. Rather than
+// waiting for each of them in order, the main thread runs it with the longest
+// one available when it's free, and how far ahead the next one is depends on
+// the results so far (see next_interval). They are only lengths whose
+// transforms FFTW can do efficiently, since they're made of small factors.
+// The intervals for downloading and capturing audio differ, since the source
+// (download) doesn't require zero-padding inside cross_correlation.
 const size_t INTERV_SAMPLE[] = {
     3 * SAMPLE_RATE,  // 144,000 frames
+    4 * SAMPLE_RATE,  // 192,000 frames
+    5 * SAMPLE_RATE,  // 240,000 frames
     6 * SAMPLE_RATE,  // 288,000 frames
-    10 * SAMPLE_RATE,  // 432,000 frames
-    15 * SAMPLE_RATE,  // 576,000 frames
-    20 * SAMPLE_RATE,  // 720,000 frames
+    8 * SAMPLE_RATE,  // 384,000 frames
+    10 * SAMPLE_RATE,  // 480,000 frames
+    12 * SAMPLE_RATE,  // 576,000 frames
+    15 * SAMPLE_RATE,  // 720,000 frames
+    18 * SAMPLE_RATE,  // 864,000 frames
+    20 * SAMPLE_RATE,  // 960,000 frames
+    24 * SAMPLE_RATE,  // 1,152,000 frames
     30 * SAMPLE_RATE,  // 1,440,000 frames
 };
 const size_t N_INTERVALS = sizeof(INTERV_SAMPLE) / sizeof(INTERV_SAMPLE[0]);
@@ -60,65 +90,192 @@ const size_t LEN_SAMPLE = 30 * SAMPLE_RATE;
 // The download intervals will always be twice as big as the capture ones,
 // and the size of n_intervals.
 const size_t INTERV_SOURCE[] = {
-    2 * 3 * SAMPLE_RATE, 
-    2 * 6 * SAMPLE_RATE, 
+    2 * 3 * SAMPLE_RATE,
+    2 * 4 * SAMPLE_RATE,
+    2 * 5 * SAMPLE_RATE,
+    2 * 6 * SAMPLE_RATE,
+    2 * 8 * SAMPLE_RATE,
     2 * 10 * SAMPLE_RATE,
+    2 * 12 * SAMPLE_RATE,
     2 * 15 * SAMPLE_RATE,
+    2 * 18 * SAMPLE_RATE,
     2 * 20 * SAMPLE_RATE,
+    2 * 24 * SAMPLE_RATE,
     2 * 30 * SAMPLE_RATE,
 };
 const size_t LEN_SOURCE = 2 * 30 * SAMPLE_RATE;
 
+// The length of the blocks used in the partitioned engine, which is also how
+// often the threads signal the main one. All the intervals must be a
+// multiple of it. Bigger blocks mean less work when accumulating the
+// products of their spectra, but more work when transforming them.
+#define PARTITION_LEN SAMPLE_RATE
+
+// The decimation factor used in the decimated engine. With a factor of 8,
+// the coarse search is done at 6 kHz.
+#define DECIMATION_FACTOR 8
+
+// The window of the capture checked while tracking the lag, how often it's
+// done, and the length of the ring buffer the capture is kept in meanwhile.
+// The lag may change by up to half a window between checks.
+#define TRACK_WINDOW SAMPLE_RATE
+#define TRACK_PERIOD_MS 1000
+#define TRACK_RING_LEN (4 * TRACK_WINDOW)
+
+// The index used by the fingerprint engine, see audiosync_set_index.
+static struct fp_index *global_index = NULL;
+
+
+int audiosync_get_debug() {
+    int ret;
+    pthread_mutex_lock(&mutex);
+    ret = global_debug;
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
 
-// The module can be controlled externally with these basic functions. They
-// expose the global status variable, which will be received from the threads
-// accordingly. These functions atomically read or write the global status.
-void audiosync_abort() {
+void audiosync_set_debug(int do_debug) {
     pthread_mutex_lock(&mutex);
-    global_status = ABORT_ST;
-    // The abort "wakes up" all threads waiting for something.
-    pthread_cond_broadcast(&interval_done);
-    pthread_cond_broadcast(&read_continue);
+    global_debug = do_debug;
     pthread_mutex_unlock(&mutex);
 }
 
-void audiosync_pause() {
+engine_t audiosync_get_engine() {
+    engine_t ret;
     pthread_mutex_lock(&mutex);
-    global_status = PAUSED_ST;
+    ret = global_engine;
     pthread_mutex_unlock(&mutex);
+
+    return ret;
 }
 
-void audiosync_resume() {
+void audiosync_set_engine(engine_t engine) {
     pthread_mutex_lock(&mutex);
-    // Changes the global status and sends a signal to the ffmpeg threads
-    // that will be waiting.
-    global_status = RUNNING_ST;
-    pthread_cond_broadcast(&read_continue);
+    global_engine = engine;
     pthread_mutex_unlock(&mutex);
 }
 
-global_status_t audiosync_status() {
-    global_status_t ret;
+int audiosync_get_normalized() {
+    int ret;
     pthread_mutex_lock(&mutex);
-    ret = global_status;
+    ret = global_normalized;
     pthread_mutex_unlock(&mutex);
 
     return ret;
 }
 
-int audiosync_get_debug() {
+void audiosync_set_normalized(int do_normalize) {
+    pthread_mutex_lock(&mutex);
+    global_normalized = do_normalize;
+    pthread_mutex_unlock(&mutex);
+}
+
+weighting_t audiosync_get_weighting() {
+    weighting_t ret;
+    pthread_mutex_lock(&mutex);
+    ret = global_weighting;
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+void audiosync_set_weighting(weighting_t weighting) {
+    pthread_mutex_lock(&mutex);
+    global_weighting = weighting;
+    pthread_mutex_unlock(&mutex);
+}
+
+int audiosync_get_multi_peak() {
     int ret;
     pthread_mutex_lock(&mutex);
-    ret = global_debug;
+    ret = global_multi_peak;
     pthread_mutex_unlock(&mutex);
 
     return ret;
 }
 
-void audiosync_set_debug(int do_debug) {
+void audiosync_set_multi_peak(int enabled) {
     pthread_mutex_lock(&mutex);
-    global_debug = do_debug;
+    global_multi_peak = enabled;
+    pthread_mutex_unlock(&mutex);
+}
+
+unsigned int audiosync_get_fragment() {
+    unsigned int ret;
+    pthread_mutex_lock(&mutex);
+    ret = global_fragment;
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+void audiosync_set_fragment(unsigned int ms) {
+    pthread_mutex_lock(&mutex);
+    global_fragment = ms > 0 ? ms : 1;
+    pthread_mutex_unlock(&mutex);
+}
+
+int audiosync_set_index(const char *path) {
+    struct fp_index *index = NULL;
+    if (path != NULL && (index = fp_index_load(path)) == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (running_sessions > 0) {
+        pthread_mutex_unlock(&mutex);
+        LOG("the index can't be changed while running");
+        fp_index_free(index);
+        return -1;
+    }
+    fp_index_free(global_index);
+    global_index = index;
     pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+int audiosync_set_cache(const char *dir, size_t max_bytes) {
+    return track_cache_configure(dir, max_bytes);
+}
+
+void audiosync_set_executor(int (*submit)(void (*task)(void *), void *arg,
+                                          void *data),
+                            void *data) {
+    thread_pool_set_executor(submit, data);
+}
+
+// Converting an engine enum value to a string.
+char *engine_to_string(engine_t engine) {
+    switch (engine) {
+    case FULL_ENGINE:
+        return "full";
+    case PARTITIONED_ENGINE:
+        return "partitioned";
+    case DECIMATED_ENGINE:
+        return "decimated";
+    case FINGERPRINT_ENGINE:
+        return "fingerprint";
+    default:
+        return "unknown";
+    }
+}
+
+// Converting a weighting enum value to a string.
+char *weighting_to_string(weighting_t weighting) {
+    switch (weighting) {
+    case NO_WEIGHTING:
+        return "none";
+    case PHAT_WEIGHTING:
+        return "phat";
+    case COHERENCE_WEIGHTING:
+        return "coherence";
+    case BAND_WEIGHTING:
+        return "band";
+    default:
+        return "unknown";
+    }
 }
 
 // Converting a status enum value to a string.
@@ -137,114 +294,620 @@ char *status_to_string(global_status_t status) {
     }
 }
 
-// The setup function is optional. It will initialize the PulseAudio sink to
-// later record the media player output directly, rather than the entire
-// desktop audio.
-// Thus, the `stream_name` variable indicates the name of the music player
-// being used. For example, "Spotify".
+// Returns the workspace of a session used by the full engine, allocating it
+// for the biggest interval if it's the first time. Returns NULL in case of
+// error.
 //
-// It's possible that the setup fails, so it returns an integer which will
-// be zero on success, and negative on error.
-int audiosync_setup(const char *stream_name) {
-    LOG("setting up audiosync module");
-    return pulseaudio_setup(stream_name);
+// audiosync_warmup may allocate the buffers of the default session while a
+// run of it is starting, so they're created with the session's mutex taken.
+static struct xcorr_workspace *get_workspace(
+        struct audiosync_session *session) {
+    pthread_mutex_lock(&session->mutex);
+    if (session->workspace == NULL) {
+        session->workspace = xcorr_workspace_new(LEN_SAMPLE);
+    }
+    struct xcorr_workspace *ws = session->workspace;
+    pthread_mutex_unlock(&session->mutex);
+
+    return ws;
 }
 
-// Main function to start the audio synchronization algorithm. It will return
-// 0 in case of success, or -1 otherwise. `yt_title` is the name of the song
-// currently playing on the computer. The obtained lag will be returned to
-// the variable `lag` points to.
+// Same as get_workspace, for the windows checked while tracking.
+static struct xcorr_workspace *get_track_workspace(
+        struct audiosync_session *session) {
+    pthread_mutex_lock(&session->mutex);
+    if (session->track_workspace == NULL) {
+        session->track_workspace = xcorr_workspace_new(TRACK_WINDOW);
+    }
+    struct xcorr_workspace *ws = session->track_workspace;
+    pthread_mutex_unlock(&session->mutex);
+
+    return ws;
+}
+
+// Same as get_workspace, for the decimated engine.
+static struct decimated_xcorr *get_decimated(
+        struct audiosync_session *session) {
+    pthread_mutex_lock(&session->mutex);
+    if (session->decimated == NULL) {
+        session->decimated = decimated_xcorr_new(DECIMATION_FACTOR,
+                                                 LEN_SAMPLE);
+    }
+    struct decimated_xcorr *decimated = session->decimated;
+    pthread_mutex_unlock(&session->mutex);
+
+    return decimated;
+}
+
+// The warm-up function is optional too. It creates the FFTW plans for every
+// interval ahead of time, so that they don't have to be created while the
+// algorithm is running. This may take a few seconds, or even minutes if
+// `patient` is true, so it's recommended to run it at startup, and to save
+// the results into a wisdom file at `wisdom_path`, which will be loaded
+// first in later calls. `wisdom_path` may be NULL to skip this.
 //
-// It will start two threads: one to download the audio, and another one to
-// record it. These threads will signal this main function once they have
-// finished an interval, so that the audio synchronization algorithm can
-// be ran with the current data. This will be done until an acceptable
-// result is obtained, or until all intervals are finished.
+// Returns zero on success, and -1 on error.
+int audiosync_warmup(const char *wisdom_path, int patient) {
+    LOG("warming up audiosync module");
+
+    if (wisdom_path != NULL && fft_wisdom_load(wisdom_path) < 0) {
+        LOG("no previous wisdom could be loaded from '%s'", wisdom_path);
+    }
+
+    // The partitioned engine only uses transforms of twice the block size,
+    // and the decimated one uses the decimated intervals.
+    const unsigned flags = patient ? FFTW_PATIENT : FFTW_MEASURE;
+    const size_t partition_len = PARTITION_LEN;
+    const size_t track_len = TRACK_WINDOW;
+    size_t decimated_lens[N_INTERVALS];
+    for (size_t i = 0; i < N_INTERVALS; i++) {
+        decimated_lens[i] = INTERV_SAMPLE[i] / DECIMATION_FACTOR;
+    }
+    if (fft_plan_warmup(INTERV_SAMPLE, N_INTERVALS, flags) < 0
+            || fft_plan_warmup(&partition_len, 1, flags) < 0
+            || fft_plan_warmup(&track_len, 1, flags) < 0
+            || fft_plan_warmup(decimated_lens, N_INTERVALS, flags) < 0) {
+        return -1;
+    }
+
+    // The normalized cross-correlation pads the intervals a bit further.
+    if (audiosync_get_normalized()) {
+        size_t ncc_lens[N_INTERVALS];
+        for (size_t i = 0; i < N_INTERVALS; i++) {
+            ncc_lens[i] = xcorr_ncc_transform_len(INTERV_SAMPLE[i]) / 2;
+        }
+        if (fft_plan_warmup(ncc_lens, N_INTERVALS, flags) < 0) {
+            return -1;
+        }
+    }
+
+    // The buffers of the default session for the current engine can be
+    // allocated ahead of time as well.
+    struct audiosync_session *session = audiosync_default_session();
+    const engine_t engine = audiosync_get_engine();
+    if ((engine == FULL_ENGINE && get_workspace(session) == NULL)
+            || (engine == DECIMATED_ENGINE
+                && get_decimated(session) == NULL)) {
+        return -1;
+    }
+
+    if (wisdom_path != NULL && fft_wisdom_save(wisdom_path) < 0) {
+        LOG("couldn't save the wisdom into '%s'", wisdom_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Allocates the intervals in which the threads will signal the main one: one
+// for each block, so that the scheduler can start the next cross-correlation
+// as soon as the data is available, and so that the partitioned engine can
+// transform them as soon as possible. Returns NULL in case of error.
+static size_t *block_intervals(size_t total_len) {
+    const size_t n = total_len / PARTITION_LEN;
+    size_t *intervals = malloc(n * sizeof(*intervals));
+    if (intervals == NULL) {
+        perror("audiosync: block intervals malloc failed");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        intervals[i] = (i + 1) * PARTITION_LEN;
+    }
+
+    return intervals;
+}
+
+// Starts searching and downloading the source of a song in the background,
+// so that a later run with the same title only has to wait for the capture.
+// The oldest prepared song is dropped if the queue is already full.
 //
-// This function starts the algorithm. Only one audiosync thread can be
-// running at once.
-int audiosync_run(const char *yt_title, long *lag) {
-    DEBUG_ASSERT(yt_title); DEBUG_ASSERT(lag);
-    DEBUG_ASSERT(global_status == IDLE_ST);
+// Returns zero on success, and -1 on error.
+int audiosync_prepare(const char *yt_title) {
+    DEBUG_ASSERT(yt_title);
+
+    size_t *intervals = block_intervals(LEN_SOURCE);
+    if (intervals == NULL) return -1;
+    const int ret = prefetch_add(yt_title, LEN_SOURCE, intervals,
+                                 LEN_SOURCE / PARTITION_LEN);
+    free(intervals);
+
+    return ret;
+}
+
+// The maximum number of songs prepared at once.
+void audiosync_set_prefetch(size_t max_songs) {
+    prefetch_set_capacity(max_songs);
+}
+
+// Loads the length of the data read by a thread so far. The frames before it
+// are safe to use, since it's published with release semantics, see
+// ffmpeg_pipe.
+static size_t loaded_len(const struct ffmpeg_data *data) {
+    return __atomic_load_n(&data->len, __ATOMIC_ACQUIRE);
+}
+
+// Returns if both threads have read the data needed for the i-th interval.
+// The source is ignored if it isn't downloaded.
+static int interval_ready(const struct ffmpeg_data *cap,
+                          const struct ffmpeg_data *down,
+                          int download_source, size_t i) {
+    return loaded_len(cap) >= INTERV_SAMPLE[i]
+        && (!download_source || loaded_len(down) >= INTERV_SOURCE[i]);
+}
+
+// Picks the index of the next interval after running the algorithm with the
+// i-th one, from how close its confidence was to MIN_CONFIDENCE. A peak that
+// was almost sharp enough only needs a bit more data, so the next interval is
+// tried, while a poor one skips ahead up to twice the length, since the ones
+// in between would most likely fail as well. A NaN confidence, from an
+// error, is considered the worst. Returns N_INTERVALS after the last one.
+static size_t next_interval(size_t i, double confidence) {
+    if (i + 1 >= N_INTERVALS) return N_INTERVALS;
+
+    double shortfall = 1.0;
+    if (confidence == confidence && confidence > 0.0) {
+        shortfall = (MIN_CONFIDENCE - confidence) / MIN_CONFIDENCE;
+    }
+    const double min_len = INTERV_SAMPLE[i] * (1.0 + shortfall);
+
+    size_t next = i + 1;
+    while (next + 1 < N_INTERVALS && INTERV_SAMPLE[next] < min_len) {
+        next++;
+    }
+
+    return next;
+}
+
+// Keeps checking the lag (in frames) every TRACK_PERIOD_MS after the initial
+// one was found, until the session is aborted or the end of the downloaded
+// source is reached. The last window of the capture is correlated with the
+// part of the source around the last lag, and `update` is called with the
+// new lag in milliseconds when it's confident and it has changed.
+//
+// Returns -1 in case of error, or zero otherwise.
+static int track_lag(struct audiosync_session *session,
+                     struct ffmpeg_data *cap, struct ffmpeg_data *down,
+                     long lag, void (*update)(long lag, void *data),
+                     void *data) {
+    int ret = -1;
+    long last_ms = round((double) lag * FRAMES_TO_MS);
+    size_t last_end = 0;
+    // Both are copied into aligned buffers, so that the cached plans can be
+    // used with them.
+    sample_t *window = FFTW(alloc_real)(TRACK_WINDOW);
+    sample_t *around = FFTW(alloc_real)(2 * TRACK_WINDOW);
+    if (window == NULL || around == NULL) {
+        perror("audiosync: tracking alloc_real failed");
+        goto finish;
+    }
+
+    LOG("tracking the lag from %ld ms", last_ms);
+    update(last_ms, data);
+
+    pthread_mutex_lock(&session->mutex);
+    while (session->status != ABORT_ST) {
+        // Waiting for the next check. The threads may signal the condition
+        // in the meantime, so it's waited for until the deadline.
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (TRACK_PERIOD_MS % 1000) * 1000000L;
+        deadline.tv_sec += TRACK_PERIOD_MS / 1000
+            + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (session->status != ABORT_ST
+               && pthread_cond_timedwait(&session->interval_done,
+                                         &session->mutex, &deadline) == 0) {
+        }
+        if (session->status == ABORT_ST) break;
+        const size_t end = loaded_len(cap);
+        const size_t down_len = loaded_len(down);
+        pthread_mutex_unlock(&session->mutex);
+
+        // The last window of the capture is checked against the source
+        // starting half a window before the last lag, so that the new lag
+        // can differ by half a window at most in either direction. Nothing
+        // is checked while paused.
+        if (end == last_end || end < TRACK_WINDOW) {
+            pthread_mutex_lock(&session->mutex);
+            continue;
+        }
+        last_end = end;
+        const long start = (long) (end - TRACK_WINDOW);
+        long offset = start + lag - TRACK_WINDOW / 2;
+        if (offset < 0) offset = 0;
+        const int past_source = (size_t) offset + 2 * TRACK_WINDOW
+            > down->total_len;
+        if (past_source || end + TRACK_WINDOW > TRACK_SECONDS * SAMPLE_RATE) {
+            LOG("reached the end of the track");
+            ret = 0;
+            goto finish;
+        }
+        if ((size_t) offset + 2 * TRACK_WINDOW > down_len) {
+            pthread_mutex_lock(&session->mutex);
+            continue;
+        }
+        // A window of margin is left for the read in progress, which is
+        // much shorter.
+        if (ffmpeg_data_copy(cap, start, TRACK_WINDOW, TRACK_WINDOW,
+                             window) < 0) {
+            LOG("the capture was overwritten while checking the lag");
+            pthread_mutex_lock(&session->mutex);
+            continue;
+        }
+        memcpy(around, down->buf + offset, 2 * TRACK_WINDOW * sizeof(*around));
+
+        long window_lag;
+        double coefficient;
+        if (xcorr_workspace_run(session->track_workspace, around, window,
+                                TRACK_WINDOW, 0, &window_lag,
+                                &coefficient) == 0
+                && coefficient >= MIN_CONFIDENCE) {
+            lag = offset + window_lag - start;
+            const long lag_ms = round((double) lag * FRAMES_TO_MS);
+            if (lag_ms != last_ms) {
+                LOG("the lag changed from %ld to %ld ms", last_ms, lag_ms);
+                last_ms = lag_ms;
+                update(lag_ms, data);
+            }
+        }
+        pthread_mutex_lock(&session->mutex);
+    }
+    pthread_mutex_unlock(&session->mutex);
+    ret = 0;
+
+finish:
+    if (window) FFTW(free)(window);
+    if (around) FFTW(free)(around);
+
+    return ret;
+}
+
+// Checks that the fields required by the provider of a source are set.
+static int valid_source(const struct audiosync_source *source) {
+    switch (source->provider) {
+    case SEARCH_PROVIDER:
+        return source->title != NULL;
+    case URL_PROVIDER:
+        return source->title != NULL && source->resolve != NULL;
+    case FILE_PROVIDER:
+        return source->path != NULL;
+    case BUFFER_PROVIDER:
+        return source->buf != NULL;
+    default:
+        return 0;
+    }
+}
+
+// Runs the audio synchronization algorithm in a session, see
+// audiosync_run_source. If `update` isn't NULL, the lag keeps being tracked
+// after it's found, see audiosync_track.
+static int synchronize(struct audiosync_session *session,
+                       const struct audiosync_source *src, long *lag,
+                       void (*update)(long lag, void *data), void *data) {
+    DEBUG_ASSERT(session); DEBUG_ASSERT(src); DEBUG_ASSERT(lag);
+
+    if (!valid_source(src)) {
+        LOG("the source is missing the fields of its provider");
+        return -1;
+    }
+
+    // Only one thread can run each session at once.
+    pthread_mutex_lock(&session->mutex);
+    if (session->running) {
+        pthread_mutex_unlock(&session->mutex);
+        LOG("the session is already running");
+        return -1;
+    }
+    session->running = 1;
+    __atomic_store_n(&session->status, RUNNING_ST, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&session->mutex);
+    // The index can't be changed while any session is running, so it's
+    // only loaded once.
+    pthread_mutex_lock(&mutex);
+    running_sessions++;
+    struct fp_index *fp_index = global_index;
+    pthread_mutex_unlock(&mutex);
 
-    global_status = RUNNING_ST;
     int ret = -1;
+    int cc_ret;
     // The audio data.
-    double *sample = NULL;
-    double *source = NULL;
+    sample_t *sample = NULL;
+    sample_t *source = NULL;
     double confidence;
-    // Threading variables
-    pthread_t cap_th = 0;
-    pthread_t down_th = 0;
+    const engine_t engine = audiosync_get_engine();
+    const int normalized = audiosync_get_normalized();
+    const weighting_t weighting = audiosync_get_weighting();
+    const int multi_peak = audiosync_get_multi_peak();
+    // While tracking, the capture continues in a ring buffer, and a longer
+    // part of the track is downloaded.
+    const int tracking = update != NULL;
+    const size_t source_len = tracking ? TRACK_SECONDS * SAMPLE_RATE
+                                       : LEN_SOURCE;
+    sample_t *ring = NULL;
+    // The partitioned engine, in case it's used.
+    struct partitioned_xcorr *part = NULL;
+    // The intervals in which the threads signal the main one.
+    size_t *sample_signals = NULL;
+    size_t *source_signals = NULL;
+    // The capture and download tasks, run by the pool.
+    struct task_group io = TASK_GROUP_INIT;
+    // The source prepared with audiosync_prepare, in case it's used.
+    struct prefetch_entry *prefetched = NULL;
+    // The statistics of the run, which are only made available to the rest
+    // of threads when it finishes.
+    struct timespec run_start;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    struct audiosync_stats stats = {
+        .resolve_ms = -1,
+        .n_intervals = N_INTERVALS,
+        .accepted_interval = -1,
+    };
+    struct stream_stats cap_stats, down_stats;
+    DEBUG_ASSERT(N_INTERVALS <= MAX_STATS_INTERVALS);
+    stream_stats_init(&cap_stats, &run_start, INTERV_SAMPLE, N_INTERVALS);
+    stream_stats_init(&down_stats, &run_start, INTERV_SOURCE, N_INTERVALS);
 
     // Allocated dynamically because the stack doesn't have enough memory.
-    sample = malloc(LEN_SAMPLE * sizeof(*sample));
+    // The sample is zero-padded to twice its length and aligned ahead of
+    // time, so that the last interval can be transformed directly.
+    sample = FFTW(alloc_real)(2 * LEN_SAMPLE);
     if (sample == NULL) {
-        perror("audiosync: sample malloc failed");
+        perror("audiosync: sample alloc_real failed");
+        goto finish;
+    }
+    memset(sample, 0, 2 * LEN_SAMPLE * sizeof(*sample));
+    // The source is allocated using FFTW(malloc) because the cross_correlation
+    // function doesn't copy it, and it needs to be aligned for faster
+    // calculations. The fingerprint engine doesn't need it at all, unless
+    // the lag is tracked afterwards.
+    const int download_source = engine != FINGERPRINT_ENGINE || tracking;
+    if (download_source && !tracking && src->provider == SEARCH_PROVIDER) {
+        prefetched = prefetch_take(src->title, session);
+    }
+    if (download_source && prefetched == NULL) {
+        source = FFTW(alloc_real)(source_len);
+        if (source == NULL) {
+            perror("audiosync: source alloc_real failed");
+            goto finish;
+        }
+    }
+    if (tracking) {
+        ring = malloc(TRACK_RING_LEN * sizeof(*ring));
+        if (ring == NULL || get_track_workspace(session) == NULL
+                || xcorr_workspace_set_weighting(session->track_workspace,
+                                                 weighting, SAMPLE_RATE) < 0) {
+            perror("audiosync: tracking allocation failed");
+            goto finish;
+        }
+        xcorr_workspace_set_multi_peak(session->track_workspace, multi_peak);
+    }
+
+    // The threads will signal the main one after each block.
+    sample_signals = block_intervals(LEN_SAMPLE);
+    source_signals = block_intervals(source_len);
+    if (sample_signals == NULL || source_signals == NULL) {
         goto finish;
     }
-    // The source is allocated using fftw_malloc because the cross_correlation
-    // function doesn't copy it (unlike the sample), and it needs to be
-    // aligned for faster calculations.
-    source = fftw_alloc_real(LEN_SOURCE);
-    if (source == NULL) {
-        perror("audiosync: source fftw_alloc_real failed");
+
+    LOG("using the %s engine%s with %s weighting", engine_to_string(engine),
+        engine == FULL_ENGINE && normalized ? " (normalized)" : "",
+        weighting_to_string(weighting));
+    if (engine == PARTITIONED_ENGINE) {
+        part = partitioned_xcorr_new(PARTITION_LEN, LEN_SAMPLE);
+        if (part == NULL) {
+            goto finish;
+        }
+    } else if (engine == FULL_ENGINE
+               && (get_workspace(session) == NULL
+                   || xcorr_workspace_set_weighting(session->workspace,
+                                                    weighting,
+                                                    SAMPLE_RATE) < 0)) {
+        goto finish;
+    } else if (engine == DECIMATED_ENGINE
+               && (get_decimated(session) == NULL
+                   || decimated_xcorr_set_weighting(session->decimated,
+                                                    weighting) < 0)) {
+        goto finish;
+    } else if (engine == FINGERPRINT_ENGINE && fp_index == NULL) {
+        LOG("no fingerprint index was loaded");
         goto finish;
     }
 
     // Initializing thread-related variables, and starting them.
     struct ffmpeg_data cap_args = {
         .title = "",
+        .session = session,
         .buf = sample,
         .total_len = LEN_SAMPLE,
         .len = 0,
-        .intervals = INTERV_SAMPLE,
-        .n_intervals = N_INTERVALS,
+        .intervals = sample_signals,
+        .n_intervals = LEN_SAMPLE / PARTITION_LEN,
+        .max_seconds = tracking ? TRACK_SECONDS_STR : NULL,
+        .ring = ring,
+        .ring_len = TRACK_RING_LEN,
+        .stats = &cap_stats,
     };
     struct ffmpeg_data down_args = {
-        .title = yt_title,
+        .title = src->provider == FILE_PROVIDER ? src->path
+               : src->provider == BUFFER_PROVIDER ? "" : src->title,
+        .source = src,
+        .session = session,
         .buf = source,
-        .total_len = LEN_SOURCE,
+        .total_len = source_len,
         .len = 0,
-        .intervals = INTERV_SOURCE,
-        .n_intervals = N_INTERVALS,
+        .intervals = source_signals,
+        .n_intervals = source_len / PARTITION_LEN,
+        .max_seconds = tracking ? TRACK_SECONDS_STR : NULL,
+        .stats = &down_stats,
     };
-    if (pthread_create(&cap_th, NULL, &capture, (void *) &cap_args) < 0) {
-        audiosync_abort();
-        perror("audiosync: pthread_create for cap_th failed");
+    if (thread_pool_spawn(&io, &capture, (void *) &cap_args) < 0) {
+        audiosync_session_abort(session);
+        perror("audiosync: thread_pool_spawn for capture failed");
         goto finish;
     }
-    if (pthread_create(&down_th, NULL, &download, (void *) &down_args) < 0) {
-        audiosync_abort();
-        perror("audiosync: pthread_create for down_th failed");
+    // A prepared source is already being downloaded into its own buffer.
+    struct ffmpeg_data *down = &down_args;
+    if (prefetched != NULL) {
+        down = prefetch_data(prefetched);
+        DEBUG_ASSERT(down->total_len == source_len);
+        source = down->buf;
+    }
+    if (download_source && prefetched == NULL
+            && thread_pool_spawn(&io, &download, (void *) &down_args) < 0) {
+        audiosync_session_abort(session);
+        perror("audiosync: thread_pool_spawn for download failed");
         goto finish;
     }
 
-    // The main loop iterates through all intervals until a valid result is
-    // found.
+    // The main loop runs the algorithm until a valid result is found. The
+    // next interval is at least `target`, but the algorithm may take longer
+    // than recording the audio, so the intervals that have become stale in
+    // the meantime are skipped, and the longest one available is used
+    // instead.
     LOG("starting interval loop");
-    for (size_t i = 0; i < N_INTERVALS; i++) {
-        // Waits for both threads to finish their interval, or until another
-        // thread sends an abort signal.
-        pthread_mutex_lock(&mutex);
-        while ((cap_args.len < INTERV_SAMPLE[i]
-               || down_args.len < INTERV_SOURCE[i])
-               && global_status != ABORT_ST) {
-            pthread_cond_wait(&interval_done, &mutex);
+    size_t target = 0;
+    while (target < N_INTERVALS) {
+        size_t i = target;
+        // Waits for both threads to read the target interval, or until
+        // another thread sends an abort signal. The lengths are loaded
+        // atomically, but the mutex is still needed to wait for the signal.
+        pthread_mutex_lock(&session->mutex);
+        while (!interval_ready(&cap_args, down, download_source, i)
+               && session->status != ABORT_ST) {
+            // With the partitioned engine, the blocks are processed while
+            // waiting for the rest of the interval.
+            if (part != NULL) {
+                pthread_mutex_unlock(&session->mutex);
+                cc_ret = partitioned_xcorr_update(part, source,
+                                                  loaded_len(down),
+                                                  sample,
+                                                  loaded_len(&cap_args),
+                                                  INTERV_SAMPLE[i]);
+                pthread_mutex_lock(&session->mutex);
+                if (cc_ret < 0) {
+                    pthread_mutex_unlock(&session->mutex);
+                    goto finish;
+                }
+
+                // More data may have been read in the meantime.
+                if (interval_ready(&cap_args, down, download_source, i)
+                        || session->status == ABORT_ST) {
+                    break;
+                }
+            }
+            pthread_cond_wait(&session->interval_done, &session->mutex);
         }
-        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&session->mutex);
 
-        // Checking if audiosync_abort() was called after waiting.
-        if (global_status == ABORT_ST) {
+        // Checking if the session was aborted after waiting.
+        if (audiosync_session_status(session) == ABORT_ST) {
             break;
         }
 
-        LOG("next interval (%ld): cap=%ld down=%ld", i, cap_args.len,
-            down_args.len);
+        while (i + 1 < N_INTERVALS
+               && interval_ready(&cap_args, down, download_source,
+                                 i + 1)) {
+            i++;
+        }
+        const size_t cap_len = loaded_len(&cap_args);
+        const size_t down_len = loaded_len(down);
+        LOG("next interval (%ld, target was %ld): cap=%ld down=%ld", i,
+            target, cap_len, down_len);
+        const double interval_start = stats_elapsed_ms(&run_start);
+        double margin = NAN;
 
         // Running the cross correlation algorithm and checking for errors.
-        if (cross_correlation(source, sample, INTERV_SAMPLE[i], lag,
-                              &confidence) < 0) {
+        if (part != NULL) {
+            if (partitioned_xcorr_update(part, source, down_len, sample,
+                                         cap_len, INTERV_SAMPLE[i]) < 0) {
+                goto finish;
+            }
+            cc_ret = partitioned_xcorr_result(part, source, sample,
+                                              INTERV_SAMPLE[i], lag,
+                                              &confidence);
+        } else if (engine == FINGERPRINT_ENGINE) {
+            // Only the requested track can be matched, rather than any
+            // track in the index.
+            struct fp_match match;
+            cc_ret = fp_index_match(fp_index, src->title, sample,
+                                    INTERV_SAMPLE[i], &match);
+            if (cc_ret == 0) {
+                LOG("matched '%s'", fp_index_title(fp_index,
+                                                   match.track));
+                *lag = match.offset;
+                confidence = match.confidence;
+            }
+        } else if (engine == DECIMATED_ENGINE) {
+            cc_ret = decimated_xcorr_run(session->decimated, source, sample,
+                                         INTERV_SAMPLE[i], lag, &confidence);
+        } else {
+            // The intermediate intervals have to be copied into the
+            // workspace, since the capture thread is still writing after
+            // them.
+            const int padded = INTERV_SAMPLE[i] == LEN_SAMPLE;
+            if (normalized) {
+                cc_ret = xcorr_workspace_ncc(session->workspace, source,
+                                             sample, INTERV_SAMPLE[i], padded,
+                                             lag, &confidence);
+            } else if (multi_peak) {
+                // The margin over the rest of the peaks is only known when
+                // they're all checked.
+                struct xcorr_result result;
+                cc_ret = xcorr_workspace_peaks(session->workspace, source,
+                                               sample, INTERV_SAMPLE[i],
+                                               padded, &result);
+                if (cc_ret == 0) {
+                    *lag = result.lag;
+                    confidence = result.coefficient;
+                    margin = result.margin;
+                }
+            } else {
+                cc_ret = xcorr_workspace_run(session->workspace, source,
+                                             sample, INTERV_SAMPLE[i], padded,
+                                             lag, &confidence);
+            }
+        }
+        if (stats.n_runs < MAX_STATS_INTERVALS) {
+            struct audiosync_interval_stats *run = &stats.runs[stats.n_runs++];
+            *run = (struct audiosync_interval_stats) {
+                .interval = i,
+                .start_ms = interval_start,
+                .compute_ms = stats_elapsed_ms(&run_start) - interval_start,
+                .confidence = cc_ret < 0 ? NAN : confidence,
+                .margin = cc_ret < 0 ? NAN : margin,
+            };
+            if (engine == FULL_ENGINE) {
+                struct xcorr_timing timing;
+                xcorr_workspace_timing(session->workspace, &timing);
+                run->fft_ms = timing.fft_ms;
+                run->multiply_ms = timing.multiply_ms;
+                run->ifft_ms = timing.ifft_ms;
+                run->pearson_ms = timing.pearson_ms;
+            }
+        }
+        if (cc_ret < 0) {
+            target = next_interval(i, NAN);
             continue;
         }
 
@@ -252,33 +915,114 @@ int audiosync_run(const char *yt_title, long *lag) {
         // required, the program ends with the obtained result, and returns
         // zero to indicate that it succeeded.
         if (confidence >= MIN_CONFIDENCE) {
+            stats.accepted_interval = i;
+            ret = tracking ? track_lag(session, &cap_args, down, *lag,
+                                       update, data)
+                           : 0;
             *lag = round((double) (*lag) * FRAMES_TO_MS);
-            ret = 0;
             break;
         }
+        target = next_interval(i, confidence);
     }
 
 finish:
     // Signaling the rest of the threads to finish.
-    audiosync_abort();
+    audiosync_session_abort(session);
 
     // Waiting for the other threads to finish.
-    if (pthread_join(cap_th, NULL) < 0) {
-        perror("audiosync: pthread_join for cap_th failed");
-        goto finish;
-    }
-    if (pthread_join(down_th, NULL) < 0) {
-        perror("audiosync: pthread_join for down_th failed");
-        goto finish;
-    }
+    thread_pool_wait(&io);
+    prefetch_release(prefetched);
 
     // Freeing the main resources used previously.
-    if (sample) free(sample);
-    if (source) fftw_free(source);
+    if (sample) FFTW(free)(sample);
+    // A prepared source is freed with its entry instead.
+    if (source && prefetched == NULL) FFTW(free)(source);
+    if (ring) free(ring);
+    partitioned_xcorr_free(part);
+    if (sample_signals) free(sample_signals);
+    if (source_signals) free(source_signals);
+
+    // The streams are finished, so their statistics can be read. A prepared
+    // source started downloading before the run, so it isn't measured.
+    stats.total_ms = stats_elapsed_ms(&run_start);
+    stats.resolve_ms = down_stats.resolve_ms;
+    stats.download_first_byte_ms = down_stats.first_byte_ms;
+    stats.capture_first_byte_ms = cap_stats.first_byte_ms;
+    memcpy(stats.download_interval_ms, down_stats.boundary_ms,
+           sizeof(stats.download_interval_ms));
+    memcpy(stats.capture_interval_ms, cap_stats.boundary_ms,
+           sizeof(stats.capture_interval_ms));
+    stats.download_bytes = down_stats.len * sizeof(sample_t);
+    stats.capture_bytes = cap_stats.len * sizeof(sample_t);
+    stats.peak_rss_kb = stats_peak_rss_kb();
 
-    // Resetting the global status at the end.
-    global_status = IDLE_ST;
+    // Resetting the status of the session at the end.
+    pthread_mutex_lock(&mutex);
+    running_sessions--;
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_lock(&session->mutex);
+    __atomic_store_n(&session->status, IDLE_ST, __ATOMIC_RELEASE);
+    session->running = 0;
+    session->stats = stats;
+    session->has_stats = 1;
+    pthread_mutex_unlock(&session->mutex);
     LOG("finished run");
 
     return ret;
 }
+
+// Main function to start the audio synchronization algorithm. It will return
+// 0 in case of success, or -1 otherwise. `source` indicates where the song
+// currently playing on the computer is obtained from. The obtained lag will
+// be returned to the variable `lag` points to.
+//
+// It will start two threads: one to download the audio, and another one to
+// record it. These threads will signal this main function every time they
+// have read a block, so that the audio synchronization algorithm can be ran
+// with the current data as soon as there's enough of it. This will be done
+// until an acceptable result is obtained, or until all intervals are
+// finished.
+//
+// This function starts the algorithm in the default session. Only one
+// thread can be running each session at once.
+int audiosync_run_source(const struct audiosync_source *source,
+                         long *lag) {
+    return synchronize(audiosync_default_session(), source, lag, NULL, NULL);
+}
+
+int audiosync_session_run(struct audiosync_session *session,
+                          const struct audiosync_source *source, long *lag) {
+    return synchronize(session, source, lag, NULL, NULL);
+}
+
+// The song is searched on YouTube by its title.
+int audiosync_run(const char *yt_title, long *lag) {
+    const struct audiosync_source source = {
+        .provider = SEARCH_PROVIDER,
+        .title = yt_title
+    };
+    return synchronize(audiosync_default_session(), &source, lag, NULL,
+                       NULL);
+}
+
+// Same as audiosync_run, but the lag keeps being tracked after it's found.
+// The tracking itself is done in track_lag.
+int audiosync_track(const char *yt_title,
+                    void (*update)(long lag, void *data), void *data) {
+    const struct audiosync_source source = {
+        .provider = SEARCH_PROVIDER,
+        .title = yt_title
+    };
+    return audiosync_session_track(audiosync_default_session(), &source,
+                                   update, data);
+}
+
+int audiosync_session_track(struct audiosync_session *session,
+                            const struct audiosync_source *source,
+                            void (*update)(long lag, void *data),
+                            void *data) {
+    DEBUG_ASSERT(update);
+
+    long lag;
+    return synchronize(session, source, &lag, update, data);
+}
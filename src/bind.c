@@ -17,6 +17,24 @@ PyObject *audiosyncmodule_setup(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_set_debug(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_get_debug(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_run(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_run_file(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_track(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_warmup(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_prepare(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_prefetch(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_engine(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_get_engine(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_normalized(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_get_normalized(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_weighting(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_get_weighting(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_multi_peak(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_get_multi_peak(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_fragment(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_get_fragment(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_cache(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_set_index(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_stats(PyObject *self, PyObject *args);
 
 
 static PyMethodDef VidifyAudiosyncMethods[] = {
@@ -27,6 +45,21 @@ static PyMethodDef VidifyAudiosyncMethods[] = {
         "Obtain the provided YouTube song's lag in respect to the currently"
         " playing track. It can only be run once at a time."
     },
+    {
+        "run_file",
+        audiosyncmodule_run_file,
+        METH_VARARGS,
+        "Same as run, but the song is read from a local file instead of"
+        " searching it on YouTube, or from the standard input with '-'."
+    },
+    {
+        "track",
+        audiosyncmodule_track,
+        METH_VARARGS,
+        "Same as run, but the lag keeps being tracked afterwards, and the"
+        " provided function is called with it every time it changes, until"
+        " it's aborted. It can only be run once at a time."
+    },
     {
         "pause",
         audiosyncmodule_pause,
@@ -59,6 +92,28 @@ static PyMethodDef VidifyAudiosyncMethods[] = {
         "Attempts to initialize a PulseAudio sink to record more easily the"
         " audio directly from the music player stream. Not thread-safe."
     },
+    {
+        "warmup",
+        audiosyncmodule_warmup,
+        METH_VARARGS,
+        "Creates the FFTW plans for every interval ahead of time, optionally"
+        " loading and saving them from a wisdom file. Not thread-safe."
+    },
+    {
+        "prepare",
+        audiosyncmodule_prepare,
+        METH_VARARGS,
+        "Starts downloading the provided YouTube song in the background, so"
+        " that a later run with the same title doesn't have to wait for it."
+        " Thread-safe."
+    },
+    {
+        "set_prefetch",
+        audiosyncmodule_set_prefetch,
+        METH_VARARGS,
+        "Sets the maximum number of songs prepared at once, dropping the"
+        " oldest ones. Zero disables it. Thread-safe."
+    },
     {
         "get_debug",
         audiosyncmodule_get_debug,
@@ -71,6 +126,96 @@ static PyMethodDef VidifyAudiosyncMethods[] = {
         METH_VARARGS,
         "Sets audiosync's debug level. Thread-safe."
     },
+    {
+        "get_engine",
+        audiosyncmodule_get_engine,
+        METH_NOARGS,
+        "Returns the name of the cross-correlation engine used. Thread-safe."
+    },
+    {
+        "set_engine",
+        audiosyncmodule_set_engine,
+        METH_VARARGS,
+        "Sets the cross-correlation engine used in the next runs, by its name."
+        " Thread-safe."
+    },
+    {
+        "get_normalized",
+        audiosyncmodule_get_normalized,
+        METH_NOARGS,
+        "Returns if the full engine uses the normalized cross-correlation."
+        " Thread-safe."
+    },
+    {
+        "set_normalized",
+        audiosyncmodule_set_normalized,
+        METH_VARARGS,
+        "Sets if the full engine uses the normalized cross-correlation in the"
+        " next runs. Thread-safe."
+    },
+    {
+        "get_weighting",
+        audiosyncmodule_get_weighting,
+        METH_NOARGS,
+        "Returns the name of the weighting applied to the cross-spectrum."
+        " Thread-safe."
+    },
+    {
+        "set_weighting",
+        audiosyncmodule_set_weighting,
+        METH_VARARGS,
+        "Sets the weighting applied to the cross-spectrum in the next runs,"
+        " by its name. Thread-safe."
+    },
+    {
+        "get_multi_peak",
+        audiosyncmodule_get_multi_peak,
+        METH_NOARGS,
+        "Returns if the few highest peaks of the cross-correlation are"
+        " checked. Thread-safe."
+    },
+    {
+        "set_multi_peak",
+        audiosyncmodule_set_multi_peak,
+        METH_VARARGS,
+        "Sets if the few highest peaks of the cross-correlation are checked"
+        " in the next runs. Thread-safe."
+    },
+    {
+        "get_fragment",
+        audiosyncmodule_get_fragment,
+        METH_NOARGS,
+        "Returns the size in milliseconds of the fragments read from"
+        " PulseAudio. Thread-safe."
+    },
+    {
+        "set_fragment",
+        audiosyncmodule_set_fragment,
+        METH_VARARGS,
+        "Sets the size in milliseconds of the fragments read from PulseAudio"
+        " in the next runs. Thread-safe."
+    },
+    {
+        "set_cache",
+        audiosyncmodule_set_cache,
+        METH_VARARGS,
+        "Sets the directory where the downloaded tracks are cached and its"
+        " maximum size in megabytes, or disables it with None. Thread-safe."
+    },
+    {
+        "set_index",
+        audiosyncmodule_set_index,
+        METH_VARARGS,
+        "Loads the fingerprint index used by the fingerprint engine, or"
+        " unloads it with None. It can't be done while running."
+    },
+    {
+        "stats",
+        audiosyncmodule_stats,
+        METH_NOARGS,
+        "Returns the timings and counters of the last finished run as a"
+        " dictionary, or None if there weren't any. Thread-safe."
+    },
     {NULL, NULL, 0, NULL}
 };
 
@@ -107,6 +252,62 @@ PyObject *audiosyncmodule_run(PyObject *self, PyObject *args) {
     return Py_BuildValue("lO", lag, ret == 0 ? Py_True : Py_False);
 }
 
+PyObject *audiosyncmodule_run_file(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *path;
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+
+    const struct audiosync_source source = {
+        .provider = FILE_PROVIDER,
+        .path = path
+    };
+    int ret;
+    long int lag;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_run_source(&source, &lag);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("lO", lag, ret == 0 ? Py_True : Py_False);
+}
+
+// Calls the Python function passed to audiosync.track with the new lag,
+// which needs the GIL.
+static void track_update(long int lag, void *data) {
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyObject *result = PyObject_CallFunction(data, "l", lag);
+    if (result == NULL) {
+        PyErr_Print();
+    }
+    Py_XDECREF(result);
+    PyGILState_Release(state);
+}
+
+PyObject *audiosyncmodule_track(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *yt_title;
+    PyObject *callback;
+    if (!PyArg_ParseTuple(args, "sO", &yt_title, &callback)) {
+        return NULL;
+    }
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "the callback must be callable");
+        return NULL;
+    }
+
+    int ret;
+    Py_INCREF(callback);
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_track(yt_title, &track_update, callback);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(callback);
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
 
 PyObject *audiosyncmodule_pause(PyObject *self, PyObject *args) {
     UNUSED(self); UNUSED(args);
@@ -170,6 +371,55 @@ PyObject *audiosyncmodule_setup(PyObject *self, PyObject *args) {
     return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
 }
 
+PyObject *audiosyncmodule_warmup(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *wisdom_path = NULL;
+    int patient = 0;
+    if (!PyArg_ParseTuple(args, "|zp", &wisdom_path, &patient)) {
+        return NULL;
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_warmup(wisdom_path, patient);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+PyObject *audiosyncmodule_prepare(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *title;
+    if (!PyArg_ParseTuple(args, "s", &title)) {
+        return NULL;
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_prepare(title);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+PyObject *audiosyncmodule_set_prefetch(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    Py_ssize_t max_songs;
+    if (!PyArg_ParseTuple(args, "n", &max_songs)) {
+        return NULL;
+    }
+    if (max_songs < 0) {
+        PyErr_SetString(PyExc_ValueError, "the number can't be negative");
+        return NULL;
+    }
+    audiosync_set_prefetch(max_songs);
+
+    Py_RETURN_NONE;
+}
+
 PyObject *audiosyncmodule_get_debug(PyObject *self, PyObject *args) {
     UNUSED(self); UNUSED(args);
 
@@ -187,3 +437,238 @@ PyObject *audiosyncmodule_set_debug(PyObject *self, PyObject *args) {
 
     Py_RETURN_NONE;
 }
+
+PyObject *audiosyncmodule_get_engine(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    return Py_BuildValue("s", engine_to_string(audiosync_get_engine()));
+}
+
+PyObject *audiosyncmodule_set_engine(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *name;
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+
+    // Looking for the engine with the provided name.
+    const engine_t engines[] = {
+        FULL_ENGINE, PARTITIONED_ENGINE, DECIMATED_ENGINE, FINGERPRINT_ENGINE
+    };
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(name, engine_to_string(engines[i])) == 0) {
+            audiosync_set_engine(engines[i]);
+            Py_RETURN_NONE;
+        }
+    }
+
+    PyErr_Format(PyExc_ValueError, "unknown engine '%s'", name);
+    return NULL;
+}
+
+PyObject *audiosyncmodule_get_normalized(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    return Py_BuildValue("O", audiosync_get_normalized() ? Py_True
+                                                         : Py_False);
+}
+
+PyObject *audiosyncmodule_set_normalized(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    int do_normalize;
+    if (!PyArg_ParseTuple(args, "p", &do_normalize)) {
+        return NULL;
+    }
+    audiosync_set_normalized(do_normalize);
+
+    Py_RETURN_NONE;
+}
+
+PyObject *audiosyncmodule_get_weighting(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    return Py_BuildValue("s", weighting_to_string(audiosync_get_weighting()));
+}
+
+PyObject *audiosyncmodule_set_weighting(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *name;
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+
+    // Looking for the weighting with the provided name.
+    const weighting_t weightings[] = {
+        NO_WEIGHTING, PHAT_WEIGHTING, COHERENCE_WEIGHTING, BAND_WEIGHTING
+    };
+    for (size_t i = 0; i < sizeof(weightings) / sizeof(weightings[0]); i++) {
+        if (strcmp(name, weighting_to_string(weightings[i])) == 0) {
+            audiosync_set_weighting(weightings[i]);
+            Py_RETURN_NONE;
+        }
+    }
+
+    PyErr_Format(PyExc_ValueError, "unknown weighting '%s'", name);
+    return NULL;
+}
+
+PyObject *audiosyncmodule_get_multi_peak(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    return Py_BuildValue("O", audiosync_get_multi_peak() ? Py_True
+                                                         : Py_False);
+}
+
+PyObject *audiosyncmodule_set_multi_peak(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    int enabled;
+    if (!PyArg_ParseTuple(args, "p", &enabled)) {
+        return NULL;
+    }
+    audiosync_set_multi_peak(enabled);
+
+    Py_RETURN_NONE;
+}
+
+PyObject *audiosyncmodule_get_fragment(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    return Py_BuildValue("I", audiosync_get_fragment());
+}
+
+PyObject *audiosyncmodule_set_fragment(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    unsigned int ms;
+    if (!PyArg_ParseTuple(args, "I", &ms)) {
+        return NULL;
+    }
+    audiosync_set_fragment(ms);
+
+    Py_RETURN_NONE;
+}
+
+PyObject *audiosyncmodule_set_cache(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *dir;
+    unsigned long long max_mb = 512;
+    if (!PyArg_ParseTuple(args, "z|K", &dir, &max_mb)) {
+        return NULL;
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_set_cache(dir, max_mb * 1024 * 1024);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+PyObject *audiosyncmodule_set_index(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *path;
+    if (!PyArg_ParseTuple(args, "z", &path)) {
+        return NULL;
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_set_index(path);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+// The times that weren't reached are negative, and they're None in Python.
+static PyObject *time_or_none(double ms) {
+    if (ms < 0) {
+        Py_RETURN_NONE;
+    }
+
+    return PyFloat_FromDouble(ms);
+}
+
+static PyObject *times_to_list(const double *times, size_t len) {
+    PyObject *list = PyList_New(len);
+    if (list == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        PyObject *item = time_or_none(times[i]);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+
+    return list;
+}
+
+PyObject *audiosyncmodule_stats(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    struct audiosync_stats stats;
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_get_stats(&stats);
+    Py_END_ALLOW_THREADS
+    if (ret < 0) {
+        Py_RETURN_NONE;
+    }
+
+    PyObject *runs = PyList_New(stats.n_runs);
+    if (runs == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < stats.n_runs; i++) {
+        const struct audiosync_interval_stats *run = &stats.runs[i];
+        PyObject *item = Py_BuildValue(
+            "{s:n,s:d,s:d,s:d,s:d,s:d,s:d,s:d,s:d}",
+            "interval", (Py_ssize_t) run->interval,
+            "start_ms", run->start_ms,
+            "compute_ms", run->compute_ms,
+            "fft_ms", run->fft_ms,
+            "multiply_ms", run->multiply_ms,
+            "ifft_ms", run->ifft_ms,
+            "pearson_ms", run->pearson_ms,
+            "confidence", run->confidence,
+            "margin", run->margin);
+        if (item == NULL) {
+            Py_DECREF(runs);
+            return NULL;
+        }
+        PyList_SET_ITEM(runs, i, item);
+    }
+
+    // The references of the "N" values are stolen, even if any of them
+    // failed, in which case NULL is returned.
+    PyObject *accepted;
+    if (stats.accepted_interval < 0) {
+        Py_INCREF(Py_None);
+        accepted = Py_None;
+    } else {
+        accepted = PyLong_FromLong(stats.accepted_interval);
+    }
+    return Py_BuildValue(
+        "{s:d,s:N,s:N,s:N,s:N,s:N,s:n,s:n,s:N,s:l,s:N}",
+        "total_ms", stats.total_ms,
+        "resolve_ms", time_or_none(stats.resolve_ms),
+        "download_first_byte_ms", time_or_none(stats.download_first_byte_ms),
+        "capture_first_byte_ms", time_or_none(stats.capture_first_byte_ms),
+        "download_interval_ms", times_to_list(stats.download_interval_ms,
+                                              stats.n_intervals),
+        "capture_interval_ms", times_to_list(stats.capture_interval_ms,
+                                             stats.n_intervals),
+        "download_bytes", (Py_ssize_t) stats.download_bytes,
+        "capture_bytes", (Py_ssize_t) stats.capture_bytes,
+        "accepted_interval", accepted,
+        "peak_rss_kb", stats.peak_rss_kb,
+        "runs", runs);
+}
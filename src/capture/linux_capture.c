@@ -8,11 +8,10 @@
 #include <pulse/error.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/session.h>
 #include <audiosync/capture/linux_capture.h>
 
-#define SINK_NAME "audiosync"
 #define MAX_NUM_SINKS 16
-#define MAX_LONG_NAME 512
 #define MAX_LONG_DESCRIPTION 256
 #define BUFSIZE 4096
 
@@ -40,13 +39,25 @@ typedef enum {
     LOOP_FINISHED = 5
 } loop_state_t;
 
-// The stream name is a global so that it can be accessed inside callback
-// functions. It will be initialized when pulseaudio_setup is called.
-static char stream_name[MAX_LONG_NAME];
-
-// Variable that acts as a boolean to indicate if the setup function was
-// called previously and worked successfully.
-static int use_default = 1;
+// The state of a setup, shared with the callbacks of its requests.
+struct setup {
+    const char *sink;         // The name of the sink created
+    const char *stream_name;  // The name of the player's stream
+    int sink_exists;          // If the sink already exists
+    uint32_t stream_index;    // The index of the player's stream, if found
+};
+
+// The state of a recording, shared with the callbacks of its stream, which
+// are called from the mainloop's thread.
+struct recording {
+    pa_threaded_mainloop *mainloop;
+    struct ffmpeg_data *data;
+    size_t len;             // Frames written so far
+    size_t max_len;         // Maximum frames written
+    size_t interval_count;  // Intervals finished so far
+    size_t holes;           // Number of times the server dropped audio
+    int done;               // 1 when finished, or -1 in case of error
+};
 
 
 // This PulseAudio function acts as a callback when the context changes state.
@@ -82,7 +93,7 @@ static void operation_cb(pa_context *c, int success, void *userdata) {
 // Callback used to check if the custom monitor already exists.
 static void sink_exists_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata) {
     UNUSED(c);
-    int *exists = userdata;
+    struct setup *setup = userdata;
 
     // If eol is positive it means there aren't more available streams.
     if (eol > 0) {
@@ -94,15 +105,15 @@ static void sink_exists_cb(pa_context *c, const pa_sink_info *i, int eol, void *
     if (i->name == NULL) {
         return;
     }
-    if (strcmp(i->name, SINK_NAME) == 0) {
-        *exists = 1;
+    if (strcmp(i->name, setup->sink) == 0) {
+        setup->sink_exists = 1;
     }
 }
 
 // Callback used to look for the media player's stream to obtain its index.
 static void find_stream_cb(pa_context *c, const pa_sink_input_info *i, int eol, void *userdata) {
     UNUSED(c);
-    uint32_t *index = userdata;
+    struct setup *setup = userdata;
 
     // If eol is positive it means there aren't more available streams.
     // If the stream wasn't found, the index value will remain as its initial
@@ -120,16 +131,16 @@ static void find_stream_cb(pa_context *c, const pa_sink_input_info *i, int eol,
     if (name == NULL) {
         return;
     }
-    if (strstr(name, stream_name) != NULL) {
-        *index = i->index;
+    if (strstr(name, setup->stream_name) != NULL) {
+        setup->stream_index = i->index;
     }
 }
 
-// Creates a new dedicated sink for recording within this module. It's
-// useful for complex PulseAudio setups, and avoids recording the entire
-// desktop audio. Only the indicated stream will be recorded, where
-// `stream_name` is the `application.name` attribute of its pulseaudio's
-// stream.
+// Creates a new dedicated sink for recording within this module, named
+// `sink`. It's useful for complex PulseAudio setups, and avoids recording
+// the entire desktop audio. Only the indicated stream will be recorded,
+// where `stream_name` is the `application.name` attribute of its
+// pulseaudio's stream.
 //
 // If this function isn't called, the capture function will use the desktop
 // audio instead, so it's completely optional, although recommended.
@@ -140,10 +151,17 @@ static void find_stream_cb(pa_context *c, const pa_sink_input_info *i, int eol,
 // Note: PulseAudio asynchronously handles all the requests, so this mainloop
 // structure is needed to handle the states one by one. See the
 // loop_state_t enum for a description of each step followed.
-int pulseaudio_setup(const char *name) {
-    // Saving the stream name as a global variable so that it can be accessed
+int pulseaudio_setup(const char *sink, const char *name) {
+    // The names are saved into the setup so that they can be accessed
     // within the callback functions.
-    strcpy(stream_name, name);
+    struct setup setup = {
+        .sink = sink,
+        .stream_name = name,
+        .sink_exists = 0,
+        .stream_index = PA_INVALID_INDEX
+    };
+    // The arguments of the modules loaded, which depend on the sink's name.
+    char args[MAX_LONG_DESCRIPTION];
 
     // Define the pulseaudio loop and connection variables
     pa_mainloop *mainloop = NULL;
@@ -153,13 +171,8 @@ int pulseaudio_setup(const char *name) {
     // To keep track of the requests
     loop_state_t state = LOOP_CHECK_SINK;
     request_state_t server_status;
-    // Variable assigned after the music player's stream index has been found
-    // so that it can be moved to the new sink.
-    uint32_t stream_index = PA_INVALID_INDEX;
     // This function's return value.
     int ret = -1;
-    // Used to check if the audiosync monitor already exists.
-    int sink_exists = 0;
 
     // Create a mainloop API and connection to the default server
     if ((mainloop = pa_mainloop_new()) == NULL) {
@@ -210,7 +223,7 @@ int pulseaudio_setup(const char *name) {
             // meaning that this function has been called more than once and
             // that this can skip directly to step number 3.
             op = pa_context_get_sink_info_list(
-                context, sink_exists_cb, &sink_exists);
+                context, sink_exists_cb, &setup);
             state++;
             break;
 
@@ -223,19 +236,20 @@ int pulseaudio_setup(const char *name) {
                 // If the previous operation concluded that the custom sink
                 // already exists, then it's reused, and it skips to the
                 // last step related to creating the sink.
-                if (sink_exists) {
+                if (setup.sink_exists) {
                     LOG("found custom monitor, reusing it");
                     op = pa_context_get_sink_input_info_list(
-                        context, find_stream_cb, &stream_index);
+                        context, find_stream_cb, &setup);
                     state = LOOP_MOVE_STREAM;
                     break;
                 }
 
                 LOG("no custom monitor found, creating a new one");
+                snprintf(args, sizeof(args), "sink_name=%s"
+                         " sink_properties=device.description=%s", sink,
+                         sink);
                 op = pa_context_load_module(
-                    context, "module-null-sink", "sink_name=" SINK_NAME
-                    " sink_properties=device.description=" SINK_NAME,
-                    load_module_cb, &ret);
+                    context, "module-null-sink", args, load_module_cb, &ret);
 
                 state++;
             }
@@ -258,9 +272,10 @@ int pulseaudio_setup(const char *name) {
                 // latency_msec is needed so that the virtual sink's audio is
                 // synchronized with the desktop audio (disables the delay).
                 LOG("loading loopback on the new sink");
+                snprintf(args, sizeof(args), "source=%s.monitor"
+                         " latency_msec=1", sink);
                 op = pa_context_load_module(
-                    context, "module-loopback", "source=" SINK_NAME ".monitor"
-                    " latency_msec=1", load_module_cb, &ret);
+                    context, "module-loopback", args, load_module_cb, &ret);
 
                 state++;
             }
@@ -279,7 +294,7 @@ int pulseaudio_setup(const char *name) {
 
                 LOG("looking for the provided stream");
                 op = pa_context_get_sink_input_info_list(
-                    context, find_stream_cb, &stream_index);
+                    context, find_stream_cb, &setup);
 
                 state++;
             }
@@ -291,7 +306,7 @@ int pulseaudio_setup(const char *name) {
             if (pa_operation_get_state(op) == PA_OPERATION_DONE) {
                 pa_operation_unref(op);
 
-                if (stream_index == PA_INVALID_INDEX) {
+                if (setup.stream_index == PA_INVALID_INDEX) {
                     LOG("application stream couldn't be found");
                     ret = -1;
                     goto error;
@@ -299,7 +314,7 @@ int pulseaudio_setup(const char *name) {
 
                 LOG("moving the found stream");
                 op = pa_context_move_sink_input_by_name(
-                    context, stream_index, SINK_NAME, operation_cb, &ret);
+                    context, setup.stream_index, sink, operation_cb, &ret);
 
                 state++;
             }
@@ -337,7 +352,6 @@ int pulseaudio_setup(const char *name) {
 finish:
     // If the function got to this point, it means that it was successful.
     ret = 0;
-    use_default = 0;
 
 error:
     // Freeing all the allocated resources. No need to do so for the mainloop
@@ -351,32 +365,287 @@ error:
     return ret;
 }
 
-// Function used for the capture thread. It will start a new ffmpeg process
-// to record either the custom sink created with pulseaudio_setup, or the
-// entire desktop.
+// These callbacks signal the capture thread waiting for the mainloop when
+// the state of the context or the stream changes.
+static void context_state_cb(pa_context *c, void *userdata) {
+    UNUSED(c);
+    struct recording *rec = userdata;
+    pa_threaded_mainloop_signal(rec->mainloop, 0);
+}
+
+static void stream_state_cb(pa_stream *s, void *userdata) {
+    UNUSED(s);
+    struct recording *rec = userdata;
+    pa_threaded_mainloop_signal(rec->mainloop, 0);
+}
+
+// Writes `frames` frames of the recording into the data, converting them
+// into sample_t. A NULL `in` is a hole in the stream, meaning that the
+// server had to drop some audio, which is filled with silence instead so
+// that the rest of the recording isn't displaced.
+static void write_frames(struct recording *rec, const float *in,
+                         size_t frames) {
+    if (in == NULL) {
+        rec->holes++;
+        LOG("the capture lost %ld frames, filling them with silence",
+            frames);
+    }
+
+    const int has_ring = rec->data->ring != NULL;
+    while (frames > 0) {
+        if (rec->len >= rec->max_len
+                || (!has_ring && rec->len >= rec->data->total_len)) {
+            rec->done = 1;
+            return;
+        }
+
+        size_t room;
+        sample_t *dest = ffmpeg_data_dest(rec->data, rec->len,
+                                          rec->max_len - rec->len, &room);
+        if (room > frames) room = frames;
+        for (size_t i = 0; i < room; i++) {
+            dest[i] = in ? in[i] : 0.0;
+        }
+        if (in) in += room;
+        frames -= room;
+        rec->len += room;
+        ffmpeg_data_publish(rec->data, rec->len, &rec->interval_count);
+    }
+}
+
+// Called from the mainloop's thread when there's new data in the stream,
+// which is written directly into the data, one fragment at a time.
+static void stream_read_cb(pa_stream *s, size_t nbytes, void *userdata) {
+    UNUSED(nbytes);
+    struct recording *rec = userdata;
+
+    const void *chunk;
+    size_t chunk_bytes;
+    while (1) {
+        if (pa_stream_peek(s, &chunk, &chunk_bytes) < 0) {
+            LOG("pa_stream_peek failed: %s",
+                pa_strerror(pa_context_errno(pa_stream_get_context(s))));
+            rec->done = -1;
+            break;
+        }
+        // The stream is empty.
+        if (chunk_bytes == 0) break;
+
+        if (rec->done == 0) {
+            write_frames(rec, chunk, chunk_bytes / sizeof(float));
+        }
+        pa_stream_drop(s);
+    }
+
+    pa_threaded_mainloop_signal(rec->mainloop, 0);
+}
+
+// Logs the current latency of the stream, which is how long it takes for
+// the audio to be read since it was played. It's only available after the
+// first timing update of the stream.
+//
+// Returns -1 if it's not available yet, or zero otherwise.
+static int log_latency(pa_stream *stream) {
+    pa_usec_t usec;
+    int negative;
+    if (pa_stream_get_latency(stream, &usec, &negative) < 0) {
+        return -1;
+    }
+
+    LOG("capture latency: %s%.1f ms", negative ? "-" : "", usec / 1000.0);
+    return 0;
+}
+
+// Pauses the stream while audiosync is paused, so that the server doesn't
+// keep the audio in the meantime. The mainloop must be locked, and it's
+// unlocked while waiting.
+//
+// Returns the status it was resumed with.
+static global_status_t pause_stream(struct recording *rec,
+                                    pa_stream *stream) {
+    LOG("corking the capture stream");
+    pa_operation *op = pa_stream_cork(stream, 1, NULL, NULL);
+    if (op) pa_operation_unref(op);
+
+    pa_threaded_mainloop_unlock(rec->mainloop);
+    const global_status_t status = ffmpeg_data_wait_resume(rec->data);
+    pa_threaded_mainloop_lock(rec->mainloop);
+
+    if (status != ABORT_ST) {
+        LOG("uncorking the capture stream");
+        op = pa_stream_cork(stream, 0, NULL, NULL);
+        if (op) pa_operation_unref(op);
+    }
+
+    return status;
+}
+
+// Function used for the capture thread. It records either the custom sink
+// of its session, created with pulseaudio_setup, or the entire desktop, with
+// the asynchronous PulseAudio API. The stream is read in fragments of
+// audiosync_get_fragment() milliseconds, directly into the data.
 //
 // In case of errors, it will signal the main thread to abort.
 void *capture(void *arg) {
     struct ffmpeg_data *data = arg;
     LOG("starting capture thread");
 
-    // Finally starting to record the audio with ffmpeg. If the setup function
-    // was called and it was successful, the audiosync monitor is used.
-    // Otherwise, the default monitor will record the entire device audio.
+    const char *seconds = data->max_seconds ? data->max_seconds
+                                            : MAX_SECONDS_STR;
+    struct recording rec = {
+        .data = data,
+        .max_len = strtoul(seconds, NULL, 10) * SAMPLE_RATE
+    };
+    const pa_sample_spec spec = {
+        .format = PA_SAMPLE_FLOAT32NE,
+        .rate = SAMPLE_RATE,
+        .channels = NUM_CHANNELS
+    };
+    pa_context *context = NULL;
+    pa_stream *stream = NULL;
+    int ret = -1;
+    __atomic_store_n(&data->len, 0, __ATOMIC_RELEASE);
+
+    // The monitor of the session's sink, if it was set up.
+    struct audiosync_session *session = ffmpeg_data_session(data);
+    char monitor[MAX_SINK_NAME + sizeof(".monitor")] = "";
+    pthread_mutex_lock(&session->mutex);
+    if (session->sink[0] != '\0') {
+        snprintf(monitor, sizeof(monitor), "%s.monitor", session->sink);
+    }
+    pthread_mutex_unlock(&session->mutex);
+    const int use_default = monitor[0] == '\0';
+
+    // The mainloop runs in its own thread, and it's locked while it's used
+    // from this one.
+    if ((rec.mainloop = pa_threaded_mainloop_new()) == NULL) {
+        LOG("pa_threaded_mainloop_new failed");
+        ffmpeg_data_abort(data);
+        return NULL;
+    }
+    if (pa_threaded_mainloop_start(rec.mainloop) < 0) {
+        LOG("pa_threaded_mainloop_start failed");
+        pa_threaded_mainloop_free(rec.mainloop);
+        ffmpeg_data_abort(data);
+        return NULL;
+    }
+    pa_threaded_mainloop_lock(rec.mainloop);
+
+    // Connecting to the default server and waiting until it's ready.
+    context = pa_context_new(pa_threaded_mainloop_get_api(rec.mainloop),
+                             SINK_NAME);
+    if (context == NULL) {
+        LOG("pa_context_new failed");
+        goto finish;
+    }
+    pa_context_set_state_callback(context, context_state_cb, &rec);
+    if (pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        LOG("pa_context_connect failed");
+        goto finish;
+    }
+    pa_context_state_t context_state;
+    while ((context_state = pa_context_get_state(context))
+           != PA_CONTEXT_READY) {
+        if (!PA_CONTEXT_IS_GOOD(context_state)) {
+            LOG("error when connecting to the server: %s",
+                pa_strerror(pa_context_errno(context)));
+            goto finish;
+        }
+        pa_threaded_mainloop_wait(rec.mainloop);
+    }
+
+    // Recording the monitor. If the setup function was called and it was
+    // successful, the audiosync monitor is used. Otherwise, the default one
+    // will record the entire device audio. Only the size of the fragments
+    // is configured, and the server chooses the rest of the buffer metrics.
     LOG("using %s monitor for capture", use_default ? "default" : "custom");
-    char *args[] = {
-        "ffmpeg", "-y", "-to", MAX_SECONDS_STR, "-f", "pulse", "-i",
-        use_default ? "default" : (SINK_NAME ".monitor"), "-ac",
-        NUM_CHANNELS_STR, "-r", SAMPLE_RATE_STR, "-f", "f64le", "pipe:1",
-        "-loglevel",
-#ifdef NDEBUG
-        "fatal",
-#else
-        "verbose",
-#endif
-        NULL
+    stream = pa_stream_new(context, "audiosync capture", &spec, NULL);
+    if (stream == NULL) {
+        LOG("pa_stream_new failed: %s",
+            pa_strerror(pa_context_errno(context)));
+        goto finish;
+    }
+    pa_stream_set_state_callback(stream, stream_state_cb, &rec);
+    pa_stream_set_read_callback(stream, stream_read_cb, &rec);
+    const pa_usec_t fragment = audiosync_get_fragment() * PA_USEC_PER_MSEC;
+    const pa_buffer_attr attr = {
+        .maxlength = (uint32_t) -1,
+        .tlength = (uint32_t) -1,
+        .prebuf = (uint32_t) -1,
+        .minreq = (uint32_t) -1,
+        .fragsize = pa_usec_to_bytes(fragment, &spec)
     };
-    ffmpeg_pipe(data, args);
+    if (pa_stream_connect_record(
+            stream, use_default ? NULL : monitor, &attr,
+            PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE
+            | PA_STREAM_INTERPOLATE_TIMING) < 0) {
+        LOG("pa_stream_connect_record failed: %s",
+            pa_strerror(pa_context_errno(context)));
+        goto finish;
+    }
+
+    // Waiting until the recording is finished, or until another thread
+    // sends an abort signal. The mainloop's thread signals this one after
+    // every fragment is read. The latency is reported once it's available.
+    int ready = 0;
+    int latency_logged = 0;
+    while (rec.done == 0) {
+        const pa_stream_state_t stream_state = pa_stream_get_state(stream);
+        if (!PA_STREAM_IS_GOOD(stream_state)) {
+            LOG("the capture stream failed: %s",
+                pa_strerror(pa_context_errno(context)));
+            goto finish;
+        }
+        if (!ready && stream_state == PA_STREAM_READY) {
+            LOG("capture stream ready");
+            ready = 1;
+        }
+        if (ready && !latency_logged) {
+            latency_logged = log_latency(stream) == 0;
+        }
+
+        switch (ffmpeg_data_status(data)) {
+        case ABORT_ST:
+            LOG("read ABORT_ST, quitting...");
+            ret = 0;
+            goto finish;
+        case PAUSED_ST:
+            if (pause_stream(&rec, stream) == ABORT_ST) {
+                LOG("read ABORT_ST after pause, quitting...");
+                ret = 0;
+                goto finish;
+            }
+            continue;
+        default:
+            // RUNNING_ST and IDLE_ST are ignored.
+            break;
+        }
+
+        pa_threaded_mainloop_wait(rec.mainloop);
+    }
+    if (rec.done < 0) goto finish;
+
+    LOG("finished capture loop");
+    log_latency(stream);
+    if (rec.holes > 0) {
+        LOG("the capture had %ld holes", rec.holes);
+    }
+    ffmpeg_data_finish(data, rec.len);
+    ret = 0;
+
+finish:
+    if (ret < 0) ffmpeg_data_abort(data);
+    if (stream) {
+        pa_stream_disconnect(stream);
+        pa_stream_unref(stream);
+    }
+    if (context) {
+        pa_context_disconnect(context);
+        pa_context_unref(context);
+    }
+    pa_threaded_mainloop_unlock(rec.mainloop);
+    pa_threaded_mainloop_stop(rec.mainloop);
+    pa_threaded_mainloop_free(rec.mainloop);
 
-    pthread_exit(NULL);
+    return NULL;
 }
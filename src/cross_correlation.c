@@ -4,21 +4,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include <pthread.h>
 #include <string.h>
 #include <complex.h>
 #include <fftw3.h>
 #include <audiosync/audiosync.h>
-
-
-// The global cross-correlation mutex.
-static pthread_mutex_t cc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#include <audiosync/cross_correlation.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/kernels.h>
+#include <audiosync/stats.h>
+#include <audiosync/thread_pool.h>
+
+// The lags whose overlap is shorter than this fraction of the sample are
+// ignored when they're only a guess, since a few frames can be highly
+// correlated just by chance.
+#define MIN_OVERLAP 0.5
+// The number of peaks of the cross-correlation whose coefficient is checked,
+// and the minimum distance between them in frames, so that they don't belong
+// to the same peak.
+#define N_PEAKS 8
+#define PEAK_DISTANCE (SAMPLE_RATE / 20)
+// The frequencies kept by BAND_WEIGHTING, in Hz. Most of the melody and the
+// voice are between them, without the bass and the hiss.
+#define BAND_LOW_HZ 200.0
+#define BAND_HIGH_HZ 4000.0
+// The bins averaged at each side of every bin to estimate the power spectra
+// for COHERENCE_WEIGHTING.
+#define COHERENCE_BINS 8
+// The weighted bins are divided by their magnitude plus this fraction of the
+// mean magnitude, so that the ones with almost no energy (like the silence
+// or the frequencies removed by the encoder) aren't amplified into noise.
+#define WEIGHTING_FLOOR 1e-3
 
 // Data structure used to pass parameters to concurrent FFTW-related functions.
 struct fftw_data {
-    double *real;
-    double complex *cpx;
+    sample_t *real;
+    sample_cpx_t *cpx;
     const size_t len;
+    int ret;
 };
 
 
@@ -28,142 +50,349 @@ static void *fft(void *arg) {
     struct fftw_data *data = arg;
     DEBUG_ASSERT(data); DEBUG_ASSERT(data->real); DEBUG_ASSERT(data->cpx);
 
-    // Initializing the plan: the only thread-safe call in FFTW is
-    // fftw_execute, so the plan has to be created and destroyed with a lock.
-    pthread_mutex_lock(&cc_mutex);
-    fftw_plan p = fftw_plan_dft_r2c_1d(data->len, data->real, data->cpx,
-                                       FFTW_ESTIMATE);
-    pthread_mutex_unlock(&cc_mutex);
+    // Obtaining the plan from the cache. Executing a plan is thread-safe,
+    // so no locks are needed to actually run it.
+    struct plan_ref p = get_plan(R2C_PLAN, data->len, data->real, data->cpx);
+    if (p.plan == NULL) {
+        LOG("couldn't create r2c plan of length %ld", data->len);
+        data->ret = -1;
+        return NULL;
+    }
 
     // Actually executing the FFT
-    fftw_execute(p);
-
-    // Destroying the plan and terminating the thread
-    pthread_mutex_lock(&cc_mutex);
-    fftw_destroy_plan(p);
-    pthread_mutex_unlock(&cc_mutex);
-    pthread_exit(NULL);
-}
-
-// Returns the index of the absolute maximum value in an array of doubles
-// of length `len`.
-//
-// Its length must be greater than zero to work correctly.
-static size_t max_abs_index(double *arr, size_t len) {
-    DEBUG_ASSERT(arr); DEBUG_ASSERT(len > 0);
-
-    double abs_val;
-    double max_val = arr[0];
-    size_t max_ind = 0;
-    for (size_t i = 1; i < len; i++) {
-        abs_val = fabs(arr[i]);
-        if (abs_val > max_val) {
-            max_val = abs_val;
-            max_ind = i;
-        }
-    }
+    FFTW(execute_dft_r2c)(p.plan, data->real, data->cpx);
+    release_plan(p);
 
-    return max_ind;
+    data->ret = 0;
+    return NULL;
 }
 
 // Calculating the Pearson Correlation Coefficient between `source` and
 // `sample` between two pointers, applying the formula:
 // https://en.wikipedia.org/wiki/Pearson_correlation_coefficient#For_a_sample
 //
-// This function will only work correctly if end - start != 0.
-double pearson_coefficient(double *source_start, const double *source_end,
-                           double *sample_start, const double *sample_end) {
+// This function will only work correctly if end - start != 0. The sums are
+// always done with double precision, even if the data is single precision.
+// See kernel_pearson for more details.
+double pearson_coefficient(sample_t *source_start, const sample_t *source_end,
+                           sample_t *sample_start,
+                           const sample_t *sample_end) {
     DEBUG_ASSERT(source_start); DEBUG_ASSERT(source_end);
     DEBUG_ASSERT(source_end - source_start > 0);
     DEBUG_ASSERT(sample_start); DEBUG_ASSERT(sample_end);
     DEBUG_ASSERT(sample_end - sample_start > 0);
+    UNUSED(sample_end);  // Only used by the assertions
 
-    // 1. The average for both datasets.
-    double sum1 = 0.0;
-    double sum2 = 0.0;
-    // Both segments have the same size but start at different indexes.
-    double *source_i = source_start;
-    double *sample_i = sample_start;
-    while (source_i != source_end) {
-         sum1 += *source_i;
-         sum2 += *sample_i;
-
-         source_i++;
-         sample_i++;
-    }
-    double avg1 = sum1 / (source_end - source_start);
-    double avg2 = sum2 / (sample_end - sample_start);
-
-    // 2. Applying the definition formula.
-    double diff1, diff2;
-    double diffprod = 0.0;
-    double diff1_squared = 0.0;
-    double diff2_squared = 0.0;
-    source_i = source_start;
-    sample_i = sample_start;
-    while (source_i != source_end) {
-        diff1 = *source_i - avg1;
-        diff2 = *sample_i - avg2;
-        diffprod += diff1 * diff2;
-        diff1_squared += diff1 * diff1;
-        diff2_squared += diff2 * diff2;
-
-        source_i++;
-        sample_i++;
-    }
-
-    return diffprod / sqrt(diff1_squared * diff2_squared);
+    return kernel_pearson(source_start, sample_start,
+                          source_end - source_start);
 }
 
-// Calculating the cross-correlation between two signals `a` and `b`:
-//     xcross = ifft(fft(a) * conj(fft(b)))
+// Calculating the Pearson Correlation Coefficient of the overlapping segments
+// of `source` and `sample` after displacing the sample by `lag` frames. Like
+// in cross_correlation, the source must be at least twice as long as the
+// sample, and the lag must be within -sample_len and 2 * sample_len.
 //
-// The source size must be twice the sample size. This is because the sample
-// will be zero-padded to length 2N-1, which is needed to calculate the
-// circular cross-correlation.
+// If the sample is displaced to the right (the lag is positive), the full
+// sample is used. Otherwise, the first -lag elements of the sample are left
+// out, since they would go before the source starts. And if it's displaced
+// more than sample_len frames, only its first 2 * sample_len - lag elements
+// are used, since the rest would go after the source ends.
+double lag_coefficient(sample_t *source, sample_t *sample, size_t sample_len,
+                       long lag) {
+    DEBUG_ASSERT(source); DEBUG_ASSERT(sample);
+    DEBUG_ASSERT(lag < 2 * (long) sample_len && lag > -(long) sample_len);
+
+    if (lag < 0) {
+        return pearson_coefficient(source, source + lag + sample_len,
+                                   sample - lag, sample + sample_len);
+    }
+    if (lag > (long) sample_len) {
+        return pearson_coefficient(source + lag, source + 2 * sample_len,
+                                   sample, sample + 2 * sample_len - lag);
+    }
+
+    return pearson_coefficient(source + lag, source + lag + sample_len,
+                               sample, sample + sample_len);
+}
+
+// Calculating the Pearson Correlation Coefficient of two segments from their
+// running sums and the sum of their products, `xy`. It's NaN if either of
+// them is constant.
+double overlap_coefficient(const struct overlap_sums *s, double xy) {
+    DEBUG_ASSERT(s); DEBUG_ASSERT(s->n > 0);
+
+    const double cov = s->n * xy - s->x * s->y;
+    const double var_x = s->n * s->xx - s->x * s->x;
+    const double var_y = s->n * s->yy - s->y * s->y;
+
+    return cov / sqrt(var_x * var_y);
+}
+
+// The buffers needed to calculate the cross-correlation, allocated once for
+// the biggest sample length, so that they can be reused between intervals
+// and runs.
+struct xcorr_workspace {
+    size_t max_len;  // Maximum sample length supported
+    // The spectrum of the source. After multiplying it by the conjugate of
+    // the sample's spectrum, it's also used for the in-place inverse
+    // transform, so it ends up containing the cross-correlation.
+    sample_cpx_t *arr1;
+    // The zero-padded sample, transformed in-place into its spectrum.
+    sample_cpx_t *arr2;
+    // The weighting of the cross-spectrum, and the sample rate of the
+    // signals for BAND_WEIGHTING.
+    weighting_t weighting;
+    double rate;
+    // The product of the smoothed power spectra, only allocated for
+    // COHERENCE_WEIGHTING.
+    sample_t *power;
+    // If the few highest peaks are checked by xcorr_workspace_run, rather
+    // than only the highest one.
+    int multi_peak;
+    // The time taken by the phases of the last cross-correlation.
+    struct xcorr_timing timing;
+};
+
+// Allocates a new workspace for samples of up to `max_len` frames. Returns
+// NULL in case of error.
 //
-// Returns the lag in frames the sample has over the source, with a confidence
-// between -1 and 1.
+// Note: FFTW(alloc_*) uses FFTW(malloc), which is an equivalent of running
+// malloc + memalign. This means that it may also return NULL in case of
+// error.
+struct xcorr_workspace *xcorr_workspace_new(size_t max_len) {
+    DEBUG_ASSERT(max_len > 0);
+
+    struct xcorr_workspace *ws = malloc(sizeof(*ws));
+    if (ws == NULL) {
+        perror("audiosync: xcorr_workspace malloc failed");
+        return NULL;
+    }
+
+    // An in-place real transform of length 2N needs 2 * (N + 1) real
+    // elements, which is exactly N + 1 complex ones. The normalized
+    // cross-correlation pads the signals a bit further, so the arrays are
+    // big enough for its transforms as well.
+    const size_t cpx_len = xcorr_ncc_transform_len(max_len) / 2 + 1;
+    ws->max_len = max_len;
+    ws->weighting = NO_WEIGHTING;
+    ws->multi_peak = 0;
+    ws->rate = SAMPLE_RATE;
+    ws->power = NULL;
+    memset(&ws->timing, 0, sizeof(ws->timing));
+    ws->arr1 = FFTW(alloc_complex)(cpx_len);
+    ws->arr2 = FFTW(alloc_complex)(cpx_len);
+    if (ws->arr1 == NULL || ws->arr2 == NULL) {
+        perror("audiosync: xcorr_workspace alloc_complex failed");
+        xcorr_workspace_free(ws);
+        return NULL;
+    }
+
+    return ws;
+}
+
+// Frees a workspace allocated with xcorr_workspace_new.
+void xcorr_workspace_free(struct xcorr_workspace *ws) {
+    if (ws == NULL) return;
+
+    if (ws->arr1) FFTW(free)(ws->arr1);
+    if (ws->arr2) FFTW(free)(ws->arr2);
+    free(ws->power);
+    free(ws);
+}
+
+// Returns the maximum sample length a workspace supports.
+size_t xcorr_workspace_max_len(const struct xcorr_workspace *ws) {
+    DEBUG_ASSERT(ws);
+
+    return ws->max_len;
+}
+
+// Obtains the timing of the last cross-correlation of a workspace.
+void xcorr_workspace_timing(const struct xcorr_workspace *ws,
+                            struct xcorr_timing *timing) {
+    DEBUG_ASSERT(ws); DEBUG_ASSERT(timing);
+
+    *timing = ws->timing;
+}
+
+// Configures the weighting applied to the cross-spectrum in the next
+// cross-correlations of the workspace. The power spectra buffer is only
+// allocated the first time COHERENCE_WEIGHTING is used.
 //
-// In case of error, the function returns -1. Otherwise, zero.
+// Returns -1 in case of error, or zero otherwise.
+int xcorr_workspace_set_weighting(struct xcorr_workspace *ws,
+                                  weighting_t weighting, double rate) {
+    DEBUG_ASSERT(ws); DEBUG_ASSERT(rate > 0);
+
+    if (weighting == COHERENCE_WEIGHTING && ws->power == NULL) {
+        ws->power = malloc((ws->max_len + 1) * sizeof(*ws->power));
+        if (ws->power == NULL) {
+            perror("audiosync: xcorr_workspace power malloc failed");
+            return -1;
+        }
+    }
+    ws->weighting = weighting;
+    ws->rate = rate;
+
+    return 0;
+}
+
+void xcorr_workspace_set_multi_peak(struct xcorr_workspace *ws,
+                                    int enabled) {
+    DEBUG_ASSERT(ws);
+    ws->multi_peak = enabled;
+}
+
+// Saves into `power` the power spectrum of `spec`, averaged over the
+// COHERENCE_BINS bins at each side, with a running sum. If `multiply` is
+// true, the previous values in `power` are multiplied by it instead.
+static void smooth_power(const sample_cpx_t *spec, size_t bins,
+                         sample_t *power, int multiply) {
+    const sample_t *x = (const sample_t *) spec;
+    double sum = 0.0;
+    size_t start = 0;
+    size_t end = 0;
+    for (size_t k = 0; k < bins; k++) {
+        // Moving the window to [k - COHERENCE_BINS, k + COHERENCE_BINS].
+        while (end < bins && end <= k + COHERENCE_BINS) {
+            sum += x[2 * end] * x[2 * end] + x[2 * end + 1] * x[2 * end + 1];
+            end++;
+        }
+        while (start + COHERENCE_BINS < k) {
+            sum -= x[2 * start] * x[2 * start]
+                + x[2 * start + 1] * x[2 * start + 1];
+            start++;
+        }
+
+        // The subtractions may leave a tiny negative rounding error.
+        const double avg = sum > 0.0 ? sum / (end - start) : 0.0;
+        power[k] = multiply ? power[k] * avg : avg;
+    }
+}
+
+// Returns the magnitude a bin of the cross-spectrum is divided by.
+static inline double bin_magnitude(const struct xcorr_workspace *ws,
+                                   const sample_t *cross, size_t k) {
+    if (ws->weighting == COHERENCE_WEIGHTING) {
+        return sqrt(ws->power[k]);
+    }
+
+    return sqrt((double) cross[2 * k] * cross[2 * k]
+                + (double) cross[2 * k + 1] * cross[2 * k + 1]);
+}
+
+// Applies the weighting of the workspace to the cross-spectrum of `bins`
+// bins in its first array, obtained from signals of length `source_len`.
+// Every bin is divided by its own magnitude with PHAT_WEIGHTING and
+// BAND_WEIGHTING (which also clears the bins outside the band), or by the
+// geometric mean of the smoothed power spectra of both signals with
+// COHERENCE_WEIGHTING, which must have been saved into `ws->power` already.
+static void apply_weighting(struct xcorr_workspace *ws, size_t bins,
+                            size_t source_len) {
+    sample_t *cross = (sample_t *) ws->arr1;
+    size_t low = 0;
+    size_t high = bins;
+    if (ws->weighting == BAND_WEIGHTING) {
+        low = ceil(BAND_LOW_HZ * source_len / ws->rate);
+        high = floor(BAND_HIGH_HZ * source_len / ws->rate) + 1;
+        if (high > bins) high = bins;
+        if (low > high) low = high;
+        memset(cross, 0, 2 * low * sizeof(*cross));
+        memset(cross + 2 * high, 0, 2 * (bins - high) * sizeof(*cross));
+    }
+    if (low == high) return;
+
+    double mean = 0.0;
+    for (size_t k = low; k < high; k++) {
+        mean += bin_magnitude(ws, cross, k);
+    }
+    mean /= high - low;
+    if (mean == 0.0) return;
+
+    const double floor = WEIGHTING_FLOOR * mean;
+    for (size_t k = low; k < high; k++) {
+        const double scale = 1.0 / (bin_magnitude(ws, cross, k) + floor);
+        cross[2 * k] *= scale;
+        cross[2 * k + 1] *= scale;
+    }
+}
+
+// Multiplies the spectrum in the first array of the workspace by the
+// conjugate of the one in the second array, applies the weighting if
+// `weighted` is true, and calculates the ifft in-place. The size of the
+// results is going to be the original length again. Returns NULL in case of
+// error.
+static sample_t *inverse_transform(struct xcorr_workspace *ws,
+                                   size_t source_len, int weighted) {
+    sample_t *results = (sample_t *) ws->arr1;
+    const size_t bins = (source_len / 2) + 1;
+    const double start = stats_now_ms();
+    weighted = weighted && ws->weighting != NO_WEIGHTING;
+    if (weighted && ws->weighting == COHERENCE_WEIGHTING) {
+        smooth_power(ws->arr1, bins, ws->power, 0);
+        smooth_power(ws->arr2, bins, ws->power, 1);
+    }
+    kernel_conj_multiply(ws->arr1, ws->arr2, bins);
+    if (weighted) {
+        apply_weighting(ws, bins, source_len);
+    }
+    const double multiplied = stats_now_ms();
+    ws->timing.multiply_ms += multiplied - start;
+
+    struct plan_ref p = get_plan(C2R_PLAN, source_len, ws->arr1, results);
+    if (p.plan == NULL) {
+        LOG("couldn't create c2r plan of length %ld", source_len);
+        return NULL;
+    }
+    FFTW(execute_dft_c2r)(p.plan, ws->arr1, results);
+    release_plan(p);
+    ws->timing.ifft_ms += stats_now_ms() - multiplied;
+
+    return results;
+}
+
+// Calculates the circular cross-correlation between the source and the
+// sample inside the workspace, and returns a pointer to it, of length
+// 2 * sample_len. The index i corresponds to a lag of i frames, or of
+// i - 2 * sample_len if i >= sample_len. It stays valid until the workspace
+// is used again. Returns NULL in case of error.
 //
-// Note: FFTW won't overwrite the source if FFTW_ESTIMATE is used, meaning
-// that the source can be initialized with fftw_alloc_real so that it's also
-// aligned and thus, the Fourier Transforms will be faster.
-int cross_correlation(double *source, double *input_sample,
-                      const size_t sample_len, long *lag,
-                      double *coefficient) {
-    DEBUG_ASSERT(source); DEBUG_ASSERT(input_sample);
-    DEBUG_ASSERT(lag); DEBUG_ASSERT(coefficient);
+// If `padded` is true, the sample buffer must already be zero-padded up to
+// twice its length, and it's transformed directly instead of being copied
+// into the workspace first.
+//
+// Note: FFTW won't overwrite the source in out-of-place real to complex
+// transforms, meaning that the source can be initialized with alloc_real
+// so that it's also aligned and thus, the Fourier Transforms will be faster.
+// The plans are taken from the cache, see fft_plan_warmup.
+//
+// The weighting of the workspace is only applied if `weighted` is true.
+static sample_t *correlate(struct xcorr_workspace *ws, sample_t *source,
+                           sample_t *sample, const size_t sample_len,
+                           int padded, int weighted) {
+    DEBUG_ASSERT(ws); DEBUG_ASSERT(source); DEBUG_ASSERT(sample);
     DEBUG_ASSERT(sample_len > 0);
 
-    int ret = -1;
     const size_t source_len = sample_len * 2;
-    const size_t cpx_len = (source_len / 2) + 1;
-    double *sample = NULL;
-    double *results = NULL;
-    double complex *arr1 = NULL;
-    double complex *arr2 = NULL;
-    pthread_t fft1_th = 0;
-    pthread_t fft2_th = 0;
-    double *source_start, *source_end, *sample_start, *sample_end;
+    sample_t *padded_sample = (sample_t *) ws->arr2;
+
+    if (sample_len > ws->max_len) {
+        LOG("sample of length %ld is too big for the workspace", sample_len);
+        return NULL;
+    }
 
     // Only the sample needs to be zero-padded, since the cross correlation
     // will be circular, and only one of the inputs is shifted.
-    // FFTW doesn't overwrite the source when FFTW_ESTIMATE is used, so the
-    // sample doesn't have to be copied.
-    //
-    // Note: fftw_alloc_* uses fftw_malloc, which is an equivalent of running
-    // malloc + memalign. This means that it may also return NULL in case of
-    // error.
-    sample = fftw_alloc_real(source_len);
-    if (sample == NULL) {
-        perror("audiosync: sample fftw_alloc_real failed");
-        goto finish;
-    }
-    memcpy(sample, input_sample, sample_len * sizeof(*sample));
-    memset(sample + sample_len, 0,
-           (source_len - sample_len) * sizeof(*sample));
+    // FFTW doesn't overwrite the source in out-of-place r2c transforms, so
+    // it doesn't have to be copied. The sample is copied into the
+    // workspace instead (unless it's padded already), because the capture
+    // keeps writing after `sample_len`, and because it's transformed
+    // in-place.
+    if (!padded) {
+        memcpy(padded_sample, sample, sample_len * sizeof(*sample));
+        memset(padded_sample + sample_len, 0,
+               (source_len - sample_len) * sizeof(*sample));
+    }
 
 #ifdef PLOT
     // Plotting the output with gnuplot
@@ -177,69 +406,273 @@ int cross_correlation(double *source, double *input_sample,
         fprintf(gnuplot, "%f\n", source[i]);
     fprintf(gnuplot, "e\n");
     for (size_t i = 0; i < source_len; ++i)
-        fprintf(gnuplot, "%f\n", sample[i]);
+        fprintf(gnuplot, "%f\n", i < sample_len ? sample[i] : 0.0);
     fprintf(gnuplot, "e\n");
     fflush(gnuplot);
     pclose(gnuplot);
 #endif
 
-    // First allocating the arrays where the results will be saved at.
-    arr1 = fftw_alloc_complex(cpx_len);
-    if (arr1 == NULL) {
-        perror("audiosync: arr1 fftw_alloc_real failed");
-        goto finish;
-    }
-    arr2 = fftw_alloc_complex(cpx_len);
-    if (arr2 == NULL) {
-        perror("audiosync: arr2 fftw_alloc_real failed");
-        goto finish;
-    }
-    results = fftw_alloc_real(source_len);
-    if (results == NULL) {
-        perror("audiosync: results fftw_alloc_real failed");
-        goto finish;
-    }
-
-    // Initializing the threads and starting them.
+    // Running both transforms at once, one of them in the pool.
     struct fftw_data fft1_data = {
         .real = source,
-        .cpx = arr1,
+        .cpx = ws->arr1,
         .len = source_len,
+        .ret = -1,
     };
     struct fftw_data fft2_data = {
-        .real = sample,
-        .cpx = arr2,
+        .real = padded ? sample : padded_sample,
+        .cpx = ws->arr2,
         .len = source_len,
+        .ret = -1,
     };
-    if (pthread_create(&fft1_th, NULL, &fft, (void *) &fft1_data) < 0) {
-        perror("audiosync: pthread_create for fft1_th failed");
-        goto finish;
+    const double start = stats_now_ms();
+    struct task_group group = TASK_GROUP_INIT;
+    thread_pool_submit(&group, &fft, (void *) &fft1_data);
+    fft(&fft2_data);
+    thread_pool_wait(&group);
+    ws->timing.fft_ms += stats_now_ms() - start;
+    if (fft1_data.ret < 0 || fft2_data.ret < 0) {
+        return NULL;
+    }
+
+    return inverse_transform(ws, source_len, weighted);
+}
+
+// Same as correlate, always applying the weighting of the workspace.
+sample_t *xcorr_workspace_correlate(struct xcorr_workspace *ws,
+                                    sample_t *source, sample_t *sample,
+                                    const size_t sample_len, int padded) {
+    memset(&ws->timing, 0, sizeof(ws->timing));
+    return correlate(ws, source, sample, sample_len, padded, 1);
+}
+
+// Data structure used to pass parameters to the tasks calculating the
+// coefficient of a candidate lag.
+struct peak_data {
+    sample_t *source;
+    sample_t *sample;
+    size_t sample_len;
+    long lag;
+    double coefficient;
+};
+
+static void *peak_coefficient(void *arg) {
+    struct peak_data *data = arg;
+    data->coefficient = lag_coefficient(data->source, data->sample,
+                                        data->sample_len, data->lag);
+
+    return NULL;
+}
+
+// A candidate peak of the cross-correlation, and its absolute value.
+struct peak {
+    size_t index;
+    sample_t value;
+};
+
+// Moves the peak at position `p` of the min-heap `heap` towards its root or
+// its leaves until it's in place, so that the lowest peak is always the
+// first one.
+static void sift_peak(struct peak *heap, size_t n, size_t p) {
+    while (p > 0 && heap[p].value < heap[(p - 1) / 2].value) {
+        const struct peak tmp = heap[p];
+        heap[p] = heap[(p - 1) / 2];
+        heap[(p - 1) / 2] = tmp;
+        p = (p - 1) / 2;
     }
-    if (pthread_create(&fft2_th, NULL, &fft, (void *) &fft2_data) < 0) {
-        perror("audiosync: pthread_create for fft2_th failed");
-        goto finish;
+    while (1) {
+        size_t min = p;
+        const size_t left = 2 * p + 1;
+        const size_t right = 2 * p + 2;
+        if (left < n && heap[left].value < heap[min].value) min = left;
+        if (right < n && heap[right].value < heap[min].value) min = right;
+        if (min == p) break;
+        const struct peak tmp = heap[p];
+        heap[p] = heap[min];
+        heap[min] = tmp;
+        p = min;
     }
-    if (pthread_join(fft1_th, NULL) < 0) {
-        perror("audiosync: pthread_join for fft1_th failed");
-        goto finish;
+}
+
+// Saves into `peaks` the N_PEAKS highest peaks of the absolute value of the
+// circular array `arr`, of length `len`, at least `dist` frames apart from
+// each other, sorted from highest to lowest. They're picked in a single pass
+// with a min-heap of the best ones so far: a value that doesn't beat the
+// lowest of them is skipped right away, and one that does replaces the
+// lower peaks too close to it, unless a higher one is already there. Only
+// the first one is taken if the array is zero.
+//
+// Returns the number of peaks found.
+static size_t find_peaks(const sample_t *arr, size_t len, size_t dist,
+                         struct peak peaks[N_PEAKS]) {
+    struct peak heap[N_PEAKS];
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        const sample_t value = fabs(arr[i]);
+        if (n > 0 && value == 0) continue;
+        if (n == N_PEAKS && value <= heap[0].value) continue;
+
+        // Looking for the peaks within `dist` frames. Since the index only
+        // grows, they're right before it, or at the start of the array
+        // when it wraps around.
+        int dominated = 0;
+        for (size_t p = 0; p < n && !dominated; p++) {
+            const size_t d = i - heap[p].index;
+            if ((d <= dist || len - d <= dist) && heap[p].value >= value) {
+                dominated = 1;
+            }
+        }
+        if (dominated) continue;
+        size_t kept = 0;
+        for (size_t p = 0; p < n; p++) {
+            const size_t d = i - heap[p].index;
+            if (d > dist && len - d > dist) {
+                heap[kept] = heap[p];
+                sift_peak(heap, kept + 1, kept);
+                kept++;
+            }
+        }
+        n = kept;
+
+        const struct peak peak = { .index = i, .value = value };
+        if (n < N_PEAKS) {
+            heap[n] = peak;
+            sift_peak(heap, n + 1, n);
+            n++;
+        } else {
+            heap[0] = peak;
+            sift_peak(heap, n, 0);
+        }
     }
-    if (pthread_join(fft2_th, NULL) < 0) {
-        perror("audiosync: pthread_join for fft2_th failed");
-        goto finish;
+
+    // Popping the lowest one each time, so that they end up sorted.
+    const size_t found = n;
+    while (n > 0) {
+        peaks[n - 1] = heap[0];
+        heap[0] = heap[--n];
+        sift_peak(heap, n, 0);
     }
 
-    // Product of fft1 and conj(fft2), saved in the first array.
-    for (size_t i = 0; i < cpx_len; ++i)
-        arr1[i] *= conj(arr2[i]);
+    return found;
+}
 
-    // And calculating the ifft. The size of the results is going to be the
-    // original length again.
-    fftw_plan p = fftw_plan_dft_c2r_1d(source_len, arr1, results, FFTW_ESTIMATE);
-    fftw_execute(p);
-    fftw_destroy_plan(p);
+// Obtains the lag and the coefficient like xcorr_workspace_run, but instead
+// of only checking the highest peak of the cross-correlation, the
+// N_PEAKS highest ones are checked, at least PEAK_DISTANCE frames apart from
+// each other. With repetitive music, the highest peak is often an alias of
+// the actual lag, like a bar before or after it. Their coefficients are
+// calculated concurrently, and the best one is returned, along with its
+// margin over the second best.
+//
+// Returns -1 in case of error, or zero otherwise.
+int xcorr_workspace_peaks(struct xcorr_workspace *ws, sample_t *source,
+                          sample_t *sample, const size_t sample_len,
+                          int padded, struct xcorr_result *result) {
+    DEBUG_ASSERT(result);
+
+    const size_t source_len = sample_len * 2;
+    sample_t *results = xcorr_workspace_correlate(ws, source, sample,
+                                                  sample_len, padded);
+    if (results == NULL) {
+        return -1;
+    }
+
+    // The index sample_len would be a lag of -sample_len, and it's circular
+    // only, since there's no overlap at all.
+    results[sample_len] = 0;
+
+    // Looking for the highest peaks, so that each one belongs to a
+    // different lag.
+    //
+    // If the index is smaller than the sample length, the sample is
+    // displaced to the right, and no sample data will be lost. Otherwise,
+    // the circular cross-correlation has two readings: the sample displaced
+    // to the left by 2 * sample_len - index frames, so that its first
+    // elements are lost, or displaced to the right by more than its length,
+    // so that only its first elements overlap the end of the source. Both
+    // are checked, unless the latter overlap is too short.
+    const size_t min_overlap = ceil(sample_len * MIN_OVERLAP);
+    struct peak highest[N_PEAKS];
+    const size_t n_highest = find_peaks(results, source_len, PEAK_DISTANCE,
+                                        highest);
+    struct peak_data peaks[2 * N_PEAKS];
+    size_t n_peaks = 0;
+    for (size_t n = 0; n < n_highest; n++) {
+        const size_t i = highest[n].index;
+        const struct peak_data peak = {
+            .source = source,
+            .sample = sample,
+            .sample_len = sample_len,
+            .lag = i,
+        };
+        if (i < sample_len) {
+            peaks[n_peaks++] = peak;
+        } else {
+            peaks[n_peaks] = peak;
+            peaks[n_peaks++].lag = (long) i - (long) source_len;
+            if (source_len - i >= min_overlap) {
+                peaks[n_peaks++] = peak;
+            }
+        }
+    }
+
+    // The Pearson Correlation Coefficient of each candidate is calculated
+    // with the resulting segments of data, in the pool. The first one is
+    // done in the current thread.
+    const double start = stats_now_ms();
+    struct task_group group = TASK_GROUP_INIT;
+    for (size_t p = 1; p < n_peaks; p++) {
+        thread_pool_submit(&group, &peak_coefficient, (void *) &peaks[p]);
+    }
+    peak_coefficient(&peaks[0]);
+    thread_pool_wait(&group);
+    ws->timing.pearson_ms += stats_now_ms() - start;
+
+    // Choosing the best one, ignoring the NaN coefficients.
+    double best = NAN;
+    double second = NAN;
+    for (size_t p = 0; p < n_peaks; p++) {
+        const double coef = peaks[p].coefficient;
+        if (coef != coef) continue;
+
+        LOG("candidate lag %ld with a confidence of %f", peaks[p].lag, coef);
+        if (best != best || coef > best) {
+            second = best;
+            best = coef;
+            result->lag = peaks[p].lag;
+        } else if (second != second || coef > second) {
+            second = coef;
+        }
+    }
+    if (best != best) return -1;
+
+    result->coefficient = best;
+    result->margin = second == second ? best - second : best;
+
+    LOG("%ld frames of delay with a confidence of %f (margin of %f)",
+        result->lag, result->coefficient, result->margin);
+
+    return 0;
+}
+
+// Obtains the lag and the coefficient of only the highest peak of the
+// cross-correlation. Returns -1 in case of error, or zero otherwise.
+static int highest_peak(struct xcorr_workspace *ws, sample_t *source,
+                        sample_t *sample, const size_t sample_len, int padded,
+                        long *lag, double *coefficient) {
+    const size_t source_len = sample_len * 2;
+    sample_t *results = xcorr_workspace_correlate(ws, source, sample,
+                                                  sample_len, padded);
+    if (results == NULL) {
+        return -1;
+    }
+
+    // The index sample_len would be a lag of -sample_len, and it's circular
+    // only, since there's no overlap at all.
+    results[sample_len] = 0;
 
     // The index of the maximum value is the desired lag.
-    *lag = max_abs_index(results, source_len);
+    *lag = kernel_max_abs_index(results, source_len);
 
     // If the lag is greater than the input array itself, it means that the
     // sample displacement has to be performed is to the left, and otherwise
@@ -250,58 +683,331 @@ int cross_correlation(double *source, double *input_sample,
     // be sample_len. But if the sample is moved to the left, some elements
     // will be lost from it and thus, the resulting size will be
     // sample_len - lag.
-    //
-    // Finally, the Pearson Correlation Coefficient is calculated with the
-    // resulting segment of data.
     if (*lag >= (long) sample_len) {
-        // Displacing the sample to the left (lag is negative), final size
-        // is sample_len - lag.
         *lag = (*lag % (long) sample_len) - (long) sample_len;
-        source_start = source;
-        source_end = source + *lag + sample_len;
-        sample_start = sample - *lag;
-        sample_end = sample + sample_len;
-    } else {
-        // Displacing the sample to the right (lag is positive), final size
-        // is sample_len.
-        source_start = source + *lag;
-        source_end = source + *lag + sample_len;
-        sample_start = sample;
-        sample_end = sample + sample_len;
     }
-    *coefficient = pearson_coefficient(source_start, source_end, sample_start,
-                                       sample_end);
+
+    // Finally, the Pearson Correlation Coefficient is calculated with the
+    // resulting segment of data.
+    const double start = stats_now_ms();
+    *coefficient = lag_coefficient(source, sample, sample_len, *lag);
+    ws->timing.pearson_ms += stats_now_ms() - start;
 
     // Checking that the resulting coefficient isn't NaN.
-    if (*coefficient != *coefficient) goto finish;
+    if (*coefficient != *coefficient) return -1;
 
     LOG("%ld frames of delay with a confidence of %f", *lag, *coefficient);
 
+    return 0;
+}
+
+// Same as cross_correlation, but using the buffers in the provided
+// workspace, so that no memory is allocated. See xcorr_workspace_correlate
+// for the `padded` parameter.
+int xcorr_workspace_run(struct xcorr_workspace *ws, sample_t *source,
+                        sample_t *sample, const size_t sample_len, int padded,
+                        long *lag, double *coefficient) {
+    DEBUG_ASSERT(ws); DEBUG_ASSERT(lag); DEBUG_ASSERT(coefficient);
+
+    if (!ws->multi_peak) {
+        if (highest_peak(ws, source, sample, sample_len, padded, lag,
+                         coefficient) < 0) {
+            return -1;
+        }
+    } else {
+        struct xcorr_result result;
+        if (xcorr_workspace_peaks(ws, source, sample, sample_len, padded,
+                                  &result) < 0) {
+            return -1;
+        }
+        *lag = result.lag;
+        *coefficient = result.coefficient;
+    }
+
 #ifdef PLOT
     // Plotting the output with gnuplot
+    const size_t source_len = sample_len * 2;
     LOG("Saving plot to '%ld.png'", source_len);
-    gnuplot = popen("gnuplot", "w");
+    const size_t skip = *lag < 0 ? (size_t) -*lag : 0;
+    sample_t *source_start = source + (*lag < 0 ? 0 : *lag);
+    FILE *gnuplot = popen("gnuplot", "w");
     fprintf(gnuplot, "set term 'png'\n");
     fprintf(gnuplot, "set output 'images/%ld.png'\n", source_len);
     fprintf(gnuplot, "plot '-' with lines title 'sample', '-' with lines"
             " title 'source'\n");
-    for (double *i = source_start; i < source_end; i++)
-        fprintf(gnuplot, "%f\n", *i);
+    for (size_t i = 0; i < sample_len - skip; i++)
+        fprintf(gnuplot, "%f\n", source_start[i]);
     fprintf(gnuplot, "e\n");
-    for (double *i = sample_start; i < sample_end; i++)
-        fprintf(gnuplot, "%f\n", *i);
+    for (size_t i = skip; i < sample_len; i++)
+        fprintf(gnuplot, "%f\n", sample[i]);
     fprintf(gnuplot, "e\n");
     fflush(gnuplot);
     pclose(gnuplot);
 #endif
 
-    ret = 0;
+    return 0;
+}
+
+// Calculating the cross-correlation between two signals `a` and `b`:
+//     xcross = ifft(fft(a) * conj(fft(b)))
+//
+// The source size must be twice the sample size. This is because the sample
+// will be zero-padded to length 2N-1, which is needed to calculate the
+// circular cross-correlation.
+//
+// Returns the lag in frames the sample has over the source, with a confidence
+// between -1 and 1.
+//
+// In case of error, the function returns -1. Otherwise, zero.
+//
+// This allocates a new workspace in every call. xcorr_workspace_run should
+// be used instead when it's called repeatedly.
+int cross_correlation(sample_t *source, sample_t *sample,
+                      const size_t sample_len, long *lag,
+                      double *coefficient) {
+    DEBUG_ASSERT(sample_len > 0);
+
+    struct xcorr_workspace *ws = xcorr_workspace_new(sample_len);
+    if (ws == NULL) {
+        return -1;
+    }
 
-finish:
-    if (sample) fftw_free(sample);
-    if (arr1) fftw_free(arr1);
-    if (arr2) fftw_free(arr2);
-    if (results) fftw_free(results);
+    int ret = xcorr_workspace_run(ws, source, sample, sample_len, 0, lag,
+                                  coefficient);
+    xcorr_workspace_free(ws);
 
     return ret;
 }
+
+// The length of the transforms of the normalized cross-correlation of a
+// sample of `sample_len` frames. The source is zero-padded by the longest
+// negative lag that overlaps at least MIN_OVERLAP of the sample, so that
+// the circular cross-correlation doesn't wrap around for any of the lags
+// that are checked. It's kept even, so that it's a multiple of the sample
+// rate for the usual intervals.
+size_t xcorr_ncc_transform_len(size_t sample_len) {
+    const size_t pad = sample_len - (size_t) ceil(sample_len * MIN_OVERLAP);
+    return 2 * sample_len + pad + pad % 2;
+}
+
+// A sum with Neumaier's compensation. The running sums of the normalized
+// cross-correlation add and remove millions of frames as the segments
+// slide, so the rounding errors would otherwise pile up, and the variances
+// are the difference of two of them.
+struct compensated_sum {
+    double sum;
+    double c;
+};
+
+static inline void compensated_add(struct compensated_sum *s, double v) {
+    const double t = s->sum + v;
+    if (fabs(s->sum) >= fabs(v)) {
+        s->c += (s->sum - t) + v;
+    } else {
+        s->c += (v - t) + s->sum;
+    }
+    s->sum = t;
+}
+
+// The running sums of two sliding segments, see overlap_sums.
+struct running_sums {
+    double n;
+    struct compensated_sum x, y, xx, yy;
+};
+
+static inline void running_slide(struct running_sums *s, double in_x,
+                                 double out_x, double out_y) {
+    compensated_add(&s->x, in_x - out_x);
+    compensated_add(&s->xx, in_x * in_x);
+    compensated_add(&s->xx, -out_x * out_x);
+    compensated_add(&s->y, -out_y);
+    compensated_add(&s->yy, -out_y * out_y);
+}
+
+static inline struct overlap_sums running_value(const struct running_sums *s) {
+    return (struct overlap_sums) {
+        .n = s->n,
+        .x = s->x.sum + s->x.c,
+        .y = s->y.sum + s->y.c,
+        .xx = s->xx.sum + s->xx.c,
+        .yy = s->yy.sum + s->yy.c,
+    };
+}
+
+// Copies the `n` frames of `src` into `dst` without their mean, which is
+// returned, and zero-pads it up to `len`. The coefficient of a lag doesn't
+// change when a constant is added to any of the signals, but their products
+// would otherwise be huge with a DC offset, and the covariance would cancel
+// out within the precision of the transforms.
+static double centered_copy(sample_t *dst, const sample_t *src, size_t n,
+                            size_t len) {
+    struct compensated_sum sum = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        compensated_add(&sum, src[i]);
+    }
+    const double mean = (sum.sum + sum.c) / n;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = src[i] - mean;
+    }
+    memset(dst + n, 0, (len - n) * sizeof(*dst));
+
+    return mean;
+}
+
+// The best lag found by the normalized cross-correlation so far, with its
+// running sums and the sum of the products of its segments.
+struct ncc_best {
+    long lag;
+    struct overlap_sums sums;
+    double xy;
+    // Its covariance and the product of the variances, both multiplied by
+    // the number of frames, so that they can be compared directly.
+    double cov;
+    double var;
+};
+
+// Replaces `best` with the lag if its coefficient is higher. Only positive
+// correlations are considered, so the coefficients can be compared by their
+// square, without any square roots or divisions.
+static void ncc_update(struct ncc_best *best, const struct running_sums *r,
+                       double xy, long lag) {
+    const struct overlap_sums s = running_value(r);
+    const double cov = s.n * xy - s.x * s.y;
+    if (cov <= 0.0) return;
+    const double var = (s.n * s.xx - s.x * s.x) * (s.n * s.yy - s.y * s.y);
+    if (!(var > 0.0)) return;
+
+    if (best->cov == 0.0
+            || cov * cov * best->var > best->cov * best->cov * var) {
+        best->lag = lag;
+        best->sums = s;
+        best->xy = xy;
+        best->cov = cov;
+        best->var = var;
+    }
+}
+
+// Same as xcorr_workspace_run, but the lag is the one with the highest
+// Pearson Correlation Coefficient, instead of the highest peak in the
+// cross-correlation. Every lag is normalized with the running sums of its
+// overlapping segments, so it's done in linear time, and the coefficient of
+// the resulting lag is obtained with them as well.
+//
+// Both the source and the sample are zero-padded to
+// xcorr_ncc_transform_len, so that a single pair of transforms is exact for
+// the positive lags and for the negative ones that are checked. The lags
+// overlapping less than MIN_OVERLAP of the sample are ignored. The sample
+// is always copied, since it's padded further than the `padded` buffers.
+//
+// The weighting of the workspace isn't applied, since the running sums only
+// normalize the plain cross-correlation.
+int xcorr_workspace_ncc(struct xcorr_workspace *ws, sample_t *source,
+                        sample_t *sample, const size_t sample_len, int padded,
+                        long *lag, double *coefficient) {
+    DEBUG_ASSERT(ws); DEBUG_ASSERT(source); DEBUG_ASSERT(sample);
+    DEBUG_ASSERT(lag); DEBUG_ASSERT(coefficient);
+    DEBUG_ASSERT(sample_len > 0);
+    UNUSED(padded);
+
+    memset(&ws->timing, 0, sizeof(ws->timing));
+    if (sample_len > ws->max_len) {
+        LOG("sample of length %ld is too big for the workspace", sample_len);
+        return -1;
+    }
+
+    // Both signals are transformed in-place in the workspace.
+    const size_t len = xcorr_ncc_transform_len(sample_len);
+    sample_t *padded_source = (sample_t *) ws->arr1;
+    sample_t *padded_sample = (sample_t *) ws->arr2;
+    const double source_mean = centered_copy(padded_source, source,
+                                             2 * sample_len, len);
+    const double sample_mean = centered_copy(padded_sample, sample,
+                                             sample_len, len);
+
+    struct fftw_data fft1_data = {
+        .real = padded_source,
+        .cpx = ws->arr1,
+        .len = len,
+        .ret = -1,
+    };
+    struct fftw_data fft2_data = {
+        .real = padded_sample,
+        .cpx = ws->arr2,
+        .len = len,
+        .ret = -1,
+    };
+    const double start = stats_now_ms();
+    struct task_group group = TASK_GROUP_INIT;
+    thread_pool_submit(&group, &fft, (void *) &fft1_data);
+    fft(&fft2_data);
+    thread_pool_wait(&group);
+    ws->timing.fft_ms += stats_now_ms() - start;
+    if (fft1_data.ret < 0 || fft2_data.ret < 0) {
+        return -1;
+    }
+    const sample_t *results = inverse_transform(ws, len, 0);
+    if (results == NULL) {
+        return -1;
+    }
+
+    // The running sums are the Pearson part of the algorithm, which is timed
+    // separately from the transforms.
+    const double timer = stats_now_ms();
+
+    // The sums for a lag of zero, where the full sample overlaps the first
+    // half of the source.
+    // The sums are of the signals without their means as well, the same as
+    // the ones that were transformed.
+    struct running_sums first = { .n = sample_len };
+    for (size_t i = 0; i < sample_len; i++) {
+        const double x = source[i] - source_mean;
+        const double y = sample[i] - sample_mean;
+        compensated_add(&first.x, x);
+        compensated_add(&first.xx, x * x);
+        compensated_add(&first.y, y);
+        compensated_add(&first.yy, y * y);
+    }
+
+    // FFTW's inverse transform isn't normalized, so the results are the sums
+    // of the products multiplied by the length of the transform.
+    const double scale = 1.0 / len;
+
+    // With positive lags the full sample is used, and the source segment
+    // slides to the right.
+    struct ncc_best best = { 0 };
+    struct running_sums s = first;
+    for (size_t k = 0; k < sample_len; k++) {
+        ncc_update(&best, &s, results[k] * scale, k);
+        if (k + 1 < sample_len) {
+            running_slide(&s, source[k + sample_len] - source_mean,
+                          source[k] - source_mean, 0.0);
+        }
+    }
+
+    // With negative lags both segments shrink: the end of the source and the
+    // start of the sample are left out. They're at the end of the
+    // cross-correlation, before the padding would wrap around.
+    const size_t min_overlap = ceil(sample_len * MIN_OVERLAP);
+    s = first;
+    for (size_t j = 1; sample_len - j >= min_overlap; j++) {
+        s.n--;
+        running_slide(&s, 0.0, source[sample_len - j] - source_mean,
+                      sample[j - 1] - sample_mean);
+        ncc_update(&best, &s, results[len - j] * scale, -(long) j);
+    }
+    ws->timing.pearson_ms += stats_now_ms() - timer;
+
+    // No lag is positively correlated at all.
+    if (best.cov == 0.0) return -1;
+
+    *lag = best.lag;
+    *coefficient = overlap_coefficient(&best.sums, best.xy);
+
+    // Checking that the resulting coefficient isn't NaN.
+    if (*coefficient != *coefficient) return -1;
+
+    LOG("%ld frames of delay with a normalized confidence of %f", *lag,
+        *coefficient);
+
+    return 0;
+}
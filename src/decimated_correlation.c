@@ -0,0 +1,250 @@
+// Coarse-to-fine cross-correlation engine.
+//
+// The full cross-correlation of the last interval is a transform of almost
+// three million points, but most of the information needed to find the lag
+// is in the lower frequencies. So the signals are first low-pass filtered
+// and decimated, and their cross-correlation is calculated at the lower rate,
+// which is `factor` times cheaper. Its highest peaks are the candidate lags,
+// with an error of up to `factor` frames because of the decimation.
+//
+// Then, each candidate is refined at the full rate, calculating the
+// cross-correlation directly for the lags around it only. The best one is
+// the resulting lag, and its Pearson Correlation Coefficient is calculated
+// like in cross_correlation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/decimated_correlation.h>
+#include <audiosync/fft_plans.h>
+
+// The anti-aliasing filter has FILTER_LOBES lobes of the sinc function at
+// each side, so its length is 2 * FILTER_LOBES * factor + 1.
+#define FILTER_LOBES 3
+// The maximum number of candidate lags refined at the full rate, and the
+// minimum distance between them at the decimated rate, so that they don't
+// belong to the same peak. Peaks lower than CANDIDATE_RATIO times the
+// highest one aren't refined.
+#define N_CANDIDATES 3
+#define MIN_CANDIDATE_DISTANCE 4
+#define CANDIDATE_RATIO 0.5
+
+
+struct decimated_xcorr {
+    size_t factor;  // The decimation factor
+    size_t max_len;  // Maximum decimated sample length
+    // The low-pass filter used before decimating, of length 2 * radius + 1.
+    size_t radius;
+    double *taps;
+    // The decimated signals. The sample is zero-padded to twice its length.
+    sample_t *source;
+    sample_t *sample;
+    struct xcorr_workspace *ws;
+};
+
+
+// Allocates a new engine for samples up to `max_sample_len` frames, which
+// are decimated by `factor`. Returns NULL in case of error.
+struct decimated_xcorr *decimated_xcorr_new(size_t factor,
+                                            size_t max_sample_len) {
+    DEBUG_ASSERT(factor > 0);
+    DEBUG_ASSERT(max_sample_len >= factor);
+
+    struct decimated_xcorr *d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+        perror("audiosync: decimated_xcorr calloc failed");
+        return NULL;
+    }
+
+    d->factor = factor;
+    d->max_len = max_sample_len / factor;
+    d->radius = FILTER_LOBES * factor;
+    d->taps = malloc((2 * d->radius + 1) * sizeof(*d->taps));
+    d->source = FFTW(alloc_real)(2 * d->max_len);
+    d->sample = FFTW(alloc_real)(2 * d->max_len);
+    d->ws = xcorr_workspace_new(d->max_len);
+    if (d->taps == NULL || d->source == NULL || d->sample == NULL
+            || d->ws == NULL) {
+        perror("audiosync: decimated_xcorr buffers allocation failed");
+        decimated_xcorr_free(d);
+        return NULL;
+    }
+
+    // Windowed sinc with the cutoff at the new Nyquist frequency, using a
+    // Hamming window. It's normalized so that its gain is 1 at 0 Hz.
+    double sum = 0.0;
+    for (size_t i = 0; i <= 2 * d->radius; i++) {
+        const double k = (double) i - (double) d->radius;
+        const double x = M_PI * k / (double) factor;
+        const double sinc = k == 0 ? 1.0 : sin(x) / x;
+        const double window = 0.54 - 0.46 * cos(M_PI * i / d->radius);
+        d->taps[i] = sinc * window;
+        sum += d->taps[i];
+    }
+    for (size_t i = 0; i <= 2 * d->radius; i++) {
+        d->taps[i] /= sum;
+    }
+
+    return d;
+}
+
+// Frees an engine allocated with decimated_xcorr_new.
+void decimated_xcorr_free(struct decimated_xcorr *d) {
+    if (d == NULL) return;
+
+    if (d->taps) free(d->taps);
+    if (d->source) FFTW(free)(d->source);
+    if (d->sample) FFTW(free)(d->sample);
+    xcorr_workspace_free(d->ws);
+    free(d);
+}
+
+// Configures the weighting of the coarse cross-correlation, which is done at
+// the decimated rate.
+int decimated_xcorr_set_weighting(struct decimated_xcorr *d,
+                                  weighting_t weighting) {
+    DEBUG_ASSERT(d);
+
+    return xcorr_workspace_set_weighting(d->ws, weighting,
+                                         (double) SAMPLE_RATE / d->factor);
+}
+
+// Filters the first `in_len` frames of `in` and saves every `factor`-th of
+// them into `out`, which has a length of `out_len`. The frames outside of
+// `in` are considered zero, so that the data after `in_len` isn't used.
+static void decimate(const struct decimated_xcorr *d, const sample_t *in,
+                     size_t in_len, sample_t *out, size_t out_len) {
+    const long radius = d->radius;
+    for (size_t j = 0; j < out_len; j++) {
+        const long center = j * d->factor;
+        long start = center - radius;
+        long end = center + radius + 1;
+        if (start < 0) start = 0;
+        if (end > (long) in_len) end = in_len;
+
+        const double *taps = d->taps + (start - center + radius);
+        double acc = 0.0;
+        for (long k = start; k < end; k++) {
+            acc += *taps++ * in[k];
+        }
+        out[j] = acc;
+    }
+}
+
+// The linear cross-correlation of the source and the sample at a single lag,
+// without the circular part.
+static double lag_product(const sample_t *source, const sample_t *sample,
+                          size_t sample_len, long lag) {
+    const size_t start = lag < 0 ? (size_t) -lag : 0;
+    const sample_t *src = source + (lag + (long) start);
+    const sample_t *smp = sample + start;
+    double sum = 0.0;
+    for (size_t i = 0; i < sample_len - start; i++) {
+        sum += (double) src[i] * smp[i];
+    }
+
+    return sum;
+}
+
+// Checks if the index `i` of the decimated cross-correlation is close to any
+// of the previous candidates, taking into account that it's circular.
+static int near_candidate(const size_t *candidates, size_t n_candidates,
+                          size_t i, size_t len) {
+    for (size_t c = 0; c < n_candidates; c++) {
+        size_t dist = i > candidates[c] ? i - candidates[c]
+                                        : candidates[c] - i;
+        if (len - dist < dist) dist = len - dist;
+        if (dist < MIN_CANDIDATE_DISTANCE) return 1;
+    }
+
+    return 0;
+}
+
+// Obtains the lag and the coefficient of the sample over the source, with the
+// same output as cross_correlation.
+//
+// Returns -1 in case of error, or zero otherwise.
+int decimated_xcorr_run(struct decimated_xcorr *d, sample_t *source,
+                        sample_t *sample, size_t sample_len, long *lag,
+                        double *coefficient) {
+    DEBUG_ASSERT(d); DEBUG_ASSERT(source); DEBUG_ASSERT(sample);
+    DEBUG_ASSERT(lag); DEBUG_ASSERT(coefficient);
+
+    const size_t len = sample_len / d->factor;
+    if (len == 0 || len > d->max_len) {
+        LOG("invalid sample length for the decimated engine: %ld",
+            sample_len);
+        return -1;
+    }
+
+    // The decimated sample is zero-padded so that it can be transformed
+    // directly, without copying it into the workspace.
+    decimate(d, source, 2 * sample_len, d->source, 2 * len);
+    decimate(d, sample, sample_len, d->sample, len);
+    memset(d->sample + len, 0, len * sizeof(*d->sample));
+    sample_t *results = xcorr_workspace_correlate(d->ws, d->source, d->sample,
+                                                  len, 1);
+    if (results == NULL) {
+        return -1;
+    }
+
+    // Looking for the highest peaks in the decimated cross-correlation.
+    size_t candidates[N_CANDIDATES];
+    size_t n_candidates = 0;
+    double highest = 0.0;
+    while (n_candidates < N_CANDIDATES) {
+        double max_val = -1.0;
+        size_t max_ind = 0;
+        for (size_t i = 0; i < 2 * len; i++) {
+            const double abs_val = fabs(results[i]);
+            if (abs_val > max_val
+                    && !near_candidate(candidates, n_candidates, i,
+                                       2 * len)) {
+                max_val = abs_val;
+                max_ind = i;
+            }
+        }
+        if (max_val < 0.0 || max_val < CANDIDATE_RATIO * highest) break;
+        if (n_candidates == 0) highest = max_val;
+        candidates[n_candidates++] = max_ind;
+    }
+
+    // Refining the candidates at the full rate, with the lags that could
+    // have been rounded to them when decimating, plus a frame of margin.
+    double max_val = -1.0;
+    long max_lag = 0;
+    for (size_t c = 0; c < n_candidates; c++) {
+        const long coarse = candidates[c] < len
+            ? (long) candidates[c]
+            : (long) candidates[c] - 2 * (long) len;
+        const long margin = d->factor / 2 + 1;
+        long start = coarse * (long) d->factor - margin;
+        long end = coarse * (long) d->factor + margin;
+        if (start <= -(long) sample_len) start = -(long) sample_len + 1;
+        if (end >= (long) sample_len) end = sample_len - 1;
+        LOG("refining candidate lag %ld in [%ld, %ld]",
+            coarse * (long) d->factor, start, end);
+
+        for (long k = start; k <= end; k++) {
+            const double abs_val = fabs(lag_product(source, sample,
+                                                    sample_len, k));
+            if (abs_val > max_val) {
+                max_val = abs_val;
+                max_lag = k;
+            }
+        }
+    }
+
+    *lag = max_lag;
+    *coefficient = lag_coefficient(source, sample, sample_len, max_lag);
+
+    // Checking that the resulting coefficient isn't NaN.
+    if (*coefficient != *coefficient) return -1;
+
+    LOG("%ld frames of delay with a confidence of %f", *lag, *coefficient);
+
+    return 0;
+}
@@ -5,53 +5,129 @@
 #include <string.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/ffmpeg_pipe.h>
+#ifdef USE_LIBAV
+# include <audiosync/libav_decode.h>
+#endif
+#include <audiosync/stats.h>
+#include <audiosync/track_cache.h>
 #include <audiosync/download/linux_download.h>
 
 #define MAX_LONG_URL 8172
 #define MAX_LONG_COMMAND 4086
 
 
+// Decodes the audio at `url` into the thread's data, either with ffmpeg or
+// in-process with USE_LIBAV.
+//
+// Returns -1 in case of error, or zero otherwise.
+static int read_url(struct ffmpeg_data *data, char *url) {
+#ifdef USE_LIBAV
+    return libav_decode(data, NULL, url);
+#else
+    char *args[] = {
+        "ffmpeg", "-y", "-to",
+        data->max_seconds ? data->max_seconds : MAX_SECONDS_STR, "-i", url,
+        "-ac", NUM_CHANNELS_STR, "-r", SAMPLE_RATE_STR, "-f",
+        SAMPLE_FORMAT_STR, "pipe:1", "-loglevel",
+#ifdef NDEBUG
+        "fatal",
+#else
+        "verbose",
+#endif
+        NULL
+    };
+    return ffmpeg_pipe(data, args);
+#endif
+}
+
+// Copies the audio of the buffer provider into the thread's data, finishing
+// every interval at once.
+static void read_buffer(struct ffmpeg_data *data, const sample_t *buf,
+                        size_t len) {
+    const size_t n = len < data->total_len ? len : data->total_len;
+    size_t interval_count = 0;
+    memcpy(data->buf, buf, n * sizeof(*buf));
+    ffmpeg_data_publish(data, n, &interval_count);
+    ffmpeg_data_finish(data, n);
+}
+
 // Function used for the download thread. In this case, it both obtains the
 // direct youtube link to download the audio from, and creates a new
-// pulseaudio process to save it inside the thread's data.
+// pulseaudio process to save it inside the thread's data. With USE_LIBAV,
+// it's decoded in-process instead.
+//
+// The song may also be obtained from another provider, see
+// audiosync_source. The local ones are read as fast as possible.
+//
+// If the track was downloaded previously and it's still cached, it's loaded
+// directly instead, and every interval is finished at once.
 //
 // In case of error, it will signal the main thread to abort.
 void *download(void *arg) {
     struct ffmpeg_data *data = arg;
+    const struct audiosync_source *source = data->source;
     LOG("starting download thread");
 
-    // Obtaining the youtube-dl direct URL to download.
+    switch (source->provider) {
+    case BUFFER_PROVIDER:
+        LOG("reading the source from a buffer");
+        read_buffer(data, source->buf, source->len);
+        return NULL;
+    case FILE_PROVIDER:
+        LOG("reading the source from %s", source->path);
+        read_url(data, strcmp(source->path, "-") == 0 ? "pipe:0"
+                                                      : (char *) source->path);
+        return NULL;
+    default:
+        break;
+    }
+
+    // The longer tracks downloaded while tracking the lag (with a custom
+    // limit of seconds) aren't cached, since they'd take several times the
+    // space of the rest.
     char *url = NULL;
+    const int cached = data->max_seconds == NULL;
+    if (cached && track_cache_load(data->title, data->buf,
+                                   data->total_len) == 0) {
+        size_t interval_count = 0;
+        ffmpeg_data_publish(data, data->total_len, &interval_count);
+        goto finish;
+    }
+
+    // Obtaining the direct URL to download, with youtube-dl or with the
+    // provided resolver.
     url = malloc(sizeof(*url) * MAX_LONG_URL);
     if (url == NULL) {
-        audiosync_abort();
+        ffmpeg_data_abort(data);
         perror("url malloc failed");
         goto finish;
     }
-    if (get_audio_url(data->title, &url) < 0) {
-        audiosync_abort();
-        LOG("could not obtain youtube url");
+    const int url_ret = source->provider == URL_PROVIDER
+        ? source->resolve(source->title, url, MAX_LONG_URL, source->data)
+        : get_audio_url(data->title, &url);
+    if (data->stats) {
+        data->stats->resolve_ms = stats_elapsed_ms(&data->stats->start);
+    }
+    if (url_ret < 0) {
+        ffmpeg_data_abort(data);
+        LOG("could not obtain the URL");
         goto finish;
     }
-    LOG("obtained youtube-dl URL for download");
+    LOG("obtained the URL for download");
 
-    // Finally downloading the track data with ffmpeg.
-    char *args[] = {
-        "ffmpeg", "-y", "-to", MAX_SECONDS_STR, "-i", url, "-ac",
-        NUM_CHANNELS_STR, "-r", SAMPLE_RATE_STR, "-f", "f64le", "pipe:1",
-        "-loglevel",
-#ifdef NDEBUG
-        "fatal",
-#else
-        "verbose",
-#endif
-        NULL
-    };
-    ffmpeg_pipe(data, args);
+    // Finally downloading the track data. Only the tracks that were
+    // downloaded completely are cached, rather than the ones aborted
+    // halfway.
+    if (read_url(data, url) == 0 && cached
+            && ffmpeg_data_status(data) != ABORT_ST
+            && __atomic_load_n(&data->len, __ATOMIC_ACQUIRE)
+               == data->total_len) {
+        track_cache_store(data->title, data->buf, data->total_len);
+    }
 
 finish:
     if (url) free(url);
-    pthread_exit(NULL);
+    return NULL;
 }
 
 // Obtains the YouTube audio link with Youtube-dl.
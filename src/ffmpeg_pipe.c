@@ -4,22 +4,159 @@
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <audiosync/audiosync.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/session.h>
+#include <audiosync/stats.h>
 
 #define PIPE_RD 0
 #define PIPE_WR 1
 #define BUFSIZE 4096
 
+// The pipes are created and forked with this lock taken, so that the child
+// of a thread doesn't inherit the write end of another one's pipe, which
+// wouldn't reach its end until both children finished.
+static pthread_mutex_t fork_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The session of the thread reading the data, which is the default one if it
+// wasn't set. It may change while reading if the data is prefetched, so it's
+// loaded again every time it's needed.
+struct audiosync_session *ffmpeg_data_session(const struct ffmpeg_data *data) {
+    struct audiosync_session *session = __atomic_load_n(&data->session,
+                                                         __ATOMIC_SEQ_CST);
+    return session ? session : audiosync_default_session();
+}
+
+// Signals the main thread of the session after publishing the length. It's
+// done with the mutex taken so that the main thread can't miss it between
+// checking the length and waiting.
+void ffmpeg_data_signal(const struct ffmpeg_data *data) {
+    struct audiosync_session *session = ffmpeg_data_session(data);
+    pthread_mutex_lock(&session->mutex);
+    pthread_cond_signal(&session->interval_done);
+    pthread_mutex_unlock(&session->mutex);
+}
+
+// Obtains where the next frames of the data should be written, after the
+// `len` frames read so far, and how many of them fit there, up to `max`.
+// With a ring buffer, it continues at the beginning of the ring after the
+// buffer is full, and it's never full.
+sample_t *ffmpeg_data_dest(const struct ffmpeg_data *data, size_t len,
+                           size_t max, size_t *room) {
+    if (data->ring != NULL && len >= data->total_len) {
+        const size_t pos = (len - data->total_len) % data->ring_len;
+        *room = data->ring_len - pos;
+        if (*room > max) *room = max;
+        return data->ring + pos;
+    }
+
+    *room = len < data->total_len ? data->total_len - len : 0;
+    if (*room > max) *room = max;
+    return data->buf + len;
+}
+
+// Copies `len` frames of the data starting at the absolute frame `start`,
+// which may be in its buffer or in its ring buffer, into `out`.
+//
+// The reading thread keeps writing into the ring buffer without any locks,
+// so its length is loaded again after copying. If it's close to wrapping
+// around over the first frame copied, the copy may be torn, and -1 is
+// returned. Otherwise, it returns zero. The `margin` is left for the read in
+// progress, which may have overwritten some frames before publishing them.
+int ffmpeg_data_copy(const struct ffmpeg_data *data, size_t start,
+                     size_t len, size_t margin, sample_t *out) {
+    for (size_t i = 0; i < len; i++) {
+        const size_t frame = start + i;
+        out[i] = frame < data->total_len
+            ? data->buf[frame]
+            : data->ring[(frame - data->total_len) % data->ring_len];
+    }
+
+    const size_t end = __atomic_load_n(&data->len, __ATOMIC_ACQUIRE);
+    if (start + len > data->total_len
+            && end + margin > start + data->ring_len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Publishes the new length of the data, after the frames before it have been
+// written, and signals the main thread when one or more intervals are
+// finished. `interval_count` is the number of intervals finished so far.
+//
+// The length is stored atomically with release semantics, so that the frames
+// before it are visible to the threads that load it with acquire semantics.
+// The mutex is only taken to signal the main thread, and not for every
+// chunk. The statistics of the stream are updated as well, if it has them.
+void ffmpeg_data_publish(struct ffmpeg_data *data, size_t len,
+                         size_t *interval_count) {
+    if (data->stats) stream_stats_update(data->stats, len);
+    __atomic_store_n(&data->len, len, __ATOMIC_RELEASE);
+
+    if (*interval_count < data->n_intervals
+            && len >= data->intervals[*interval_count]) {
+        while (*interval_count < data->n_intervals
+               && len >= data->intervals[*interval_count]) {
+            (*interval_count)++;
+        }
+        ffmpeg_data_signal(data);
+    }
+}
+
+// Finishes the data after `len` frames were read. If the track isn't long
+// enough for every interval, the rest of the data is filled with zeroes, and
+// the main thread is signaled so that it knows every interval was read. The
+// statistics only count the frames actually read, so the boundaries after
+// them are never reached.
+void ffmpeg_data_finish(struct ffmpeg_data *data, size_t len) {
+    if (data->stats) stream_stats_update(data->stats, len);
+    if (len >= data->total_len) return;
+
+    for (size_t i = len; i < data->total_len; i++) {
+        data->buf[i] = 0.0;
+    }
+    __atomic_store_n(&data->len, data->total_len, __ATOMIC_RELEASE);
+    ffmpeg_data_signal(data);
+}
+
+// The status followed by the thread reading the data, which is its
+// session's.
+global_status_t ffmpeg_data_status(const struct ffmpeg_data *data) {
+    return audiosync_session_status(ffmpeg_data_session(data));
+}
+
+// Aborts the session of the thread reading the data, in case of errors.
+void ffmpeg_data_abort(struct ffmpeg_data *data) {
+    audiosync_session_abort(ffmpeg_data_session(data));
+}
+
+// Blocks the calling thread while its session is paused. Returns the status
+// it was resumed with.
+global_status_t ffmpeg_data_wait_resume(const struct ffmpeg_data *data) {
+    struct audiosync_session *session = ffmpeg_data_session(data);
+    pthread_mutex_lock(&session->mutex);
+    while (session->status == PAUSED_ST) {
+        pthread_cond_wait(&session->read_continue, &session->mutex);
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    return audiosync_session_status(session);
+}
 
 // Executes the ffmpeg command in the arguments and pipes its data into the
 // provided array.
 //
 // It will send signals to the main thread as the intervals are being
-// finished, while also checking the current global status, or updating it in
+// finished, while also checking the status of its session, or updating it in
 // case of errors.
 //
+// This thread is the only writer of the data, and the length is published
+// after every read, see ffmpeg_data_publish.
+//
 // Returns -1 in case of error, or zero otherwise.
 int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]) {
     DEBUG_ASSERT(args); DEBUG_ASSERT(data); DEBUG_ASSERT(data->title);
@@ -27,21 +164,29 @@ int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]) {
     DEBUG_ASSERT(data->intervals[data->n_intervals-1] == data->total_len);
 
     int wav_pipe[2];
-    int interval_count = 0;
+    size_t interval_count = 0;
     ssize_t read_bytes;
     pid_t pid;
 
+    pthread_mutex_lock(&fork_mutex);
     if (pipe(wav_pipe) < 0) {
-        audiosync_abort();
+        ffmpeg_data_abort(data);
         perror("audiosync: pipe for wav_pipe failed");
+        pthread_mutex_unlock(&fork_mutex);
         return -1;
     }
+    // Neither end is inherited by the rest of the children either, like the
+    // youtube-dl ones of popen, which don't take the lock. The copy of the
+    // write end made by dup2 in this one is kept open.
+    fcntl(wav_pipe[PIPE_RD], F_SETFD, FD_CLOEXEC);
+    fcntl(wav_pipe[PIPE_WR], F_SETFD, FD_CLOEXEC);
 
     pid = fork();
     if (pid < 0) {
-        audiosync_abort();
+        ffmpeg_data_abort(data);
         perror("audiosync: fork in read_pipe failed");
         close(wav_pipe[PIPE_RD]); close(wav_pipe[PIPE_WR]);
+        pthread_mutex_unlock(&fork_mutex);
         return -1;
     }
     if (pid == 0) {
@@ -57,70 +202,67 @@ int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]) {
         execvp("ffmpeg", args);
 
         // If this part of the code is executed, it means that execvp failed.
-        audiosync_abort();
-        LOG("ffmpeg command failed");
-        return -1;
+        // The child is a copy of a worker of the pool, so it must exit right
+        // away instead of returning into it, without touching the session
+        // either. The parent then reads the end of the pipe.
+        perror("audiosync: execvp for ffmpeg failed");
+        _exit(127);
     }
 
     // Parent process (reading the output pipe), doesn't write.
     close(wav_pipe[PIPE_WR]);
-    data->len = 0;
+    pthread_mutex_unlock(&fork_mutex);
+    size_t len = 0;
+    __atomic_store_n(&data->len, len, __ATOMIC_RELEASE);
     while (1) {
-        // Reading the data from ffmpeg in chunks of size `BUFSIZE`.
-        read_bytes = read(wav_pipe[PIPE_RD], data->buf + data->len,
-                          BUFSIZE * sizeof(*(data->buf)));
+        // Reading the data from ffmpeg in chunks of size `BUFSIZE`. With a
+        // ring buffer, they're smaller when there's less room left before
+        // the end of the buffer, which is then continued in the ring.
+        size_t room;
+        sample_t *dest = ffmpeg_data_dest(data, len, BUFSIZE, &room);
+        read_bytes = read(wav_pipe[PIPE_RD], dest, room * sizeof(*dest));
 
         // Error when trying to read
         if (read_bytes < 0) {
-            audiosync_abort();
+            ffmpeg_data_abort(data);
             perror("audiosync: read for wav_pipe failed");
             close(wav_pipe[PIPE_RD]);
             return -1;
         }
 
-        data->len += read_bytes / sizeof(*(data->buf));
+        len += read_bytes / sizeof(*(data->buf));
 
         // End of file or the buffer won't be big enough for the next read.
-        if (read_bytes == 0 || data->len + BUFSIZE >= data->total_len) {
+        if (read_bytes == 0 || (data->ring == NULL
+                                && len + BUFSIZE >= data->total_len)) {
             LOG("finished ffmpeg loop");
             break;
         }
 
-        // Signaling the main thread when a full interval is read.
-        if (data->len >= data->intervals[interval_count]) {
-            pthread_mutex_lock(&mutex);
-            pthread_cond_signal(&interval_done);
-            pthread_mutex_unlock(&mutex);
-            interval_count++;
-        }
+        // Signaling the main thread when one or more intervals are finished.
+        ffmpeg_data_publish(data, len, &interval_count);
 
         // Checking if the main process has indicated that this thread
-        // should end (accessing it atomically).
-        switch (audiosync_status()) {
+        // should end (accessing it atomically, without the mutex).
+        switch (ffmpeg_data_status(data)) {
         case ABORT_ST:
             LOG("read ABORT_ST, quitting...");
             kill(pid, SIGKILL);
-            wait(NULL);
+            waitpid(pid, NULL, 0);
             close(wav_pipe[PIPE_RD]);
             return 0;
         case PAUSED_ST:
             // Suspending the ffmpeg process with a SIGSTOP until the
-            // global status is changed from PAUSED_ST.
+            // status of the session is changed from PAUSED_ST.
             LOG("stopping ffmpeg");
             kill(pid, SIGSTOP);
 
-            pthread_mutex_lock(&mutex);
-            while (global_status == PAUSED_ST) {
-                pthread_cond_wait(&read_continue, &mutex);
-            }
-            pthread_mutex_unlock(&mutex);
-
             // After being woken up, checking if the ffmpeg process
             // should continue or stop.
-            if (global_status == ABORT_ST) {
+            if (ffmpeg_data_wait_resume(data) == ABORT_ST) {
                 LOG("read ABORT_ST after pause, quitting...");
                 kill(pid, SIGKILL);
-                wait(NULL);
+                waitpid(pid, NULL, 0);
                 close(wav_pipe[PIPE_RD]);
                 return 0;
             }
@@ -134,22 +276,22 @@ int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]) {
         }
     }
 
-    // If the track isn't long enough for every interval, the rest of the
-    // data is filled with zeroes.
-    if (data->len < data->total_len) {
-        for (size_t i = data->len; i < data->total_len; i++) {
-            data->buf[i] = 0.0;
-        }
-        data->len = data->total_len;
-        // Also sending a signal to the main thread indicating it that all the
-        // intervals have been read successfully.
-        pthread_mutex_lock(&mutex);
-        pthread_cond_signal(&interval_done);
-        pthread_mutex_unlock(&mutex);
+    // Waiting for ffmpeg before finishing the data, since its exit status
+    // tells if it could be run at all. If the loop ended because the buffer
+    // is full, closing the pipe will make it quit.
+    close(wav_pipe[PIPE_RD]);
+    int status;
+    if (waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+            && WEXITSTATUS(status) == 127) {
+        ffmpeg_data_abort(data);
+        LOG("ffmpeg command failed");
+        return -1;
     }
 
-    close(wav_pipe[PIPE_RD]);
-    wait(NULL);
+    // If the track isn't long enough for every interval, the rest of the
+    // data is filled with zeroes.
+    __atomic_store_n(&data->len, len, __ATOMIC_RELEASE);
+    ffmpeg_data_finish(data, len);
 
     return 0;
 }
@@ -0,0 +1,415 @@
+// The FFTW plans used in audiosync are shared by the whole process, since
+// creating them is expensive and they can be reused between intervals and
+// runs. This module also handles the FFTW wisdom, so that the measured plans
+// can be persisted on disk.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/thread_pool.h>
+
+
+// The global cross-correlation mutex. FFTW's planner isn't thread-safe, so
+// it's only taken when a plan has to be created or the wisdom is accessed.
+static pthread_mutex_t cc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The cache grows in blocks of PLAN_BLOCK_LEN plans, which are never moved
+// or freed, so that the lookups can keep reading them without locking while
+// more are added. Each interval of each engine needs three plans, and the
+// alignment of the buffers may vary, so the maximum is far more than any
+// usage needs. When the cache is full, plans are created and destroyed on
+// every call, as before.
+#define PLAN_BLOCK_LEN 64
+#define MAX_PLAN_BLOCKS 64
+
+// The planner flags used when a plan doesn't exist yet in the cache. Plans
+// are only measured in fft_plan_warmup, so that the hot path never runs the
+// planner for longer than FFTW_ESTIMATE takes, unless the wisdom already
+// knows about that size.
+#define HOT_PLANNER_FLAGS (FFTW_MEASURE | FFTW_WISDOM_ONLY)
+
+// The transforms at least this long are split between the workers of the
+// pool by FFTW itself. The shorter ones are already run concurrently with
+// each other, and splitting them isn't worth it.
+#define FFT_THREADS_MIN_LEN (1 << 18)
+
+// A plan in the cache. FFTW's new-array execute functions can only be used
+// with arrays that have the same alignment and in-place-ness as the ones
+// used when planning, so they are part of the key too. The planner flags it
+// was actually created with are kept as well, so that the warm-up can
+// replace the plans that weren't measured.
+struct cached_plan {
+    plan_kind_t kind;
+    size_t len;
+    int in_align;
+    int out_align;
+    int inplace;
+    unsigned flags;
+    FFTW(plan) plan;
+};
+
+// The process-wide plan cache. Entries are only appended while holding
+// `cc_mutex`, and `n_cached_plans` is published afterwards with release
+// semantics, so that lookups can be done without locking anything. The
+// block of a new entry is allocated before that, so it's visible too.
+static struct cached_plan *plan_blocks[MAX_PLAN_BLOCKS];
+static size_t n_cached_plans = 0;
+
+// The plans replaced by the warm-up. Other threads may still be executing
+// them, since the lookups don't lock anything, so they're kept until the
+// process exits. A plan is only replaced by a more thorough one, so there
+// are at most a few of them per entry. Only accessed with `cc_mutex`
+// locked.
+static FFTW(plan) *retired_plans = NULL;
+static size_t n_retired_plans = 0;
+static size_t retired_capacity = 0;
+
+
+#ifdef HAVE_FFTW_THREADS_CALLBACK
+// FFTW's callback to run its threads' work in the pool, instead of starting
+// its own threads. The first job is done in the current thread.
+struct fftw_job {
+    void *(*work)(char *);
+    char *data;
+};
+
+static void *run_fftw_job(void *arg) {
+    struct fftw_job *job = arg;
+    job->work(job->data);
+
+    return NULL;
+}
+
+static void parallel_loop(void *(*work)(char *), char *jobdata,
+                          size_t elsize, int njobs, void *data) {
+    UNUSED(data);
+
+    struct fftw_job jobs[njobs];
+    struct task_group group = TASK_GROUP_INIT;
+    for (int i = 0; i < njobs; i++) {
+        jobs[i] = (struct fftw_job) { work, jobdata + elsize * i };
+        if (i > 0) {
+            thread_pool_submit(&group, &run_fftw_job, (void *) &jobs[i]);
+        }
+    }
+
+    run_fftw_job(&jobs[0]);
+    thread_pool_wait(&group);
+}
+#endif
+
+// Initializes FFTW's threads the first time the planner is used.
+// `cc_mutex` must be locked.
+static void setup_threads() {
+    static int done = 0;
+    if (done) return;
+    done = 1;
+
+    if (FFTW(init_threads)() == 0) {
+        LOG("couldn't initialize FFTW's threads");
+        return;
+    }
+#ifdef HAVE_FFTW_THREADS_CALLBACK
+    FFTW(threads_set_callback)(&parallel_loop, NULL);
+#endif
+}
+
+// Looks up an entry of the cache without locking. Returns NULL if it wasn't
+// found.
+static struct cached_plan *find_entry(plan_kind_t kind, size_t len,
+                                      int in_align, int out_align,
+                                      int inplace) {
+    size_t n = __atomic_load_n(&n_cached_plans, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        struct cached_plan *c = &plan_blocks[i / PLAN_BLOCK_LEN]
+                                            [i % PLAN_BLOCK_LEN];
+        if (c->kind == kind && c->len == len && c->in_align == in_align
+                && c->out_align == out_align && c->inplace == inplace) {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+// Same as find_entry, but only returns the plan. It's loaded atomically,
+// since the warm-up may replace it at any time.
+static FFTW(plan) find_plan(plan_kind_t kind, size_t len, int in_align,
+                             int out_align, int inplace) {
+    struct cached_plan *c = find_entry(kind, len, in_align, out_align,
+                                       inplace);
+    return c ? __atomic_load_n(&c->plan, __ATOMIC_ACQUIRE) : NULL;
+}
+
+// How thoroughly a plan was measured with the provided planner flags, where
+// zero means that it was only estimated.
+static int planner_rigor(unsigned flags) {
+    if (flags & FFTW_ESTIMATE) return 0;
+    if (flags & FFTW_EXHAUSTIVE) return 3;
+    if (flags & FFTW_PATIENT) return 2;
+    return 1;
+}
+
+// Creates a new plan for the provided arrays. `cc_mutex` must be locked.
+// FFTW_ESTIMATE is used as a fallback when the requested flags can't produce
+// a plan (for example with FFTW_WISDOM_ONLY and no wisdom available), and
+// the flags finally used are written into `used_flags`.
+static FFTW(plan) create_plan(plan_kind_t kind, size_t len, void *in,
+                              void *out, unsigned flags,
+                              unsigned *used_flags) {
+    setup_threads();
+    FFTW(plan_with_nthreads)(len >= FFT_THREADS_MIN_LEN
+                             ? (int) thread_pool_size() : 1);
+
+    FFTW(plan) p = NULL;
+    *used_flags = flags;
+    if (kind == R2C_PLAN) {
+        p = FFTW(plan_dft_r2c_1d)(len, in, out, flags);
+        if (p == NULL && flags != FFTW_ESTIMATE) {
+            *used_flags = FFTW_ESTIMATE;
+            p = FFTW(plan_dft_r2c_1d)(len, in, out, FFTW_ESTIMATE);
+        }
+    } else {
+        p = FFTW(plan_dft_c2r_1d)(len, in, out, flags);
+        if (p == NULL && flags != FFTW_ESTIMATE) {
+            *used_flags = FFTW_ESTIMATE;
+            p = FFTW(plan_dft_c2r_1d)(len, in, out, FFTW_ESTIMATE);
+        }
+    }
+
+    return p;
+}
+
+// Saves a new plan into the cache, allocating a new block if needed.
+// `cc_mutex` must be locked. Returns -1 if the cache is already full or in
+// case of error.
+static int cache_plan(plan_kind_t kind, size_t len, int in_align,
+                      int out_align, int inplace, unsigned flags,
+                      FFTW(plan) p) {
+    size_t n = n_cached_plans;
+    if (n >= MAX_PLAN_BLOCKS * PLAN_BLOCK_LEN) {
+        return -1;
+    }
+    struct cached_plan **block = &plan_blocks[n / PLAN_BLOCK_LEN];
+    if (*block == NULL) {
+        *block = malloc(PLAN_BLOCK_LEN * sizeof(**block));
+        if (*block == NULL) {
+            perror("audiosync: plan cache malloc failed");
+            return -1;
+        }
+    }
+
+    (*block)[n % PLAN_BLOCK_LEN] = (struct cached_plan) {
+        .kind = kind,
+        .len = len,
+        .in_align = in_align,
+        .out_align = out_align,
+        .inplace = inplace,
+        .flags = flags,
+        .plan = p,
+    };
+    __atomic_store_n(&n_cached_plans, n + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Obtains a plan for a transform between `in` and `out`, which may be used
+// with FFTW(execute_dft_r2c) or FFTW(execute_dft_c2r).
+//
+// If it was already cached, no lock is taken at all. Otherwise, the plan is
+// created without measuring, so the arrays aren't overwritten.
+struct plan_ref get_plan(plan_kind_t kind, size_t len, void *in, void *out) {
+    const int in_align = FFTW(alignment_of)(in);
+    const int out_align = FFTW(alignment_of)(out);
+    const int inplace = in == out;
+    struct plan_ref ref = { .plan = NULL, .cached = 1 };
+
+    ref.plan = find_plan(kind, len, in_align, out_align, inplace);
+    if (ref.plan != NULL) {
+        return ref;
+    }
+
+    pthread_mutex_lock(&cc_mutex);
+    // Another thread may have created it while waiting for the lock.
+    ref.plan = find_plan(kind, len, in_align, out_align, inplace);
+    if (ref.plan == NULL) {
+        LOG("creating %s plan of length %ld outside of the warm-up",
+            kind == R2C_PLAN ? "r2c" : "c2r", len);
+        unsigned flags;
+        ref.plan = create_plan(kind, len, in, out, HOT_PLANNER_FLAGS,
+                               &flags);
+        if (ref.plan != NULL && cache_plan(kind, len, in_align, out_align,
+                                           inplace, flags, ref.plan) < 0) {
+            ref.cached = 0;
+        }
+    }
+    pthread_mutex_unlock(&cc_mutex);
+
+    return ref;
+}
+
+// Destroys a plan obtained with get_plan in case it wasn't cached.
+void release_plan(struct plan_ref ref) {
+    if (ref.plan == NULL || ref.cached) {
+        return;
+    }
+
+    pthread_mutex_lock(&cc_mutex);
+    FFTW(destroy_plan)(ref.plan);
+    pthread_mutex_unlock(&cc_mutex);
+}
+
+// Creating the plans for the cross-correlation of the provided sample lengths
+// ahead of time (see xcorr_workspace_run for the kinds of transforms).
+// They're measured with the provided planner flags (usually FFTW_MEASURE or
+// FFTW_PATIENT), which may take a while unless the wisdom was loaded
+// previously with fft_wisdom_load.
+//
+// The plans are created for buffers allocated with FFTW(alloc_*), which is
+// what audiosync uses for all its buffers. The ones already in the cache are
+// replaced if they were measured less thoroughly, like the ones created
+// outside of the warm-up without any wisdom, which are only estimated.
+//
+// Returns -1 in case of error, or zero otherwise.
+int fft_plan_warmup(const size_t *sample_lens, size_t n, unsigned flags) {
+    DEBUG_ASSERT(sample_lens);
+
+    int ret = -1;
+    sample_t *real = NULL;
+    sample_cpx_t *cpx = NULL;
+    size_t max_len = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (sample_lens[i] > max_len) max_len = sample_lens[i];
+    }
+    if (max_len == 0) {
+        return 0;
+    }
+
+    // The planner overwrites the arrays when measuring, so a scratch buffer
+    // is used, big enough for the largest transform. The in-place r2c
+    // transforms are done on the real one, so it has room for the
+    // 2 * (N + 1) real elements of their output.
+    real = FFTW(alloc_real)(2 * max_len + 2);
+    if (real == NULL) {
+        perror("audiosync: warm-up alloc_real failed");
+        goto finish;
+    }
+    cpx = FFTW(alloc_complex)(max_len + 1);
+    if (cpx == NULL) {
+        perror("audiosync: warm-up alloc_complex failed");
+        goto finish;
+    }
+
+    // The transforms used by the cross-correlation: the source is
+    // transformed out-of-place, the sample either in-place or out-of-place,
+    // and the inverse transform is always in-place.
+    const struct {
+        plan_kind_t kind;
+        int inplace;
+    } configs[] = {
+        { R2C_PLAN, 0 },
+        { R2C_PLAN, 1 },
+        { C2R_PLAN, 1 },
+    };
+    const size_t n_configs = sizeof(configs) / sizeof(configs[0]);
+
+    pthread_mutex_lock(&cc_mutex);
+    for (size_t i = 0; i < n; i++) {
+        const size_t len = 2 * sample_lens[i];
+        for (size_t k = 0; k < n_configs; k++) {
+            const plan_kind_t kind = configs[k].kind;
+            void *in = kind == R2C_PLAN ? (void *) real : (void *) cpx;
+            void *out = configs[k].inplace ? in
+                        : (kind == R2C_PLAN ? (void *) cpx : (void *) real);
+            struct cached_plan *entry = find_entry(
+                kind, len, FFTW(alignment_of)(in), FFTW(alignment_of)(out),
+                configs[k].inplace);
+            if (entry != NULL
+                    && planner_rigor(entry->flags) >= planner_rigor(flags)) {
+                continue;
+            }
+            if (entry != NULL && n_retired_plans == retired_capacity) {
+                const size_t capacity = 2 * retired_capacity + 8;
+                FFTW(plan) *tmp = realloc(retired_plans,
+                                          capacity * sizeof(*tmp));
+                if (tmp == NULL) {
+                    perror("audiosync: retired plans realloc failed");
+                    pthread_mutex_unlock(&cc_mutex);
+                    goto finish;
+                }
+                retired_plans = tmp;
+                retired_capacity = capacity;
+            }
+
+            LOG("planning %s%s transform of length %ld",
+                configs[k].inplace ? "in-place " : "",
+                kind == R2C_PLAN ? "r2c" : "c2r", len);
+            unsigned used_flags;
+            FFTW(plan) p = create_plan(kind, len, in, out, flags,
+                                       &used_flags);
+            if (p == NULL) {
+                LOG("couldn't create plan of length %ld", len);
+                pthread_mutex_unlock(&cc_mutex);
+                goto finish;
+            }
+            if (entry != NULL) {
+                // The lookups may have just loaded the previous plan, so
+                // it's retired instead of destroyed.
+                retired_plans[n_retired_plans++] = entry->plan;
+                entry->flags = used_flags;
+                __atomic_store_n(&entry->plan, p, __ATOMIC_RELEASE);
+                continue;
+            }
+            if (cache_plan(kind, len, FFTW(alignment_of)(in),
+                           FFTW(alignment_of)(out), configs[k].inplace,
+                           used_flags, p) < 0) {
+                LOG("plan cache is full");
+                FFTW(destroy_plan)(p);
+                pthread_mutex_unlock(&cc_mutex);
+                goto finish;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cc_mutex);
+
+    ret = 0;
+
+finish:
+    if (real) FFTW(free)(real);
+    if (cpx) FFTW(free)(cpx);
+
+    return ret;
+}
+
+// Loading the FFTW wisdom from a file, so that the warm-up doesn't have to
+// measure the plans again.
+//
+// Returns -1 in case of error (for example if the file doesn't exist), or
+// zero otherwise.
+int fft_wisdom_load(const char *path) {
+    DEBUG_ASSERT(path);
+
+    pthread_mutex_lock(&cc_mutex);
+    // The wisdom of the multithreaded plans is only read after this.
+    setup_threads();
+    int ok = FFTW(import_wisdom_from_filename)(path);
+    pthread_mutex_unlock(&cc_mutex);
+
+    return ok ? 0 : -1;
+}
+
+// Saving the FFTW wisdom accumulated so far into a file.
+//
+// Returns -1 in case of error, or zero otherwise.
+int fft_wisdom_save(const char *path) {
+    DEBUG_ASSERT(path);
+
+    pthread_mutex_lock(&cc_mutex);
+    int ok = FFTW(export_wisdom_to_filename)(path);
+    pthread_mutex_unlock(&cc_mutex);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,683 @@
+// Landmark fingerprint engine.
+//
+// The cross-correlation can only find lags within the downloaded source,
+// and it needs many seconds of audio to be confident. This engine follows a
+// different approach: the spectrogram of a track is reduced to its most
+// prominent peaks (a "constellation"), which survive noise and equalization
+// well. Each peak is paired with a few of the ones that follow it, and each
+// pair is hashed with both frequencies and the time between them. The
+// hashes are saved in an inverted index, sorted by hash, along with the
+// track and the time of the first peak.
+//
+// To match a sample, its own hashes are looked up in the index, and each hit
+// votes for the offset between the time in the track and the time in the
+// sample. Only the right track and offset accumulate many votes, so a few
+// seconds are enough, and the offset may be anywhere in the track.
+//
+// The index is saved on disk as its header, the titles of the tracks and
+// the entries, so that it can be mapped into memory and searched directly
+// after loading it.
+
+#define _XOPEN_SOURCE 700  // strdup() and M_PI
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/fingerprint.h>
+
+// The spectrogram is calculated with Hann windows of FRAME_LEN frames every
+// HOP frames (85 ms and 10.7 ms at 48 kHz), which is also the resolution of
+// the offsets before refining them.
+#define FRAME_LEN 4096
+#define HOP 512
+// The peaks are searched in bands of one octave each, up to 6 kHz at 48 kHz
+// (so that the bins fit in 9 bits). Each band has at most one peak per
+// frame, which must be the highest one in PEAK_RADIUS frames around it, and
+// louder than MIN_POWER.
+#define N_BANDS 7
+static const size_t BAND_EDGES[N_BANDS + 1] = {
+    4, 8, 16, 32, 64, 128, 256, 512
+};
+#define PEAK_RADIUS 6
+#define MIN_POWER 1e-6
+// Each peak is paired with up to FAN_OUT of the ones in the next
+// TARGET_FRAMES frames. The hash is then made of the bins of both peaks (9
+// bits each) and the frames between them (6 bits).
+#define FAN_OUT 10
+#define TARGET_FRAMES 64
+// Hashes found more than MAX_HITS times in the index are ignored, since
+// they say little about the track. A match needs at least MIN_VOTES votes.
+#define MAX_HITS 1000
+#define MIN_VOTES 8
+// The offsets are stored with this bias in the votes, so that the negative
+// ones can be sorted as unsigned integers.
+#define OFFSET_BIAS (1LL << 31)
+
+#define INDEX_MAGIC "ASFP"
+#define INDEX_VERSION 1
+#define MAX_INDEX_PATH 4096
+
+// The number of temporary files created so far, so that each one has its
+// own name, even if several threads save the same index at once.
+static unsigned long tmp_count = 0;
+
+
+// An entry of the inverted index, sorted by hash, track and time.
+struct fp_entry {
+    uint32_t hash;
+    uint32_t track;
+    uint32_t time;
+};
+
+// A hash found in a signal, and the frame of its first peak.
+struct fp_hash {
+    uint32_t hash;
+    uint32_t time;
+};
+
+struct fp_peak {
+    uint32_t time;
+    uint32_t bin;
+};
+
+struct fp_index {
+    char **titles;
+    size_t n_tracks;
+    struct fp_entry *entries;
+    size_t n_entries;
+    // If the index was loaded from disk, the entries point to the mapped
+    // file, and they're copied before adding any tracks.
+    void *map;
+    size_t map_len;
+};
+
+// The header at the start of a saved index, followed by the length and the
+// characters of each title, padding up to a multiple of 4 bytes, and the
+// entries.
+struct fp_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t frame_len;
+    uint32_t hop;
+    uint32_t n_tracks;
+    uint64_t n_entries;
+};
+
+
+static int compare_entries(const void *a, const void *b) {
+    const struct fp_entry *ea = a;
+    const struct fp_entry *eb = b;
+    if (ea->hash != eb->hash) return ea->hash < eb->hash ? -1 : 1;
+    if (ea->track != eb->track) return ea->track < eb->track ? -1 : 1;
+    if (ea->time != eb->time) return ea->time < eb->time ? -1 : 1;
+    return 0;
+}
+
+static int compare_votes(const void *a, const void *b) {
+    const uint64_t va = *(const uint64_t *) a;
+    const uint64_t vb = *(const uint64_t *) b;
+    return va < vb ? -1 : va > vb;
+}
+
+// Calculates the hashes of the first `len` frames of a signal, which are
+// saved into a new array in `hashes`, ordered by time.
+//
+// Returns -1 in case of error, or zero otherwise.
+static int fingerprint(const sample_t *signal, size_t len,
+                       struct fp_hash **hashes, size_t *n_hashes) {
+    int ret = -1;
+    sample_t *frame = NULL;
+    sample_cpx_t *spectrum = NULL;
+    double *window = NULL;
+    double *power = NULL;
+    uint32_t *bins = NULL;
+    struct fp_peak *peaks = NULL;
+    struct plan_ref p = { .plan = NULL, .cached = 1 };
+
+    *hashes = NULL;
+    *n_hashes = 0;
+    const size_t n_frames = len >= FRAME_LEN ? (len - FRAME_LEN) / HOP + 1
+                                             : 0;
+    if (n_frames == 0) {
+        return 0;
+    }
+
+    frame = FFTW(alloc_real)(FRAME_LEN);
+    spectrum = FFTW(alloc_complex)(FRAME_LEN / 2 + 1);
+    window = malloc(FRAME_LEN * sizeof(*window));
+    power = malloc(n_frames * N_BANDS * sizeof(*power));
+    bins = malloc(n_frames * N_BANDS * sizeof(*bins));
+    peaks = malloc(n_frames * N_BANDS * sizeof(*peaks));
+    *hashes = malloc(n_frames * N_BANDS * FAN_OUT * sizeof(**hashes));
+    if (frame == NULL || spectrum == NULL || window == NULL || power == NULL
+            || bins == NULL || peaks == NULL || *hashes == NULL) {
+        perror("audiosync: fingerprint buffers alloc failed");
+        goto finish;
+    }
+    p = get_plan(R2C_PLAN, FRAME_LEN, frame, spectrum);
+    if (p.plan == NULL) {
+        LOG("couldn't create r2c plan of length %d", FRAME_LEN);
+        goto finish;
+    }
+
+    // The highest bin of each band in every frame.
+    for (size_t i = 0; i < FRAME_LEN; i++) {
+        window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / FRAME_LEN);
+    }
+    for (size_t t = 0; t < n_frames; t++) {
+        const sample_t *start = signal + t * HOP;
+        for (size_t i = 0; i < FRAME_LEN; i++) {
+            frame[i] = start[i] * window[i];
+        }
+        FFTW(execute_dft_r2c)(p.plan, frame, spectrum);
+
+        for (size_t band = 0; band < N_BANDS; band++) {
+            double best = -1.0;
+            uint32_t best_bin = 0;
+            for (size_t b = BAND_EDGES[band]; b < BAND_EDGES[band + 1]; b++) {
+                const double re = creal(spectrum[b]);
+                const double im = cimag(spectrum[b]);
+                const double pw = re * re + im * im;
+                if (pw > best) {
+                    best = pw;
+                    best_bin = b;
+                }
+            }
+            power[t * N_BANDS + band] = best;
+            bins[t * N_BANDS + band] = best_bin;
+        }
+    }
+
+    // The peaks are the band maxima that are also the highest ones in the
+    // same band in the frames around them. In case of ties, the first one
+    // is used.
+    size_t n_peaks = 0;
+    for (size_t t = 0; t < n_frames; t++) {
+        for (size_t band = 0; band < N_BANDS; band++) {
+            const double pw = power[t * N_BANDS + band];
+            if (pw < MIN_POWER) continue;
+
+            int is_peak = 1;
+            const size_t first = t > PEAK_RADIUS ? t - PEAK_RADIUS : 0;
+            for (size_t u = first; u <= t + PEAK_RADIUS && u < n_frames;
+                 u++) {
+                const double other = power[u * N_BANDS + band];
+                if (other > pw || (other == pw && u < t)) {
+                    is_peak = 0;
+                    break;
+                }
+            }
+            if (is_peak) {
+                peaks[n_peaks++] = (struct fp_peak) {
+                    .time = t,
+                    .bin = bins[t * N_BANDS + band],
+                };
+            }
+        }
+    }
+
+    // Pairing each peak with the next ones in its target zone.
+    for (size_t i = 0; i < n_peaks; i++) {
+        size_t fan = 0;
+        for (size_t j = i + 1; j < n_peaks && fan < FAN_OUT; j++) {
+            const uint32_t dt = peaks[j].time - peaks[i].time;
+            if (dt >= TARGET_FRAMES) break;
+            if (dt == 0) continue;
+
+            (*hashes)[(*n_hashes)++] = (struct fp_hash) {
+                .hash = (peaks[i].bin << 15) | (peaks[j].bin << 6) | dt,
+                .time = peaks[i].time,
+            };
+            fan++;
+        }
+    }
+
+    ret = 0;
+
+finish:
+    release_plan(p);
+    if (frame) FFTW(free)(frame);
+    if (spectrum) FFTW(free)(spectrum);
+    free(window);
+    free(power);
+    free(bins);
+    free(peaks);
+    if (ret < 0) {
+        free(*hashes);
+        *hashes = NULL;
+    }
+
+    return ret;
+}
+
+// Returns the first entry with the provided hash, or `n_entries` if there
+// are none.
+static size_t lower_bound(const struct fp_index *index, uint32_t hash) {
+    size_t lo = 0;
+    size_t hi = index->n_entries;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Copies the entries of an index loaded from disk, so that more tracks can
+// be added. Returns -1 in case of error, or zero otherwise.
+static int own_entries(struct fp_index *index) {
+    if (index->map == NULL) return 0;
+
+    // One more byte is allocated so that an empty index isn't mistaken for
+    // an error.
+    struct fp_entry *entries = malloc(index->n_entries * sizeof(*entries)
+                                      + 1);
+    if (entries == NULL) {
+        perror("audiosync: fingerprint entries malloc failed");
+        return -1;
+    }
+    memcpy(entries, index->entries, index->n_entries * sizeof(*entries));
+    munmap(index->map, index->map_len);
+    index->map = NULL;
+    index->entries = entries;
+
+    return 0;
+}
+
+struct fp_index *fp_index_new() {
+    struct fp_index *index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        perror("audiosync: fp_index calloc failed");
+    }
+
+    return index;
+}
+
+void fp_index_free(struct fp_index *index) {
+    if (index == NULL) return;
+
+    for (size_t i = 0; i < index->n_tracks; i++) {
+        free(index->titles[i]);
+    }
+    free(index->titles);
+    if (index->map) {
+        munmap(index->map, index->map_len);
+    } else {
+        free(index->entries);
+    }
+    free(index);
+}
+
+size_t fp_index_len(const struct fp_index *index) {
+    DEBUG_ASSERT(index);
+
+    return index->n_tracks;
+}
+
+const char *fp_index_title(const struct fp_index *index, size_t track) {
+    DEBUG_ASSERT(index); DEBUG_ASSERT(track < index->n_tracks);
+
+    return index->titles[track];
+}
+
+int fp_index_add(struct fp_index *index, const char *title,
+                 const sample_t *track, size_t len) {
+    DEBUG_ASSERT(index); DEBUG_ASSERT(title); DEBUG_ASSERT(track);
+
+    int ret = -1;
+    struct fp_hash *hashes = NULL;
+    struct fp_entry *added = NULL;
+    size_t n_hashes;
+
+    if (own_entries(index) < 0 || fingerprint(track, len, &hashes,
+                                              &n_hashes) < 0) {
+        goto finish;
+    }
+
+    char **titles = realloc(index->titles,
+                            (index->n_tracks + 1) * sizeof(*titles));
+    if (titles == NULL) {
+        perror("audiosync: fingerprint titles realloc failed");
+        goto finish;
+    }
+    index->titles = titles;
+    titles[index->n_tracks] = strdup(title);
+    if (titles[index->n_tracks] == NULL) {
+        perror("audiosync: fingerprint title strdup failed");
+        goto finish;
+    }
+
+    // The new entries are sorted and then merged with the existing ones
+    // from the end, so that the index stays sorted without sorting it all
+    // again.
+    added = malloc(n_hashes * sizeof(*added) + 1);
+    struct fp_entry *entries = realloc(
+        index->entries, (index->n_entries + n_hashes) * sizeof(*entries) + 1);
+    if (added == NULL || entries == NULL) {
+        perror("audiosync: fingerprint entries alloc failed");
+        if (entries != NULL) index->entries = entries;
+        free(titles[index->n_tracks]);
+        goto finish;
+    }
+    index->entries = entries;
+    for (size_t i = 0; i < n_hashes; i++) {
+        added[i] = (struct fp_entry) {
+            .hash = hashes[i].hash,
+            .track = index->n_tracks,
+            .time = hashes[i].time,
+        };
+    }
+    qsort(added, n_hashes, sizeof(*added), compare_entries);
+
+    size_t i = index->n_entries;
+    size_t j = n_hashes;
+    size_t k = index->n_entries + n_hashes;
+    while (j > 0) {
+        if (i > 0 && compare_entries(&entries[i - 1], &added[j - 1]) > 0) {
+            entries[--k] = entries[--i];
+        } else {
+            entries[--k] = added[--j];
+        }
+    }
+    index->n_entries += n_hashes;
+    index->n_tracks++;
+    LOG("indexed '%s' with %ld hashes", title, n_hashes);
+    ret = 0;
+
+finish:
+    free(hashes);
+    free(added);
+
+    return ret;
+}
+
+int fp_index_save(const struct fp_index *index, const char *path) {
+    DEBUG_ASSERT(index); DEBUG_ASSERT(path);
+
+    // The index is written into a temporary file first, and then renamed,
+    // since `path` may be the file this index was loaded from.
+    char tmp_path[MAX_INDEX_PATH];
+    int n = snprintf(tmp_path, MAX_INDEX_PATH, "%s.%ld.%lu", path,
+                     (long) getpid(),
+                     __atomic_fetch_add(&tmp_count, 1, __ATOMIC_RELAXED));
+    if (n < 0 || n >= MAX_INDEX_PATH) {
+        LOG("index path is too long");
+        return -1;
+    }
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        perror("audiosync: fopen for the fingerprint index failed");
+        return -1;
+    }
+
+    const struct fp_header header = {
+        .magic = { 'A', 'S', 'F', 'P' },
+        .version = INDEX_VERSION,
+        .sample_rate = SAMPLE_RATE,
+        .frame_len = FRAME_LEN,
+        .hop = HOP,
+        .n_tracks = index->n_tracks,
+        .n_entries = index->n_entries,
+    };
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+    size_t offset = sizeof(header);
+    for (size_t i = 0; i < index->n_tracks && !failed; i++) {
+        const uint32_t title_len = strlen(index->titles[i]);
+        failed = fwrite(&title_len, sizeof(title_len), 1, fp) != 1
+                 || fwrite(index->titles[i], 1, title_len, fp) != title_len;
+        offset += sizeof(title_len) + title_len;
+    }
+    const char padding[4] = { 0 };
+    const size_t padding_len = (4 - offset % 4) % 4;
+    failed = failed || fwrite(padding, 1, padding_len, fp) != padding_len
+             || fwrite(index->entries, sizeof(*index->entries),
+                       index->n_entries, fp) != index->n_entries;
+
+    // fclose may also fail when flushing the last entries.
+    failed = fclose(fp) != 0 || failed;
+    if (failed) {
+        perror("audiosync: fwrite for the fingerprint index failed");
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("audiosync: rename for the fingerprint index failed");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct fp_index *fp_index_load(const char *path) {
+    DEBUG_ASSERT(path);
+
+    struct fp_index *index = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("audiosync: open for the fingerprint index failed");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("audiosync: fstat for the fingerprint index failed");
+        goto error;
+    }
+    if ((size_t) st.st_size < sizeof(struct fp_header)) {
+        LOG("'%s' isn't a fingerprint index", path);
+        goto error;
+    }
+
+    index = fp_index_new();
+    if (index == NULL) goto error;
+    index->map_len = st.st_size;
+    index->map = mmap(NULL, index->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (index->map == MAP_FAILED) {
+        perror("audiosync: mmap for the fingerprint index failed");
+        index->map = NULL;
+        goto error;
+    }
+
+    // The index must have been created with the same parameters.
+    const char *data = index->map;
+    const struct fp_header *header = index->map;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != INDEX_VERSION
+            || header->sample_rate != SAMPLE_RATE
+            || header->frame_len != FRAME_LEN || header->hop != HOP) {
+        LOG("'%s' isn't a compatible fingerprint index", path);
+        goto error;
+    }
+
+    index->titles = calloc(header->n_tracks + 1, sizeof(*index->titles));
+    if (index->titles == NULL) {
+        perror("audiosync: fingerprint titles calloc failed");
+        goto error;
+    }
+    size_t offset = sizeof(*header);
+    for (size_t i = 0; i < header->n_tracks; i++) {
+        uint32_t title_len;
+        if (offset + sizeof(title_len) > index->map_len) goto truncated;
+        memcpy(&title_len, data + offset, sizeof(title_len));
+        offset += sizeof(title_len);
+        if (offset + title_len > index->map_len) goto truncated;
+
+        index->titles[i] = malloc(title_len + 1);
+        if (index->titles[i] == NULL) {
+            perror("audiosync: fingerprint title malloc failed");
+            goto error;
+        }
+        memcpy(index->titles[i], data + offset, title_len);
+        index->titles[i][title_len] = '\0';
+        index->n_tracks++;
+        offset += title_len;
+    }
+    offset += (4 - offset % 4) % 4;
+    if (offset + header->n_entries * sizeof(struct fp_entry)
+            != index->map_len) {
+        goto truncated;
+    }
+    index->entries = (struct fp_entry *) (data + offset);
+    index->n_entries = header->n_entries;
+
+    close(fd);
+    LOG("loaded fingerprint index with %ld tracks", index->n_tracks);
+    return index;
+
+truncated:
+    LOG("fingerprint index '%s' is truncated", path);
+error:
+    fp_index_free(index);
+    close(fd);
+    return NULL;
+}
+
+int fp_index_match(const struct fp_index *index, const char *title,
+                   const sample_t *sample, size_t len,
+                   struct fp_match *match) {
+    DEBUG_ASSERT(index); DEBUG_ASSERT(sample); DEBUG_ASSERT(match);
+
+    int ret = -1;
+    struct fp_hash *hashes = NULL;
+    uint64_t *votes = NULL;
+    size_t *counts = NULL;
+    unsigned char *allowed = NULL;
+    size_t n_hashes;
+    size_t n_votes = 0;
+
+    // The tracks that can vote, if only the ones with a title are searched.
+    if (title != NULL) {
+        allowed = calloc(index->n_tracks + 1, sizeof(*allowed));
+        if (allowed == NULL) {
+            perror("audiosync: fingerprint tracks calloc failed");
+            goto finish;
+        }
+        size_t n_allowed = 0;
+        for (size_t t = 0; t < index->n_tracks; t++) {
+            if (strcmp(index->titles[t], title) == 0) {
+                allowed[t] = 1;
+                n_allowed++;
+            }
+        }
+        if (n_allowed == 0) {
+            LOG("'%s' isn't in the fingerprint index", title);
+            goto finish;
+        }
+    }
+
+    if (fingerprint(sample, len, &hashes, &n_hashes) < 0) {
+        goto finish;
+    }
+
+    // Each hit votes for a track and an offset, packed in a single integer
+    // so that the votes can be counted by sorting them.
+    size_t capacity = 0;
+    for (size_t i = 0; i < n_hashes; i++) {
+        const size_t first = lower_bound(index, hashes[i].hash);
+        size_t last = first;
+        while (last < index->n_entries
+               && index->entries[last].hash == hashes[i].hash
+               && last - first <= MAX_HITS) {
+            last++;
+        }
+        if (last - first > MAX_HITS) continue;
+
+        if (n_votes + (last - first) > capacity) {
+            capacity = 2 * (n_votes + (last - first));
+            uint64_t *tmp = realloc(votes, capacity * sizeof(*votes));
+            if (tmp == NULL) {
+                perror("audiosync: fingerprint votes realloc failed");
+                goto finish;
+            }
+            votes = tmp;
+        }
+        for (size_t e = first; e < last; e++) {
+            const struct fp_entry *entry = &index->entries[e];
+            if (allowed != NULL && !allowed[entry->track]) continue;
+
+            const long long offset = (long long) entry->time
+                                     - hashes[i].time + OFFSET_BIAS;
+            votes[n_votes++] = ((uint64_t) entry->track << 32)
+                               | (uint32_t) offset;
+        }
+    }
+    if (n_votes == 0) {
+        LOG("no fingerprints matched");
+        goto finish;
+    }
+
+    // Counting the votes of each track and offset, which are left at the
+    // start of the array.
+    qsort(votes, n_votes, sizeof(*votes), compare_votes);
+    counts = malloc(n_votes * sizeof(*counts));
+    if (counts == NULL) {
+        perror("audiosync: fingerprint counts malloc failed");
+        goto finish;
+    }
+    size_t n_unique = 0;
+    size_t best = 0;
+    for (size_t i = 0; i < n_votes; i++) {
+        if (n_unique > 0 && votes[n_unique - 1] == votes[i]) {
+            counts[n_unique - 1]++;
+        } else {
+            votes[n_unique] = votes[i];
+            counts[n_unique++] = 1;
+        }
+        if (counts[n_unique - 1] > counts[best]) {
+            best = n_unique - 1;
+        }
+    }
+
+    // The sample rarely starts at a multiple of the hop, so the votes of
+    // the offset are spread between it and its neighbors. These are merged
+    // into a weighted average, and the second best offset is searched
+    // outside of them.
+    const uint64_t track = votes[best] >> 32;
+    const long long best_offset = (long long) (votes[best] & 0xffffffff)
+                                  - OFFSET_BIAS;
+    size_t n_match = 0;
+    size_t second = 0;
+    double weighted = 0.0;
+    for (size_t i = 0; i < n_unique; i++) {
+        const long long offset = (long long) (votes[i] & 0xffffffff)
+                                 - OFFSET_BIAS;
+        if ((votes[i] >> 32) == track && llabs(offset - best_offset) <= 1) {
+            n_match += counts[i];
+            weighted += (double) offset * counts[i];
+        } else if (counts[i] > second) {
+            second = counts[i];
+        }
+    }
+
+    match->track = track;
+    match->offset = lround(weighted / n_match * HOP);
+    match->votes = n_match;
+    // Repeated notes and sections give the wrong offsets a few votes too, so
+    // the ratio is squared: MIN_CONFIDENCE then means about 4.5 times as
+    // many votes as the second best offset.
+    const double ratio = (double) second / counts[best];
+    match->confidence = counts[best] < MIN_VOTES ? 0.0 : 1.0 - ratio * ratio;
+    LOG("fingerprint matched '%s' at %ld with %ld votes (second: %ld)",
+        index->titles[track], match->offset, n_match, second);
+    ret = 0;
+
+finish:
+    free(hashes);
+    free(votes);
+    free(counts);
+    free(allowed);
+
+    return ret;
+}
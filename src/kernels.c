@@ -0,0 +1,769 @@
+// Low-level kernels for the hot loops outside of the Fourier Transforms.
+//
+// They have generic implementations, and specialized ones for AVX2 and
+// AVX-512 which are compiled with the `target` attribute, so that the module
+// can be built without any special flags. The best implementation supported
+// by the CPU is chosen at runtime.
+//
+// The Pearson Correlation Coefficient is calculated in a single pass, which
+// matters because it's memory bound. The data is processed in blocks small
+// enough to stay in the cache: the raw sums of each block are calculated with
+// SIMD, converted into its means and centered sums, and then merged with the
+// rest using Chan's formulas:
+// https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Parallel_algorithm
+// That way, the precision is similar to the two-pass formula's, and the big
+// spans can be split between the workers of the pool easily.
+//
+// The spectral products and the search of the cross-correlation's peak are
+// also here, since they're done for every interval and they're memory bound
+// as well.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/kernels.h>
+#include <audiosync/thread_pool.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define KERNELS_X86
+# include <immintrin.h>
+#endif
+
+// The length of the blocks whose raw sums are calculated at once.
+#define STATS_BLOCK_LEN 2048
+// Spans shorter than this aren't split between the workers of the pool, since
+// it's not worth the cost of synchronizing them.
+#define PARALLEL_MIN_LEN (1 << 18)
+#define MAX_CHUNKS 8
+
+
+// The instruction set supported by the CPU, detected only once, and the one
+// currently used, which may be limited with kernels_set_isa.
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+static isa_t supported_isa = GENERIC_ISA;
+static isa_t current_isa = GENERIC_ISA;
+static pthread_mutex_t isa_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The raw sums of a block of both signals.
+struct block_sums {
+    double x, y, xx, yy, xy;
+};
+
+// The statistics of a span of both signals, which can be merged with others:
+// its length, means, sums of the squared differences from the mean, and the
+// sum of the products of the differences.
+struct pair_stats {
+    double n;
+    double mean_x, mean_y;
+    double m2_x, m2_y;
+    double cov;
+};
+
+typedef void (*block_sums_fn)(const sample_t *x, const sample_t *y,
+                              size_t len, struct block_sums *s);
+
+
+static void detect_isa() {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        supported_isa = AVX512_ISA;
+    } else if (__builtin_cpu_supports("avx2")
+               && __builtin_cpu_supports("fma")) {
+        supported_isa = AVX2_ISA;
+    }
+#endif
+    current_isa = supported_isa;
+}
+
+// Converting an instruction set enum value to a string.
+char *isa_to_string(isa_t isa) {
+    switch (isa) {
+    case GENERIC_ISA:
+        return "generic";
+    case AVX2_ISA:
+        return "avx2";
+    case AVX512_ISA:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
+
+// Returns the instruction set currently used by the kernels.
+isa_t kernels_get_isa() {
+    pthread_once(&isa_once, detect_isa);
+
+    isa_t ret;
+    pthread_mutex_lock(&isa_mutex);
+    ret = current_isa;
+    pthread_mutex_unlock(&isa_mutex);
+
+    return ret;
+}
+
+// Limits the kernels to an instruction set, mostly useful for testing and
+// benchmarking. Returns -1 if the CPU doesn't support it, or zero otherwise.
+int kernels_set_isa(isa_t isa) {
+    pthread_once(&isa_once, detect_isa);
+
+    if (isa > supported_isa) {
+        LOG("the %s instruction set isn't supported", isa_to_string(isa));
+        return -1;
+    }
+
+    pthread_mutex_lock(&isa_mutex);
+    current_isa = isa;
+    pthread_mutex_unlock(&isa_mutex);
+
+    return 0;
+}
+
+static void block_sums_generic(const sample_t *x, const sample_t *y,
+                               size_t len, struct block_sums *s) {
+    double sx = 0.0, sy = 0.0, sxx = 0.0, syy = 0.0, sxy = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        const double vx = x[i];
+        const double vy = y[i];
+        sx += vx;
+        sy += vy;
+        sxx += vx * vx;
+        syy += vy * vy;
+        sxy += vx * vy;
+    }
+
+    s->x = sx; s->y = sy; s->xx = sxx; s->yy = syy; s->xy = sxy;
+}
+
+#ifdef KERNELS_X86
+// Loading the samples into vectors of doubles, converting them first if
+// they're single precision.
+# ifdef SINGLE_PRECISION
+#  define LOAD4_PD(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#  define LOAD8_PD(p) _mm512_cvtps_pd(_mm256_loadu_ps(p))
+# else
+#  define LOAD4_PD(p) _mm256_loadu_pd(p)
+#  define LOAD8_PD(p) _mm512_loadu_pd(p)
+# endif
+
+__attribute__((target("avx2,fma")))
+static double hsum_avx2(__m256d v) {
+    const __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v),
+                                   _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+__attribute__((target("avx2,fma")))
+static void block_sums_avx2(const sample_t *x, const sample_t *y,
+                            size_t len, struct block_sums *s) {
+    __m256d sx = _mm256_setzero_pd();
+    __m256d sy = _mm256_setzero_pd();
+    __m256d sxx = _mm256_setzero_pd();
+    __m256d syy = _mm256_setzero_pd();
+    __m256d sxy = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        const __m256d vx = LOAD4_PD(x + i);
+        const __m256d vy = LOAD4_PD(y + i);
+        sx = _mm256_add_pd(sx, vx);
+        sy = _mm256_add_pd(sy, vy);
+        sxx = _mm256_fmadd_pd(vx, vx, sxx);
+        syy = _mm256_fmadd_pd(vy, vy, syy);
+        sxy = _mm256_fmadd_pd(vx, vy, sxy);
+    }
+
+    // The remaining elements are added with the generic version.
+    block_sums_generic(x + i, y + i, len - i, s);
+    s->x += hsum_avx2(sx);
+    s->y += hsum_avx2(sy);
+    s->xx += hsum_avx2(sxx);
+    s->yy += hsum_avx2(syy);
+    s->xy += hsum_avx2(sxy);
+}
+
+__attribute__((target("avx512f")))
+static void block_sums_avx512(const sample_t *x, const sample_t *y,
+                              size_t len, struct block_sums *s) {
+    __m512d sx = _mm512_setzero_pd();
+    __m512d sy = _mm512_setzero_pd();
+    __m512d sxx = _mm512_setzero_pd();
+    __m512d syy = _mm512_setzero_pd();
+    __m512d sxy = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        const __m512d vx = LOAD8_PD(x + i);
+        const __m512d vy = LOAD8_PD(y + i);
+        sx = _mm512_add_pd(sx, vx);
+        sy = _mm512_add_pd(sy, vy);
+        sxx = _mm512_fmadd_pd(vx, vx, sxx);
+        syy = _mm512_fmadd_pd(vy, vy, syy);
+        sxy = _mm512_fmadd_pd(vx, vy, sxy);
+    }
+
+    block_sums_generic(x + i, y + i, len - i, s);
+    s->x += _mm512_reduce_add_pd(sx);
+    s->y += _mm512_reduce_add_pd(sy);
+    s->xx += _mm512_reduce_add_pd(sxx);
+    s->yy += _mm512_reduce_add_pd(syy);
+    s->xy += _mm512_reduce_add_pd(sxy);
+}
+#endif
+
+// Returns the block sums implementation for the current instruction set.
+static block_sums_fn get_block_sums() {
+#ifdef KERNELS_X86
+    switch (kernels_get_isa()) {
+    case AVX512_ISA:
+        return block_sums_avx512;
+    case AVX2_ISA:
+        return block_sums_avx2;
+    default:
+        break;
+    }
+#endif
+    return block_sums_generic;
+}
+
+// Merges the statistics of `b` into `a`, using Chan's formulas.
+static void merge_stats(struct pair_stats *a, const struct pair_stats *b) {
+    if (b->n == 0) return;
+    if (a->n == 0) {
+        *a = *b;
+        return;
+    }
+
+    const double n = a->n + b->n;
+    const double dx = b->mean_x - a->mean_x;
+    const double dy = b->mean_y - a->mean_y;
+    const double f = a->n * b->n / n;
+    a->m2_x += b->m2_x + dx * dx * f;
+    a->m2_y += b->m2_y + dy * dy * f;
+    a->cov += b->cov + dx * dy * f;
+    a->mean_x += dx * b->n / n;
+    a->mean_y += dy * b->n / n;
+    a->n = n;
+}
+
+// Calculates the statistics of a span block by block.
+static void span_stats(block_sums_fn block_sums, const sample_t *x,
+                       const sample_t *y, size_t len,
+                       struct pair_stats *stats) {
+    *stats = (struct pair_stats) { 0 };
+    for (size_t start = 0; start < len; start += STATS_BLOCK_LEN) {
+        const size_t n = len - start < STATS_BLOCK_LEN
+            ? len - start : STATS_BLOCK_LEN;
+        struct block_sums s;
+        block_sums(x + start, y + start, n, &s);
+
+        // Converting the raw sums into centered ones. Inside a block, the
+        // cancellation is small enough, although it may make the squares
+        // slightly negative.
+        struct pair_stats block = {
+            .n = n,
+            .mean_x = s.x / n,
+            .mean_y = s.y / n,
+        };
+        block.m2_x = fmax(s.xx - s.x * block.mean_x, 0.0);
+        block.m2_y = fmax(s.yy - s.y * block.mean_y, 0.0);
+        block.cov = s.xy - s.x * block.mean_y;
+        merge_stats(stats, &block);
+    }
+}
+
+// Returns the number of chunks a span of `len` elements is split into, one
+// per core.
+static size_t num_chunks(size_t len) {
+    if (len < 2 * PARALLEL_MIN_LEN) return 1;
+
+    const size_t cores = thread_pool_size();
+    size_t n = len / PARALLEL_MIN_LEN;
+    if (n > cores) n = cores;
+    if (n > MAX_CHUNKS) n = MAX_CHUNKS;
+
+    return n;
+}
+
+// Function called for each chunk of a span, which saves its result in `ctx`
+// at the chunk's index.
+typedef void (*chunk_fn)(void *ctx, size_t index, size_t start, size_t end);
+
+// Data structure used to pass parameters to the tasks running a chunk.
+struct chunk_data {
+    chunk_fn fn;
+    void *ctx;
+    size_t index;
+    size_t start;
+    size_t end;
+};
+
+static void *chunk_task(void *arg) {
+    struct chunk_data *data = arg;
+    data->fn(data->ctx, data->index, data->start, data->end);
+
+    return NULL;
+}
+
+// Splits a span of `len` elements into chunks, whose length is a multiple of
+// `align`, and runs `fn` for each of them in the pool. The first chunk is
+// run in the current thread. Returns the number of chunks, which is at most
+// MAX_CHUNKS.
+static size_t run_chunks(chunk_fn fn, void *ctx, size_t len, size_t align) {
+    const size_t n_chunks = num_chunks(len);
+    size_t chunk = (len + n_chunks - 1) / n_chunks;
+    chunk = (chunk + align - 1) / align * align;
+
+    struct chunk_data data[MAX_CHUNKS];
+    struct task_group group = TASK_GROUP_INIT;
+    for (size_t t = 0; t < n_chunks; t++) {
+        const size_t start = t * chunk < len ? t * chunk : len;
+        const size_t end = start + chunk < len ? start + chunk : len;
+        data[t] = (struct chunk_data) {
+            .fn = fn,
+            .ctx = ctx,
+            .index = t,
+            .start = start,
+            .end = end,
+        };
+        if (t > 0) {
+            thread_pool_submit(&group, &chunk_task, (void *) &data[t]);
+        }
+    }
+
+    chunk_task(&data[0]);
+    thread_pool_wait(&group);
+
+    return n_chunks;
+}
+
+// The shared parameters and the results of each chunk of kernel_pearson.
+struct pearson_ctx {
+    block_sums_fn block_sums;
+    const sample_t *x;
+    const sample_t *y;
+    struct pair_stats stats[MAX_CHUNKS];
+};
+
+static void pearson_chunk(void *ctx, size_t index, size_t start, size_t end) {
+    struct pearson_ctx *c = ctx;
+    span_stats(c->block_sums, c->x + start, c->y + start, end - start,
+               &c->stats[index]);
+}
+
+// Calculates the Pearson Correlation Coefficient between the first `len`
+// elements of `x` and `y` in a single pass. The sums are done in blocks with
+// double precision and merged with Chan's formulas, and big spans are split
+// between threads.
+//
+// The result is NaN if either signal is constant.
+double kernel_pearson(const sample_t *x, const sample_t *y, size_t len) {
+    DEBUG_ASSERT(x); DEBUG_ASSERT(y);
+
+    // The chunks are a multiple of the block length, so that the blocks are
+    // the same as in a single thread.
+    struct pearson_ctx ctx = {
+        .block_sums = get_block_sums(),
+        .x = x,
+        .y = y,
+    };
+    const size_t n_chunks = run_chunks(pearson_chunk, &ctx, len,
+                                       STATS_BLOCK_LEN);
+    struct pair_stats stats = ctx.stats[0];
+    for (size_t t = 1; t < n_chunks; t++) {
+        merge_stats(&stats, &ctx.stats[t]);
+    }
+
+    return stats.cov / sqrt(stats.m2_x * stats.m2_y);
+}
+
+// The product of each element of `a` by the conjugate of the one in `b`.
+//
+// These are written explicitly instead of using the C99 complex operators,
+// because without -ffast-math (or -fcx-limited-range) every product goes
+// through __muldc3 to handle the NaN and infinity cases, which the spectra
+// never contain.
+static void conj_multiply_generic(sample_cpx_t *a, const sample_cpx_t *b,
+                                  size_t len) {
+    sample_t *x = (sample_t *) a;
+    const sample_t *y = (const sample_t *) b;
+    for (size_t i = 0; i < 2 * len; i += 2) {
+        const sample_t re = x[i] * y[i] + x[i + 1] * y[i + 1];
+        const sample_t im = x[i + 1] * y[i] - x[i] * y[i + 1];
+        x[i] = re;
+        x[i + 1] = im;
+    }
+}
+
+static void conj_multiply_add_generic(sample_cpx_t *acc,
+                                      const sample_cpx_t *a,
+                                      const sample_cpx_t *b, size_t len) {
+    sample_t *z = (sample_t *) acc;
+    const sample_t *x = (const sample_t *) a;
+    const sample_t *y = (const sample_t *) b;
+    for (size_t i = 0; i < 2 * len; i += 2) {
+        z[i] += x[i] * y[i] + x[i + 1] * y[i + 1];
+        z[i + 1] += x[i + 1] * y[i] - x[i] * y[i + 1];
+    }
+}
+
+// Returns the index of the first absolute maximum between `start` and `end`,
+// and saves the maximum into `max`. Only values strictly greater replace the
+// current maximum, so the first one is kept in case of ties, and NaNs are
+// ignored.
+static size_t max_abs_generic(const sample_t *arr, size_t start, size_t end,
+                              sample_t *max) {
+    sample_t max_val = -1;
+    size_t max_ind = start;
+    for (size_t i = start; i < end; i++) {
+        const sample_t abs_val = fabs(arr[i]);
+        if (abs_val > max_val) {
+            max_val = abs_val;
+            max_ind = i;
+        }
+    }
+
+    *max = max_val;
+    return max_ind;
+}
+
+#ifdef KERNELS_X86
+// The interleaved complex numbers are handled with the same operations in
+// both precisions, only with a different number of lanes. For each pair of
+// lanes (re, im) the product by the conjugate is:
+//     (a.re * b.re + a.im * b.im, a.im * b.re - a.re * b.im)
+// which is a single fmsubadd of `a` by the real parts of `b`, and of `a` with
+// its lanes swapped by the imaginary parts of `b`.
+//
+// The indices of the absolute maximum are kept in integer lanes of the same
+// width as the samples.
+# ifdef SINGLE_PRECISION
+#  define V256 __m256
+#  define V256_LANES 8
+#  define V256_LOAD _mm256_loadu_ps
+#  define V256_STORE _mm256_storeu_ps
+#  define V256_SET1 _mm256_set1_ps
+#  define V256_ADD _mm256_add_ps
+#  define V256_MUL _mm256_mul_ps
+#  define V256_FMSUBADD _mm256_fmsubadd_ps
+#  define V256_DUP_RE(v) _mm256_moveldup_ps(v)
+#  define V256_DUP_IM(v) _mm256_movehdup_ps(v)
+#  define V256_SWAP(v) _mm256_permute_ps(v, 0xB1)
+#  define V256_ABS(v) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v)
+#  define V256_GT(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#  define V256_BLEND _mm256_blendv_ps
+#  define V256_TO_INT _mm256_castps_si256
+#  define V256_FROM_INT _mm256_castsi256_ps
+#  define V256_IDX_INIT _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0)
+#  define V256_IDX_ADD _mm256_add_epi32
+#  define V256_IDX_SET1(n) _mm256_set1_epi32(n)
+#  define V512 __m512
+#  define V512_LANES 16
+#  define V512_LOAD _mm512_loadu_ps
+#  define V512_STORE _mm512_storeu_ps
+#  define V512_SET1 _mm512_set1_ps
+#  define V512_ADD _mm512_add_ps
+#  define V512_MUL _mm512_mul_ps
+#  define V512_FMSUBADD _mm512_fmsubadd_ps
+#  define V512_DUP_RE(v) _mm512_moveldup_ps(v)
+#  define V512_DUP_IM(v) _mm512_movehdup_ps(v)
+#  define V512_SWAP(v) _mm512_permute_ps(v, 0xB1)
+#  define V512_ABS _mm512_abs_ps
+#  define V512_MASK __mmask16
+#  define V512_GT(a, b) _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ)
+#  define V512_BLEND _mm512_mask_blend_ps
+#  define V512_IDX_BLEND _mm512_mask_blend_epi32
+#  define V512_IDX_INIT _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, \
+                                         7, 6, 5, 4, 3, 2, 1, 0)
+#  define V512_IDX_ADD _mm512_add_epi32
+#  define V512_IDX_SET1(n) _mm512_set1_epi32(n)
+typedef int32_t lane_index_t;
+// Bigger spans are split so that the lane indices don't overflow.
+#  define MAX_LANE_SPAN ((size_t) INT32_MAX)
+# else
+#  define V256 __m256d
+#  define V256_LANES 4
+#  define V256_LOAD _mm256_loadu_pd
+#  define V256_STORE _mm256_storeu_pd
+#  define V256_SET1 _mm256_set1_pd
+#  define V256_ADD _mm256_add_pd
+#  define V256_MUL _mm256_mul_pd
+#  define V256_FMSUBADD _mm256_fmsubadd_pd
+#  define V256_DUP_RE(v) _mm256_movedup_pd(v)
+#  define V256_DUP_IM(v) _mm256_permute_pd(v, 0xF)
+#  define V256_SWAP(v) _mm256_permute_pd(v, 0x5)
+#  define V256_ABS(v) _mm256_andnot_pd(_mm256_set1_pd(-0.0), v)
+#  define V256_GT(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#  define V256_BLEND _mm256_blendv_pd
+#  define V256_TO_INT _mm256_castpd_si256
+#  define V256_FROM_INT _mm256_castsi256_pd
+#  define V256_IDX_INIT _mm256_set_epi64x(3, 2, 1, 0)
+#  define V256_IDX_ADD _mm256_add_epi64
+#  define V256_IDX_SET1(n) _mm256_set1_epi64x(n)
+#  define V512 __m512d
+#  define V512_LANES 8
+#  define V512_LOAD _mm512_loadu_pd
+#  define V512_STORE _mm512_storeu_pd
+#  define V512_SET1 _mm512_set1_pd
+#  define V512_ADD _mm512_add_pd
+#  define V512_MUL _mm512_mul_pd
+#  define V512_FMSUBADD _mm512_fmsubadd_pd
+#  define V512_DUP_RE(v) _mm512_movedup_pd(v)
+#  define V512_DUP_IM(v) _mm512_permute_pd(v, 0xFF)
+#  define V512_SWAP(v) _mm512_permute_pd(v, 0x55)
+#  define V512_ABS _mm512_abs_pd
+#  define V512_MASK __mmask8
+#  define V512_GT(a, b) _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ)
+#  define V512_BLEND _mm512_mask_blend_pd
+#  define V512_IDX_BLEND _mm512_mask_blend_epi64
+#  define V512_IDX_INIT _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0)
+#  define V512_IDX_ADD _mm512_add_epi64
+#  define V512_IDX_SET1(n) _mm512_set1_epi64(n)
+typedef int64_t lane_index_t;
+#  define MAX_LANE_SPAN SIZE_MAX
+# endif
+
+__attribute__((target("avx2,fma")))
+static inline V256 conj_product_avx2(V256 a, V256 b) {
+    const V256 t = V256_MUL(V256_SWAP(a), V256_DUP_IM(b));
+    return V256_FMSUBADD(a, V256_DUP_RE(b), t);
+}
+
+__attribute__((target("avx2,fma")))
+static void conj_multiply_avx2(sample_cpx_t *a, const sample_cpx_t *b,
+                               size_t len) {
+    sample_t *x = (sample_t *) a;
+    const sample_t *y = (const sample_t *) b;
+    size_t i = 0;
+    for (; i + V256_LANES <= 2 * len; i += V256_LANES) {
+        V256_STORE(x + i, conj_product_avx2(V256_LOAD(x + i),
+                                            V256_LOAD(y + i)));
+    }
+
+    conj_multiply_generic(a + i / 2, b + i / 2, len - i / 2);
+}
+
+__attribute__((target("avx2,fma")))
+static void conj_multiply_add_avx2(sample_cpx_t *acc, const sample_cpx_t *a,
+                                   const sample_cpx_t *b, size_t len) {
+    sample_t *z = (sample_t *) acc;
+    const sample_t *x = (const sample_t *) a;
+    const sample_t *y = (const sample_t *) b;
+    size_t i = 0;
+    for (; i + V256_LANES <= 2 * len; i += V256_LANES) {
+        const V256 prod = conj_product_avx2(V256_LOAD(x + i),
+                                            V256_LOAD(y + i));
+        V256_STORE(z + i, V256_ADD(V256_LOAD(z + i), prod));
+    }
+
+    conj_multiply_add_generic(acc + i / 2, a + i / 2, b + i / 2,
+                              len - i / 2);
+}
+
+// Each lane keeps its own maximum and the index where it was found, and they
+// are reduced at the end.
+__attribute__((target("avx2,fma")))
+static size_t max_abs_avx2(const sample_t *arr, size_t start, size_t end,
+                           sample_t *max) {
+    V256 max_vals = V256_SET1(-1);
+    __m256i max_inds = V256_IDX_ADD(V256_IDX_INIT, V256_IDX_SET1(start));
+    __m256i inds = max_inds;
+    const __m256i step = V256_IDX_SET1(V256_LANES);
+    size_t i = start;
+    for (; i + V256_LANES <= end; i += V256_LANES) {
+        const V256 vals = V256_ABS(V256_LOAD(arr + i));
+        const V256 gt = V256_GT(vals, max_vals);
+        max_vals = V256_BLEND(max_vals, vals, gt);
+        max_inds = V256_TO_INT(V256_BLEND(V256_FROM_INT(max_inds),
+                                          V256_FROM_INT(inds), gt));
+        inds = V256_IDX_ADD(inds, step);
+    }
+
+    sample_t lane_vals[V256_LANES];
+    lane_index_t lane_inds[V256_LANES];
+    V256_STORE(lane_vals, max_vals);
+    _mm256_storeu_si256((__m256i *) lane_inds, max_inds);
+    size_t max_ind = max_abs_generic(arr, i, end, max);
+    for (size_t l = 0; l < V256_LANES; l++) {
+        if (lane_vals[l] > *max || (lane_vals[l] == *max
+                                    && (size_t) lane_inds[l] < max_ind)) {
+            *max = lane_vals[l];
+            max_ind = lane_inds[l];
+        }
+    }
+
+    return max_ind;
+}
+
+__attribute__((target("avx512f")))
+static inline V512 conj_product_avx512(V512 a, V512 b) {
+    const V512 t = V512_MUL(V512_SWAP(a), V512_DUP_IM(b));
+    return V512_FMSUBADD(a, V512_DUP_RE(b), t);
+}
+
+__attribute__((target("avx512f")))
+static void conj_multiply_avx512(sample_cpx_t *a, const sample_cpx_t *b,
+                                 size_t len) {
+    sample_t *x = (sample_t *) a;
+    const sample_t *y = (const sample_t *) b;
+    size_t i = 0;
+    for (; i + V512_LANES <= 2 * len; i += V512_LANES) {
+        V512_STORE(x + i, conj_product_avx512(V512_LOAD(x + i),
+                                              V512_LOAD(y + i)));
+    }
+
+    conj_multiply_generic(a + i / 2, b + i / 2, len - i / 2);
+}
+
+__attribute__((target("avx512f")))
+static void conj_multiply_add_avx512(sample_cpx_t *acc,
+                                     const sample_cpx_t *a,
+                                     const sample_cpx_t *b, size_t len) {
+    sample_t *z = (sample_t *) acc;
+    const sample_t *x = (const sample_t *) a;
+    const sample_t *y = (const sample_t *) b;
+    size_t i = 0;
+    for (; i + V512_LANES <= 2 * len; i += V512_LANES) {
+        const V512 prod = conj_product_avx512(V512_LOAD(x + i),
+                                              V512_LOAD(y + i));
+        V512_STORE(z + i, V512_ADD(V512_LOAD(z + i), prod));
+    }
+
+    conj_multiply_add_generic(acc + i / 2, a + i / 2, b + i / 2,
+                              len - i / 2);
+}
+
+__attribute__((target("avx512f")))
+static size_t max_abs_avx512(const sample_t *arr, size_t start, size_t end,
+                             sample_t *max) {
+    V512 max_vals = V512_SET1(-1);
+    __m512i max_inds = V512_IDX_ADD(V512_IDX_INIT, V512_IDX_SET1(start));
+    __m512i inds = max_inds;
+    const __m512i step = V512_IDX_SET1(V512_LANES);
+    size_t i = start;
+    for (; i + V512_LANES <= end; i += V512_LANES) {
+        const V512 vals = V512_ABS(V512_LOAD(arr + i));
+        const V512_MASK gt = V512_GT(vals, max_vals);
+        max_vals = V512_BLEND(gt, max_vals, vals);
+        max_inds = V512_IDX_BLEND(gt, max_inds, inds);
+        inds = V512_IDX_ADD(inds, step);
+    }
+
+    sample_t lane_vals[V512_LANES];
+    lane_index_t lane_inds[V512_LANES];
+    V512_STORE(lane_vals, max_vals);
+    _mm512_storeu_si512(lane_inds, max_inds);
+    size_t max_ind = max_abs_generic(arr, i, end, max);
+    for (size_t l = 0; l < V512_LANES; l++) {
+        if (lane_vals[l] > *max || (lane_vals[l] == *max
+                                    && (size_t) lane_inds[l] < max_ind)) {
+            *max = lane_vals[l];
+            max_ind = lane_inds[l];
+        }
+    }
+
+    return max_ind;
+}
+#endif
+
+// Multiplies each element of `a` by the conjugate of the one in `b`, saving
+// the result in `a`.
+void kernel_conj_multiply(sample_cpx_t *a, const sample_cpx_t *b,
+                          size_t len) {
+    DEBUG_ASSERT(a); DEBUG_ASSERT(b);
+
+#ifdef KERNELS_X86
+    switch (kernels_get_isa()) {
+    case AVX512_ISA:
+        conj_multiply_avx512(a, b, len);
+        return;
+    case AVX2_ISA:
+        conj_multiply_avx2(a, b, len);
+        return;
+    default:
+        break;
+    }
+#endif
+    conj_multiply_generic(a, b, len);
+}
+
+// Adds the product of each element of `a` by the conjugate of the one in `b`
+// to `acc`.
+void kernel_conj_multiply_add(sample_cpx_t *acc, const sample_cpx_t *a,
+                              const sample_cpx_t *b, size_t len) {
+    DEBUG_ASSERT(acc); DEBUG_ASSERT(a); DEBUG_ASSERT(b);
+
+#ifdef KERNELS_X86
+    switch (kernels_get_isa()) {
+    case AVX512_ISA:
+        conj_multiply_add_avx512(acc, a, b, len);
+        return;
+    case AVX2_ISA:
+        conj_multiply_add_avx2(acc, a, b, len);
+        return;
+    default:
+        break;
+    }
+#endif
+    conj_multiply_add_generic(acc, a, b, len);
+}
+
+typedef size_t (*max_abs_fn)(const sample_t *arr, size_t start, size_t end,
+                             sample_t *max);
+
+// The shared parameters and the results of each chunk of
+// kernel_max_abs_index.
+struct max_abs_ctx {
+    max_abs_fn max_abs;
+    const sample_t *arr;
+    size_t inds[MAX_CHUNKS];
+    sample_t vals[MAX_CHUNKS];
+};
+
+static void max_abs_chunk(void *ctx, size_t index, size_t start, size_t end) {
+    struct max_abs_ctx *c = ctx;
+    c->inds[index] = c->max_abs(c->arr, start, end, &c->vals[index]);
+}
+
+// Returns the index of the absolute maximum value in the first `len`
+// elements of `arr`, or the first one in case of ties. Big arrays are split
+// between threads.
+//
+// Its length must be greater than zero to work correctly.
+size_t kernel_max_abs_index(const sample_t *arr, size_t len) {
+    DEBUG_ASSERT(arr); DEBUG_ASSERT(len > 0);
+
+    struct max_abs_ctx ctx = {
+        .max_abs = max_abs_generic,
+        .arr = arr,
+    };
+#ifdef KERNELS_X86
+    if (len <= MAX_LANE_SPAN) {
+        switch (kernels_get_isa()) {
+        case AVX512_ISA:
+            ctx.max_abs = max_abs_avx512;
+            break;
+        case AVX2_ISA:
+            ctx.max_abs = max_abs_avx2;
+            break;
+        default:
+            break;
+        }
+    }
+#endif
+
+    // The chunks are in order, so keeping the first of the equal maximums
+    // returns the first index overall.
+    const size_t n_chunks = run_chunks(max_abs_chunk, &ctx, len, 1);
+    size_t max_ind = ctx.inds[0];
+    sample_t max_val = ctx.vals[0];
+    for (size_t t = 1; t < n_chunks; t++) {
+        if (ctx.vals[t] > max_val) {
+            max_val = ctx.vals[t];
+            max_ind = ctx.inds[t];
+        }
+    }
+
+    return max_ind;
+}
@@ -0,0 +1,318 @@
+// In-process decoding backend, used instead of ffmpeg_pipe when audiosync is
+// built with the USE_LIBAV option. Rather than starting an ffmpeg process
+// and reading its output through a pipe, the input is demuxed and decoded
+// with libavformat and libavcodec, and its frames are downmixed and
+// resampled by libswresample straight into the buffers of the data. This
+// saves starting a process, copying the audio into the kernel and back, and
+// converting its format in another process.
+//
+// The progress is published and signaled exactly like in ffmpeg_pipe. It
+// requires FFmpeg 5.1 or later, for the channel layout API.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/libav_decode.h>
+
+// The libav format with the same precision as sample_t.
+#ifdef SINGLE_PRECISION
+# define SAMPLE_FORMAT AV_SAMPLE_FMT_FLT
+#else
+# define SAMPLE_FORMAT AV_SAMPLE_FMT_DBL
+#endif
+
+
+// The state of a single decoding.
+struct decoder {
+    AVFormatContext *fmt;
+    AVCodecContext *codec;
+    SwrContext *swr;
+    AVPacket *packet;
+    AVFrame *frame;
+    int stream;              // Index of the decoded stream
+    size_t len;              // Frames written so far
+    size_t max_len;          // Maximum frames written, like ffmpeg's -to
+    size_t interval_count;   // Intervals finished so far
+};
+
+// The log level only has to be set once.
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+
+// Sets the same log level the ffmpeg command would use.
+static void set_log_level() {
+#ifdef NDEBUG
+    av_log_set_level(AV_LOG_FATAL);
+#else
+    av_log_set_level(AV_LOG_VERBOSE);
+#endif
+}
+
+// Called by libavformat while it's blocked, so that the download can be
+// aborted while waiting for more data.
+static int interrupt_cb(void *opaque) {
+    return ffmpeg_data_status(opaque) == ABORT_ST;
+}
+
+// Logs a libav error code along with a message.
+static void log_error(const char *msg, int err) {
+    char buf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(err, buf, sizeof(buf));
+    LOG("%s: %s", msg, buf);
+}
+
+// Opens the input and the decoder of its best audio stream, and the
+// resampler into the format of the data.
+//
+// Returns -1 in case of error, or zero otherwise.
+static int open_decoder(struct decoder *dec, struct ffmpeg_data *data,
+                        const char *format, const char *url) {
+    const AVInputFormat *input = NULL;
+    const AVCodec *codec = NULL;
+    int ret = -1;
+    int err;
+
+    if (format != NULL && (input = av_find_input_format(format)) == NULL) {
+        LOG("input format %s not found", format);
+        goto finish;
+    }
+
+    dec->fmt = avformat_alloc_context();
+    if (dec->fmt == NULL) {
+        LOG("avformat_alloc_context failed");
+        goto finish;
+    }
+    dec->fmt->interrupt_callback.callback = interrupt_cb;
+    dec->fmt->interrupt_callback.opaque = data;
+    if ((err = avformat_open_input(&dec->fmt, url, input, NULL)) < 0) {
+        log_error("avformat_open_input failed", err);
+        goto finish;
+    }
+    if ((err = avformat_find_stream_info(dec->fmt, NULL)) < 0) {
+        log_error("avformat_find_stream_info failed", err);
+        goto finish;
+    }
+    dec->stream = av_find_best_stream(dec->fmt, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                      &codec, 0);
+    if (dec->stream < 0) {
+        log_error("no audio stream found", dec->stream);
+        goto finish;
+    }
+
+    dec->codec = avcodec_alloc_context3(codec);
+    if (dec->codec == NULL) {
+        LOG("avcodec_alloc_context3 failed");
+        goto finish;
+    }
+    const AVCodecParameters *params = dec->fmt->streams[dec->stream]->codecpar;
+    if ((err = avcodec_parameters_to_context(dec->codec, params)) < 0
+            || (err = avcodec_open2(dec->codec, codec, NULL)) < 0) {
+        log_error("couldn't open the decoder", err);
+        goto finish;
+    }
+
+    // Some inputs don't indicate the order of their channels, in which case
+    // the default one is assumed.
+    if (dec->codec->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_default(&dec->codec->ch_layout,
+                                  dec->codec->ch_layout.nb_channels);
+    }
+    AVChannelLayout layout;
+    av_channel_layout_default(&layout, NUM_CHANNELS);
+    if ((err = swr_alloc_set_opts2(&dec->swr, &layout, SAMPLE_FORMAT,
+                                   SAMPLE_RATE, &dec->codec->ch_layout,
+                                   dec->codec->sample_fmt,
+                                   dec->codec->sample_rate, 0, NULL)) < 0
+            || (err = swr_init(dec->swr)) < 0) {
+        log_error("couldn't initialize the resampler", err);
+        goto finish;
+    }
+
+    dec->packet = av_packet_alloc();
+    dec->frame = av_frame_alloc();
+    if (dec->packet == NULL || dec->frame == NULL) {
+        LOG("av_packet_alloc or av_frame_alloc failed");
+        goto finish;
+    }
+
+    ret = 0;
+
+finish:
+    return ret;
+}
+
+// Frees everything opened with open_decoder, even if it failed halfway.
+static void close_decoder(struct decoder *dec) {
+    av_frame_free(&dec->frame);
+    av_packet_free(&dec->packet);
+    swr_free(&dec->swr);
+    avcodec_free_context(&dec->codec);
+    avformat_close_input(&dec->fmt);
+}
+
+// Resamples `in_count` frames of `in` into the data. The frames that don't
+// fit in the room left before the end of the buffer (or of the ring) are
+// kept by the resampler, and written in the next iteration. A NULL `in`
+// flushes the resampler at the end.
+//
+// Returns 1 if the maximum length was reached, -1 in case of error, or zero
+// otherwise.
+static int resample(struct decoder *dec, struct ffmpeg_data *data,
+                    const uint8_t **in, int in_count) {
+    while (1) {
+        if (dec->len >= dec->max_len
+                || (data->ring == NULL && dec->len >= data->total_len)) {
+            return 1;
+        }
+
+        size_t room;
+        sample_t *dest = ffmpeg_data_dest(data, dec->len,
+                                          dec->max_len - dec->len, &room);
+        if (room > INT_MAX) room = INT_MAX;
+        const int n = swr_convert(dec->swr, (uint8_t **) &dest, room, in,
+                                  in_count);
+        if (n < 0) {
+            log_error("swr_convert failed", n);
+            return -1;
+        }
+        // The input is only passed once. The same pointer is kept without
+        // any frames rather than NULL, which would flush the resampler.
+        in_count = 0;
+        if (n == 0) return 0;
+
+        dec->len += n;
+        ffmpeg_data_publish(data, dec->len, &dec->interval_count);
+        if ((size_t) n < room) return 0;
+    }
+}
+
+// Sends a packet to the decoder and resamples all the frames it returns. A
+// NULL `packet` drains the decoder at the end.
+//
+// Returns 1 if the maximum length was reached, -1 in case of error, or zero
+// otherwise.
+static int decode_packet(struct decoder *dec, struct ffmpeg_data *data,
+                         const AVPacket *packet) {
+    int err = avcodec_send_packet(dec->codec, packet);
+    if (err < 0 && err != AVERROR_EOF) {
+        log_error("avcodec_send_packet failed", err);
+        return -1;
+    }
+
+    while ((err = avcodec_receive_frame(dec->codec, dec->frame)) >= 0) {
+        const int ret = resample(dec, data,
+                                 (const uint8_t **) dec->frame->extended_data,
+                                 dec->frame->nb_samples);
+        av_frame_unref(dec->frame);
+        if (ret != 0) return ret;
+    }
+    if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
+        log_error("avcodec_receive_frame failed", err);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Decodes the audio at `url` in-process with the FFmpeg libraries, instead of
+// running ffmpeg, downmixing and resampling it straight into the provided
+// data. `format` is the name of the input format, or NULL to detect it from
+// the URL.
+//
+// Like ffmpeg_pipe, it will send signals to the main thread as the intervals
+// are being finished, while also checking the status of its session, or
+// updating it in case of errors.
+//
+// Returns -1 in case of error, or zero otherwise.
+int libav_decode(struct ffmpeg_data *data, const char *format,
+                 const char *url) {
+    DEBUG_ASSERT(data); DEBUG_ASSERT(url); DEBUG_ASSERT(data->buf);
+    DEBUG_ASSERT(data->intervals);
+    DEBUG_ASSERT(data->intervals[data->n_intervals-1] == data->total_len);
+
+    struct decoder dec = {0};
+    int ret = -1;
+    int full = 0;
+
+    pthread_once(&log_once, set_log_level);
+    const char *seconds = data->max_seconds ? data->max_seconds
+                                            : MAX_SECONDS_STR;
+    dec.max_len = strtoul(seconds, NULL, 10) * SAMPLE_RATE;
+    __atomic_store_n(&data->len, 0, __ATOMIC_RELEASE);
+
+    LOG("decoding %s with libav", format ? format : "the URL");
+    if (open_decoder(&dec, data, format, url) < 0) {
+        // Opening the input may have been interrupted by an abort.
+        if (ffmpeg_data_status(data) == ABORT_ST) ret = 0;
+        goto error;
+    }
+
+    while (!full) {
+        const int err = av_read_frame(dec.fmt, dec.packet);
+        if (err == AVERROR_EOF) break;
+        if (err < 0) {
+            if (ffmpeg_data_status(data) == ABORT_ST) {
+                LOG("read ABORT_ST, quitting...");
+                ret = 0;
+                goto finish;
+            }
+            log_error("av_read_frame failed", err);
+            goto error;
+        }
+
+        if (dec.packet->stream_index == dec.stream) {
+            full = decode_packet(&dec, data, dec.packet);
+        }
+        av_packet_unref(dec.packet);
+        if (full < 0) goto error;
+
+        // Checking if the main process has indicated that this thread
+        // should end (accessing it atomically, without the mutex).
+        switch (ffmpeg_data_status(data)) {
+        case ABORT_ST:
+            LOG("read ABORT_ST, quitting...");
+            ret = 0;
+            goto finish;
+        case PAUSED_ST:
+            // No more packets are read until the status of the session is
+            // changed from PAUSED_ST.
+            LOG("pausing libav decoding");
+            if (ffmpeg_data_wait_resume(data) == ABORT_ST) {
+                LOG("read ABORT_ST after pause, quitting...");
+                ret = 0;
+                goto finish;
+            }
+            LOG("resuming libav decoding");
+            break;
+        default:
+            // RUNNING_ST and IDLE_ST are ignored.
+            break;
+        }
+    }
+
+    // Draining the frames left in the decoder and in the resampler.
+    if (full == 0) full = decode_packet(&dec, data, NULL);
+    if (full == 0) full = resample(&dec, data, NULL, 0);
+    if (full < 0) goto error;
+    LOG("finished libav loop");
+
+    // If the track isn't long enough for every interval, the rest of the
+    // data is filled with zeroes.
+    ffmpeg_data_finish(data, dec.len);
+    ret = 0;
+    goto finish;
+
+error:
+    if (ret < 0) ffmpeg_data_abort(data);
+finish:
+    close_decoder(&dec);
+
+    return ret;
+}
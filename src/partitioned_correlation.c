@@ -0,0 +1,389 @@
+// Incremental cross-correlation engine, based on uniformly partitioned
+// overlap-save correlation.
+//
+// Both signals are split into blocks of B frames. Let X_j be the spectrum of
+// the source's window [jB, (j+2)B), and S_m the spectrum of the sample's
+// block [mB, (m+1)B) zero-padded to 2B. Then, the first B values of
+//
+//     ifft(X_{m+q} * conj(S_m))
+//
+// are the linear cross-correlation of the sample block m with the source at
+// the lags [qB, (q+1)B). Adding up these products for all the sample blocks
+// gives the accumulator A_q, whose inverse transform is the full
+// cross-correlation of the interval in that range of lags.
+//
+// Every block spectrum is only calculated once, when the block is available,
+// and the accumulators only receive the products of the new blocks in each
+// interval, so the previous intervals' work isn't repeated. X_{-1} is also
+// used (the first block of the source, preceded by zeroes), so that the
+// negative lags are covered too.
+//
+// The inverse transforms are linear as well, so each range of lags keeps its
+// correlation in the time domain, and the accumulator only holds the
+// products added since it was last transformed. Since the inverse transform
+// is a sum of the spectrum's bins, the sum of their magnitudes bounds how
+// much any of its lags can change. The ranges are visited from the highest
+// bound to the lowest, and the ones whose bound is below the best peak
+// found so far can't contain the result, so they aren't transformed at all.
+// Most of them are skipped once the peak stands out from the rest, and their
+// products are kept for later intervals.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/kernels.h>
+#include <audiosync/partitioned_correlation.h>
+
+
+struct partitioned_xcorr {
+    size_t block_len;  // B, the length of the blocks
+    size_t max_blocks;  // Maximum number of blocks in the sample
+    size_t cpx_len;  // Length of each block's spectrum
+    size_t stride;  // Distance between spectra, so that all are aligned
+    // X_j for j in [-1, 2 * max_blocks - 2], saved at the index j + 1.
+    sample_cpx_t *source_spectra;
+    size_t source_ready;
+    // S_m for m in [0, max_blocks).
+    sample_cpx_t *sample_spectra;
+    size_t sample_ready;
+    // A_q for q in [-max_blocks, max_blocks), saved at the index
+    // q + max_blocks, and the next sample block that has to be added to it.
+    // Only the products that haven't been transformed yet are kept, and
+    // `pending` tells if there are any.
+    sample_cpx_t *acc;
+    size_t *acc_next;
+    int *pending;
+    // The time-domain correlation of each range of lags, with the products
+    // transformed so far, and the index and absolute value of its peak.
+    sample_t *corr;
+    size_t *peak_index;
+    double *peak;
+    // Scratch list of the ranges of lags, sorted by their bound.
+    struct lag_range *ranges;
+    // Scratch buffers for the transforms.
+    sample_t *pad;
+    sample_cpx_t *cpx;
+};
+
+
+// A range of lags and the maximum absolute value it may have.
+struct lag_range {
+    long q;
+    double bound;
+};
+
+// The bounds are compared with a small margin, since the transforms have
+// rounding errors of their own.
+#define BOUND_MARGIN 1e-4
+
+
+// Pointers to the spectra of each kind given their index.
+#define SOURCE_SPECTRUM(p, i) ((p)->source_spectra + (i) * (p)->stride)
+#define SAMPLE_SPECTRUM(p, m) ((p)->sample_spectra + (m) * (p)->stride)
+#define ACCUMULATOR(p, q) \
+    ((p)->acc + ((q) + (long) (p)->max_blocks) * (p)->stride)
+#define ACCUMULATOR_NEXT(p, q) \
+    ((p)->acc_next[(q) + (long) (p)->max_blocks])
+#define RANGE_INDEX(p, q) ((size_t) ((q) + (long) (p)->max_blocks))
+#define CORRELATION(p, q) ((p)->corr + RANGE_INDEX(p, q) * (p)->block_len)
+
+
+// Runs a forward transform of length 2B from `in` into `out`.
+static int block_fft(struct partitioned_xcorr *p, sample_t *in,
+                     sample_cpx_t *out) {
+    struct plan_ref plan = get_plan(R2C_PLAN, 2 * p->block_len, in, out);
+    if (plan.plan == NULL) {
+        LOG("couldn't create r2c plan of length %ld", 2 * p->block_len);
+        return -1;
+    }
+    FFTW(execute_dft_r2c)(plan.plan, in, out);
+    release_plan(plan);
+
+    return 0;
+}
+
+// Allocates a new engine for samples up to `max_sample_len` frames, which
+// must be a multiple of `block_len`. Returns NULL in case of error.
+struct partitioned_xcorr *partitioned_xcorr_new(size_t block_len,
+                                                size_t max_sample_len) {
+    DEBUG_ASSERT(block_len > 0);
+    DEBUG_ASSERT(max_sample_len % block_len == 0);
+
+    struct partitioned_xcorr *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        perror("audiosync: partitioned_xcorr calloc failed");
+        return NULL;
+    }
+
+    p->block_len = block_len;
+    p->max_blocks = max_sample_len / block_len;
+    p->cpx_len = block_len + 1;
+    // Rounding up to an even number of elements keeps every spectrum with
+    // the same alignment, so that they can share the same plans.
+    p->stride = (p->cpx_len + 1) & ~((size_t) 1);
+
+    p->source_spectra = FFTW(alloc_complex)(2 * p->max_blocks * p->stride);
+    p->sample_spectra = FFTW(alloc_complex)(p->max_blocks * p->stride);
+    p->acc = FFTW(alloc_complex)(2 * p->max_blocks * p->stride);
+    p->acc_next = malloc(2 * p->max_blocks * sizeof(*p->acc_next));
+    p->pending = malloc(2 * p->max_blocks * sizeof(*p->pending));
+    p->corr = malloc(2 * max_sample_len * sizeof(*p->corr));
+    p->peak_index = malloc(2 * p->max_blocks * sizeof(*p->peak_index));
+    p->peak = malloc(2 * p->max_blocks * sizeof(*p->peak));
+    p->ranges = malloc(2 * p->max_blocks * sizeof(*p->ranges));
+    p->pad = FFTW(alloc_real)(2 * block_len);
+    p->cpx = FFTW(alloc_complex)(p->stride);
+    if (p->source_spectra == NULL || p->sample_spectra == NULL
+            || p->acc == NULL || p->acc_next == NULL || p->pending == NULL
+            || p->corr == NULL || p->peak_index == NULL || p->peak == NULL
+            || p->ranges == NULL || p->pad == NULL || p->cpx == NULL) {
+        perror("audiosync: partitioned_xcorr buffers allocation failed");
+        partitioned_xcorr_free(p);
+        return NULL;
+    }
+
+    partitioned_xcorr_reset(p);
+
+    return p;
+}
+
+// Frees an engine allocated with partitioned_xcorr_new.
+void partitioned_xcorr_free(struct partitioned_xcorr *p) {
+    if (p == NULL) return;
+
+    if (p->source_spectra) FFTW(free)(p->source_spectra);
+    if (p->sample_spectra) FFTW(free)(p->sample_spectra);
+    if (p->acc) FFTW(free)(p->acc);
+    if (p->acc_next) free(p->acc_next);
+    free(p->pending);
+    free(p->corr);
+    free(p->peak_index);
+    free(p->peak);
+    free(p->ranges);
+    if (p->pad) FFTW(free)(p->pad);
+    if (p->cpx) FFTW(free)(p->cpx);
+    free(p);
+}
+
+// Resets the engine so that it can be used with new signals.
+void partitioned_xcorr_reset(struct partitioned_xcorr *p) {
+    DEBUG_ASSERT(p);
+
+    p->source_ready = 0;
+    p->sample_ready = 0;
+    memset(p->acc, 0, 2 * p->max_blocks * p->stride * sizeof(*p->acc));
+    memset(p->corr, 0, 2 * p->max_blocks * p->block_len * sizeof(*p->corr));
+    // A_q only uses the sample blocks where X_{m+q} exists, that is,
+    // m + q >= -1.
+    for (long q = -(long) p->max_blocks; q < (long) p->max_blocks; q++) {
+        ACCUMULATOR_NEXT(p, q) = q < -1 ? (size_t) (-q - 1) : 0;
+        p->pending[RANGE_INDEX(p, q)] = 0;
+        p->peak_index[RANGE_INDEX(p, q)] = 0;
+        p->peak[RANGE_INDEX(p, q)] = 0.0;
+    }
+}
+
+// Transforms the blocks that have become available since the last call,
+// given the current lengths of the source and the sample, and accumulates
+// their products for a sample of up to `sample_len` frames. It may be called
+// as often as wanted, since each block is only processed once.
+//
+// Returns -1 in case of error, or zero otherwise.
+int partitioned_xcorr_update(struct partitioned_xcorr *p, sample_t *source,
+                             size_t source_len, sample_t *sample,
+                             size_t avail_sample_len, size_t sample_len) {
+    DEBUG_ASSERT(p); DEBUG_ASSERT(source); DEBUG_ASSERT(sample);
+
+    const size_t B = p->block_len;
+    const size_t n_source = 2 * p->max_blocks;
+
+    // The source window of X_j ends at (j + 2) * B, so the one saved at the
+    // index i is available when the source has (i + 1) * B frames.
+    while (p->source_ready < n_source
+           && source_len >= (p->source_ready + 1) * B) {
+        sample_t *in;
+        if (p->source_ready == 0) {
+            memset(p->pad, 0, B * sizeof(*p->pad));
+            memcpy(p->pad + B, source, B * sizeof(*p->pad));
+            in = p->pad;
+        } else {
+            in = source + (p->source_ready - 1) * B;
+        }
+        if (block_fft(p, in, SOURCE_SPECTRUM(p, p->source_ready)) < 0) {
+            return -1;
+        }
+        p->source_ready++;
+    }
+
+    // The sample blocks are zero-padded to 2B.
+    while (p->sample_ready < p->max_blocks
+           && avail_sample_len >= (p->sample_ready + 1) * B) {
+        memcpy(p->pad, sample + p->sample_ready * B, B * sizeof(*p->pad));
+        memset(p->pad + B, 0, B * sizeof(*p->pad));
+        if (block_fft(p, p->pad, SAMPLE_SPECTRUM(p, p->sample_ready)) < 0) {
+            return -1;
+        }
+        p->sample_ready++;
+    }
+
+    // Adding the new products to the accumulators. Only the sample blocks
+    // inside the requested length are used, so that the accumulators are
+    // exact for that interval.
+    size_t limit = sample_len / B;
+    if (limit > p->max_blocks) limit = p->max_blocks;
+    const size_t m_end = limit < p->sample_ready ? limit : p->sample_ready;
+    for (long q = -(long) limit; q < (long) limit; q++) {
+        size_t *next = &ACCUMULATOR_NEXT(p, q);
+        sample_cpx_t *acc = ACCUMULATOR(p, q);
+        while (*next < m_end
+               && (long) *next + q + 1 < (long) p->source_ready) {
+            const sample_cpx_t *x = SOURCE_SPECTRUM(p, *next + q + 1);
+            const sample_cpx_t *s = SAMPLE_SPECTRUM(p, *next);
+            kernel_conj_multiply_add(acc, x, s, p->cpx_len);
+            p->pending[RANGE_INDEX(p, q)] = 1;
+            (*next)++;
+        }
+    }
+
+    return 0;
+}
+
+// The most that the inverse transform of the pending products of A_q may
+// add to any of its lags: the sum of the magnitudes of the full spectrum,
+// whose bins other than the first and the last appear twice.
+static double pending_bound(struct partitioned_xcorr *p, long q) {
+    const sample_cpx_t *acc = ACCUMULATOR(p, q);
+    const size_t B = p->block_len;
+    double sum = cabs(acc[0]) + cabs(acc[B]);
+    for (size_t k = 1; k < B; k++) {
+        const double re = creal(acc[k]), im = cimag(acc[k]);
+        sum += 2 * sqrt(re * re + im * im);
+    }
+
+    return sum;
+}
+
+// Adds the inverse transform of the pending products of A_q to its
+// correlation, and looks for its new peak. The inverse transform destroys
+// its input, so the accumulator is copied first, and then transformed
+// in-place.
+static void flush_range(struct partitioned_xcorr *p, long q,
+                        FFTW(plan) plan) {
+    const size_t B = p->block_len;
+    const size_t r = RANGE_INDEX(p, q);
+    if (!p->pending[r]) return;
+
+    sample_t *results = (sample_t *) p->cpx;
+    sample_t *corr = CORRELATION(p, q);
+    memcpy(p->cpx, ACCUMULATOR(p, q), p->cpx_len * sizeof(*p->cpx));
+    FFTW(execute_dft_c2r)(plan, p->cpx, results);
+    for (size_t t = 0; t < B; t++) {
+        corr[t] += results[t];
+    }
+    memset(ACCUMULATOR(p, q), 0, p->cpx_len * sizeof(*p->cpx));
+    p->pending[r] = 0;
+
+    p->peak_index[r] = kernel_max_abs_index(corr, B);
+    p->peak[r] = fabs(corr[p->peak_index[r]]);
+}
+
+// Sorts the ranges of lags from the highest bound to the lowest.
+static int compare_ranges(const void *a, const void *b) {
+    const double x = ((const struct lag_range *) a)->bound;
+    const double y = ((const struct lag_range *) b)->bound;
+    return (x < y) - (x > y);
+}
+
+// Obtains the lag and the coefficient for the first `sample_len` frames of
+// the sample, with the same output as cross_correlation. All the blocks in
+// the interval must have been processed with partitioned_xcorr_update
+// first.
+//
+// Returns -1 in case of error, or zero otherwise.
+int partitioned_xcorr_result(struct partitioned_xcorr *p, sample_t *source,
+                             sample_t *sample, size_t sample_len, long *lag,
+                             double *coefficient) {
+    DEBUG_ASSERT(p); DEBUG_ASSERT(source); DEBUG_ASSERT(sample);
+    DEBUG_ASSERT(lag); DEBUG_ASSERT(coefficient);
+
+    const size_t B = p->block_len;
+    const long M = sample_len / B;
+    if (M == 0 || M * B != sample_len || (size_t) M > p->max_blocks) {
+        LOG("invalid sample length for the partitioned engine: %ld",
+            sample_len);
+        return -1;
+    }
+
+    // The accumulators must contain exactly the blocks in the interval.
+    for (long q = -M; q < M; q++) {
+        if (ACCUMULATOR_NEXT(p, q) != (size_t) M) {
+            LOG("the blocks for the interval haven't been processed");
+            return -1;
+        }
+    }
+
+    // The upper bound of each range of lags: its current peak plus whatever
+    // its pending products may add.
+    const size_t n_ranges = 2 * M;
+    for (long q = -M; q < M; q++) {
+        const size_t r = RANGE_INDEX(p, q);
+        p->ranges[q + M] = (struct lag_range) {
+            .q = q,
+            .bound = p->peak[r] + (p->pending[r] ? pending_bound(p, q) : 0),
+        };
+    }
+    qsort(p->ranges, n_ranges, sizeof(*p->ranges), &compare_ranges);
+
+    // Looking for the absolute maximum, only in the ranges that may still
+    // contain it.
+    sample_t *results = (sample_t *) p->cpx;
+    struct plan_ref plan = get_plan(C2R_PLAN, 2 * B, p->cpx, results);
+    if (plan.plan == NULL) {
+        LOG("couldn't create c2r plan of length %ld", 2 * B);
+        return -1;
+    }
+    double max_val = -1.0;
+    long max_lag = 0;
+    size_t visited = 0;
+    for (; visited < n_ranges; visited++) {
+        const long q = p->ranges[visited].q;
+        if (p->ranges[visited].bound * (1 + BOUND_MARGIN) < max_val) {
+            break;
+        }
+
+        flush_range(p, q, plan.plan);
+        const sample_t *corr = CORRELATION(p, q);
+        size_t t = p->peak_index[RANGE_INDEX(p, q)];
+        // There's no overlap at all with a lag of -sample_len.
+        if (q == -M && t == 0) {
+            if (B == 1) continue;
+            t = 1 + kernel_max_abs_index(corr + 1, B - 1);
+        }
+        // The earliest lag wins in case of ties, like in
+        // cross_correlation.
+        const double abs_val = fabs(corr[t]);
+        const long cur_lag = q * (long) B + (long) t;
+        if (abs_val > max_val || (abs_val == max_val && cur_lag < max_lag)) {
+            max_val = abs_val;
+            max_lag = cur_lag;
+        }
+    }
+    release_plan(plan);
+    LOG("%ld of %ld ranges of lags visited", visited, n_ranges);
+
+    *lag = max_lag;
+    *coefficient = lag_coefficient(source, sample, sample_len, max_lag);
+
+    // Checking that the resulting coefficient isn't NaN.
+    if (*coefficient != *coefficient) return -1;
+
+    LOG("%ld frames of delay with a confidence of %f", *lag, *coefficient);
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+// The queue of the sources prepared ahead of time. Each entry owns the
+// buffer of a source and the data its download writes into, and it runs in
+// its own session while it's in the queue, so that it isn't affected by the
+// runs in the meantime. When a run takes it, the download is moved into the
+// run's session, like the run's own download thread.
+//
+// The downloads aren't waited for when the entries are dropped from the
+// queue. Instead, they're aborted and marked as released, and the entry is
+// freed by the task itself once the download stops. The taken ones are
+// waited for by the run, which may free its session afterwards.
+
+#define _POSIX_C_SOURCE 200809L  // strdup()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/prefetch.h>
+#include <audiosync/session.h>
+#include <audiosync/thread_pool.h>
+#include <audiosync/download/linux_download.h>
+
+// The maximum capacity of the queue.
+#define MAX_PREFETCH 16
+
+
+struct prefetch_entry {
+    char *title;
+    sample_t *buf;
+    size_t *intervals;
+    struct audiosync_source source;
+    struct ffmpeg_data data;
+    // The session of the download while it's in the queue, which only
+    // provides its status.
+    struct audiosync_session session;
+    int done;      // If the download has finished
+    int released;  // If it's freed as soon as the download finishes
+};
+
+// The queue, from the oldest entry to the newest, protected by
+// `prefetch_mutex` along with the flags of the entries.
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a download finishes.
+static pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+static struct prefetch_entry *queue[MAX_PREFETCH];
+static size_t queue_len = 0;
+static size_t capacity = DEFAULT_PREFETCH;
+// The downloads are never waited for, so they share the same group.
+static struct task_group downloads = TASK_GROUP_INIT;
+
+
+static void free_entry(struct prefetch_entry *entry) {
+    session_destroy(&entry->session);
+    if (entry->title) free(entry->title);
+    if (entry->buf) FFTW(free)(entry->buf);
+    if (entry->intervals) free(entry->intervals);
+    free(entry);
+}
+
+// Frees an entry that's no longer in the queue, or aborts its download and
+// leaves it to the task if it's still running. The mutex must be locked.
+static void drop_entry(struct prefetch_entry *entry) {
+    if (entry->done) {
+        free_entry(entry);
+        return;
+    }
+
+    entry->released = 1;
+    audiosync_session_abort(&entry->session);
+}
+
+// Removes the i-th entry from the queue, without freeing it. The mutex must
+// be locked.
+static struct prefetch_entry *remove_entry(size_t i) {
+    struct prefetch_entry *entry = queue[i];
+    memmove(queue + i, queue + i + 1, (queue_len - i - 1) * sizeof(*queue));
+    queue[--queue_len] = NULL;
+
+    return entry;
+}
+
+// Returns the index of the entry of `title` in the queue, or -1 if it isn't
+// there. The mutex must be locked.
+static long find_entry(const char *title) {
+    for (size_t i = 0; i < queue_len; i++) {
+        if (strcmp(queue[i]->title, title) == 0) return i;
+    }
+
+    return -1;
+}
+
+// The task downloading an entry in the background.
+static void *prefetch_task(void *arg) {
+    struct prefetch_entry *entry = arg;
+    download(&entry->data);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    entry->done = 1;
+    const int released = entry->released;
+    pthread_cond_broadcast(&prefetch_done);
+    pthread_mutex_unlock(&prefetch_mutex);
+    if (released) {
+        free_entry(entry);
+    }
+
+    return NULL;
+}
+
+// Starts preparing the source of `title` in the background. Nothing is done
+// if it's already in the queue.
+//
+// Returns -1 in case of error, or zero otherwise.
+int prefetch_add(const char *title, size_t len, const size_t *intervals,
+                 size_t n_intervals) {
+    DEBUG_ASSERT(title); DEBUG_ASSERT(intervals);
+    DEBUG_ASSERT(intervals[n_intervals - 1] == len);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    const long found = find_entry(title);
+    const size_t max_len = capacity;
+    pthread_mutex_unlock(&prefetch_mutex);
+    if (found >= 0) return 0;
+    if (max_len == 0) {
+        LOG("prefetching is disabled");
+        return -1;
+    }
+
+    // The buffers are allocated before taking the lock again, since it
+    // takes a while.
+    struct prefetch_entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        perror("audiosync: prefetch entry calloc failed");
+        return -1;
+    }
+    if (session_init(&entry->session) < 0) {
+        free(entry);
+        return -1;
+    }
+    entry->title = strdup(title);
+    entry->buf = FFTW(alloc_real)(len);
+    entry->intervals = malloc(n_intervals * sizeof(*intervals));
+    if (entry->title == NULL || entry->buf == NULL
+            || entry->intervals == NULL) {
+        perror("audiosync: prefetch buffers allocation failed");
+        free_entry(entry);
+        return -1;
+    }
+    memcpy(entry->intervals, intervals, n_intervals * sizeof(*intervals));
+    entry->source.provider = SEARCH_PROVIDER;
+    entry->source.title = entry->title;
+    entry->session.status = RUNNING_ST;
+    // The data has constant fields, so it's copied after initializing it.
+    const struct ffmpeg_data data = {
+        .title = entry->title,
+        .source = &entry->source,
+        .session = &entry->session,
+        .buf = entry->buf,
+        .len = 0,
+        .total_len = len,
+        .intervals = entry->intervals,
+        .n_intervals = n_intervals,
+    };
+    memcpy(&entry->data, &data, sizeof(data));
+
+    pthread_mutex_lock(&prefetch_mutex);
+    // It may have been added by another thread in the meantime.
+    if (find_entry(title) >= 0) {
+        pthread_mutex_unlock(&prefetch_mutex);
+        free_entry(entry);
+        return 0;
+    }
+    while (queue_len > 0 && queue_len >= capacity) {
+        LOG("dropping the prefetched '%s'", queue[0]->title);
+        drop_entry(remove_entry(0));
+    }
+    if (thread_pool_spawn(&downloads, &prefetch_task, entry) < 0) {
+        pthread_mutex_unlock(&prefetch_mutex);
+        perror("audiosync: thread_pool_spawn for prefetch failed");
+        free_entry(entry);
+        return -1;
+    }
+    queue[queue_len++] = entry;
+    pthread_mutex_unlock(&prefetch_mutex);
+    LOG("prefetching '%s'", title);
+
+    return 0;
+}
+
+// Takes the source of `title` out of the queue, if it's there and it didn't
+// fail, moving it into `session`. Returns NULL otherwise.
+struct prefetch_entry *prefetch_take(const char *title,
+                                     struct audiosync_session *session) {
+    DEBUG_ASSERT(title); DEBUG_ASSERT(session);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    const long found = find_entry(title);
+    if (found < 0) {
+        pthread_mutex_unlock(&prefetch_mutex);
+        return NULL;
+    }
+    struct prefetch_entry *entry = remove_entry(found);
+
+    // From now on, the download follows the run's session, so that it's
+    // stopped with the run, and so that its errors abort it. If it had
+    // failed before that, it's no longer useful. Both the status and the
+    // session are sequentially consistent, so that an error can't be missed
+    // between checking them.
+    __atomic_store_n(&entry->data.session, session, __ATOMIC_SEQ_CST);
+    const int failed =
+        audiosync_session_status(&entry->session) == ABORT_ST
+        || (entry->done && __atomic_load_n(&entry->data.len, __ATOMIC_ACQUIRE)
+                           < entry->data.total_len);
+    if (failed) {
+        LOG("the prefetched '%s' failed", title);
+        __atomic_store_n(&entry->data.session, &entry->session,
+                         __ATOMIC_SEQ_CST);
+        drop_entry(entry);
+        entry = NULL;
+    } else {
+        LOG("using the prefetched '%s'", title);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    return entry;
+}
+
+// The data of a taken source.
+struct ffmpeg_data *prefetch_data(struct prefetch_entry *entry) {
+    DEBUG_ASSERT(entry);
+
+    return &entry->data;
+}
+
+// Frees a taken source after the run. Its download follows the run's
+// session, which must be aborted already, so it's only waited for.
+void prefetch_release(struct prefetch_entry *entry) {
+    if (entry == NULL) return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    while (!entry->done) {
+        pthread_cond_wait(&prefetch_done, &prefetch_mutex);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+    free_entry(entry);
+}
+
+// Configures the maximum number of sources in the queue, dropping the
+// oldest ones if there are more.
+void prefetch_set_capacity(size_t max_len) {
+    if (max_len > MAX_PREFETCH) max_len = MAX_PREFETCH;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    capacity = max_len;
+    while (queue_len > capacity) {
+        drop_entry(remove_entry(0));
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+// Waits for every download in the background, which is only needed to make
+// sure that the dropped entries were freed.
+void prefetch_wait() {
+    thread_pool_wait(&downloads);
+}
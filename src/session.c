@@ -0,0 +1,185 @@
+// The sessions hold the state of each synchronization, so that a process can
+// run several of them at once, for example one for every stream in the
+// system. The functions without a session, like audiosync_run, use the
+// default one, which always exists.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/decimated_correlation.h>
+#include <audiosync/session.h>
+#include <audiosync/capture/linux_capture.h>
+
+
+// The session used by the functions without a session. It's initialized
+// statically, so that audiosync_abort or similar functions can be called
+// before audiosync_run.
+static struct audiosync_session default_session = {
+    .status = IDLE_ST,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .interval_done = PTHREAD_COND_INITIALIZER,
+    .read_continue = PTHREAD_COND_INITIALIZER,
+    .id = 0,
+};
+
+// The id of the next session created, so that each one has its own sink.
+static unsigned int next_id = 1;
+
+
+int session_init(struct audiosync_session *session) {
+    DEBUG_ASSERT(session);
+
+    memset(session, 0, sizeof(*session));
+    session->status = IDLE_ST;
+    if (pthread_mutex_init(&session->mutex, NULL) != 0) {
+        perror("audiosync: session pthread_mutex_init failed");
+        return -1;
+    }
+    if (pthread_cond_init(&session->interval_done, NULL) != 0) {
+        perror("audiosync: session pthread_cond_init failed");
+        pthread_mutex_destroy(&session->mutex);
+        return -1;
+    }
+    if (pthread_cond_init(&session->read_continue, NULL) != 0) {
+        perror("audiosync: session pthread_cond_init failed");
+        pthread_cond_destroy(&session->interval_done);
+        pthread_mutex_destroy(&session->mutex);
+        return -1;
+    }
+    session->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void session_destroy(struct audiosync_session *session) {
+    DEBUG_ASSERT(session);
+
+    xcorr_workspace_free(session->workspace);
+    xcorr_workspace_free(session->track_workspace);
+    decimated_xcorr_free(session->decimated);
+    pthread_cond_destroy(&session->read_continue);
+    pthread_cond_destroy(&session->interval_done);
+    pthread_mutex_destroy(&session->mutex);
+}
+
+struct audiosync_session *audiosync_session_new() {
+    struct audiosync_session *session = malloc(sizeof(*session));
+    if (session == NULL) {
+        perror("audiosync: session malloc failed");
+        return NULL;
+    }
+
+    if (session_init(session) < 0) {
+        free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+void audiosync_session_free(struct audiosync_session *session) {
+    if (session == NULL) return;
+    DEBUG_ASSERT(session != &default_session);
+    DEBUG_ASSERT(!session->running);
+
+    session_destroy(session);
+    free(session);
+}
+
+struct audiosync_session *audiosync_default_session() {
+    return &default_session;
+}
+
+// A session can be controlled externally with these basic functions. They
+// expose the session's status, which will be received from its threads
+// accordingly.
+//
+// The status is written with the mutex taken, since the threads wait for its
+// changes with condition variables, but it's also stored atomically, so
+// that audiosync_session_status() can read it without the mutex. This way,
+// the threads reading the audio can check it after every chunk without any
+// lock traffic. The abort is sequentially consistent, since a prefetched
+// download may be moved into another session at the same time, see
+// prefetch_take.
+void audiosync_session_abort(struct audiosync_session *session) {
+    pthread_mutex_lock(&session->mutex);
+    __atomic_store_n(&session->status, ABORT_ST, __ATOMIC_SEQ_CST);
+    // The abort "wakes up" all threads waiting for something.
+    pthread_cond_broadcast(&session->interval_done);
+    pthread_cond_broadcast(&session->read_continue);
+    pthread_mutex_unlock(&session->mutex);
+}
+
+void audiosync_session_pause(struct audiosync_session *session) {
+    pthread_mutex_lock(&session->mutex);
+    __atomic_store_n(&session->status, PAUSED_ST, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&session->mutex);
+}
+
+void audiosync_session_resume(struct audiosync_session *session) {
+    pthread_mutex_lock(&session->mutex);
+    // Changes the status and sends a signal to the threads that will be
+    // waiting.
+    __atomic_store_n(&session->status, RUNNING_ST, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&session->read_continue);
+    pthread_mutex_unlock(&session->mutex);
+}
+
+global_status_t audiosync_session_status(
+        const struct audiosync_session *session) {
+    return __atomic_load_n(&session->status, __ATOMIC_SEQ_CST);
+}
+
+void audiosync_abort() {
+    audiosync_session_abort(&default_session);
+}
+
+void audiosync_pause() {
+    audiosync_session_pause(&default_session);
+}
+
+void audiosync_resume() {
+    audiosync_session_resume(&default_session);
+}
+
+global_status_t audiosync_status() {
+    return audiosync_session_status(&default_session);
+}
+
+// The setup function is optional. It will initialize a PulseAudio sink to
+// later record the media player output directly, rather than the entire
+// desktop audio. Each session has its own sink, so that each one can record
+// a different player.
+// Thus, the `stream_name` variable indicates the name of the music player
+// being used. For example, "Spotify".
+//
+// It's possible that the setup fails, so it returns an integer which will
+// be zero on success, and negative on error.
+int audiosync_session_setup(struct audiosync_session *session,
+                            const char *stream_name) {
+    DEBUG_ASSERT(session); DEBUG_ASSERT(stream_name);
+    LOG("setting up audiosync session %u", session->id);
+
+    char sink[MAX_SINK_NAME];
+    if (session->id == 0) {
+        snprintf(sink, sizeof(sink), "%s", SINK_NAME);
+    } else {
+        snprintf(sink, sizeof(sink), "%s-%u", SINK_NAME, session->id);
+    }
+    if (pulseaudio_setup(sink, stream_name) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&session->mutex);
+    strcpy(session->sink, sink);
+    pthread_mutex_unlock(&session->mutex);
+
+    return 0;
+}
+
+int audiosync_setup(const char *stream_name) {
+    return audiosync_session_setup(&default_session, stream_name);
+}
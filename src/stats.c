@@ -0,0 +1,96 @@
+// The statistics of the runs, so that it's possible to tell if a slow
+// synchronization was caused by the network, the capture, or the
+// calculations. The timers are only read a few times per chunk of audio or
+// per interval, so they're always enabled.
+
+#define _POSIX_C_SOURCE 200809L  // clock_gettime()
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/session.h>
+#include <audiosync/stats.h>
+
+
+double stats_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+double stats_elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3
+           + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void stream_stats_init(struct stream_stats *stats,
+                       const struct timespec *start, const size_t *boundaries,
+                       size_t n_boundaries) {
+    DEBUG_ASSERT(stats); DEBUG_ASSERT(start); DEBUG_ASSERT(boundaries);
+    DEBUG_ASSERT(n_boundaries <= MAX_STATS_INTERVALS);
+
+    stats->start = *start;
+    stats->boundaries = boundaries;
+    stats->n_boundaries = n_boundaries;
+    stats->next = 0;
+    stats->len = 0;
+    stats->resolve_ms = -1;
+    stats->first_byte_ms = -1;
+    for (size_t i = 0; i < MAX_STATS_INTERVALS; i++) {
+        stats->boundary_ms[i] = -1;
+    }
+}
+
+// Records when the stream's first frame was read, and when it reached each
+// boundary. The clock is only read when one of them is reached.
+void stream_stats_update(struct stream_stats *stats, size_t len) {
+    stats->len = len;
+    if (len == 0 || (stats->first_byte_ms >= 0
+                     && (stats->next == stats->n_boundaries
+                         || len < stats->boundaries[stats->next]))) {
+        return;
+    }
+
+    const double ms = stats_elapsed_ms(&stats->start);
+    if (stats->first_byte_ms < 0) {
+        stats->first_byte_ms = ms;
+    }
+    while (stats->next < stats->n_boundaries
+           && len >= stats->boundaries[stats->next]) {
+        stats->boundary_ms[stats->next++] = ms;
+    }
+}
+
+long stats_peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return -1;
+    }
+
+    // It's already in kilobytes on Linux.
+    return usage.ru_maxrss;
+}
+
+// The statistics of the last run of a session, which are copied with the
+// session's mutex taken, so that they can be obtained while it's running
+// again.
+int audiosync_session_get_stats(struct audiosync_session *session,
+                                struct audiosync_stats *stats) {
+    DEBUG_ASSERT(session); DEBUG_ASSERT(stats);
+
+    pthread_mutex_lock(&session->mutex);
+    const int ret = session->has_stats ? 0 : -1;
+    if (session->has_stats) {
+        memcpy(stats, &session->stats, sizeof(*stats));
+    }
+    pthread_mutex_unlock(&session->mutex);
+
+    return ret;
+}
+
+int audiosync_get_stats(struct audiosync_stats *stats) {
+    return audiosync_session_get_stats(audiosync_default_session(), stats);
+}
@@ -0,0 +1,276 @@
+// The worker pool used for everything that runs concurrently in audiosync:
+// the transforms, the coefficients of the candidate lags, the kernels split
+// in chunks, FFTW's own threads, and the capture and download.
+//
+// There are two queues. The short tasks can be run by any worker, and also
+// by the threads waiting for a group, which keeps the nested groups from
+// running out of workers (a task waiting for other tasks runs them itself
+// if there are no free workers). The blocking tasks are only run by the
+// workers, and a new worker is started whenever there wouldn't be one per
+// core left for the short tasks otherwise. The workers are never stopped, so
+// the ones started for the capture and download are reused in later runs.
+//
+// The host application may also provide its own executor for the short
+// tasks. In that case, the waiting threads can't help, since the tasks
+// aren't in the queue anymore.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/thread_pool.h>
+
+// The maximum number of queued tasks of each kind. The short tasks are run
+// in the current thread when their queue is full.
+#define QUEUE_LEN 64
+// The maximum number of workers for the short tasks, regardless of the
+// number of cores.
+#define MAX_WORKERS 64
+
+
+struct task {
+    task_fn fn;
+    void *arg;
+    struct task_group *group;
+};
+
+// A circular queue of tasks.
+struct task_queue {
+    struct task tasks[QUEUE_LEN];
+    size_t head;
+    size_t len;
+};
+
+// The whole state of the pool is protected by `pool_mutex`. `task_ready` is
+// signaled when a task is queued, and `task_done` is broadcast when a group
+// is finished.
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t task_done = PTHREAD_COND_INITIALIZER;
+static struct task_queue short_queue;
+static struct task_queue blocking_queue;
+// The number of cores, which is zero until the pool is started.
+static size_t pool_size = 0;
+// The number of workers, and how many of them are running or about to run a
+// blocking task.
+static size_t n_workers = 0;
+static size_t n_blocking = 0;
+// The host application's executor, if any.
+static int (*executor_submit)(void (*task)(void *), void *arg,
+                              void *data) = NULL;
+static void *executor_data = NULL;
+
+
+static int push_task(struct task_queue *q, struct task t) {
+    if (q->len == QUEUE_LEN) return -1;
+
+    q->tasks[(q->head + q->len) % QUEUE_LEN] = t;
+    q->len++;
+    return 0;
+}
+
+static int pop_task(struct task_queue *q, struct task *t) {
+    if (q->len == 0) return -1;
+
+    *t = q->tasks[q->head];
+    q->head = (q->head + 1) % QUEUE_LEN;
+    q->len--;
+    return 0;
+}
+
+// Marks a task of a group as finished. `pool_mutex` must be locked.
+static void finish_task(struct task_group *group) {
+    if (group == NULL) return;
+
+    if (--group->pending == 0) {
+        pthread_cond_broadcast(&task_done);
+    }
+}
+
+static void *worker(void *arg) {
+    UNUSED(arg);
+
+    struct task t;
+    pthread_mutex_lock(&pool_mutex);
+    for (;;) {
+        // The blocking tasks go first, since a worker was started for them.
+        int blocking = 1;
+        if (pop_task(&blocking_queue, &t) < 0) {
+            blocking = 0;
+            if (pop_task(&short_queue, &t) < 0) {
+                pthread_cond_wait(&task_ready, &pool_mutex);
+                continue;
+            }
+        }
+
+        pthread_mutex_unlock(&pool_mutex);
+        t.fn(t.arg);
+        pthread_mutex_lock(&pool_mutex);
+        if (blocking) n_blocking--;
+        finish_task(t.group);
+    }
+
+    return NULL;
+}
+
+// Starts a new worker. `pool_mutex` must be locked. Returns the error code
+// of pthread_create.
+static int start_worker() {
+    pthread_t th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&th, &attr, &worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (err == 0) {
+        n_workers++;
+    }
+
+    return err;
+}
+
+// Starts the pool the first time it's used. `pool_mutex` must be locked.
+static void start_pool() {
+    if (pool_size > 0) return;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_size = cpus > 0 ? (size_t) cpus : 1;
+    if (pool_size > MAX_WORKERS) pool_size = MAX_WORKERS;
+
+    for (size_t i = 0; i < pool_size; i++) {
+        if (start_worker() != 0) {
+            LOG("couldn't start worker %ld of the pool", i);
+            break;
+        }
+    }
+    LOG("started pool with %ld workers", n_workers);
+}
+
+// Returns the number of tasks that can run at once, which is the number of
+// cores.
+size_t thread_pool_size() {
+    pthread_mutex_lock(&pool_mutex);
+    start_pool();
+    const size_t ret = pool_size;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return ret;
+}
+
+// Runs a task sent to the host application's executor, which was allocated
+// in thread_pool_submit.
+static void run_executor_task(void *arg) {
+    struct task *t = arg;
+    t->fn(t->arg);
+
+    pthread_mutex_lock(&pool_mutex);
+    finish_task(t->group);
+    pthread_mutex_unlock(&pool_mutex);
+    free(t);
+}
+
+// Runs a short task concurrently, in the pool or in the host application's
+// executor. If it can't be queued, it's run before returning.
+void thread_pool_submit(struct task_group *group, task_fn fn, void *arg) {
+    DEBUG_ASSERT(group); DEBUG_ASSERT(fn);
+
+    const struct task t = { .fn = fn, .arg = arg, .group = group };
+    pthread_mutex_lock(&pool_mutex);
+    if (executor_submit != NULL) {
+        int (*submit)(void (*)(void *), void *, void *) = executor_submit;
+        void *data = executor_data;
+        struct task *et = malloc(sizeof(*et));
+        if (et != NULL) {
+            *et = t;
+            group->pending++;
+            pthread_mutex_unlock(&pool_mutex);
+            if (submit(run_executor_task, et, data) == 0) {
+                return;
+            }
+
+            // The host couldn't take it, so it's run here instead.
+            pthread_mutex_lock(&pool_mutex);
+            group->pending--;
+            free(et);
+        }
+    } else {
+        start_pool();
+        if (n_workers > 0 && push_task(&short_queue, t) == 0) {
+            group->pending++;
+            pthread_cond_signal(&task_ready);
+            pthread_mutex_unlock(&pool_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    fn(arg);
+}
+
+// Runs a task that may block for a long time in a worker dedicated to it.
+//
+// Returns -1 if no worker could be started, with errno set, or zero
+// otherwise.
+int thread_pool_spawn(struct task_group *group, task_fn fn, void *arg) {
+    DEBUG_ASSERT(group); DEBUG_ASSERT(fn);
+
+    const struct task t = { .fn = fn, .arg = arg, .group = group };
+    pthread_mutex_lock(&pool_mutex);
+    start_pool();
+
+    // There must be a worker per core left for the short tasks.
+    if (n_workers < pool_size + n_blocking + 1) {
+        int err = start_worker();
+        if (err != 0) {
+            pthread_mutex_unlock(&pool_mutex);
+            errno = err;
+            return -1;
+        }
+    }
+    if (push_task(&blocking_queue, t) < 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    n_blocking++;
+    group->pending++;
+    // All the workers are woken up, since the ones that were already waiting
+    // may be about to take a short task.
+    pthread_cond_broadcast(&task_ready);
+    pthread_mutex_unlock(&pool_mutex);
+
+    return 0;
+}
+
+// Waits until all the tasks in the group have finished, running the queued
+// short tasks in the meantime.
+void thread_pool_wait(struct task_group *group) {
+    DEBUG_ASSERT(group);
+
+    struct task t;
+    pthread_mutex_lock(&pool_mutex);
+    while (group->pending > 0) {
+        if (pop_task(&short_queue, &t) == 0) {
+            pthread_mutex_unlock(&pool_mutex);
+            t.fn(t.arg);
+            pthread_mutex_lock(&pool_mutex);
+            finish_task(t.group);
+        } else {
+            pthread_cond_wait(&task_done, &pool_mutex);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Sets the host application's executor, see audiosync_set_executor.
+void thread_pool_set_executor(int (*submit)(void (*task)(void *), void *arg,
+                                            void *data),
+                              void *data) {
+    pthread_mutex_lock(&pool_mutex);
+    executor_submit = submit;
+    executor_data = data;
+    pthread_mutex_unlock(&pool_mutex);
+}
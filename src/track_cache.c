@@ -0,0 +1,446 @@
+// The on-disk cache of the downloaded tracks. Each track is saved in its own
+// file, named after a hash of its title, with a small header followed by the
+// title itself (to detect collisions) and the samples. They're always saved
+// in single precision, which is more than enough for the cross-correlation
+// and halves the size of the cache in double precision builds.
+//
+// The files are mapped into memory when loading them, so that only the
+// samples are read, without any intermediate buffers. Their modification
+// time is updated on every hit, which is used to remove the least recently
+// used ones when the cache is too big.
+
+#define _POSIX_C_SOURCE 200809L  // strdup(), futimens() and posix_madvise()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/track_cache.h>
+
+#define CACHE_MAGIC "ASTC"
+#define CACHE_VERSION 1
+#define CACHE_EXT ".pcm"
+#define MAX_CACHE_PATH 4096
+// The samples are converted in blocks of this size when saving them.
+#define STORE_BLOCK 4096
+
+
+// The header at the start of each file, followed by the title, padding up to
+// a multiple of 8 bytes, and the samples as 32-bit floats.
+struct cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t title_len;
+    uint64_t len;
+};
+
+// A file in the cache directory, used to remove the least recently used ones.
+struct cache_entry {
+    char name[64];
+    struct timespec mtime;
+    size_t size;
+};
+
+// The cache's configuration, protected by `cache_mutex`. It's disabled while
+// `cache_dir` is NULL.
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_dir = NULL;
+static size_t cache_max_bytes = 0;
+// The number of temporary files created so far, so that each one has its
+// own name, even with several sessions storing the same track at once.
+static unsigned long tmp_count = 0;
+
+
+// The offset of the samples in a file, after the header and the title.
+static size_t data_offset(size_t title_len) {
+    return (sizeof(struct cache_header) + title_len + 7) / 8 * 8;
+}
+
+// 64-bit FNV-1a hash of the title, used for the file names.
+static uint64_t hash_title(const char *title) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = title; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Obtains a copy of the cache directory and its maximum size, or NULL if
+// it's disabled.
+static char *get_dir(size_t *max_bytes) {
+    pthread_mutex_lock(&cache_mutex);
+    char *dir = cache_dir ? strdup(cache_dir) : NULL;
+    *max_bytes = cache_max_bytes;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return dir;
+}
+
+// Writes the path of the track's file into `path`. Returns -1 if it's too
+// long, or zero otherwise.
+static int track_path(const char *dir, const char *title, char *path) {
+    int n = snprintf(path, MAX_CACHE_PATH, "%s/%016llx" CACHE_EXT, dir,
+                     (unsigned long long) hash_title(title));
+    if (n < 0 || n >= MAX_CACHE_PATH) {
+        LOG("cache path is too long");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns if a file in the cache directory is a track, rather than a
+// temporary file or anything else.
+static int is_track_file(const char *name) {
+    const size_t name_len = strlen(name);
+    const size_t ext_len = strlen(CACHE_EXT);
+
+    return name_len > ext_len
+           && strcmp(name + name_len - ext_len, CACHE_EXT) == 0;
+}
+
+int track_cache_configure(const char *dir, size_t max_bytes) {
+    char *copy = NULL;
+    if (dir != NULL) {
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            perror("audiosync: mkdir for the cache failed");
+            return -1;
+        }
+        copy = strdup(dir);
+        if (copy == NULL) {
+            perror("audiosync: strdup for the cache failed");
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    free(cache_dir);
+    cache_dir = copy;
+    cache_max_bytes = max_bytes;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+// Maps a cached track into memory, checking that it's valid. The file is
+// opened into `fd`, since it's needed to mark it as recently used.
+//
+// Returns NULL if it doesn't exist or it isn't valid.
+static const struct cache_header *map_track(const char *path, int *fd,
+                                            size_t *map_len) {
+    *fd = open(path, O_RDONLY);
+    if (*fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(*fd, &st) < 0) {
+        perror("audiosync: fstat for the cached track failed");
+        goto error;
+    }
+    *map_len = st.st_size;
+    if (*map_len < sizeof(struct cache_header)) {
+        goto invalid;
+    }
+
+    void *map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, *fd, 0);
+    if (map == MAP_FAILED) {
+        perror("audiosync: mmap for the cached track failed");
+        goto error;
+    }
+    posix_madvise(map, *map_len, POSIX_MADV_SEQUENTIAL);
+
+    // The whole file has to be consistent, or else it's ignored (it will be
+    // replaced after downloading the track again).
+    const struct cache_header *header = map;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != CACHE_VERSION
+            || header->sample_rate != SAMPLE_RATE
+            || header->title_len > *map_len
+            || *map_len != data_offset(header->title_len)
+                           + header->len * sizeof(float)) {
+        munmap(map, *map_len);
+        goto invalid;
+    }
+
+    return header;
+
+invalid:
+    LOG("%s isn't a valid cached track", path);
+error:
+    close(*fd);
+    *fd = -1;
+    return NULL;
+}
+
+// Converts the samples of a mapped track into `buf`.
+static void copy_samples(const struct cache_header *header, sample_t *buf) {
+    const float *samples = (const float *) ((const char *) header
+                                            + data_offset(header->title_len));
+    for (size_t i = 0; i < header->len; i++) {
+        buf[i] = samples[i];
+    }
+}
+
+int track_cache_load(const char *title, sample_t *buf, size_t len) {
+    DEBUG_ASSERT(title); DEBUG_ASSERT(buf);
+
+    int ret = -1;
+    int fd = -1;
+    const struct cache_header *header = NULL;
+    size_t map_len = 0;
+    size_t max_bytes;
+    char path[MAX_CACHE_PATH];
+
+    char *dir = get_dir(&max_bytes);
+    if (dir == NULL || track_path(dir, title, path) < 0) {
+        goto finish;
+    }
+
+    header = map_track(path, &fd, &map_len);
+    if (header == NULL) {
+        LOG("'%s' isn't cached", title);
+        goto finish;
+    }
+    const size_t title_len = strlen(title);
+    if (header->len != len || header->title_len != title_len
+            || memcmp(header + 1, title, title_len) != 0) {
+        LOG("cached track doesn't match '%s'", title);
+        goto finish;
+    }
+    copy_samples(header, buf);
+
+    // Marking it as recently used.
+    if (futimens(fd, NULL) < 0) {
+        perror("audiosync: futimens for the cached track failed");
+    }
+    LOG("loaded '%s' from the cache", title);
+    ret = 0;
+
+finish:
+    if (header) munmap((void *) header, map_len);
+    if (fd >= 0) close(fd);
+    free(dir);
+
+    return ret;
+}
+
+int track_cache_foreach(int (*fn)(const char *title, const sample_t *buf,
+                                  size_t len, void *data),
+                        void *data) {
+    DEBUG_ASSERT(fn);
+
+    int ret = -1;
+    size_t max_bytes;
+    char path[MAX_CACHE_PATH];
+    DIR *dp = NULL;
+
+    char *dir = get_dir(&max_bytes);
+    if (dir == NULL) {
+        goto finish;
+    }
+    dp = opendir(dir);
+    if (dp == NULL) {
+        perror("audiosync: opendir for the cache failed");
+        goto finish;
+    }
+
+    struct dirent *d;
+    while ((d = readdir(dp)) != NULL) {
+        if (!is_track_file(d->d_name)) continue;
+
+        int fd;
+        size_t map_len;
+        snprintf(path, MAX_CACHE_PATH, "%s/%s", dir, d->d_name);
+        const struct cache_header *header = map_track(path, &fd, &map_len);
+        if (header == NULL) continue;
+
+        char *title = malloc(header->title_len + 1);
+        sample_t *buf = malloc(header->len * sizeof(*buf) + 1);
+        int fn_ret = -1;
+        if (title == NULL || buf == NULL) {
+            perror("audiosync: malloc for the cached track failed");
+        } else {
+            memcpy(title, header + 1, header->title_len);
+            title[header->title_len] = '\0';
+            copy_samples(header, buf);
+            fn_ret = fn(title, buf, header->len, data);
+        }
+        free(title);
+        free(buf);
+        munmap((void *) header, map_len);
+        close(fd);
+        if (fn_ret < 0) goto finish;
+    }
+    ret = 0;
+
+finish:
+    if (dp) closedir(dp);
+    free(dir);
+
+    return ret;
+}
+
+// Sorts the cache entries from the least to the most recently used.
+static int compare_entries(const void *a, const void *b) {
+    const struct cache_entry *ea = a;
+    const struct cache_entry *eb = b;
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec) {
+        return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+    }
+    if (ea->mtime.tv_nsec != eb->mtime.tv_nsec) {
+        return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+    }
+
+    return strcmp(ea->name, eb->name);
+}
+
+// Removes the least recently used tracks until the cache is at most
+// `max_bytes` big.
+static void evict_tracks(const char *dir, size_t max_bytes) {
+    struct cache_entry *entries = NULL;
+    size_t n_entries = 0;
+    size_t capacity = 0;
+    size_t total = 0;
+    char path[MAX_CACHE_PATH];
+
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        perror("audiosync: opendir for the cache failed");
+        return;
+    }
+
+    struct dirent *d;
+    while ((d = readdir(dp)) != NULL) {
+        // Only the files created by the cache are considered.
+        if (!is_track_file(d->d_name)
+                || strlen(d->d_name) >= sizeof(entries->name)) {
+            continue;
+        }
+
+        struct stat st;
+        snprintf(path, MAX_CACHE_PATH, "%s/%s", dir, d->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (n_entries == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            struct cache_entry *tmp = realloc(entries,
+                                              capacity * sizeof(*entries));
+            if (tmp == NULL) {
+                perror("audiosync: realloc for the cache entries failed");
+                goto finish;
+            }
+            entries = tmp;
+        }
+        strcpy(entries[n_entries].name, d->d_name);
+        entries[n_entries].mtime = st.st_mtim;
+        entries[n_entries].size = st.st_size;
+        total += st.st_size;
+        n_entries++;
+    }
+
+    qsort(entries, n_entries, sizeof(*entries), compare_entries);
+    for (size_t i = 0; i < n_entries && total > max_bytes; i++) {
+        snprintf(path, MAX_CACHE_PATH, "%s/%s", dir, entries[i].name);
+        if (unlink(path) < 0) {
+            perror("audiosync: unlink for the cached track failed");
+            continue;
+        }
+        LOG("removed %s from the cache", entries[i].name);
+        total -= entries[i].size;
+    }
+
+finish:
+    closedir(dp);
+    free(entries);
+}
+
+int track_cache_store(const char *title, const sample_t *buf, size_t len) {
+    DEBUG_ASSERT(title); DEBUG_ASSERT(buf);
+
+    int ret = -1;
+    FILE *fp = NULL;
+    size_t max_bytes;
+    char path[MAX_CACHE_PATH];
+    char tmp_path[MAX_CACHE_PATH];
+
+    char *dir = get_dir(&max_bytes);
+    if (dir == NULL || track_path(dir, title, path) < 0) {
+        goto finish;
+    }
+
+    // The track is written into a temporary file first, and then renamed,
+    // so that a half-written file is never loaded.
+    int n = snprintf(tmp_path, MAX_CACHE_PATH, "%s.%ld.%lu", path,
+                     (long) getpid(),
+                     __atomic_fetch_add(&tmp_count, 1, __ATOMIC_RELAXED));
+    if (n < 0 || n >= MAX_CACHE_PATH) {
+        LOG("cache path is too long");
+        goto finish;
+    }
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        perror("audiosync: fopen for the cached track failed");
+        goto finish;
+    }
+
+    const size_t title_len = strlen(title);
+    const struct cache_header header = {
+        .magic = { 'A', 'S', 'T', 'C' },
+        .version = CACHE_VERSION,
+        .sample_rate = SAMPLE_RATE,
+        .title_len = title_len,
+        .len = len,
+    };
+    const char padding[8] = { 0 };
+    const size_t padding_len = data_offset(title_len) - sizeof(header)
+                               - title_len;
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1
+                 || fwrite(title, 1, title_len, fp) != title_len
+                 || fwrite(padding, 1, padding_len, fp) != padding_len;
+
+    float block[STORE_BLOCK];
+    for (size_t i = 0; i < len && !failed; i += STORE_BLOCK) {
+        const size_t block_len = len - i < STORE_BLOCK ? len - i
+                                                       : STORE_BLOCK;
+        for (size_t k = 0; k < block_len; k++) {
+            block[k] = buf[i + k];
+        }
+        failed = fwrite(block, sizeof(*block), block_len, fp) != block_len;
+    }
+
+    // fclose may also fail when flushing the last block.
+    failed = fclose(fp) != 0 || failed;
+    fp = NULL;
+    if (failed) {
+        perror("audiosync: fwrite for the cached track failed");
+        unlink(tmp_path);
+        goto finish;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("audiosync: rename for the cached track failed");
+        unlink(tmp_path);
+        goto finish;
+    }
+    LOG("saved '%s' into the cache", title);
+
+    evict_tracks(dir, max_bytes);
+    ret = 0;
+
+finish:
+    if (fp) fclose(fp);
+    free(dir);
+
+    return ret;
+}
@@ -4,7 +4,23 @@
 #include <math.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/cross_correlation.h>
+#include <audiosync/fft_plans.h>
 
+#define NCC_LEN 2000
+#define PERIODIC_LEN 20000
+#define PERIOD 6000
+#define BASS_LEN 16000
+#define BASS_LAG 2345
+#define DRIFT_LEN 240000
+#define DRIFT_LAG 4321
+#define DRIFT_OFFSET 500.0
+
+
+// Simple pseudo-random noise between -0.5 and 0.5.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
 
 // Testing the cross_correlation function. These results can be compared to
 // matlab's implementation:
@@ -19,8 +35,8 @@ int main() {
     // Both arrays are the same: the displacement should be zero with a
     // coefficient of 1.
     printf(">> Test 1\n");
-    double source1[] = { 1.1,2.2,3.3,4.4,5.5,0,0,0,0,0 };
-    double sample1[] = { 1.1,2.2,3.3,4.4,5.5 };
+    sample_t source1[] = { 1.1,2.2,3.3,4.4,5.5,0,0,0,0,0 };
+    sample_t sample1[] = { 1.1,2.2,3.3,4.4,5.5 };
     length = sizeof(sample1) / sizeof(*sample1);
     ret = cross_correlation(source1, sample1, length, &lag, &coef);
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
@@ -30,8 +46,8 @@ int main() {
 
     // One array is filled with zeros, so an error should be returned.
     printf(">> Test 2\n");
-    double source2[] = { 1,2,3,4,5,6,7,8,9,10,11,12,13,14 };
-    double sample2[] = { 0,0,0,0,0,0,0 };
+    sample_t source2[] = { 1,2,3,4,5,6,7,8,9,10,11,12,13,14 };
+    sample_t sample2[] = { 0,0,0,0,0,0,0 };
     length = sizeof(sample2) / sizeof(*sample2);
     ret = cross_correlation(source2, sample2, length, &lag, &coef);
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
@@ -39,8 +55,8 @@ int main() {
 
     // Both arrays are linearly equal.
     printf(">> Test 3\n");
-    double source3[] = { 0,0,0,1,2,3,4,5,6,0,0,0 };
-    double sample3[] = { 1,2,3,4,5,6 };
+    sample_t source3[] = { 0,0,0,1,2,3,4,5,6,0,0,0 };
+    sample_t sample3[] = { 1,2,3,4,5,6 };
     length = sizeof(sample3) / sizeof(*sample3);
     ret = cross_correlation(source3, sample3, length, &lag, &coef);
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
@@ -50,8 +66,8 @@ int main() {
 
     // Similar to the test above, but the other way around.
     printf(">> Test 4\n");
-    double source4[] = { 1,2,3,0.4,1.1,0,0,0,0,0,0,0 };
-    double sample4[] = { 0,0,0,1,2,3 };
+    sample_t source4[] = { 1,2,3,0.4,1.1,0,0,0,0,0,0,0 };
+    sample_t sample4[] = { 0,0,0,1,2,3 };
     length = sizeof(sample4) / sizeof(*sample4);
     ret = cross_correlation(source4, sample4, length, &lag, &coef);
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
@@ -61,8 +77,8 @@ int main() {
 
     // Other simple tests
     printf(">> Test 5\n");
-    double source5[] = { 1,2,3,4,-1.0,0,0,4,3,2,1,0,0,0 };
-    double sample5[] = { 0,0,0,1,2,3,4 };
+    sample_t source5[] = { 1,2,3,4,-1.0,0,0,4,3,2,1,0,0,0 };
+    sample_t sample5[] = { 0,0,0,1,2,3,4 };
     length = sizeof(sample5) / sizeof(*sample5);
     ret = cross_correlation(source5, sample5, length, &lag, &coef);
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
@@ -71,8 +87,8 @@ int main() {
     assert(coef > MIN_CONFIDENCE);
 
     printf(">> Test 6\n");
-    double source6[] = { 0,0,0,0,0,1,2,3,4,-1,-3,-5,0,0 };
-    double sample6[] = { 1,2,3,4,-1,-3,-5 };
+    sample_t source6[] = { 0,0,0,0,0,1,2,3,4,-1,-3,-5,0,0 };
+    sample_t sample6[] = { 1,2,3,4,-1,-3,-5 };
     length = sizeof(sample6) / sizeof(*sample6);
     ret = cross_correlation(source6, sample6, length, &lag, &coef);
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
@@ -83,8 +99,8 @@ int main() {
     // Using a sine wave with positive linear correlation (same function).
     printf(">> Test 7\n");
     length = 1000;
-    double source7[length*2];
-    double sample7[length];
+    sample_t source7[length*2];
+    sample_t sample7[length];
     for (size_t i = 0; i < length*2; ++i)
         source7[i] = sin(i);
     for (size_t i = 0; i < length; ++i)
@@ -98,8 +114,8 @@ int main() {
     // Using a sine wave with negative linear correlation.
     printf(">> Test 8\n");
     length = 1000;
-    double source8[length*2];
-    double sample8[length];
+    sample_t source8[length*2];
+    sample_t sample8[length];
     for (size_t i = 0; i < length; ++i)
         source8[i] = sin(i + 180);
     for (size_t i = length; i < length*2; ++i)
@@ -112,5 +128,248 @@ int main() {
     assert(lag == -1);
     assert(coef < -MIN_CONFIDENCE);  // Leaving a margin for precision
 
+    // Same as test 7, but after measuring the plans for its size, which
+    // should give the same results. The signal is a chirp, since sin(i) is
+    // almost exactly inverted 355 frames later (113 half periods), and
+    // single precision can't tell which one of both peaks is higher.
+    printf(">> Test 9\n");
+    length = 1000;
+    ret = fft_plan_warmup(&length, 1, FFTW_MEASURE);
+    assert(ret == 0);
+    sample_t source9[length*2];
+    sample_t sample9[length];
+    for (size_t i = 0; i < length*2; ++i)
+        source9[i] = sin(i + 1e-3 * i * i);
+    for (size_t i = 0; i < length; ++i)
+        sample9[i] = sin(i + 1e-3 * i * i);
+    ret = cross_correlation(source9, sample9, length, &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 0);
+    assert(coef > MIN_CONFIDENCE);
+
+    // A plan created outside of the warm-up is only estimated, so the
+    // warm-up replaces it with a measured one.
+    const size_t estimated_len = 1200;
+    sample_t *real = FFTW(alloc_real)(2 * estimated_len);
+    sample_cpx_t *cpx = FFTW(alloc_complex)(estimated_len + 1);
+    assert(real != NULL && cpx != NULL);
+    struct plan_ref estimated = get_plan(R2C_PLAN, 2 * estimated_len, real,
+                                         cpx);
+    assert(estimated.plan != NULL && estimated.cached);
+    ret = fft_plan_warmup(&estimated_len, 1, FFTW_MEASURE);
+    assert(ret == 0);
+    struct plan_ref measured = get_plan(R2C_PLAN, 2 * estimated_len, real,
+                                        cpx);
+    assert(measured.plan != NULL && measured.plan != estimated.plan);
+    // Measuring it again doesn't replace it.
+    ret = fft_plan_warmup(&estimated_len, 1, FFTW_MEASURE);
+    assert(ret == 0);
+    assert(get_plan(R2C_PLAN, 2 * estimated_len, real, cpx).plan
+           == measured.plan);
+    FFTW(free)(real);
+    FFTW(free)(cpx);
+
+    // Reusing the same workspace for different lengths, with both a regular
+    // and a zero-padded sample. The results should be the same as test 3.
+    printf(">> Test 10\n");
+    struct xcorr_workspace *ws = xcorr_workspace_new(length);
+    assert(ws != NULL);
+    ret = xcorr_workspace_run(ws, source9, sample9, length, 0, &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 0);
+    assert(coef > MIN_CONFIDENCE);
+    sample_t sample10[] = { 1,2,3,4,5,6,0,0,0,0,0,0 };
+    length = sizeof(sample3) / sizeof(*sample3);
+    ret = xcorr_workspace_run(ws, source3, sample10, length, 1, &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 3);
+    assert(coef > MIN_CONFIDENCE);
+    // The sample is too big for the workspace.
+    ret = xcorr_workspace_run(ws, source7, sample7, 2000, 0, &lag, &coef);
+    printf(">> Returned %d\n", ret);
+    assert(ret == -1);
+    xcorr_workspace_free(ws);
+
+    // The normalized cross-correlation must return the same lag as checking
+    // the coefficient of every lag overlapping at least half of the sample,
+    // here with a noisy copy of the sample displaced to the left.
+    printf(">> Test 11\n");
+    unsigned seed = 1234;
+    sample_t *source11 = malloc(2 * NCC_LEN * sizeof(*source11));
+    sample_t *sample11 = malloc(NCC_LEN * sizeof(*sample11));
+    assert(source11 != NULL && sample11 != NULL);
+    for (size_t i = 0; i < 2 * NCC_LEN; i++)
+        source11[i] = noise(&seed);
+    for (size_t i = 0; i < NCC_LEN; i++)
+        sample11[i] = i < 321 ? noise(&seed)
+                              : source11[i - 321] + 0.5 * noise(&seed);
+    long best_lag = 0;
+    double best_coef = -1.0;
+    for (long k = -NCC_LEN / 2; k < NCC_LEN; k++) {
+        const double c = lag_coefficient(source11, sample11, NCC_LEN, k);
+        if (c > best_coef) {
+            best_coef = c;
+            best_lag = k;
+        }
+    }
+    ws = xcorr_workspace_new(NCC_LEN);
+    assert(ws != NULL);
+    ret = xcorr_workspace_ncc(ws, source11, sample11, NCC_LEN, 0, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f (expected lag=%ld coef=%f)\n",
+           ret, lag, coef, best_lag, best_coef);
+    assert(ret == 0);
+    assert(lag == -321 && lag == best_lag);
+    assert(fabs(coef - best_coef) < 1e-4);
+
+    // The second half of the source is much louder, so its peak in the
+    // cross-correlation is higher than the one of the actual lag, which is
+    // zero, but its coefficient isn't.
+    printf(">> Test 12\n");
+    for (size_t i = 0; i < 2 * NCC_LEN; i++)
+        source11[i] = (i < NCC_LEN ? 1.0 : 100.0) * noise(&seed);
+    for (size_t i = 0; i < NCC_LEN; i++)
+        sample11[i] = source11[i] + noise(&seed);
+    ret = xcorr_workspace_run(ws, source11, sample11, NCC_LEN, 0, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f with the raw peak\n", ret, lag,
+           coef);
+    ret = xcorr_workspace_ncc(ws, source11, sample11, NCC_LEN, 0, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 0);
+    assert(fabs(coef - lag_coefficient(source11, sample11, NCC_LEN, 0))
+           < 1e-4);
+    xcorr_workspace_free(ws);
+    free(source11);
+    free(sample11);
+
+    // The audio is periodic after the first 1000 frames, and it's louder and
+    // noisier after the sample, so the highest peaks of the cross-correlation
+    // are its aliases, like 19000, 13000 or 25000 (which also reads as
+    // -15000), but the actual lag is 1000.
+    printf(">> Test 13\n");
+    sample_t pattern[PERIOD];
+    for (size_t i = 0; i < PERIOD; i++)
+        pattern[i] = noise(&seed);
+    sample_t *source13 = malloc(2 * PERIODIC_LEN * sizeof(*source13));
+    sample_t *sample13 = malloc(PERIODIC_LEN * sizeof(*sample13));
+    assert(source13 != NULL && sample13 != NULL);
+    for (size_t i = 0; i < 2 * PERIODIC_LEN; i++) {
+        source13[i] = pattern[(i + PERIOD - 1000) % PERIOD];
+        if (i < 1000)
+            source13[i] = noise(&seed);
+        if (i >= 1000 + PERIODIC_LEN)
+            source13[i] = 3.0 * source13[i] + 3.0 * noise(&seed);
+    }
+    for (size_t i = 0; i < PERIODIC_LEN; i++)
+        sample13[i] = source13[i + 1000];
+    ws = xcorr_workspace_new(PERIODIC_LEN);
+    assert(ws != NULL);
+    struct xcorr_result result;
+    ret = xcorr_workspace_peaks(ws, source13, sample13, PERIODIC_LEN, 0,
+                                &result);
+    printf(">> Returned %d: lag=%ld coef=%f margin=%f\n", ret, result.lag,
+           result.coefficient, result.margin);
+    assert(ret == 0);
+    assert(result.lag == 1000);
+    assert(result.coefficient > MIN_CONFIDENCE);
+    assert(result.margin > 0.0 && result.margin < result.coefficient);
+
+    // xcorr_workspace_run only checks the highest peak by default, which is
+    // one of the aliases, unless the rest are enabled as well.
+    ret = xcorr_workspace_run(ws, source13, sample13, PERIODIC_LEN, 0, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f with the highest peak\n", ret,
+           lag, coef);
+    assert(ret == 0);
+    assert(lag != 1000);
+    xcorr_workspace_set_multi_peak(ws, 1);
+    ret = xcorr_workspace_run(ws, source13, sample13, PERIODIC_LEN, 0, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f with the highest peaks\n", ret,
+           lag, coef);
+    assert(ret == 0);
+    assert(lag == 1000 && coef == result.coefficient);
+    xcorr_workspace_free(ws);
+    free(source13);
+    free(sample13);
+
+    // Most of the energy is in the bass, which is heavily low-pass filtered
+    // noise, so the plain cross-correlation has a very broad peak. Every
+    // weighting must find the same lag, with a much sharper peak: its value
+    // a few frames away from the lag should be lower relative to the peak.
+    printf(">> Test 14\n");
+    sample_t *source14 = malloc(2 * BASS_LEN * sizeof(*source14));
+    sample_t *sample14 = malloc(BASS_LEN * sizeof(*sample14));
+    assert(source14 != NULL && sample14 != NULL);
+    double bass = 0.0;
+    for (size_t i = 0; i < 2 * BASS_LEN; i++) {
+        bass = 0.995 * bass + noise(&seed);
+        source14[i] = bass + 0.05 * noise(&seed);
+    }
+    for (size_t i = 0; i < BASS_LEN; i++)
+        sample14[i] = source14[i + BASS_LAG] + 0.05 * noise(&seed);
+    ws = xcorr_workspace_new(BASS_LEN);
+    assert(ws != NULL);
+    const weighting_t weightings[] = {
+        NO_WEIGHTING, PHAT_WEIGHTING, COHERENCE_WEIGHTING, BAND_WEIGHTING
+    };
+    double plain_ratio = 0.0;
+    for (size_t w = 0; w < sizeof(weightings) / sizeof(*weightings); w++) {
+        assert(xcorr_workspace_set_weighting(ws, weightings[w], SAMPLE_RATE)
+               == 0);
+        sample_t *results = xcorr_workspace_correlate(ws, source14, sample14,
+                                                      BASS_LEN, 0);
+        assert(results != NULL);
+        const double ratio = fabs(results[BASS_LAG + 10])
+            / fabs(results[BASS_LAG]);
+        ret = xcorr_workspace_run(ws, source14, sample14, BASS_LEN, 0, &lag,
+                                  &coef);
+        printf(">> Returned %d: lag=%ld coef=%f ratio=%f with %s\n", ret,
+               lag, coef, ratio, weighting_to_string(weightings[w]));
+        assert(ret == 0);
+        assert(lag == BASS_LAG);
+        assert(coef > MIN_CONFIDENCE);
+        if (weightings[w] == NO_WEIGHTING) {
+            plain_ratio = ratio;
+        } else {
+            assert(ratio < plain_ratio / 4);
+        }
+    }
+    xcorr_workspace_free(ws);
+    free(source14);
+    free(sample14);
+
+    // A long sample with a big DC offset, so that the variances are the
+    // difference of two huge running sums. The coefficient must still be the
+    // same as the one calculated directly for the lag.
+    printf(">> Test 15\n");
+    sample_t *source15 = malloc(2 * DRIFT_LEN * sizeof(*source15));
+    sample_t *sample15 = malloc(DRIFT_LEN * sizeof(*sample15));
+    assert(source15 != NULL && sample15 != NULL);
+    for (size_t i = 0; i < 2 * DRIFT_LEN; i++)
+        source15[i] = DRIFT_OFFSET + noise(&seed);
+    for (size_t i = 0; i < DRIFT_LEN; i++)
+        sample15[i] = source15[i + DRIFT_LAG] + 0.5 * noise(&seed);
+    ws = xcorr_workspace_new(DRIFT_LEN);
+    assert(ws != NULL);
+    ret = xcorr_workspace_ncc(ws, source15, sample15, DRIFT_LEN, 0, &lag,
+                              &coef);
+    const double expected = lag_coefficient(source15, sample15, DRIFT_LEN,
+                                            DRIFT_LAG);
+    printf(">> Returned %d: lag=%ld coef=%f (expected coef=%f)\n", ret, lag,
+           coef, expected);
+    assert(ret == 0);
+    assert(lag == DRIFT_LAG);
+    assert(fabs(coef - expected) < 1e-4);
+    xcorr_workspace_free(ws);
+    free(source15);
+    free(sample15);
+
     return 0;
 }
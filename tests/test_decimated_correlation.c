@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/decimated_correlation.h>
+
+#define FACTOR 8
+#define MAX_SAMPLE_LEN 4000
+
+
+// Simple pseudo-random noise, so that there's a single clear peak in the
+// cross-correlation.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
+
+// Testing the decimated engine, whose results should be the same as the
+// regular cross_correlation function, even when the lag isn't a multiple of
+// the decimation factor.
+int main() {
+    int ret;
+    long lag;
+    double coef;
+    unsigned seed = 1234;
+    sample_t source[2 * MAX_SAMPLE_LEN];
+    sample_t sample[MAX_SAMPLE_LEN];
+    struct decimated_xcorr *d = decimated_xcorr_new(FACTOR, MAX_SAMPLE_LEN);
+    assert(d != NULL);
+
+    // The sample is displaced to the right. Both a smaller interval and the
+    // full one should return the same lag as cross_correlation.
+    printf(">> Test 1\n");
+    for (size_t i = 0; i < 2 * MAX_SAMPLE_LEN; i++)
+        source[i] = noise(&seed);
+    for (size_t i = 0; i < MAX_SAMPLE_LEN; i++)
+        sample[i] = source[i + 373];
+    ret = decimated_xcorr_run(d, source, sample, MAX_SAMPLE_LEN / 2, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 373);
+    assert(coef > MIN_CONFIDENCE);
+    ret = decimated_xcorr_run(d, source, sample, MAX_SAMPLE_LEN, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 373);
+    assert(coef > MIN_CONFIDENCE);
+    long full_lag;
+    double full_coef;
+    ret = cross_correlation(source, sample, MAX_SAMPLE_LEN, &full_lag,
+                            &full_coef);
+    assert(ret == 0);
+    assert(full_lag == lag);
+    assert(fabs(full_coef - coef) < 1e-9);
+
+    // The sample is displaced to the left, and its first frames aren't in
+    // the source.
+    printf(">> Test 2\n");
+    for (size_t i = 0; i < 2 * MAX_SAMPLE_LEN; i++)
+        source[i] = noise(&seed);
+    for (size_t i = 0; i < 835; i++)
+        sample[i] = noise(&seed);
+    for (size_t i = 835; i < MAX_SAMPLE_LEN; i++)
+        sample[i] = source[i - 835];
+    ret = decimated_xcorr_run(d, source, sample, MAX_SAMPLE_LEN, &lag,
+                              &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == -835);
+    assert(coef > MIN_CONFIDENCE);
+
+    // The sample is too big for the engine, or too small to be decimated,
+    // so an error should be returned.
+    printf(">> Test 3\n");
+    ret = decimated_xcorr_run(d, source, sample, 2 * MAX_SAMPLE_LEN, &lag,
+                              &coef);
+    printf(">> Returned %d\n", ret);
+    assert(ret == -1);
+    ret = decimated_xcorr_run(d, source, sample, FACTOR - 1, &lag, &coef);
+    printf(">> Returned %d\n", ret);
+    assert(ret == -1);
+
+    decimated_xcorr_free(d);
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fingerprint.h>
+
+#define TRACK_LEN (40 * SAMPLE_RATE)
+#define QUERY_LEN (5 * SAMPLE_RATE)
+#define NOTE_LEN (SAMPLE_RATE / 5)
+// The offset of the query in the second track, which isn't a multiple of
+// the hop.
+#define QUERY_OFFSET (17 * SAMPLE_RATE + 333)
+#define INDEX_PATH "/tmp/audiosync_test_index"
+
+
+// Simple pseudo-random noise between -0.5 and 0.5.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
+
+// Generates a "melody" of random notes with a few harmonics, which fade
+// out after being played, and some noise.
+static void melody(sample_t *track, size_t len, unsigned seed) {
+    double freq = 0.0;
+    unsigned notes = seed * 2654435761u;
+    for (size_t i = 0; i < len; i++) {
+        // The notes use their own generator, so that they're independent
+        // from the noise.
+        if (i % NOTE_LEN == 0) {
+            freq = 100.0 * pow(2.0, 5.0 * (noise(&notes) + 0.5));
+        }
+        const double t = (double) i / SAMPLE_RATE;
+        const double decay = exp(-10.0 * (i % NOTE_LEN) / SAMPLE_RATE);
+        track[i] = decay * (0.4 * sin(2 * M_PI * freq * t)
+                            + 0.2 * sin(2 * M_PI * 2.01 * freq * t)
+                            + 0.1 * sin(2 * M_PI * 3.03 * freq * t))
+                   + 0.02 * noise(&seed);
+    }
+}
+
+static void check_match(const struct fp_index *index, const sample_t *query) {
+    struct fp_match match;
+    assert(fp_index_match(index, NULL, query, QUERY_LEN, &match) == 0);
+    printf("offset=%ld votes=%ld confidence=%f\n", match.offset, match.votes,
+           match.confidence);
+    assert(match.track == 1);
+    assert(labs(match.offset - QUERY_OFFSET) < 512);
+    assert(match.confidence >= MIN_CONFIDENCE);
+}
+
+// Testing that a short sample is found anywhere in the right track, even
+// with some noise, both with a new index and one loaded from disk.
+int main() {
+    unsigned seed = 4321;
+    sample_t *first = malloc(TRACK_LEN * sizeof(*first));
+    sample_t *second = malloc(TRACK_LEN * sizeof(*second));
+    sample_t *query = malloc(QUERY_LEN * sizeof(*query));
+    assert(first != NULL && second != NULL && query != NULL);
+    melody(first, TRACK_LEN, 1111);
+    melody(second, TRACK_LEN, 2222);
+    for (size_t i = 0; i < QUERY_LEN; i++)
+        query[i] = 0.8 * second[QUERY_OFFSET + i] + 0.05 * noise(&seed);
+
+    // Nothing can be matched in an empty index.
+    printf(">> Test 1\n");
+    struct fp_index *index = fp_index_new();
+    assert(index != NULL);
+    struct fp_match match;
+    assert(fp_index_match(index, NULL, query, QUERY_LEN, &match) < 0);
+
+    printf(">> Test 2\n");
+    assert(fp_index_add(index, "first", first, TRACK_LEN) == 0);
+    assert(fp_index_add(index, "second", second, TRACK_LEN) == 0);
+    assert(fp_index_len(index) == 2);
+    check_match(index, query);
+
+    // The same results after saving and loading it.
+    printf(">> Test 3\n");
+    assert(fp_index_save(index, INDEX_PATH) == 0);
+    fp_index_free(index);
+    index = fp_index_load(INDEX_PATH);
+    assert(index != NULL);
+    assert(fp_index_len(index) == 2);
+    assert(strcmp(fp_index_title(index, 1), "second") == 0);
+    check_match(index, query);
+
+    // Tracks can still be added to a loaded index.
+    printf(">> Test 4\n");
+    assert(fp_index_add(index, "first again", first, TRACK_LEN) == 0);
+    assert(fp_index_len(index) == 3);
+    check_match(index, query);
+
+    // Only the requested track is matched: the sample is from "second", so
+    // it's found when that one is requested, but not when it's one of the
+    // others, or a track that isn't in the index.
+    printf(">> Test 5\n");
+    assert(fp_index_match(index, "second", query, QUERY_LEN, &match) == 0);
+    assert(match.track == 1);
+    assert(labs(match.offset - QUERY_OFFSET) < 512);
+    assert(match.confidence >= MIN_CONFIDENCE);
+    assert(fp_index_match(index, "first", query, QUERY_LEN, &match) < 0
+           || (match.track == 0 && match.confidence < MIN_CONFIDENCE));
+    assert(fp_index_match(index, "third", query, QUERY_LEN, &match) < 0);
+
+    // A sample that isn't in the index isn't confident.
+    printf(">> Test 6\n");
+    melody(query, QUERY_LEN, 3333);
+    assert(fp_index_match(index, NULL, query, QUERY_LEN, &match) < 0
+           || match.confidence < MIN_CONFIDENCE);
+
+    fp_index_free(index);
+    unlink(INDEX_PATH);
+    free(first);
+    free(second);
+    free(query);
+
+    return 0;
+}
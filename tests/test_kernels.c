@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fft_plans.h>
+#include <audiosync/kernels.h>
+
+// Odd so that the vectorized kernels also have remaining elements, and long
+// enough for kernel_max_abs_index to be split between threads.
+#define LEN 1001
+#define LONG_LEN 1234567
+
+
+// Simple pseudo-random noise between -0.5 and 0.5.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
+
+// Testing the kernels with every instruction set supported by the CPU, whose
+// results should be the same as the C99 complex operators and a simple loop.
+int main() {
+    unsigned seed = 1234;
+    size_t ret;
+    sample_cpx_t a[LEN], b[LEN], acc[LEN], expected[LEN];
+    sample_t *arr = malloc(LONG_LEN * sizeof(*arr));
+    assert(arr != NULL);
+
+    const isa_t isas[] = { GENERIC_ISA, AVX2_ISA, AVX512_ISA };
+    for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+        if (kernels_set_isa(isas[i]) < 0) continue;
+        printf(">> Using %s\n", isa_to_string(isas[i]));
+
+        // The product by the conjugate, and its accumulation.
+        printf(">> Test 1\n");
+        for (size_t k = 0; k < LEN; k++) {
+            a[k] = noise(&seed) + noise(&seed) * I;
+            b[k] = noise(&seed) + noise(&seed) * I;
+            acc[k] = noise(&seed) + noise(&seed) * I;
+            expected[k] = acc[k] + a[k] * conj(b[k]);
+        }
+        kernel_conj_multiply_add(acc, a, b, LEN);
+        for (size_t k = 0; k < LEN; k++)
+            assert(cabs(acc[k] - expected[k]) < 1e-6);
+        for (size_t k = 0; k < LEN; k++)
+            expected[k] = a[k] * conj(b[k]);
+        kernel_conj_multiply(a, b, LEN);
+        for (size_t k = 0; k < LEN; k++)
+            assert(cabs(a[k] - expected[k]) < 1e-6);
+
+        // The absolute maximum, which is negative, at the start, at the end
+        // and between the vectorized part and the remaining elements.
+        printf(">> Test 2\n");
+        for (size_t k = 0; k < LONG_LEN; k++)
+            arr[k] = noise(&seed);
+        const size_t positions[] = { 0, 1, 777, LEN - 1, 412345,
+                                     LONG_LEN - 1 };
+        for (size_t p = 0; p < sizeof(positions) / sizeof(positions[0]);
+             p++) {
+            arr[positions[p]] = -2.0;
+            if (positions[p] < LEN) {
+                ret = kernel_max_abs_index(arr, LEN);
+                assert(ret == positions[p]);
+            }
+            ret = kernel_max_abs_index(arr, LONG_LEN);
+            printf(">> Returned %ld (expected %ld)\n", ret, positions[p]);
+            assert(ret == positions[p]);
+            arr[positions[p]] = 0.0;
+        }
+
+        // If the first element is negative, it must still be compared by
+        // its absolute value. In case of ties, the first index is returned.
+        printf(">> Test 3\n");
+        sample_t small[] = { -5.0, 1.0, 2.0, -3.0, 4.0, 0.5, 1.0, 3.0, 2.0 };
+        ret = kernel_max_abs_index(small, sizeof(small) / sizeof(small[0]));
+        printf(">> Returned %ld\n", ret);
+        assert(ret == 0);
+        for (size_t k = 0; k < LONG_LEN; k++)
+            arr[k] = k % 3 == 0 ? 1.0 : -1.0;
+        ret = kernel_max_abs_index(arr + 1, LONG_LEN - 1);
+        printf(">> Returned %ld\n", ret);
+        assert(ret == 0);
+        arr[LONG_LEN - 2] = 2.0;
+        arr[600001] = -2.0;
+        ret = kernel_max_abs_index(arr, LONG_LEN);
+        printf(">> Returned %ld\n", ret);
+        assert(ret == 600001);
+    }
+
+    free(arr);
+
+    return 0;
+}
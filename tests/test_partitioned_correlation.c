@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/partitioned_correlation.h>
+
+#define BLOCK_LEN 50
+#define MAX_SAMPLE_LEN 400
+#define CHUNK_LEN 30
+
+
+// Simple pseudo-random noise, so that there's a single clear peak in the
+// cross-correlation.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
+
+// The lag with the highest absolute value of the cross-correlation,
+// calculated directly from its definition.
+static long direct_peak(const sample_t *source, const sample_t *sample,
+                        size_t len) {
+    double max_val = -1.0;
+    long max_lag = 0;
+    for (long lag = -(long) len + 1; lag < (long) len; lag++) {
+        double sum = 0.0;
+        for (long n = 0; n < (long) len; n++) {
+            if (n + lag >= 0 && n + lag < 2 * (long) len)
+                sum += sample[n] * source[n + lag];
+        }
+        if (fabs(sum) > max_val) {
+            max_val = fabs(sum);
+            max_lag = lag;
+        }
+    }
+
+    return max_lag;
+}
+
+// Feeds the data to the engine in small chunks, as if it was being read
+// by the threads, until the interval of `sample_len` is complete.
+static void feed(struct partitioned_xcorr *p, sample_t *source,
+                 sample_t *sample, size_t sample_len) {
+    for (size_t len = 0; len <= 2 * sample_len; len += CHUNK_LEN) {
+        int ret = partitioned_xcorr_update(p, source, len, sample,
+                                           len / 2, sample_len);
+        assert(ret == 0);
+    }
+    int ret = partitioned_xcorr_update(p, source, 2 * sample_len, sample,
+                                       sample_len, sample_len);
+    assert(ret == 0);
+}
+
+// Testing the partitioned engine, whose results should be the same as the
+// regular cross_correlation function, in intervals of different sizes.
+int main() {
+    int ret;
+    long lag;
+    double coef;
+    unsigned seed = 1234;
+    sample_t source[2 * MAX_SAMPLE_LEN];
+    sample_t sample[MAX_SAMPLE_LEN];
+    struct partitioned_xcorr *p = partitioned_xcorr_new(BLOCK_LEN,
+                                                        MAX_SAMPLE_LEN);
+    assert(p != NULL);
+
+    // The sample is displaced to the right. Both intervals should return the
+    // same lag, and the same results as cross_correlation.
+    printf(">> Test 1\n");
+    for (size_t i = 0; i < 2 * MAX_SAMPLE_LEN; i++)
+        source[i] = noise(&seed);
+    for (size_t i = 0; i < MAX_SAMPLE_LEN; i++)
+        sample[i] = source[i + 37];
+    feed(p, source, sample, MAX_SAMPLE_LEN / 2);
+    ret = partitioned_xcorr_result(p, source, sample, MAX_SAMPLE_LEN / 2,
+                                   &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 37);
+    assert(coef > MIN_CONFIDENCE);
+    feed(p, source, sample, MAX_SAMPLE_LEN);
+    ret = partitioned_xcorr_result(p, source, sample, MAX_SAMPLE_LEN,
+                                   &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 37);
+    assert(coef > MIN_CONFIDENCE);
+    long full_lag;
+    double full_coef;
+    ret = cross_correlation(source, sample, MAX_SAMPLE_LEN, &full_lag,
+                            &full_coef);
+    assert(ret == 0);
+    assert(full_lag == lag);
+    assert(fabs(full_coef - coef) < 1e-9);
+
+    // The sample is displaced to the left, and its first frames aren't in
+    // the source.
+    printf(">> Test 2\n");
+    partitioned_xcorr_reset(p);
+    for (size_t i = 0; i < 2 * MAX_SAMPLE_LEN; i++)
+        source[i] = noise(&seed);
+    for (size_t i = 0; i < 83; i++)
+        sample[i] = noise(&seed);
+    for (size_t i = 83; i < MAX_SAMPLE_LEN; i++)
+        sample[i] = source[i - 83];
+    feed(p, source, sample, MAX_SAMPLE_LEN);
+    ret = partitioned_xcorr_result(p, source, sample, MAX_SAMPLE_LEN,
+                                   &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == -83);
+    assert(coef > MIN_CONFIDENCE);
+
+    // The interval hasn't been processed yet, so an error should be
+    // returned.
+    printf(">> Test 3\n");
+    partitioned_xcorr_reset(p);
+    ret = partitioned_xcorr_result(p, source, sample, MAX_SAMPLE_LEN,
+                                   &lag, &coef);
+    printf(">> Returned %d\n", ret);
+    assert(ret == -1);
+
+    // The intervals must be a multiple of the block length.
+    printf(">> Test 4\n");
+    feed(p, source, sample, MAX_SAMPLE_LEN / 2);
+    ret = partitioned_xcorr_result(p, source, sample, MAX_SAMPLE_LEN / 2 + 1,
+                                   &lag, &coef);
+    printf(">> Returned %d\n", ret);
+    assert(ret == -1);
+
+    // With a lot of noise the peak barely stands out, so most ranges of lags
+    // have to be checked again. Every interval must still give the highest
+    // peak of the cross-correlation.
+    printf(">> Test 5\n");
+    partitioned_xcorr_reset(p);
+    for (size_t i = 0; i < 2 * MAX_SAMPLE_LEN; i++)
+        source[i] = noise(&seed);
+    for (size_t i = 0; i < MAX_SAMPLE_LEN; i++)
+        sample[i] = 0.3 * source[i + 161] + noise(&seed);
+    for (size_t len = BLOCK_LEN; len <= MAX_SAMPLE_LEN; len += BLOCK_LEN) {
+        feed(p, source, sample, len);
+        ret = partitioned_xcorr_result(p, source, sample, len, &lag, &coef);
+        printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+        assert(ret == 0);
+        assert(lag == direct_peak(source, sample, len));
+    }
+    assert(lag == 161);
+
+    partitioned_xcorr_free(p);
+
+    return 0;
+}
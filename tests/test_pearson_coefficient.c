@@ -4,6 +4,31 @@
 #include <math.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/cross_correlation.h>
+#include <audiosync/kernels.h>
+
+// Long enough to be split between threads.
+#define LONG_LEN 1234567
+
+
+// The previous two-pass implementation, used as a reference.
+static double reference_pearson(sample_t *x, sample_t *y, size_t len) {
+    double avg1 = 0.0, avg2 = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        avg1 += x[i];
+        avg2 += y[i];
+    }
+    avg1 /= len;
+    avg2 /= len;
+
+    double diffprod = 0.0, diff1_squared = 0.0, diff2_squared = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        diffprod += (x[i] - avg1) * (y[i] - avg2);
+        diff1_squared += (x[i] - avg1) * (x[i] - avg1);
+        diff2_squared += (y[i] - avg2) * (y[i] - avg2);
+    }
+
+    return diffprod / sqrt(diff1_squared * diff2_squared);
+}
 
 
 // Testing the Pearson Correlation Coefficient. These results can be compared
@@ -18,8 +43,8 @@ int main() {
     // Basic tests for identical source and sample.
     // Test 1 simulates a displacement to the left.
     printf(">> Test 1\n");
-    double source1[] = { 1.0,2.1,3.2,4.3,5.4,6.5,7.6,8.7,9.8,10.9 };
-    double sample1[] = { 0,0,1.0,2.1,3.2,4.3,5.4,6.5,7.6,8.7 };
+    sample_t source1[] = { 1.0,2.1,3.2,4.3,5.4,6.5,7.6,8.7,9.8,10.9 };
+    sample_t sample1[] = { 0,0,1.0,2.1,3.2,4.3,5.4,6.5,7.6,8.7 };
     len = sizeof(sample1) / sizeof(*sample1);
     lag = -2;
     ret = pearson_coefficient(source1, source1 + lag + len,
@@ -29,8 +54,8 @@ int main() {
 
     // Test 2 simulates a displacement to the right.
     printf(">> Test 2\n");
-    double source2[] = { 0,0,0,0,100,200,300,400,500,600,700 };
-    double sample2[] = { 100,200,300,400,500 };
+    sample_t source2[] = { 0,0,0,0,100,200,300,400,500,600,700 };
+    sample_t sample2[] = { 100,200,300,400,500 };
     len = sizeof(sample2) / sizeof(*sample2);
     lag = 4;
     ret = pearson_coefficient(source2 + lag, source2 + lag + len,
@@ -40,8 +65,8 @@ int main() {
 
     // Testing negative linear correlation
     printf(">> Test 3\n");
-    double source3[] = { 1,2,3,4 };
-    double sample3[] = { 4,3,2,1 };
+    sample_t source3[] = { 1,2,3,4 };
+    sample_t sample3[] = { 4,3,2,1 };
     len = sizeof(source3) / sizeof(*source3);
     ret = pearson_coefficient(source3, source3 + len, sample3, sample3 + len);
     printf(">> Returned %f between %ld and %ld\n", ret, 0L, len);
@@ -50,12 +75,42 @@ int main() {
     // Testing that on error, NaN is returned (in this case, an array filled
     // with zeroes isn't defined in the Pearson Correlation Coefficient).
     printf(">> Test 4\n");
-    double source4[] = { 1,2,3,4 };
-    double sample4[] = { 0,0,0,0 };
+    sample_t source4[] = { 1,2,3,4 };
+    sample_t sample4[] = { 0,0,0,0 };
     len = sizeof(source4) / sizeof(*source4);
     ret = pearson_coefficient(source4, source4 + len, sample4, sample4 + len);
     printf(">> Returned %f between %ld and %ld\n", ret, 0L, len);
     assert(ret != ret);
 
+    // Comparing the results of every instruction set supported with the
+    // reference implementation, with a long span and an offset that isn't
+    // aligned to the vectors.
+    printf(">> Test 5\n");
+    sample_t *source5 = malloc((LONG_LEN + 1) * sizeof(*source5));
+    sample_t *sample5 = malloc(LONG_LEN * sizeof(*sample5));
+    assert(source5 != NULL && sample5 != NULL);
+    unsigned seed = 1234;
+    for (size_t i = 0; i < LONG_LEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        source5[i] = sin(i * 0.001) + 10.0;
+        sample5[i] = source5[i] + ((seed >> 16) & 0x7fff) / 32767.0;
+    }
+    source5[LONG_LEN] = 0.0;
+    const isa_t isas[] = { GENERIC_ISA, AVX2_ISA, AVX512_ISA };
+    for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+        if (kernels_set_isa(isas[i]) < 0) continue;
+        for (size_t len5 = 1001; len5 <= LONG_LEN; len5 += LONG_LEN - 1001) {
+            const double expected = reference_pearson(source5 + 1, sample5,
+                                                      len5 - 1);
+            ret = pearson_coefficient(source5 + 1, source5 + len5, sample5,
+                                      sample5 + len5 - 1);
+            printf(">> Returned %f with %s for %ld elements (expected %f)\n",
+                   ret, isa_to_string(isas[i]), len5 - 1, expected);
+            assert(fabs(ret - expected) < 1e-9);
+        }
+    }
+    free(source5);
+    free(sample5);
+
     return 0;
 }
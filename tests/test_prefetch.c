@@ -0,0 +1,171 @@
+#define _GNU_SOURCE  // setenv(), mkstemp(), usleep()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/prefetch.h>
+
+// The length of the WAV file served by the stubs, and of the prefetched
+// sources, with two intervals.
+#define WAV_LEN (2 * SAMPLE_RATE)
+#define SOURCE_LEN SAMPLE_RATE
+#define WAIT_MS 10000
+// The sources are downloaded at half their speed in some tests, which takes
+// two seconds, so the ones aborted halfway must stop well before that.
+#define ABORTED_MS 1500
+
+
+static int16_t wav_sample(size_t i) {
+    return (int16_t) ((i * 7919) % 65536 - 32768);
+}
+
+static void put_le(FILE *fp, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc((value >> (8 * i)) & 0xff, fp);
+    }
+}
+
+// Writes the 16 bits, mono WAV file read by the ffmpeg stub.
+static void write_wav(int fd) {
+    FILE *fp = fdopen(fd, "wb");
+    assert(fp != NULL);
+    const uint32_t data_bytes = WAV_LEN * sizeof(int16_t);
+    fputs("RIFF", fp); put_le(fp, 36 + data_bytes, 4);
+    fputs("WAVEfmt ", fp); put_le(fp, 16, 4);
+    put_le(fp, 1, 2); put_le(fp, 1, 2);
+    put_le(fp, SAMPLE_RATE, 4); put_le(fp, SAMPLE_RATE * 2, 4);
+    put_le(fp, 2, 2); put_le(fp, 16, 2);
+    fputs("data", fp); put_le(fp, data_bytes, 4);
+    for (size_t i = 0; i < WAV_LEN; i++) {
+        put_le(fp, (uint16_t) wav_sample(i), 2);
+    }
+    assert(fclose(fp) == 0);
+}
+
+// The first interval of a finished source must be the start of the file.
+// The rest may be padded, since the reads stop close to the end.
+static void check_data(struct ffmpeg_data *data) {
+    assert(__atomic_load_n(&data->len, __ATOMIC_ACQUIRE) == SOURCE_LEN);
+    for (size_t i = 0; i < data->intervals[0]; i++) {
+        assert(data->buf[i] == wav_sample(i) / 32768.0);
+    }
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3
+           + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void wait_finished(struct ffmpeg_data *data) {
+    for (int ms = 0; ms < WAIT_MS; ms += 10) {
+        if (__atomic_load_n(&data->len, __ATOMIC_ACQUIRE) == SOURCE_LEN) {
+            return;
+        }
+        usleep(10 * 1000);
+    }
+    assert(0 && "the prefetched source wasn't finished");
+}
+
+// Testing the queue of prefetched sources, with the stubs of youtube-dl and
+// ffmpeg of the end-to-end benchmark, which serve a WAV file. The
+// environment of the stubs is only changed while no downloads are running.
+int main() {
+    char wav_path[] = "/tmp/audiosync_prefetch_XXXXXX";
+    const int fd = mkstemp(wav_path);
+    assert(fd >= 0);
+    write_wav(fd);
+
+    char path[8192];
+    snprintf(path, sizeof(path), "%s:%s", STUBS_DIR, getenv("PATH"));
+    setenv("PATH", path, 1);
+    setenv("E2E_SOURCE", wav_path, 1);
+    setenv("E2E_DOWNLOAD_SPEED", "0", 1);
+
+    const size_t intervals[] = {SOURCE_LEN / 2, SOURCE_LEN};
+    const size_t n_intervals = sizeof(intervals) / sizeof(*intervals);
+    struct audiosync_session *session = audiosync_session_new();
+    assert(session != NULL);
+    struct prefetch_entry *entry;
+
+    // The oldest source is evicted from a full queue, and the rest are
+    // taken after they're done.
+    printf(">> Test 1\n");
+    prefetch_set_capacity(2);
+    assert(prefetch_add("first", SOURCE_LEN, intervals, n_intervals) == 0);
+    assert(prefetch_add("second", SOURCE_LEN, intervals, n_intervals) == 0);
+    assert(prefetch_add("second", SOURCE_LEN, intervals, n_intervals) == 0);
+    assert(prefetch_add("third", SOURCE_LEN, intervals, n_intervals) == 0);
+    prefetch_wait();
+    assert(prefetch_take("first", session) == NULL);
+    entry = prefetch_take("second", session);
+    assert(entry != NULL);
+    assert(prefetch_data(entry)->session == session);
+    check_data(prefetch_data(entry));
+    prefetch_release(entry);
+    assert(prefetch_take("second", session) == NULL);
+    entry = prefetch_take("third", session);
+    assert(entry != NULL);
+    check_data(prefetch_data(entry));
+    prefetch_release(entry);
+
+    // A source taken before it's done keeps being downloaded in the run's
+    // session.
+    printf(">> Test 2\n");
+    setenv("E2E_DOWNLOAD_SPEED", "0.5", 1);
+    assert(prefetch_add("fourth", SOURCE_LEN, intervals, n_intervals) == 0);
+    entry = prefetch_take("fourth", session);
+    assert(entry != NULL);
+    assert(__atomic_load_n(&prefetch_data(entry)->len, __ATOMIC_ACQUIRE)
+           < SOURCE_LEN);
+    wait_finished(prefetch_data(entry));
+    check_data(prefetch_data(entry));
+    prefetch_release(entry);
+
+    // Aborting the run's session stops the download of a taken source, so
+    // that it can be released.
+    printf(">> Test 3\n");
+    struct timespec start;
+    struct audiosync_session *aborted = audiosync_session_new();
+    assert(aborted != NULL);
+    assert(prefetch_add("fifth", SOURCE_LEN, intervals, n_intervals) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    entry = prefetch_take("fifth", aborted);
+    assert(entry != NULL);
+    audiosync_session_abort(aborted);
+    prefetch_release(entry);
+    assert(elapsed_ms(&start) < ABORTED_MS);
+    audiosync_session_free(aborted);
+
+    // A source dropped while it's running is aborted, and freed by its
+    // task once it stops.
+    printf(">> Test 4\n");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(prefetch_add("sixth", SOURCE_LEN, intervals, n_intervals) == 0);
+    prefetch_set_capacity(0);
+    assert(prefetch_add("seventh", SOURCE_LEN, intervals, n_intervals) < 0);
+    prefetch_wait();
+    printf(">> Stopped after %.0f ms\n", elapsed_ms(&start));
+    assert(elapsed_ms(&start) < ABORTED_MS);
+    prefetch_set_capacity(2);
+    assert(prefetch_take("sixth", session) == NULL);
+
+    // A failed source is rejected without aborting the run's session. The
+    // youtube-dl stub fails without a source.
+    printf(">> Test 5\n");
+    unsetenv("E2E_SOURCE");
+    assert(prefetch_add("eighth", SOURCE_LEN, intervals, n_intervals) == 0);
+    prefetch_wait();
+    assert(prefetch_take("eighth", session) == NULL);
+    assert(audiosync_session_status(session) != ABORT_ST);
+
+    audiosync_session_free(session);
+    unlink(wav_path);
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pulse/simple.h>
+#include <pulse/error.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/capture/linux_capture.h>
+
+// The signal played, the audio captured from it, and the segments of the
+// capture looked up in the signal, all in frames.
+#define PLAYED_LEN (8 * SAMPLE_RATE)
+#define CAPTURED_LEN (2 * SAMPLE_RATE)
+#define SEGMENT_LEN (SAMPLE_RATE / 4)
+#define BEFORE_PAUSE (SAMPLE_RATE / 10)
+#define AFTER_PAUSE (3 * SAMPLE_RATE / 2)
+// The capture is paused once it has read PAUSE_AT frames, for PAUSE_MS.
+#define PAUSE_AT (SAMPLE_RATE / 2)
+#define PAUSE_MS 1000
+// How long the fragments already sent by the server may take to arrive
+// after the stream is corked.
+#define CORK_MS 300
+#define PLAYBACK_CHUNK 1024
+
+
+static sample_t played[PLAYED_LEN];
+
+// Simple pseudo-random noise between -0.5 and 0.5.
+static double noise(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (double) ((*seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+}
+
+// Plays the signal into the default sink, which is the null sink loaded by
+// the wrapper, at its real pace.
+static void *playback(void *arg) {
+    UNUSED(arg);
+    const pa_sample_spec spec = {
+        .format = PA_SAMPLE_FLOAT32NE,
+        .rate = SAMPLE_RATE,
+        .channels = NUM_CHANNELS
+    };
+    int error;
+    pa_simple *s = pa_simple_new(NULL, "audiosync test", PA_STREAM_PLAYBACK,
+                                 NULL, "signal", &spec, NULL, NULL, &error);
+    if (s == NULL) {
+        fprintf(stderr, "pa_simple_new failed: %s\n", pa_strerror(error));
+        exit(1);
+    }
+
+    float chunk[PLAYBACK_CHUNK];
+    for (size_t i = 0; i < PLAYED_LEN; i += PLAYBACK_CHUNK) {
+        for (size_t j = 0; j < PLAYBACK_CHUNK; j++) {
+            chunk[j] = i + j < PLAYED_LEN ? played[i + j] : 0.0;
+        }
+        if (pa_simple_write(s, chunk, sizeof(chunk), &error) < 0) {
+            fprintf(stderr, "pa_simple_write failed: %s\n",
+                    pa_strerror(error));
+            exit(1);
+        }
+    }
+    pa_simple_drain(s, NULL);
+    pa_simple_free(s);
+
+    return NULL;
+}
+
+// Finds where a captured segment was played, trying every window of the
+// signal. Returns its position, and saves the coefficient of the match.
+static size_t find_segment(sample_t *segment, double *coef) {
+    size_t best_pos = 0;
+    *coef = -1.0;
+    for (size_t start = 0; start + 2 * SEGMENT_LEN <= PLAYED_LEN;
+            start += SEGMENT_LEN) {
+        long lag;
+        double window_coef;
+        if (cross_correlation(played + start, segment, SEGMENT_LEN, &lag,
+                              &window_coef) < 0) {
+            continue;
+        }
+        if (window_coef > *coef) {
+            *coef = window_coef;
+            best_pos = start + lag;
+        }
+    }
+
+    return best_pos;
+}
+
+static size_t captured_len(struct ffmpeg_data *data) {
+    return __atomic_load_n(&data->len, __ATOMIC_ACQUIRE);
+}
+
+// Plays a known signal into a null sink whose monitor is the default
+// source, and records it with the capture thread, which is paused in the
+// middle. The captured audio must be the signal itself, and the audio
+// played while it was paused must be skipped rather than delayed.
+int main() {
+    // Low-passed noise, so that the match has a single sharp peak and the
+    // signal can't be confused with a shifted copy of itself.
+    unsigned seed = 1;
+    double prev = 0.0;
+    for (size_t i = 0; i < PLAYED_LEN; i++) {
+        prev = 0.7 * prev + 0.3 * noise(&seed);
+        played[i] = prev;
+    }
+
+    struct audiosync_session *session = audiosync_session_new();
+    assert(session != NULL);
+    sample_t *buf = malloc(CAPTURED_LEN * sizeof(*buf));
+    assert(buf != NULL);
+    const size_t intervals[] = {CAPTURED_LEN};
+    struct ffmpeg_data data = {
+        .title = "",
+        .session = session,
+        .buf = buf,
+        .total_len = CAPTURED_LEN,
+        .intervals = intervals,
+        .n_intervals = 1,
+        .max_seconds = "10"
+    };
+
+    // The playback starts first so that the capture doesn't begin with
+    // silence.
+    printf(">> Starting the playback\n");
+    pthread_t playback_thread, capture_thread;
+    assert(pthread_create(&playback_thread, NULL, &playback, NULL) == 0);
+    usleep(500 * 1000);
+    printf(">> Starting the capture\n");
+    assert(pthread_create(&capture_thread, NULL, &capture, &data) == 0);
+
+    // Pausing the capture, which corks its stream. Nothing else is read
+    // until it's resumed, once the fragments in flight have arrived.
+    while (captured_len(&data) < PAUSE_AT) {
+        assert(audiosync_session_status(session) != ABORT_ST);
+        usleep(10 * 1000);
+    }
+    printf(">> Pausing the capture at %zu frames\n", captured_len(&data));
+    audiosync_session_pause(session);
+    usleep(CORK_MS * 1000);
+    const size_t paused_len = captured_len(&data);
+    usleep((PAUSE_MS - CORK_MS) * 1000);
+    printf(">> Resuming the capture at %zu frames\n", captured_len(&data));
+    assert(captured_len(&data) == paused_len);
+    assert(paused_len < AFTER_PAUSE);
+    audiosync_session_resume(session);
+
+    assert(pthread_join(capture_thread, NULL) == 0);
+    printf(">> Captured %zu frames\n", captured_len(&data));
+    assert(audiosync_session_status(session) != ABORT_ST);
+    assert(captured_len(&data) == CAPTURED_LEN);
+
+    // The audio before and after the pause must be found in the signal.
+    double coef_before, coef_after;
+    const size_t before = find_segment(buf + BEFORE_PAUSE, &coef_before);
+    const size_t after = find_segment(buf + AFTER_PAUSE, &coef_after);
+    printf(">> Before the pause: position=%zu coef=%f\n", before,
+           coef_before);
+    printf(">> After the pause: position=%zu coef=%f\n", after, coef_after);
+    assert(coef_before >= MIN_CONFIDENCE);
+    assert(coef_after >= MIN_CONFIDENCE);
+
+    // Without the pause, both segments would be as far apart in the signal
+    // as they are in the capture. The corked stream must have skipped most
+    // of the audio played in the meantime.
+    const long skipped = (long) after - (long) before
+                         - (AFTER_PAUSE - BEFORE_PAUSE);
+    printf(">> Skipped %ld frames while paused\n", skipped);
+    assert(skipped >= (PAUSE_MS / 2) * (SAMPLE_RATE / 1000));
+    assert(skipped <= 2 * PAUSE_MS * (SAMPLE_RATE / 1000));
+
+    assert(pthread_join(playback_thread, NULL) == 0);
+    free(buf);
+    audiosync_session_free(session);
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/usr/bin/env sh
+
+# Shell test for the native capture. It's written in sh because that way,
+# setting up a known sink for the test is much easier.
+#
+# A null sink is loaded and made the default sink, with its monitor as the
+# default source, so that test_pulseaudio_capture.c can play a known signal
+# into it and record it with the capture thread, which will use the default
+# monitor.
+#
+# The test will restart pulseaudio at the end, so it may modify your current
+# pulseaudio's setup.
+
+SINK="audiosync_capture"
+CURDIR=$(dirname "$0")
+
+# First of all, restarting pulseaudio. The test can't be skipped, so it fails
+# if there's no server to play the signal into.
+killall pulseaudio
+if ! pulseaudio --check >/dev/null 2>&1; then
+    pulseaudio --start -D
+fi
+if ! pactl info >/dev/null; then
+    echo "The pulseaudio server couldn't be started"
+    exit 1
+fi
+
+# The sink has the same format as the capture, so that the server doesn't
+# have to convert the signal.
+if ! pactl load-module module-null-sink sink_name="$SINK" sink_properties=device.description="$SINK" rate=48000 channels=1 format=float32le 1>/dev/null; then
+    echo "Null sink creation unsuccessful"
+    exit 1
+fi
+pactl set-default-sink "$SINK"
+pactl set-default-source "$SINK.monitor"
+
+"$CURDIR/test_pulseaudio_capture"
+ret=$?
+if [ "$ret" -ne 0 ]; then
+    echo "Capture unsuccessful"
+fi
+
+# Restarting pulseaudio at the end to undo the changes made.
+killall pulseaudio
+pulseaudio --start -D
+exit $ret
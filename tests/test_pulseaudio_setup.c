@@ -10,7 +10,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    int ret = pulseaudio_setup(argv[1]);
+    int ret = pulseaudio_setup(SINK_NAME, argv[1]);
 
     return ret == 0 ? 0 : 1;
 }
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/ffmpeg_pipe.h>
+
+#define TOTAL_LEN 10
+#define RING_LEN 4
+#define CHUNK 3
+
+
+// Writes `frames` more frames into the data like a reading thread, in
+// chunks of up to CHUNK frames. Every frame holds its absolute index.
+static void write_frames(struct ffmpeg_data *data, size_t frames,
+                         size_t *interval_count) {
+    size_t len = __atomic_load_n(&data->len, __ATOMIC_ACQUIRE);
+    const size_t end = len + frames;
+    while (len < end) {
+        size_t room;
+        sample_t *dest = ffmpeg_data_dest(data, len, CHUNK, &room);
+        if (room > end - len) room = end - len;
+        assert(room > 0);
+        for (size_t i = 0; i < room; i++) {
+            dest[i] = len + i;
+        }
+        len += room;
+        ffmpeg_data_publish(data, len, interval_count);
+    }
+}
+
+static void check_copy(const sample_t *out, size_t start, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        assert(out[i] == start + i);
+    }
+}
+
+int main() {
+    const size_t intervals[] = {TOTAL_LEN / 2, TOTAL_LEN};
+    sample_t buf[TOTAL_LEN];
+    sample_t ring[RING_LEN];
+    sample_t out[TOTAL_LEN];
+    size_t room;
+    struct ffmpeg_data data = {
+        .title = "",
+        .buf = buf,
+        .total_len = TOTAL_LEN,
+        .intervals = intervals,
+        .n_intervals = 2,
+    };
+
+    // Without a ring buffer, the frames are written into the buffer until
+    // it's full.
+    printf(">> Test 1\n");
+    assert(ffmpeg_data_dest(&data, 0, CHUNK, &room) == buf);
+    assert(room == CHUNK);
+    assert(ffmpeg_data_dest(&data, 8, CHUNK, &room) == buf + 8);
+    assert(room == 2);
+    ffmpeg_data_dest(&data, TOTAL_LEN, CHUNK, &room);
+    assert(room == 0);
+
+    // With one, the frames after the buffer continue in the ring, which
+    // wraps around and is never full. The room ends at the end of the ring.
+    printf(">> Test 2\n");
+    data.ring = ring;
+    data.ring_len = RING_LEN;
+    assert(ffmpeg_data_dest(&data, 8, CHUNK, &room) == buf + 8);
+    assert(room == 2);
+    assert(ffmpeg_data_dest(&data, TOTAL_LEN, CHUNK, &room) == ring);
+    assert(room == CHUNK);
+    assert(ffmpeg_data_dest(&data, TOTAL_LEN, 2 * RING_LEN, &room) == ring);
+    assert(room == RING_LEN);
+    assert(ffmpeg_data_dest(&data, 12, CHUNK, &room) == ring + 2);
+    assert(room == 2);
+    assert(ffmpeg_data_dest(&data, 13, CHUNK, &room) == ring + 3);
+    assert(room == 1);
+    assert(ffmpeg_data_dest(&data, TOTAL_LEN + RING_LEN, CHUNK, &room)
+           == ring);
+    assert(room == CHUNK);
+    assert(ffmpeg_data_dest(&data, TOTAL_LEN + 5 * RING_LEN + 1, CHUNK,
+                            &room) == ring + 1);
+    assert(room == CHUNK);
+
+    // The frames are copied from both the buffer and the ring, across the
+    // point where it wraps around.
+    printf(">> Test 3\n");
+    size_t interval_count = 0;
+    write_frames(&data, 16, &interval_count);
+    assert(interval_count == 2);
+    assert(ffmpeg_data_copy(&data, 2, 6, 0, out) == 0);
+    check_copy(out, 2, 6);
+    assert(ffmpeg_data_copy(&data, 12, RING_LEN, 0, out) == 0);
+    check_copy(out, 12, RING_LEN);
+    assert(ffmpeg_data_copy(&data, 13, 3, 0, out) == 0);
+    check_copy(out, 13, 3);
+
+    // A frame of the ring that was written over is rejected, and so is one
+    // that's within the margin of being written over.
+    printf(">> Test 4\n");
+    assert(ffmpeg_data_copy(&data, 11, RING_LEN, 0, out) == -1);
+    assert(ffmpeg_data_copy(&data, 12, RING_LEN, 1, out) == -1);
+    assert(ffmpeg_data_copy(&data, 13, 3, 1, out) == 0);
+    write_frames(&data, 1, &interval_count);
+    assert(ffmpeg_data_copy(&data, 12, RING_LEN, 0, out) == -1);
+    assert(ffmpeg_data_copy(&data, 13, RING_LEN, 0, out) == 0);
+    check_copy(out, 13, RING_LEN);
+
+    // The frames in the buffer are never written over.
+    printf(">> Test 5\n");
+    write_frames(&data, 5 * RING_LEN, &interval_count);
+    assert(ffmpeg_data_copy(&data, 0, TOTAL_LEN, RING_LEN, out) == 0);
+    check_copy(out, 0, TOTAL_LEN);
+
+    return 0;
+}
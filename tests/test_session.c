@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/stats.h>
+#include <audiosync/download/linux_download.h>
+
+
+// A reading thread waiting while its session is paused.
+static void *wait_resume(void *arg) {
+    struct ffmpeg_data *data = arg;
+    global_status_t *status = malloc(sizeof(*status));
+    assert(status != NULL);
+    *status = ffmpeg_data_wait_resume(data);
+
+    return status;
+}
+
+int main() {
+    struct audiosync_session *first = audiosync_session_new();
+    struct audiosync_session *second = audiosync_session_new();
+    assert(first != NULL && second != NULL);
+    assert(audiosync_session_status(first) == IDLE_ST);
+    assert(audiosync_session_status(second) == IDLE_ST);
+
+    // The controls of each session don't affect the rest.
+    audiosync_session_pause(first);
+    assert(audiosync_session_status(first) == PAUSED_ST);
+    assert(audiosync_session_status(second) == IDLE_ST);
+    assert(audiosync_status() == IDLE_ST);
+    audiosync_abort();
+    assert(audiosync_status() == ABORT_ST);
+    assert(audiosync_session_status(first) == PAUSED_ST);
+    audiosync_resume();
+
+    // The threads follow the session of their data, and the data without
+    // one follow the default session.
+    const size_t intervals[] = {1};
+    sample_t buf[1];
+    struct ffmpeg_data data = {
+        .title = "",
+        .session = first,
+        .buf = buf,
+        .total_len = 1,
+        .intervals = intervals,
+        .n_intervals = 1,
+    };
+    struct ffmpeg_data default_data = {
+        .title = "",
+        .buf = buf,
+        .total_len = 1,
+        .intervals = intervals,
+        .n_intervals = 1,
+    };
+    assert(ffmpeg_data_session(&data) == first);
+    assert(ffmpeg_data_session(&default_data) == audiosync_default_session());
+    assert(ffmpeg_data_status(&data) == PAUSED_ST);
+    assert(ffmpeg_data_status(&default_data) == RUNNING_ST);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, &wait_resume, &data) == 0);
+    audiosync_session_resume(first);
+    void *ret;
+    assert(pthread_join(thread, &ret) == 0);
+    assert(*(global_status_t *) ret == RUNNING_ST);
+    free(ret);
+
+    // An error while reading only aborts the reader's session.
+    ffmpeg_data_abort(&data);
+    assert(audiosync_session_status(first) == ABORT_ST);
+    assert(audiosync_session_status(second) == IDLE_ST);
+    assert(audiosync_status() == RUNNING_ST);
+
+    // A run with an invalid source fails without changing the session.
+    const struct audiosync_source source = {
+        .provider = FILE_PROVIDER,
+        .path = NULL
+    };
+    long lag;
+    assert(audiosync_session_run(second, &source, &lag) == -1);
+    assert(audiosync_session_status(second) == IDLE_ST);
+
+    // A source shorter than the data is padded with zeroes, but only the
+    // frames actually read are counted, and the boundaries after them
+    // aren't reached.
+    const sample_t short_buf[] = { 1, 2, 3 };
+    const struct audiosync_source buffer_source = {
+        .provider = BUFFER_PROVIDER,
+        .buf = short_buf,
+        .len = 3
+    };
+    const size_t boundaries[] = { 2, 4, 8 };
+    sample_t padded_buf[8];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct stream_stats stream;
+    stream_stats_init(&stream, &start, boundaries, 3);
+    struct ffmpeg_data buffer_data = {
+        .title = "",
+        .session = second,
+        .source = &buffer_source,
+        .buf = padded_buf,
+        .total_len = 8,
+        .intervals = boundaries,
+        .n_intervals = 3,
+        .stats = &stream,
+    };
+    download(&buffer_data);
+    assert(buffer_data.len == 8);
+    assert(padded_buf[2] == 3 && padded_buf[3] == 0 && padded_buf[7] == 0);
+    assert(stream.len == 3);
+    assert(stream.first_byte_ms >= 0 && stream.boundary_ms[0] >= 0);
+    assert(stream.boundary_ms[1] == -1 && stream.boundary_ms[2] == -1);
+
+    // There aren't any statistics until a run finishes.
+    struct audiosync_stats stats;
+    assert(audiosync_session_get_stats(first, &stats) == -1);
+    assert(audiosync_session_get_stats(second, &stats) == -1);
+
+    audiosync_session_free(first);
+    audiosync_session_free(second);
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/thread_pool.h>
+
+// More than fit in the queue, so that some of them are run inline.
+#define N_TASKS 200
+#define N_NESTED 8
+
+
+static size_t counter = 0;
+static size_t executor_calls = 0;
+static pthread_mutex_t flag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flag_cond = PTHREAD_COND_INITIALIZER;
+static int flag = 0;
+
+static void *increment(void *arg) {
+    UNUSED(arg);
+    __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+// A task that waits for other tasks itself.
+static void *nested(void *arg) {
+    UNUSED(arg);
+    struct task_group group = TASK_GROUP_INIT;
+    for (size_t i = 0; i < N_NESTED; i++)
+        thread_pool_submit(&group, &increment, NULL);
+    thread_pool_wait(&group);
+
+    return NULL;
+}
+
+// A task that blocks until the flag is set, like the capture does until
+// there's data.
+static void *wait_flag(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&flag_mutex);
+    while (!flag)
+        pthread_cond_wait(&flag_cond, &flag_mutex);
+    pthread_mutex_unlock(&flag_mutex);
+
+    return NULL;
+}
+
+// A minimal executor for the host application, with a thread per task.
+struct executor_task {
+    void (*task)(void *);
+    void *arg;
+};
+
+static void *executor_thread(void *arg) {
+    struct executor_task *t = arg;
+    t->task(t->arg);
+    free(t);
+
+    return NULL;
+}
+
+static int executor_submit(void (*task)(void *), void *arg, void *data) {
+    assert(data == &executor_calls);
+    __atomic_add_fetch(&executor_calls, 1, __ATOMIC_RELAXED);
+
+    struct executor_task *t = malloc(sizeof(*t));
+    assert(t != NULL);
+    t->task = task;
+    t->arg = arg;
+    pthread_t th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&th, &attr, &executor_thread, t);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        free(t);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main() {
+    assert(thread_pool_size() > 0);
+
+    // Every submitted task is run once before the wait returns.
+    printf(">> Test 1\n");
+    struct task_group group = TASK_GROUP_INIT;
+    for (size_t i = 0; i < N_TASKS; i++)
+        thread_pool_submit(&group, &increment, NULL);
+    thread_pool_wait(&group);
+    assert(counter == N_TASKS);
+    assert(group.pending == 0);
+
+    // Tasks waiting for their own tasks can't run out of workers.
+    printf(">> Test 2\n");
+    counter = 0;
+    for (size_t i = 0; i < N_TASKS; i++)
+        thread_pool_submit(&group, &nested, NULL);
+    thread_pool_wait(&group);
+    assert(counter == N_TASKS * N_NESTED);
+
+    // The blocking tasks don't take the place of the short ones, even if
+    // there are more of them than cores.
+    printf(">> Test 3\n");
+    counter = 0;
+    struct task_group blocking = TASK_GROUP_INIT;
+    for (size_t i = 0; i < thread_pool_size() + 2; i++)
+        assert(thread_pool_spawn(&blocking, &wait_flag, NULL) == 0);
+    for (size_t i = 0; i < N_TASKS; i++)
+        thread_pool_submit(&group, &nested, NULL);
+    thread_pool_wait(&group);
+    assert(counter == N_TASKS * N_NESTED);
+    pthread_mutex_lock(&flag_mutex);
+    flag = 1;
+    pthread_cond_broadcast(&flag_cond);
+    pthread_mutex_unlock(&flag_mutex);
+    thread_pool_wait(&blocking);
+
+    // The host application's executor runs the short tasks instead.
+    printf(">> Test 4\n");
+    counter = 0;
+    audiosync_set_executor(&executor_submit, &executor_calls);
+    for (size_t i = 0; i < N_NESTED; i++)
+        thread_pool_submit(&group, &increment, NULL);
+    thread_pool_wait(&group);
+    assert(counter == N_NESTED);
+    assert(executor_calls == N_NESTED);
+    audiosync_set_executor(NULL, NULL);
+    thread_pool_submit(&group, &increment, NULL);
+    thread_pool_wait(&group);
+    assert(counter == N_NESTED + 1);
+    assert(executor_calls == N_NESTED);
+
+    return 0;
+}
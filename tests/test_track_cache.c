@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L  // mkdtemp() and nanosleep()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/track_cache.h>
+
+#define LEN 10000
+// Each track takes a bit more than its samples.
+#define TRACK_SIZE (LEN * sizeof(float) + 128)
+#define CONCURRENT_STORES 20
+
+
+// Waits a bit, so that the modification times are different.
+static void wait_mtime() {
+    const struct timespec ts = { .tv_sec = 0, .tv_nsec = 20000000 };
+    nanosleep(&ts, NULL);
+}
+
+static void *store_track(void *arg) {
+    assert(track_cache_store("title", arg, LEN) == 0);
+    return NULL;
+}
+
+// Testing that the cached tracks are loaded back correctly, and that the
+// least recently used ones are removed.
+int main() {
+    sample_t track[LEN], loaded[LEN];
+    for (size_t i = 0; i < LEN; i++)
+        track[i] = sin(i * 0.01);
+    char dir[] = "/tmp/audiosync_cache_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+
+    // Nothing is cached while it's disabled.
+    printf(">> Test 1\n");
+    assert(track_cache_store("title", track, LEN) < 0);
+    assert(track_cache_load("title", loaded, LEN) < 0);
+
+    // The tracks are loaded with the same title and length only.
+    printf(">> Test 2\n");
+    assert(audiosync_set_cache(dir, 2 * TRACK_SIZE) == 0);
+    assert(track_cache_load("title", loaded, LEN) < 0);
+    assert(track_cache_store("title", track, LEN) == 0);
+    assert(track_cache_load("title", loaded, LEN) == 0);
+    for (size_t i = 0; i < LEN; i++)
+        assert(fabs(loaded[i] - track[i]) < 1e-6);
+    assert(track_cache_load("other title", loaded, LEN) < 0);
+    assert(track_cache_load("title", loaded, LEN - 1) < 0);
+
+    // Only two tracks fit. The first one was used more recently than the
+    // second one, so the latter is removed.
+    printf(">> Test 3\n");
+    wait_mtime();
+    assert(track_cache_store("second", track, LEN) == 0);
+    wait_mtime();
+    assert(track_cache_load("title", loaded, LEN) == 0);
+    wait_mtime();
+    assert(track_cache_store("third", track, LEN) == 0);
+    assert(track_cache_load("title", loaded, LEN) == 0);
+    assert(track_cache_load("second", loaded, LEN) < 0);
+    assert(track_cache_load("third", loaded, LEN) == 0);
+
+    // The same track stored at once by two threads, like two sessions do,
+    // is one of them entirely, and never a mix of both.
+    printf(">> Test 4\n");
+    sample_t inverted[LEN];
+    for (size_t i = 0; i < LEN; i++)
+        inverted[i] = -track[i];
+    for (size_t n = 0; n < CONCURRENT_STORES; n++) {
+        pthread_t first, second;
+        assert(pthread_create(&first, NULL, &store_track, track) == 0);
+        assert(pthread_create(&second, NULL, &store_track, inverted) == 0);
+        assert(pthread_join(first, NULL) == 0);
+        assert(pthread_join(second, NULL) == 0);
+        assert(track_cache_load("title", loaded, LEN) == 0);
+        const sample_t *stored = loaded[1] > 0 ? track : inverted;
+        for (size_t i = 0; i < LEN; i++)
+            assert(fabs(loaded[i] - stored[i]) < 1e-6);
+    }
+
+    // Cleaning up, with the maximum size at zero so that every track is
+    // removed.
+    assert(audiosync_set_cache(dir, 0) == 0);
+    assert(track_cache_store("title", track, LEN) == 0);
+    assert(track_cache_load("title", loaded, LEN) < 0);
+    assert(audiosync_set_cache(NULL, 0) == 0);
+    assert(rmdir(dir) == 0);
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/fft_plans.h>
+
+
+// Testing that the warm-up can create the plans of every engine at once,
+// which are many more than the ones of a single interval ladder.
+int main() {
+    // Measuring the longest transforms takes minutes, so the planner is only
+    // given a few milliseconds for each plan. The plans are cached all the
+    // same.
+    FFTW(set_timelimit)(0.01);
+
+    printf(">> Test 1\n");
+    assert(audiosync_warmup(NULL, 0) == 0);
+
+    // Nothing is planned again, and the padded lengths of the normalized
+    // cross-correlation fit as well.
+    printf(">> Test 2\n");
+    assert(audiosync_warmup(NULL, 0) == 0);
+    audiosync_set_normalized(1);
+    assert(audiosync_warmup(NULL, 0) == 0);
+
+    return 0;
+}